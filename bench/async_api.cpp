@@ -0,0 +1,164 @@
+// Compares the event loop of HttpClient with a thread per request: both
+// keep `requests` searches in flight against the mock Web API server, for
+// a number of rounds, and report the time taken, the peak number of
+// threads and the peak resident memory as one JSON object.
+//
+// Usage: async_api_bench async|threads [base_url] [requests] [rounds]
+//
+// Start the server with latency, so that requests overlap:
+//   mock_spotify_server --latency 50 &
+
+#include "http_client.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Threads of the process, -1 where /proc is not available
+int threadCount() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 8, "Threads:") == 0) {
+      return std::atoi(line.c_str() + 8);
+    }
+  }
+  return -1;
+}
+
+long peakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+size_t discard(char *, size_t size, size_t count, void *) {
+  return size * count;
+}
+
+// One round with a thread per request, each with a curl handle of its own
+// that is kept between rounds, as the session pool did
+void threadRound(const std::string &base_url, std::vector<CURL *> &handles,
+                 size_t round, std::atomic<size_t> &failed) {
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < handles.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      CURL *easy = handles[i];
+      std::string url = base_url + "/search?type=track&limit=1&q=r" +
+                        std::to_string(round) + "q" + std::to_string(i);
+      curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+      curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard);
+      curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+      long status = 0;
+      if (curl_easy_perform(easy) == CURLE_OK) {
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+      }
+      if (status != 200) {
+        ++failed;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// One round with all requests submitted to the event loop at once
+void asyncRound(HttpClient &client, size_t requests, size_t round,
+                std::atomic<size_t> &failed) {
+  std::vector<std::future<HttpResponse>> futures;
+  for (size_t i = 0; i < requests; ++i) {
+    HttpRequest request;
+    request.path = "/search";
+    request.parameters = {{"q", "r" + std::to_string(round) + "q" +
+                                    std::to_string(i)},
+                          {"type", "track"},
+                          {"limit", "1"}};
+    futures.push_back(client.submit(std::move(request)));
+  }
+  for (auto &future : futures) {
+    if (future.get().status_code != 200) {
+      ++failed;
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || (strcmp(argv[1], "async") != 0 &&
+                   strcmp(argv[1], "threads") != 0)) {
+    std::cerr << "Usage: " << argv[0]
+              << " async|threads [base_url] [requests] [rounds]" << std::endl;
+    return 1;
+  }
+  bool async = strcmp(argv[1], "async") == 0;
+  std::string base_url = argc > 2 ? argv[2] : "http://127.0.0.1:8888/v1";
+  size_t requests = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 256;
+  size_t rounds = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 10;
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  // Samples the thread count while requests run
+  std::atomic<bool> sampling{true};
+  std::atomic<int> peak_threads{0};
+  std::thread sampler([&]() {
+    while (sampling) {
+      peak_threads = std::max(peak_threads.load(), threadCount());
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  long rss_before = peakRssKb();
+
+  std::atomic<size_t> failed{0};
+  auto start = Clock::now();
+  if (async) {
+    HttpConfig config;
+    config.base_url = base_url;
+    SchedulerConfig scheduler_config;
+    scheduler_config.rate = 1e9;
+    scheduler_config.burst = 1e9;
+    HttpClient client(config, scheduler_config);
+    for (size_t round = 0; round < rounds; ++round) {
+      asyncRound(client, requests, round, failed);
+    }
+  } else {
+    std::vector<CURL *> handles(requests);
+    for (auto &handle : handles) {
+      handle = curl_easy_init();
+    }
+    for (size_t round = 0; round < rounds; ++round) {
+      threadRound(base_url, handles, round, failed);
+    }
+    for (auto &handle : handles) {
+      curl_easy_cleanup(handle);
+    }
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  sampling = false;
+  sampler.join();
+
+  // The main and the sampler thread are not counted
+  std::cout << "{\"mode\":\"" << argv[1] << "\",\"requests\":" << requests
+            << ",\"rounds\":" << rounds << ",\"failed\":" << failed
+            << ",\"seconds\":" << seconds
+            << ",\"requests_per_sec\":" << requests * rounds / seconds
+            << ",\"peak_threads\":" << peak_threads - 2
+            << ",\"rss_before_kb\":" << rss_before
+            << ",\"peak_rss_kb\":" << peakRssKb() << "}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,209 @@
+// In-process stand-in for the Web API. Serves a synthetic library of the
+// shape set with setFakeLibrary() without any network access, so the
+// filesystem can be driven by benchmarks and tests. Only the requests
+// SpotifyFS makes are implemented.
+
+#include "fake_spotify_api.h"
+#include "spotify_api.h"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+
+SpotifyAPI *SpotifyAPI::instance = nullptr;
+
+namespace {
+
+FakeLibrary library;
+std::atomic<size_t> created_playlists{0};
+std::mutex changes_mutex;
+std::vector<FakeChange> changes;
+
+void record(FakeChange change) {
+  std::lock_guard<std::mutex> lock(changes_mutex);
+  changes.push_back(std::move(change));
+}
+
+// `prefix` followed by `number`, padded with letters to `length`
+std::string paddedName(const std::string &prefix, size_t number,
+                       size_t length) {
+  std::string name = prefix + std::to_string(number);
+  for (size_t i = 0; name.size() < length; ++i) {
+    name += i % 8 == 7 ? ' ' : static_cast<char>('a' + (number + i) % 26);
+  }
+  return name;
+}
+
+// Base62 track ID derived from `seed`
+std::string trackId(size_t seed) {
+  static const char digits[] =
+      "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  std::string id(22, '0');
+  for (size_t i = 22; i-- > 0 && seed;) {
+    id[i] = digits[seed % 62];
+    seed /= 62;
+  }
+  return id;
+}
+
+// Half of the entries of the library are tracks that also appear in other
+// playlists, as in a real library
+Track libraryTrack(size_t playlist, size_t position) {
+  size_t entries = library.playlists * library.tracks_per_playlist;
+  size_t distinct = entries / 2 + 1;
+  size_t n = (playlist * library.tracks_per_playlist + position) * 7919 %
+             distinct;
+  Track track;
+  track.id = trackId(n + 1);
+  track.name = paddedName("Song ", n, library.name_length);
+  track.artist = paddedName("Artist ", n / 20, library.name_length);
+  track.album = paddedName("Album ", n / 10, library.name_length);
+  track.uri = "spotify:track:" + track.id;
+  track.duration_ms = 180000 + n % 60000;
+  track.added_at = 1600000000 + n * 60;
+  return track;
+}
+
+// Entry at `position` of a playlist, a repeat of the one before it every
+// `repeat_every` entries
+Track playlistTrack(size_t playlist, size_t position) {
+  if (library.repeat_every && position > 0 &&
+      position % library.repeat_every == library.repeat_every - 1) {
+    --position;
+  }
+  return libraryTrack(playlist, position);
+}
+
+} // namespace
+
+void setFakeLibrary(const FakeLibrary &value) {
+  library = value;
+  std::lock_guard<std::mutex> lock(changes_mutex);
+  changes.clear();
+}
+
+std::vector<FakeChange> fakeChanges() {
+  std::lock_guard<std::mutex> lock(changes_mutex);
+  return changes;
+}
+
+SpotifyAPI *SpotifyAPI::getInstance() {
+  if (!instance) {
+    instance = new SpotifyAPI();
+  }
+  return instance;
+}
+
+bool SpotifyAPI::init(const AuthConfig &auth_config, const HttpConfig &config,
+                      const SchedulerConfig &scheduler_config) {
+  getInstance();
+  return true;
+}
+
+bool SpotifyAPI::getAllPlaylists(std::vector<Playlist> &playlists) {
+  for (size_t i = 0; i < library.playlists; ++i) {
+    Playlist playlist;
+    playlist.id = "playlist" + std::to_string(i);
+    playlist.name = "Playlist " + std::to_string(i);
+    playlist.owner = "bench";
+    playlist.snapshot_id = "snapshot";
+    playlist.track_count = library.tracks_per_playlist;
+    playlists.push_back(playlist);
+  }
+  return true;
+}
+
+bool SpotifyAPI::getPlaylistTracksPage(const std::string &playlist_id,
+                                       int offset, int limit,
+                                       std::vector<Track> &tracks,
+                                       int &total) {
+  size_t playlist = std::stoul(playlist_id.substr(8));
+  total = library.tracks_per_playlist;
+  for (int i = offset; i < offset + limit && i < total; ++i) {
+    tracks.push_back(playlistTrack(playlist, i));
+  }
+  return true;
+}
+
+std::future<std::optional<TracksPage>>
+SpotifyAPI::getSavedTracksPageAsync(int offset, int limit) {
+  // The saved tracks are the entries at the start of the library
+  TracksPage page;
+  page.total = library.saved_tracks;
+  for (int i = offset; i < offset + limit && i < page.total; ++i) {
+    page.tracks.push_back(libraryTrack(0, i));
+  }
+  std::promise<std::optional<TracksPage>> done;
+  done.set_value(std::move(page));
+  return done.get_future();
+}
+
+bool SpotifyAPI::getSavedTracksPage(int offset, int limit,
+                                    std::vector<Track> &tracks, int &total) {
+  std::optional<TracksPage> page =
+      getSavedTracksPageAsync(offset, limit).get();
+  total = page->total;
+  tracks.insert(tracks.end(), page->tracks.begin(), page->tracks.end());
+  return true;
+}
+
+bool SpotifyAPI::addTracksToPlaylist(const std::string &playlist_id,
+                                     const std::vector<std::string> &uris) {
+  FakeChange change;
+  change.kind = FakeChange::Kind::add;
+  change.playlist_id = playlist_id;
+  change.uris = uris;
+  record(std::move(change));
+  return true;
+}
+
+bool SpotifyAPI::removeTracksFromPlaylist(
+    const std::string &playlist_id, const std::vector<std::string> &uris) {
+  FakeChange change;
+  change.kind = FakeChange::Kind::remove;
+  change.playlist_id = playlist_id;
+  change.uris = uris;
+  record(std::move(change));
+  return true;
+}
+
+bool SpotifyAPI::reorderPlaylistTracks(const std::string &playlist_id,
+                                       int range_start, int insert_before,
+                                       int range_length) {
+  FakeChange change;
+  change.kind = FakeChange::Kind::reorder;
+  change.playlist_id = playlist_id;
+  change.range_start = range_start;
+  change.insert_before = insert_before;
+  change.range_length = range_length;
+  record(std::move(change));
+  return true;
+}
+
+bool SpotifyAPI::renamePlaylist(const std::string &playlist_id,
+                                const std::string &name) {
+  return true;
+}
+
+Playlist SpotifyAPI::createPlaylist(std::string name, std::string description,
+                                    bool is_public) {
+  Playlist playlist;
+  playlist.id = "created" + std::to_string(created_playlists++);
+  playlist.name = name;
+  playlist.snapshot_id = "snapshot";
+  return playlist;
+}
+
+bool SpotifyAPI::searchTrack(const std::string &query, Track &track) {
+  // Every query matches a track of its own
+  size_t seed = std::hash<std::string>()(query);
+  track = Track();
+  track.id = trackId(seed);
+  track.name = query;
+  track.artist = "Search Artist";
+  track.album = "Search Album";
+  track.uri = "spotify:track:" + track.id;
+  track.duration_ms = 200000;
+  return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Shape of the synthetic library served by the fake SpotifyAPI in
+// fake_spotify_api.cpp, which benchmarks and tests link instead of
+// src/spotify_api.cpp
+struct FakeLibrary {
+  size_t playlists = 100;           // Playlists in the library
+  size_t tracks_per_playlist = 100; // Tracks in each playlist
+  size_t name_length = 24;          // Length of track, artist and album names
+  size_t saved_tracks = 0;          // Tracks in Liked Songs
+  // Every Nth entry of a playlist repeats the track before it, 0 for none
+  size_t repeat_every = 0;
+};
+
+// Change of a playlist sent to the fake. The served library stays as it
+// was set, tests apply the changes to their own copy.
+struct FakeChange {
+  enum class Kind { add, remove, reorder };
+
+  Kind kind;
+  std::string playlist_id;
+  std::vector<std::string> uris; // Added or removed tracks
+  int range_start = 0;           // Reorders only
+  int insert_before = 0;
+  int range_length = 0;
+};
+
+// Sets the library served from then on and clears the recorded changes
+void setFakeLibrary(const FakeLibrary &library);
+// Changes sent since the library was set, in the order they were made
+std::vector<FakeChange> fakeChanges();
@@ -0,0 +1,318 @@
+// Drives the filesystem operations in-process against a synthetic library
+// served by the fake SpotifyAPI. Reports time and heap allocations per
+// operation and the memory used by the library, one JSON object per line.
+// readdir of a playlist is also timed against the flat path-keyed map the
+// tree replaced, and getattr/readdir are run from 1 to 32 threads at once.
+//
+// Usage: fs_bench [playlists] [tracks_per_playlist] [name_length]
+//
+// Each library shape runs in its own process so that RSS is not shared, e.g.
+//   for n in 100 1000 10000; do fs_bench 100 $n; done > results.jsonl
+// or, for readdir of 50 tracks in libraries of 10k, 100k and 1M tracks,
+//   for n in 200 2000 20000; do fs_bench $n 50; done > results.jsonl
+
+#include "fake_spotify_api.h"
+#include "spotify_fs.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+FakeLibrary library;
+
+size_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Prints one result line. `ops` operations took `elapsed` and made
+// `allocs` allocations.
+void report(const char *bench, size_t ops, std::chrono::nanoseconds elapsed,
+            size_t allocs) {
+  printf("{\"bench\":\"%s\",\"playlists\":%zu,\"tracks_per_playlist\":%zu,"
+         "\"name_length\":%zu,\"ops\":%zu,\"ns_per_op\":%.1f,"
+         "\"allocs_per_op\":%.2f,\"rss_bytes\":%zu}\n",
+         bench, library.playlists, library.tracks_per_playlist,
+         library.name_length, ops,
+         static_cast<double>(elapsed.count()) / ops,
+         static_cast<double>(allocs) / ops, residentBytes());
+  fflush(stdout);
+}
+
+// Runs `op` `ops` times with the operation number and reports it
+void measure(const char *bench, size_t ops,
+             const std::function<void(size_t)> &op) {
+  size_t allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < ops; ++i) {
+    op(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  report(bench, ops, elapsed, allocations - allocations_before);
+}
+
+int countEntry(void *buf, const char *name, const struct stat *stbuf,
+               off_t off) {
+  ++*static_cast<size_t *>(buf);
+  return 0;
+}
+
+int collectEntry(void *buf, const char *name, const struct stat *stbuf,
+                 off_t off) {
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    static_cast<std::vector<std::string> *>(buf)->push_back(name);
+  }
+  return 0;
+}
+
+// The flat map of every path the directory tree replaced, listed the way
+// it was: a scan of the whole map per readdir
+struct FlatMap {
+  std::unordered_map<std::string, bool> files; // Path -> is a playlist
+
+  void list(const char *path, void *buf, fuse_fill_dir_t filler) const {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for (const auto &pair : files) {
+      std::string parent_path = std::string(path) + "/";
+      if (pair.first.find(parent_path) == 0 && !pair.second) {
+        std::string filename =
+            pair.first.substr(pair.first.find_last_of('/') + 1);
+        filler(buf, filename.c_str(), NULL, 0);
+      }
+    }
+  }
+};
+
+// Runs `op` from `threads` threads at once, `ops` times in all, and prints
+// the throughput
+void stress(const char *bench, size_t threads, size_t ops,
+            const std::function<void(size_t)> &op) {
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    // Each thread takes a contiguous run of operations, which walks the
+    // same paths a single thread does
+    workers.emplace_back([&op, t, threads, ops]() {
+      for (size_t i = t * ops / threads; i < (t + 1) * ops / threads; ++i) {
+        op(i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("{\"bench\":\"%s\",\"playlists\":%zu,\"tracks_per_playlist\":%zu,"
+         "\"threads\":%zu,\"ops\":%zu,\"ops_per_sec\":%.0f}\n",
+         bench, library.playlists, library.tracks_per_playlist, threads, ops,
+         ops / elapsed.count());
+  fflush(stdout);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    library.playlists = std::strtoul(argv[1], nullptr, 10);
+  }
+  if (argc > 2) {
+    library.tracks_per_playlist = std::strtoul(argv[2], nullptr, 10);
+  }
+  if (argc > 3) {
+    library.name_length = std::strtoul(argv[3], nullptr, 10);
+  }
+  setFakeLibrary(library);
+
+  // The cache directory is fresh so every playlist is loaded from the fake
+  char cache_dir[] = "/tmp/fs_bench.XXXXXX";
+  if (!mkdtemp(cache_dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  spotify_options options = {};
+  options.load_concurrency = 8;
+  options.cache_dir = cache_dir;
+  options.flush_delay = 200;
+  options.import_concurrency = 8;
+  options.search_cache_size = 4096;
+  options.search_ttl = 3600;
+  options.sync_interval = 0;
+  options.playback = 0;
+
+  // Messages of the filesystem would mix with the results
+  std::streambuf *cout_buf = std::cout.rdbuf(nullptr);
+
+  size_t rss_before = residentBytes();
+  measure("init", 1, [&](size_t) { SpotifyFileSystem::init(options); });
+
+  std::vector<std::string> playlists;
+  for (size_t i = 0; i < library.playlists; ++i) {
+    playlists.push_back("/Playlist " + std::to_string(i));
+  }
+  measure("load_playlist", playlists.size(), [&](size_t i) {
+    size_t entries = 0;
+    SpotifyFileSystem::listFiles(playlists[i].c_str(), &entries, countEntry,
+                                 0, nullptr);
+  });
+  size_t library_bytes = residentBytes() - rss_before;
+  size_t entries = library.playlists * library.tracks_per_playlist;
+  printf("{\"bench\":\"library\",\"playlists\":%zu,"
+         "\"tracks_per_playlist\":%zu,\"name_length\":%zu,\"entries\":%zu,"
+         "\"library_rss_bytes\":%zu,\"bytes_per_entry\":%.1f}\n",
+         library.playlists, library.tracks_per_playlist, library.name_length,
+         entries, library_bytes,
+         entries ? static_cast<double>(library_bytes) / entries : 0.0);
+
+  // Paths of a random sample of tracks, built before timing
+  std::vector<std::string> tracks;
+  std::mt19937 random(42);
+  for (size_t i = 0; i < 4096 && entries > 0; ++i) {
+    const std::string &playlist = playlists[random() % playlists.size()];
+    size_t position = random() % library.tracks_per_playlist;
+    std::string found;
+    // Keeps the name of the entry at `position`, after "." and ".."
+    auto pick = [](void *buf, const char *name, const struct stat *,
+                   off_t) -> int {
+      auto state = static_cast<std::pair<size_t, std::string *> *>(buf);
+      if (state->first-- == 0) {
+        *state->second = name;
+        return 1;
+      }
+      return 0;
+    };
+    std::pair<size_t, std::string *> state(position + 2, &found);
+    SpotifyFileSystem::listFiles(playlist.c_str(), &state, pick, 0, nullptr);
+    tracks.push_back(playlist + "/" + found);
+  }
+  if (tracks.empty()) {
+    std::cerr << "The library has no tracks" << std::endl;
+    return 1;
+  }
+
+  struct stat stbuf;
+  measure("getattr_root", 100000,
+          [&](size_t) { SpotifyFileSystem::getFileAttributes("/", &stbuf); });
+  measure("getattr_playlist", 100000, [&](size_t i) {
+    SpotifyFileSystem::getFileAttributes(
+        playlists[i % playlists.size()].c_str(), &stbuf);
+  });
+  measure("getattr_track", 200000, [&](size_t i) {
+    SpotifyFileSystem::getFileAttributes(tracks[i % tracks.size()].c_str(),
+                                         &stbuf);
+  });
+  std::string missing = playlists[0] + "/No such track";
+  measure("getattr_missing", 200000, [&](size_t) {
+    SpotifyFileSystem::getFileAttributes(missing.c_str(), &stbuf);
+  });
+
+  measure("readdir_root", 1000, [&](size_t) {
+    size_t count = 0;
+    SpotifyFileSystem::listFiles("/", &count, countEntry, 0, nullptr);
+  });
+  measure("readdir_playlist", 1000, [&](size_t i) {
+    size_t count = 0;
+    SpotifyFileSystem::listFiles(playlists[i % playlists.size()].c_str(),
+                                 &count, countEntry, 0, nullptr);
+  });
+
+  // Readers on many threads at once: getattr of tracks with a readdir of a
+  // playlist every 16th operation
+  for (size_t threads = 1; threads <= 32; threads *= 2) {
+    stress("stress_getattr_readdir", threads, 400000, [&](size_t i) {
+      struct stat st;
+      if (i % 16 == 0) {
+        size_t count = 0;
+        SpotifyFileSystem::listFiles(playlists[i % playlists.size()].c_str(),
+                                     &count, countEntry, 0, nullptr);
+      } else {
+        SpotifyFileSystem::getFileAttributes(tracks[i % tracks.size()].c_str(),
+                                             &st);
+      }
+    });
+  }
+
+  // The same listing from the flat map. A scan of the whole map per call is
+  // slow, so it runs fewer times in larger libraries.
+  {
+    FlatMap flat;
+    std::vector<std::string> names;
+    for (const auto &playlist : playlists) {
+      flat.files[playlist] = true;
+      names.clear();
+      SpotifyFileSystem::listFiles(playlist.c_str(), &names, collectEntry, 0,
+                                   nullptr);
+      for (const auto &name : names) {
+        flat.files[playlist + "/" + name] = false;
+      }
+    }
+    size_t ops = std::max<size_t>(10, 10000000 / flat.files.size());
+    measure("readdir_playlist_flat_map", ops, [&](size_t i) {
+      size_t count = 0;
+      flat.list(playlists[i % playlists.size()].c_str(), &count, countEntry);
+    });
+  }
+  // The map's memory goes back to the system, so that the RSS reported
+  // from here on is the filesystem's again
+  malloc_trim(0);
+
+  char buf[4096];
+  measure("open_read_release", 100000, [&](size_t i) {
+    const char *path = tracks[i % tracks.size()].c_str();
+    struct fuse_file_info fi = {};
+    fi.flags = O_RDONLY;
+    SpotifyFileSystem::openFile(path, &fi);
+    SpotifyFileSystem::readFile(path, buf, sizeof(buf), 0, &fi);
+    SpotifyFileSystem::releaseFile(path, &fi);
+  });
+
+  // Every create searches a new name through the fake and queues the
+  // addition for a batch
+  measure("create", 10000, [&](size_t i) {
+    std::string path = playlists[i % playlists.size()] + "/Created track " +
+                       std::to_string(i);
+    struct fuse_file_info fi = {};
+    fi.flags = O_WRONLY | O_CREAT;
+    SpotifyFileSystem::createFile(path.c_str(), 0644, &fi);
+    SpotifyFileSystem::releaseFile(path.c_str(), &fi);
+  });
+
+  SpotifyFileSystem::destroy(nullptr);
+  std::cout.rdbuf(cout_buf);
+  std::string cache_file = std::string(cache_dir) + "/library.bin";
+  unlink(cache_file.c_str());
+  rmdir(cache_dir);
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Imports a batch of search queries through TrackImporter and SpotifyAPI
+// against the mock Web API server, the way a write to a playlist's
+// .import file does, and reports the throughput as one JSON object.
+//
+// Usage: import_bench [base_url] [queries] [concurrency] [rate_limit]
+//
+// A rate limit of 0, the default, lifts the request budget, so that the
+// importer and not the scheduler bounds the throughput. Start the server
+// with latency, so that searches overlap:
+//   mock_spotify_server --latency 50 &
+//   SPOTIFY_ACCESS_TOKEN=mock import_bench
+
+#include "spotify_api.h"
+#include "track_importer.h"
+#include "track_resolver.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+  std::string base_url = argc > 1 ? argv[1] : "http://127.0.0.1:8888/v1";
+  size_t queries = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 5000;
+  size_t concurrency = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 8;
+  double rate_limit = argc > 4 ? std::strtod(argv[4], nullptr) : 0;
+
+  HttpConfig config;
+  config.base_url = base_url;
+  SchedulerConfig scheduler_config;
+  scheduler_config.rate = rate_limit > 0 ? rate_limit : 1e9;
+  scheduler_config.burst = rate_limit > 0 ? 2 * rate_limit : 1e9;
+  if (!SpotifyAPI::init(AuthConfig(), config, scheduler_config)) {
+    std::cerr << "Set SPOTIFY_ACCESS_TOKEN to skip the login" << std::endl;
+    return 1;
+  }
+
+  // As in the filesystem, but every query is new, so none is answered
+  // from the cache
+  TrackResolver resolver(queries, std::chrono::seconds(3600),
+                         std::chrono::seconds(60));
+  std::atomic<size_t> searched{0};
+  std::atomic<size_t> matched{0};
+  std::atomic<size_t> committed{0};
+  TrackImporter importer(
+      concurrency,
+      [&](const std::string &query) {
+        Track track = resolver.resolve(query);
+        if (!track.id.empty()) {
+          ++matched;
+        }
+        ++searched;
+        return track;
+      },
+      [&](const std::string &, const std::vector<Track> &tracks) {
+        committed += tracks.size();
+      });
+
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < queries; ++i) {
+    lines.push_back("Artist " + std::to_string(i) + " - Song " +
+                    std::to_string(i));
+  }
+  auto start = std::chrono::steady_clock::now();
+  importer.submit("playlist0", std::move(lines));
+  while (searched < queries || committed < matched) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  importer.stop();
+
+  printf("{\"bench\":\"import\",\"queries\":%zu,\"concurrency\":%zu,"
+         "\"rate_limit\":%.1f,\"matched\":%zu,\"seconds\":%.3f,"
+         "\"queries_per_sec\":%.1f}\n",
+         queries, concurrency, rate_limit, matched.load(), elapsed.count(),
+         queries / elapsed.count());
+  return 0;
+}
@@ -0,0 +1,237 @@
+// Compares the streaming TrackDecoder with the JsonCpp DOM on playlist
+// track pages. Reports parse time and heap allocations per page.
+//
+// Usage: json_decode_bench [page.json...]
+//
+// Pages saved from GET /playlists/{id}/tracks?limit=100 can be passed as
+// arguments. Without arguments a page of 100 items with the size and shape
+// of a real response (markets, images, external IDs) is generated.
+
+#include "response_decoder.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+const char *MARKETS[] = {
+    "AD", "AE", "AG", "AL", "AM", "AO", "AR", "AT", "AU", "AZ", "BA", "BB",
+    "BD", "BE", "BF", "BG", "BH", "BI", "BJ", "BN", "BO", "BR", "BS", "BT",
+    "BW", "BY", "BZ", "CA", "CD", "CG", "CH", "CI", "CL", "CM", "CO", "CR",
+    "CV", "CW", "CY", "CZ", "DE", "DJ", "DK", "DM", "DO", "DZ", "EC", "EE",
+    "EG", "ES", "ET", "FI", "FJ", "FM", "FR", "GA", "GB", "GD", "GE", "GH",
+    "GM", "GN", "GQ", "GR", "GT", "GW", "GY", "HK", "HN", "HR", "HT", "HU",
+    "ID", "IE", "IL", "IN", "IQ", "IS", "IT", "JM", "JO", "JP", "KE", "KG",
+    "KH", "KI", "KM", "KN", "KR", "KW", "KZ", "LA", "LB", "LC", "LI", "LK",
+    "LR", "LS", "LT", "LU", "LV", "LY", "MA", "MC", "MD", "ME", "MG", "MH",
+    "MK", "ML", "MN", "MO", "MR", "MT", "MU", "MV", "MW", "MX", "MY", "MZ",
+    "NA", "NE", "NG", "NI", "NL", "NO", "NP", "NR", "NZ", "OM", "PA", "PE",
+    "PG", "PH", "PK", "PL", "PS", "PT", "PW", "PY", "QA", "RO", "RS", "RW",
+    "SA", "SB", "SC", "SE", "SG", "SI", "SK", "SL", "SM", "SN", "SR", "ST",
+    "SV", "SZ", "TD", "TG", "TH", "TJ", "TL", "TN", "TO", "TR", "TT", "TV",
+    "TW", "TZ", "UA", "UG", "US", "UY", "UZ", "VC", "VE", "VN", "VU", "WS",
+    "XK", "ZA", "ZM", "ZW"};
+
+std::string markets() {
+  std::string out = "[";
+  for (const char *market : MARKETS) {
+    out += std::string(out.size() > 1 ? "," : "") + "\"" + market + "\"";
+  }
+  return out + "]";
+}
+
+std::string artist(int i) {
+  std::string id = "0artist" + std::to_string(i) + "xxxxxxxxxxxx";
+  return "{\"external_urls\":{\"spotify\":\"https://open.spotify.com/artist/" +
+         id + "\"},\"href\":\"https://api.spotify.com/v1/artists/" + id +
+         "\",\"id\":\"" + id + "\",\"name\":\"Artist \\u00e9 " +
+         std::to_string(i) + "\",\"type\":\"artist\",\"uri\":\"spotify:artist:" +
+         id + "\"}";
+}
+
+// A page shaped like a real /playlists/{id}/tracks response
+std::string generatePage(int items) {
+  std::string market_list = markets();
+  std::ostringstream out;
+  out << "{\"href\":\"https://api.spotify.com/v1/playlists/x/tracks?offset=0"
+         "&limit=100\",\"items\":[";
+  for (int i = 0; i < items; ++i) {
+    std::string id = "4track" + std::to_string(i) + "xxxxxxxxxxxxx";
+    std::string album_id = "1album" + std::to_string(i) + "xxxxxxxxxxxxx";
+    out << (i ? "," : "")
+        << "{\"added_at\":\"2023-05-01T12:00:00Z\",\"added_by\":{"
+           "\"external_urls\":{\"spotify\":\"https://open.spotify.com/user/u\"}"
+           ",\"href\":\"https://api.spotify.com/v1/users/u\",\"id\":\"u\","
+           "\"type\":\"user\",\"uri\":\"spotify:user:u\"},\"is_local\":false,"
+           "\"primary_color\":null,\"track\":{\"album\":{\"album_type\":"
+           "\"album\",\"artists\":["
+        << artist(i) << "],\"available_markets\":" << market_list
+        << ",\"external_urls\":{\"spotify\":\"https://open.spotify.com/album/"
+        << album_id << "\"},\"href\":\"https://api.spotify.com/v1/albums/"
+        << album_id << "\",\"id\":\"" << album_id << "\",\"images\":[";
+    for (int size : {640, 300, 64}) {
+      out << (size != 640 ? "," : "")
+          << "{\"height\":" << size
+          << ",\"url\":\"https://i.scdn.co/image/ab67616d0000b273" << album_id
+          << "\",\"width\":" << size << "}";
+    }
+    out << "],\"name\":\"Album " << i
+        << "\",\"release_date\":\"2019-03-08\",\"release_date_precision\":"
+           "\"day\",\"total_tracks\":12,\"type\":\"album\",\"uri\":"
+           "\"spotify:album:"
+        << album_id << "\"},\"artists\":[" << artist(i) << "," << artist(i + 1)
+        << "],\"available_markets\":" << market_list
+        << ",\"disc_number\":1,\"duration_ms\":" << 180000 + i * 1000
+        << ",\"episode\":false,\"explicit\":false,\"external_ids\":{\"isrc\":"
+           "\"USRC11900001\"},\"external_urls\":{\"spotify\":"
+           "\"https://open.spotify.com/track/"
+        << id << "\"},\"href\":\"https://api.spotify.com/v1/tracks/" << id
+        << "\",\"id\":\"" << id
+        << "\",\"is_local\":false,\"name\":\"Song \\\"" << i
+        << "\\\"\",\"popularity\":42,\"preview_url\":null,\"track\":true,"
+           "\"track_number\":3,\"type\":\"track\",\"uri\":\"spotify:track:"
+        << id << "\"},\"video_thumbnail\":{\"url\":null}}";
+  }
+  out << "],\"limit\":100,\"next\":null,\"offset\":0,\"previous\":null,"
+         "\"total\":"
+      << items << "}";
+  return out.str();
+}
+
+// The extraction SpotifyAPI did before the streaming decoder
+std::vector<Track> parseWithJsonCpp(const std::string &body, int &total) {
+  Json::Value root;
+  Json::Reader reader;
+  std::vector<Track> tracks;
+  if (!reader.parse(body, root)) {
+    return tracks;
+  }
+  total = root["total"].asInt();
+  for (const Json::Value &item : root["items"]) {
+    Track track;
+    track.id = item["track"]["id"].asString();
+    track.name = item["track"]["name"].asString();
+    track.artist = item["track"]["artists"][0]["name"].asString();
+    track.album = item["track"]["album"]["name"].asString();
+    track.duration_ms = item["track"]["duration_ms"].asInt();
+    track.uri = item["track"]["uri"].asString();
+    tracks.push_back(track);
+  }
+  return tracks;
+}
+
+std::vector<Track> parseStreaming(const std::string &body, size_t chunk_size,
+                                  int &total) {
+  TrackDecoder decoder(TrackDecoder::Source::playlist_page);
+  for (size_t i = 0; i < body.size(); i += chunk_size) {
+    decoder.feed(std::string_view(body).substr(i, chunk_size));
+  }
+  if (!decoder.finish()) {
+    return {};
+  }
+  total = decoder.total;
+  return std::move(decoder.tracks);
+}
+
+bool sameTracks(const std::vector<Track> &a, const std::vector<Track> &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].id != b[i].id || a[i].name != b[i].name ||
+        a[i].artist != b[i].artist || a[i].album != b[i].album ||
+        a[i].uri != b[i].uri || a[i].duration_ms != b[i].duration_ms) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Parse>
+void measure(const char *label, const std::string &body, int iterations,
+             Parse parse) {
+  size_t allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    int total = 0;
+    std::vector<Track> tracks = parse(body, total);
+    if (tracks.empty() && total != 0) {
+      std::cerr << label << ": parse failed" << std::endl;
+      return;
+    }
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "  " << label << ": "
+            << static_cast<double>(elapsed.count()) / iterations
+            << " us/page, " << (allocations - allocations_before) / iterations
+            << " allocations/page" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector<std::pair<std::string, std::string>> fixtures;
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream file(argv[i], std::ios::binary);
+    if (!file) {
+      std::cerr << "Cannot read " << argv[i] << std::endl;
+      return 1;
+    }
+    std::ostringstream body;
+    body << file.rdbuf();
+    fixtures.emplace_back(argv[i], body.str());
+  }
+  if (fixtures.empty()) {
+    fixtures.emplace_back("generated page of 100 items", generatePage(100));
+  }
+
+  const int iterations = 200;
+  for (const auto &fixture : fixtures) {
+    const std::string &body = fixture.second;
+    std::cout << fixture.first << " (" << body.size() / 1024 << " KiB)"
+              << std::endl;
+
+    int dom_total = 0, stream_total = 0;
+    std::vector<Track> expected = parseWithJsonCpp(body, dom_total);
+    for (size_t chunk_size : {body.size(), size_t(16384), size_t(1)}) {
+      if (!sameTracks(expected, parseStreaming(body, chunk_size,
+                                               stream_total)) ||
+          dom_total != stream_total) {
+        std::cerr << "  Decoders disagree with " << chunk_size
+                  << " byte chunks" << std::endl;
+        return 1;
+      }
+    }
+
+    measure("JsonCpp DOM", body, iterations, parseWithJsonCpp);
+    measure("TrackDecoder, whole body", body, iterations,
+            [](const std::string &body, int &total) {
+              return parseStreaming(body, body.size(), total);
+            });
+    measure("TrackDecoder, 16 KiB chunks", body, iterations,
+            [](const std::string &body, int &total) {
+              return parseStreaming(body, 16384, total);
+            });
+  }
+  return 0;
+}
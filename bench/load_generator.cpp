@@ -0,0 +1,431 @@
+// Drives a mounted SpotifyFS from many threads with a mix of the operations
+// clients make, and reports latency percentiles and throughput per
+// operation as one JSON object per line.
+//
+// Usage: load_generator [--threads N] [--duration SEC] [--mix MIX]
+//            [--spotifyfs PATH] [--api-url URL] [--mount-options OPTS]
+//            mountpoint
+//
+// MIX weighs the operations, by default stat=70,list=10,read=10,create=5,
+// unlink=5:
+//   stat    lstat of a random track (stat storms)
+//   list    readdir of a random playlist and lstat of every entry (ls -l)
+//   read    open, read to the end and close a random track
+//   create  create and close a new file in a random playlist
+//   unlink  remove a file created earlier by the same thread
+//
+// With --spotifyfs the binary is started in the foreground against the API
+// at --api-url (by default mock_spotify_server on port 8888) and unmounted
+// at the end; otherwise `mountpoint` must already be mounted. The tree is
+// first walked recursively, which is reported as the "walk" line.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <spawn.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Operation { STAT, LIST, READ, CREATE, UNLINK, OPERATIONS };
+
+const char *const OPERATION_NAMES[OPERATIONS] = {"stat", "list", "read",
+                                                 "create", "unlink"};
+
+struct LoadOptions {
+  size_t threads = 8;
+  double duration = 10; // Seconds of mixed load
+  unsigned weights[OPERATIONS] = {70, 10, 10, 5, 5};
+  const char *spotifyfs = nullptr; // Binary to mount with, if any
+  std::string api_url = "http://127.0.0.1:8888/v1";
+  std::string mount_options;
+  std::string mountpoint;
+};
+
+// Latency histogram with 16 linear buckets per power of two, so a reported
+// percentile is at most 6.25% below the true value
+class Histogram {
+public:
+  void record(uint64_t ns) {
+    ++counts[bucketOf(ns)];
+    ++count;
+    longest = std::max(longest, ns);
+  }
+
+  void merge(const Histogram &other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      counts[i] += other.counts[i];
+    }
+    count += other.count;
+    longest = std::max(longest, other.longest);
+  }
+
+  // Lower bound of the bucket holding the `q` quantile
+  uint64_t percentile(double q) const {
+    uint64_t rank = static_cast<uint64_t>(q * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen > rank) {
+        return lowerBound(i);
+      }
+    }
+    return longest;
+  }
+
+  uint64_t total() const { return count; }
+  uint64_t max() const { return longest; }
+
+private:
+  static constexpr size_t BUCKETS = 61 * 16;
+
+  static size_t bucketOf(uint64_t ns) {
+    if (ns < 16) {
+      return ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    return (exponent - 3) * 16 + ((ns >> (exponent - 4)) & 15);
+  }
+
+  static uint64_t lowerBound(size_t bucket) {
+    if (bucket < 16) {
+      return bucket;
+    }
+    int exponent = bucket / 16 + 3;
+    return (16 + bucket % 16) << (exponent - 4);
+  }
+
+  std::array<uint64_t, BUCKETS> counts{};
+  uint64_t count = 0;
+  uint64_t longest = 0;
+};
+
+struct WorkerResult {
+  Histogram latency[OPERATIONS];
+  size_t errors[OPERATIONS] = {};
+};
+
+LoadOptions options;
+std::vector<std::string> playlists; // Paths of the playlist directories
+std::vector<std::string> tracks;    // Paths of the track files
+
+bool parseMix(const std::string &mix) {
+  std::fill(std::begin(options.weights), std::end(options.weights), 0);
+  size_t start = 0;
+  while (start < mix.size()) {
+    size_t end = mix.find(',', start);
+    std::string pair = mix.substr(start, end - start);
+    size_t equals = pair.find('=');
+    auto name = std::find(std::begin(OPERATION_NAMES),
+                          std::end(OPERATION_NAMES), pair.substr(0, equals));
+    if (equals == std::string::npos || name == std::end(OPERATION_NAMES)) {
+      return false;
+    }
+    options.weights[name - std::begin(OPERATION_NAMES)] =
+        std::strtoul(pair.c_str() + equals + 1, nullptr, 10);
+    start = end == std::string::npos ? mix.size() : end + 1;
+  }
+  return true;
+}
+
+bool parseOptions(int argc, char *argv[]) {
+  int i = 1;
+  for (; i + 1 < argc; i += 2) {
+    std::string name = argv[i];
+    const char *value = argv[i + 1];
+    if (name == "--threads") {
+      options.threads = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+    } else if (name == "--duration") {
+      options.duration = std::atof(value);
+    } else if (name == "--mix") {
+      if (!parseMix(value)) {
+        return false;
+      }
+    } else if (name == "--spotifyfs") {
+      options.spotifyfs = value;
+    } else if (name == "--api-url") {
+      options.api_url = value;
+    } else if (name == "--mount-options") {
+      options.mount_options = value;
+    } else {
+      return false;
+    }
+  }
+  if (i + 1 != argc) {
+    return false;
+  }
+  options.mountpoint = argv[i];
+  unsigned total = 0;
+  for (unsigned weight : options.weights) {
+    total += weight;
+  }
+  return total > 0;
+}
+
+// Device of `path`, which changes once a file system is mounted on it
+dev_t deviceOf(const std::string &path) {
+  struct stat stbuf;
+  return stat(path.c_str(), &stbuf) == 0 ? stbuf.st_dev : 0;
+}
+
+// Starts SpotifyFS in the foreground and waits until the mount is up
+bool mount(pid_t &pid) {
+  dev_t unmounted = deviceOf(options.mountpoint);
+  std::string mount_options = "api_url=" + options.api_url + ",playback=0";
+  if (!options.mount_options.empty()) {
+    mount_options += "," + options.mount_options;
+  }
+  // Any token is accepted by the mock server
+  setenv("SPOTIFY_ACCESS_TOKEN", "mock", 0);
+  const char *argv[] = {options.spotifyfs, options.mountpoint.c_str(), "-f",
+                        "-o", mount_options.c_str(), nullptr};
+  int err = posix_spawn(&pid, options.spotifyfs, nullptr, nullptr,
+                        const_cast<char **>(argv), environ);
+  if (err != 0) {
+    std::cerr << "Failed to run " << options.spotifyfs << ": "
+              << strerror(err) << std::endl;
+    return false;
+  }
+  auto deadline = Clock::now() + std::chrono::seconds(30);
+  while (deviceOf(options.mountpoint) == unmounted) {
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      std::cerr << "SpotifyFS exited before mounting" << std::endl;
+      return false;
+    }
+    if (Clock::now() > deadline) {
+      std::cerr << "Timed out waiting for the mount" << std::endl;
+      kill(pid, SIGTERM);
+      waitpid(pid, &status, 0);
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return true;
+}
+
+void unmount(pid_t pid) {
+#ifdef __APPLE__
+  const char *argv[] = {"umount", options.mountpoint.c_str(), nullptr};
+#else
+  const char *argv[] = {"fusermount", "-u", options.mountpoint.c_str(),
+                        nullptr};
+#endif
+  pid_t unmounter;
+  int status;
+  if (posix_spawnp(&unmounter, argv[0], nullptr, nullptr,
+                   const_cast<char **>(argv), environ) == 0) {
+    waitpid(unmounter, &status, 0);
+  }
+  waitpid(pid, &status, 0);
+}
+
+// Lists `dir` and lstats every visible entry, as `ls -l` does. Returns
+// false if the directory could not be read.
+bool listDirectory(const std::string &dir, std::vector<std::string> *files,
+                   std::vector<std::string> *dirs) {
+  DIR *handle = opendir(dir.c_str());
+  if (!handle) {
+    return false;
+  }
+  bool ok = true;
+  while (struct dirent *entry = readdir(handle)) {
+    if (entry->d_name[0] == '.') {
+      continue; // Hidden control files, "." and ".."
+    }
+    std::string path = dir + "/" + entry->d_name;
+    struct stat stbuf;
+    if (lstat(path.c_str(), &stbuf) != 0) {
+      ok = ok && errno == ENOENT; // Removed by another thread meanwhile
+    } else if (S_ISDIR(stbuf.st_mode) && dirs) {
+      // Read-only directories, such as Liked Songs, take no creates
+      if (stbuf.st_mode & S_IWUSR) {
+        dirs->push_back(path);
+      }
+    } else if (S_ISREG(stbuf.st_mode) && files) {
+      files->push_back(path);
+    }
+  }
+  closedir(handle);
+  return ok;
+}
+
+// Recursive listing of the whole mount, which collects the paths the load
+// works on
+void walk() {
+  auto start = Clock::now();
+  bool ok = listDirectory(options.mountpoint, nullptr, &playlists);
+  for (const std::string &playlist : playlists) {
+    ok = listDirectory(playlist, &tracks, nullptr) && ok;
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  printf("{\"phase\":\"walk\",\"playlists\":%zu,\"tracks\":%zu,"
+         "\"seconds\":%.3f,\"errors\":%s}\n",
+         playlists.size(), tracks.size(), seconds, ok ? "false" : "true");
+  fflush(stdout);
+}
+
+// Performs `op` once, returns false if it failed
+bool perform(Operation op, std::mt19937 &random,
+             std::vector<std::string> &created, size_t worker) {
+  static std::atomic<size_t> created_count{0};
+  switch (op) {
+  case STAT: {
+    struct stat stbuf;
+    return lstat(tracks[random() % tracks.size()].c_str(), &stbuf) == 0;
+  }
+  case LIST:
+    return listDirectory(playlists[random() % playlists.size()], nullptr,
+                         nullptr);
+  case READ: {
+    int fd = open(tracks[random() % tracks.size()].c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    }
+    close(fd);
+    return n == 0;
+  }
+  case CREATE: {
+    std::string path = playlists[random() % playlists.size()] +
+                       "/Load Artist - Track " + std::to_string(worker) +
+                       "-" + std::to_string(created_count++);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+      return false;
+    }
+    close(fd);
+    created.push_back(path);
+    return true;
+  }
+  case UNLINK: {
+    std::string path = std::move(created.back());
+    created.pop_back();
+    return unlink(path.c_str()) == 0;
+  }
+  default:
+    return false;
+  }
+}
+
+void work(size_t worker, Clock::time_point deadline, WorkerResult &result) {
+  std::mt19937 random(worker + 1);
+  std::discrete_distribution<int> pick(std::begin(options.weights),
+                                       std::end(options.weights));
+  std::vector<std::string> created;
+  while (Clock::now() < deadline) {
+    auto op = static_cast<Operation>(pick(random));
+    if (op == UNLINK && created.empty()) {
+      op = CREATE; // Nothing of this thread to remove yet
+    }
+    auto start = Clock::now();
+    bool ok = perform(op, random, created, worker);
+    result.latency[op].record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                             start)
+            .count());
+    if (!ok) {
+      ++result.errors[op];
+    }
+  }
+  // Leave the library as it was
+  for (const std::string &path : created) {
+    unlink(path.c_str());
+  }
+}
+
+void report(const char *op, const Histogram &latency, size_t errors,
+            double seconds) {
+  printf("{\"op\":\"%s\",\"threads\":%zu,\"ops\":%llu,\"errors\":%zu,"
+         "\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+         "\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+         op, options.threads,
+         static_cast<unsigned long long>(latency.total()), errors,
+         latency.total() / seconds, latency.percentile(0.5) / 1e3,
+         latency.percentile(0.99) / 1e3, latency.percentile(0.999) / 1e3,
+         latency.max() / 1e3);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (!parseOptions(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--threads N] [--duration SEC] [--mix stat=N,list=N,"
+                 "read=N,create=N,unlink=N] [--spotifyfs PATH]"
+                 " [--api-url URL] [--mount-options OPTS] mountpoint"
+              << std::endl;
+    return 1;
+  }
+  pid_t pid = 0;
+  if (options.spotifyfs && !mount(pid)) {
+    return 1;
+  }
+
+  walk();
+  int ret = 0;
+  if (playlists.empty() || tracks.empty()) {
+    std::cerr << "The mount has no playlists or tracks" << std::endl;
+    ret = 1;
+  } else {
+    std::vector<WorkerResult> results(options.threads);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+                                std::chrono::duration<double>(
+                                    options.duration));
+    for (size_t i = 0; i < options.threads; ++i) {
+      workers.emplace_back(work, i, deadline, std::ref(results[i]));
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    Histogram all;
+    size_t all_errors = 0;
+    for (int op = 0; op < OPERATIONS; ++op) {
+      Histogram latency;
+      size_t errors = 0;
+      for (const auto &result : results) {
+        latency.merge(result.latency[op]);
+        errors += result.errors[op];
+      }
+      if (latency.total() > 0) {
+        report(OPERATION_NAMES[op], latency, errors, seconds);
+      }
+      all.merge(latency);
+      all_errors += errors;
+    }
+    report("all", all, all_errors, seconds);
+  }
+
+  if (pid) {
+    unmount(pid);
+  }
+  return ret;
+}
@@ -0,0 +1,76 @@
+// Measures the cost of recording metrics: a counter increment, a histogram
+// record and a scoped timer, from one thread and from several threads at
+// once, and the time to render /.stats afterwards. Timers and spans are
+// measured again with tracing into /dev/null.
+//
+// Usage: metrics_bench [events_per_thread] [threads]
+
+#include "metrics.h"
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Runs `event` `events` times on each of `threads` threads and prints the
+// time per event
+void measure(const char *label, size_t threads, size_t events,
+             const std::function<void(size_t)> &event) {
+  std::vector<std::thread> workers;
+  auto start = Clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&event, events]() {
+      for (size_t i = 0; i < events; ++i) {
+        event(i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+  std::cout << "  " << label << ": " << ns / events << " ns/event per thread"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t events = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+  size_t threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+
+  for (size_t n : {size_t(1), threads}) {
+    std::cout << n << " thread(s), " << events << " events each" << std::endl;
+    measure("Metrics::add", n, events,
+            [](size_t) { Metrics::add(Counter::http_bytes_received, 512); });
+    measure("Metrics::record", n, events, [](size_t i) {
+      Metrics::record(FuseOp::getattr, 1000 + (i & 0xFFFF));
+    });
+    measure("Metrics::Timer", n, events,
+            [](size_t) { Metrics::Timer timer(FuseOp::read); });
+    measure("Tracer::Span", n, events,
+            [](size_t) { Tracer::Span span("read", "fuse"); });
+  }
+
+  Tracer::start("/dev/null");
+  std::cout << "tracing enabled, " << threads << " thread(s)" << std::endl;
+  measure("Metrics::Timer", threads, events,
+          [](size_t) { Metrics::Timer timer(FuseOp::read); });
+  measure("Tracer::Span", threads, events,
+          [](size_t) { Tracer::Span span("read", "fuse"); });
+  Tracer::stop();
+
+  auto start = Clock::now();
+  std::string stats = Metrics::render();
+  std::cout << "render: " << stats.size() << " bytes in "
+            << std::chrono::duration<double, std::micro>(Clock::now() - start)
+                   .count()
+            << " us" << std::endl;
+  return 0;
+}
@@ -0,0 +1,879 @@
+// Local stand-in for the Spotify Web API. Serves the endpoints SpotifyAPI
+// uses over plain HTTP/1.1 from a synthetic library held in memory, so the
+// mounted filesystem can be driven without network access. Latency, jitter,
+// failures and rate limiting can be injected into every request.
+//
+// Usage: mock_spotify_server [--port N] [--playlists N] [--tracks N]
+//            [--saved N] [--latency MS] [--jitter MS] [--error-rate P]
+//            [--rate-limit-rate P] [--retry-after SEC] [--token-ttl SEC]
+//
+// The API is served under /v1, any bearer token is accepted:
+//   SPOTIFY_ACCESS_TOKEN=mock SpotifyFS mnt -o api_url=http://127.0.0.1:8888/v1
+//
+// With --token-ttl only tokens issued by the mock's own accounts service,
+// at /authorize and /api/token, are accepted, and they expire after that
+// many seconds. /authorize redirects to the redirect URI at once, as if the
+// user had allowed the access; the PKCE verifier has to be sent with the
+// code but is not checked against the challenge:
+//   SpotifyFS mnt -o api_url=http://127.0.0.1:8888/v1,
+//       auth_url=http://127.0.0.1:8888,token_file=/tmp/mock_token
+//
+// Counts of the requests served are printed on SIGINT or SIGTERM.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <json/json.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <string>
+#include <strings.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+struct MockOptions {
+  int port = 8888;            // Port listened on at 127.0.0.1
+  size_t playlists = 100;     // Playlists in the library
+  size_t tracks = 100;        // Tracks in each playlist
+  size_t saved = 1000;        // Tracks in Liked Songs
+  double latency_ms = 0;      // Delay added to every request
+  double jitter_ms = 0;       // Random delay of up to this much on top
+  double error_rate = 0;      // Share of requests failing with 500
+  double rate_limit_rate = 0; // Share of requests refused with 429
+  int retry_after = 1;        // Retry-After sent with a 429, in seconds
+  int token_ttl = 0;          // Lifetime of issued tokens, 0 accepts any
+};
+
+struct MockTrack {
+  std::string id;
+  std::string name;
+  std::string artist;
+  std::string album;
+  size_t duration_ms;
+};
+
+struct MockItem {
+  size_t track;    // Index into the catalogue
+  time_t added_at; // When the track was added to the playlist
+};
+
+struct MockPlaylist {
+  std::string id;
+  std::string name;
+  uint64_t version = 0; // Bumped on every change, part of the snapshot ID
+  std::vector<MockItem> items;
+};
+
+struct HttpRequest {
+  std::string method;
+  std::string path; // Without the query and the /v1 prefix
+  std::unordered_map<std::string, std::string> query;
+  std::string body;
+  std::string authorization; // Value of the Authorization header
+};
+
+struct HttpResponse {
+  int status = 200;
+  std::string body;
+  std::string headers; // Extra header lines, each ending with CRLF
+};
+
+MockOptions options;
+
+// The library, guarded by library_mutex
+std::mutex library_mutex;
+std::vector<MockTrack> catalogue;
+std::unordered_map<std::string, size_t> track_ids;
+std::unordered_map<std::string, size_t> searches; // Query to track
+std::vector<MockPlaylist> playlists;
+std::unordered_map<std::string, size_t> playlist_ids;
+std::vector<MockItem> saved; // Liked Songs, most recently saved first
+
+// The accounts service, guarded by auth_mutex
+std::mutex auth_mutex;
+std::unordered_map<std::string, std::string> auth_codes; // To redirect URI
+std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+    access_tokens; // To their expiry
+std::unordered_map<std::string, bool> refresh_tokens;
+size_t issued = 0;
+
+volatile std::sig_atomic_t stopping = 0;
+std::atomic<size_t> served{0};
+std::atomic<size_t> injected_errors{0};
+std::atomic<size_t> injected_rate_limits{0};
+std::atomic<size_t> unauthorized{0};
+std::atomic<size_t> connections{0};
+
+// `prefix` followed by `number`, padded with letters to 24 characters
+std::string paddedName(const std::string &prefix, size_t number) {
+  std::string name = prefix + std::to_string(number);
+  for (size_t i = 0; name.size() < 24; ++i) {
+    name += i % 8 == 7 ? ' ' : static_cast<char>('a' + (number + i) % 26);
+  }
+  return name;
+}
+
+// Base62 ID derived from `seed`
+std::string base62Id(size_t seed) {
+  static const char digits[] =
+      "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  std::string id(22, '0');
+  for (size_t i = 22; i-- > 0 && seed;) {
+    id[i] = digits[seed % 62];
+    seed /= 62;
+  }
+  return id;
+}
+
+// Adds a track to the catalogue and returns its index
+size_t addTrack(std::string name, std::string artist, std::string album,
+                size_t duration_ms) {
+  size_t index = catalogue.size();
+  MockTrack track;
+  track.id = base62Id(index + 1);
+  track.name = std::move(name);
+  track.artist = std::move(artist);
+  track.album = std::move(album);
+  track.duration_ms = duration_ms;
+  track_ids[track.id] = index;
+  catalogue.push_back(std::move(track));
+  return index;
+}
+
+size_t addPlaylist(std::string name) {
+  size_t index = playlists.size();
+  MockPlaylist playlist;
+  playlist.id = "mock" + base62Id(index + 1).substr(4);
+  playlist.name = std::move(name);
+  playlist_ids[playlist.id] = index;
+  playlists.push_back(std::move(playlist));
+  return index;
+}
+
+// Half of the entries are tracks that also appear in other playlists, as
+// in a real library
+void buildLibrary() {
+  size_t entries = options.playlists * options.tracks;
+  size_t distinct = entries / 2 + 1;
+  for (size_t n = 0; n < distinct; ++n) {
+    addTrack(paddedName("Song ", n), paddedName("Artist ", n / 20),
+             paddedName("Album ", n / 10), 180000 + n % 60000);
+  }
+  for (size_t i = 0; i < options.playlists; ++i) {
+    MockPlaylist &playlist =
+        playlists[addPlaylist("Playlist " + std::to_string(i))];
+    playlist.items.reserve(options.tracks);
+    for (size_t position = 0; position < options.tracks; ++position) {
+      size_t n = (i * options.tracks + position) * 7919 % distinct;
+      playlist.items.push_back({n, static_cast<time_t>(1600000000 + n * 60)});
+    }
+  }
+  // Saved tracks are taken from the end of the catalogue, which is extended
+  // if there are more of them than it holds
+  for (size_t i = 0; i < options.saved; ++i) {
+    size_t n = i < distinct ? distinct - 1 - i
+                            : addTrack(paddedName("Saved Song ", i),
+                                       paddedName("Artist ", i / 20),
+                                       paddedName("Album ", i / 10), 200000);
+    saved.push_back({n, static_cast<time_t>(1700000000 - i * 3600)});
+  }
+}
+
+void appendJson(std::string &out, const std::string &value) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xF];
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+void appendTrack(std::string &out, const MockTrack &track) {
+  out += "{\"id\":";
+  appendJson(out, track.id);
+  out += ",\"name\":";
+  appendJson(out, track.name);
+  out += ",\"artists\":[{\"name\":";
+  appendJson(out, track.artist);
+  out += "}],\"album\":{\"name\":";
+  appendJson(out, track.album);
+  out += "},\"duration_ms\":" + std::to_string(track.duration_ms) +
+         ",\"uri\":\"spotify:track:" + track.id + "\"}";
+}
+
+std::string snapshotId(const MockPlaylist &playlist) {
+  return playlist.id + "-" + std::to_string(playlist.version);
+}
+
+void appendPlaylist(std::string &out, const MockPlaylist &playlist) {
+  out += "{\"id\":";
+  appendJson(out, playlist.id);
+  out += ",\"name\":";
+  appendJson(out, playlist.name);
+  out += ",\"owner\":{\"id\":\"mock_user\",\"display_name\":\"Mock User\"}"
+         ",\"snapshot_id\":\"" +
+         snapshotId(playlist) + "\",\"tracks\":{\"total\":" +
+         std::to_string(playlist.items.size()) + "}}";
+}
+
+std::string formatTime(time_t time) {
+  struct tm tm;
+  char buf[32];
+  gmtime_r(&time, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  return buf;
+}
+
+HttpResponse error(int status, const std::string &message) {
+  HttpResponse response;
+  response.status = status;
+  response.body = "{\"error\":{\"status\":" + std::to_string(status) +
+                  ",\"message\":";
+  appendJson(response.body, message);
+  response.body += "}}";
+  return response;
+}
+
+// Clamps the offset and limit parameters of a paged listing
+void pageOf(const HttpRequest &request, size_t total, size_t max_limit,
+            size_t &begin, size_t &end) {
+  auto number = [&request](const char *name, size_t fallback) {
+    auto it = request.query.find(name);
+    return it == request.query.end() ? fallback
+                                     : std::strtoul(it->second.c_str(),
+                                                    nullptr, 10);
+  };
+  begin = std::min(number("offset", 0), total);
+  end = std::min(begin + std::min(number("limit", 20), max_limit), total);
+}
+
+std::string pageJson(const std::string &items, size_t begin, size_t end,
+                     size_t total) {
+  return "{\"items\":[" + items + "],\"offset\":" + std::to_string(begin) +
+         ",\"limit\":" + std::to_string(end - begin) +
+         ",\"total\":" + std::to_string(total) + "}";
+}
+
+// Items of a page of playlist tracks or saved tracks
+std::string itemsJson(const std::vector<MockItem> &items, size_t begin,
+                      size_t end) {
+  std::string out;
+  for (size_t i = begin; i < end; ++i) {
+    out += i > begin ? ",{\"added_at\":\"" : "{\"added_at\":\"";
+    out += formatTime(items[i].added_at) + "\",\"track\":";
+    appendTrack(out, catalogue[items[i].track]);
+    out += '}';
+  }
+  return out;
+}
+
+bool parseBody(const HttpRequest &request, Json::Value &root) {
+  Json::Reader reader;
+  return reader.parse(request.body, root) && root.isObject();
+}
+
+// Track index of a "spotify:track:" URI, false if it is not in the catalogue
+bool trackOfUri(const std::string &uri, size_t &track) {
+  static const std::string prefix = "spotify:track:";
+  if (uri.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  auto it = track_ids.find(uri.substr(prefix.size()));
+  if (it == track_ids.end()) {
+    return false;
+  }
+  track = it->second;
+  return true;
+}
+
+HttpResponse route(const HttpRequest &request) {
+  std::vector<std::string> parts;
+  for (size_t start = 1; start <= request.path.size();) {
+    size_t end = request.path.find('/', start);
+    if (end == std::string::npos) {
+      end = request.path.size();
+    }
+    parts.push_back(request.path.substr(start, end - start));
+    start = end + 1;
+  }
+  const std::string &method = request.method;
+  HttpResponse response;
+  std::lock_guard<std::mutex> lock(library_mutex);
+
+  // GET /me
+  if (method == "GET" && parts.size() == 1 && parts[0] == "me") {
+    response.body = "{\"id\":\"mock_user\",\"display_name\":\"Mock User\"}";
+    return response;
+  }
+
+  // GET /me/playlists
+  if (method == "GET" && parts.size() == 2 && parts[0] == "me" &&
+      parts[1] == "playlists") {
+    size_t begin, end;
+    pageOf(request, playlists.size(), 50, begin, end);
+    std::string items;
+    for (size_t i = begin; i < end; ++i) {
+      if (i > begin) {
+        items += ',';
+      }
+      appendPlaylist(items, playlists[i]);
+    }
+    response.body = pageJson(items, begin, end, playlists.size());
+    return response;
+  }
+
+  // GET /me/tracks
+  if (method == "GET" && parts.size() == 2 && parts[0] == "me" &&
+      parts[1] == "tracks") {
+    size_t begin, end;
+    pageOf(request, saved.size(), 50, begin, end);
+    response.body =
+        pageJson(itemsJson(saved, begin, end), begin, end, saved.size());
+    return response;
+  }
+
+  // POST /users/{user_id}/playlists
+  if (method == "POST" && parts.size() == 3 && parts[0] == "users" &&
+      parts[2] == "playlists") {
+    Json::Value body;
+    if (!parseBody(request, body) || !body["name"].isString()) {
+      return error(400, "Missing playlist name");
+    }
+    response.status = 201;
+    appendPlaylist(response.body,
+                   playlists[addPlaylist(body["name"].asString())]);
+    return response;
+  }
+
+  // PUT /playlists/{id}, only the name is changed
+  if (method == "PUT" && parts.size() == 2 && parts[0] == "playlists") {
+    auto it = playlist_ids.find(parts[1]);
+    if (it == playlist_ids.end()) {
+      return error(404, "Playlist not found");
+    }
+    Json::Value body;
+    if (!parseBody(request, body) || !body["name"].isString()) {
+      return error(400, "Missing playlist name");
+    }
+    MockPlaylist &playlist = playlists[it->second];
+    playlist.name = body["name"].asString();
+    ++playlist.version;
+    return response;
+  }
+
+  // GET, POST, PUT and DELETE /playlists/{id}/tracks
+  if (parts.size() == 3 && parts[0] == "playlists" && parts[2] == "tracks") {
+    auto it = playlist_ids.find(parts[1]);
+    if (it == playlist_ids.end()) {
+      return error(404, "Playlist not found");
+    }
+    MockPlaylist &playlist = playlists[it->second];
+    if (method == "GET") {
+      size_t begin, end;
+      pageOf(request, playlist.items.size(), 100, begin, end);
+      response.body = pageJson(itemsJson(playlist.items, begin, end), begin,
+                               end, playlist.items.size());
+      return response;
+    }
+
+    Json::Value body;
+    if (!parseBody(request, body)) {
+      return error(400, "Malformed request body");
+    }
+    if (method == "POST") {
+      const Json::Value &uris = body["uris"];
+      if (!uris.isArray() || uris.empty() || uris.size() > 100) {
+        return error(400, "Expected 1 to 100 URIs");
+      }
+      std::vector<MockItem> added;
+      time_t now = time(nullptr);
+      for (const auto &uri : uris) {
+        size_t track;
+        if (!trackOfUri(uri.asString(), track)) {
+          return error(400, "Invalid track uri: " + uri.asString());
+        }
+        added.push_back({track, now});
+      }
+      size_t position = playlist.items.size();
+      if (body["position"].isIntegral()) {
+        position = std::min<size_t>(body["position"].asUInt(), position);
+      }
+      playlist.items.insert(playlist.items.begin() + position, added.begin(),
+                            added.end());
+      ++playlist.version;
+      response.status = 201;
+    } else if (method == "DELETE") {
+      const Json::Value &tracks = body["tracks"];
+      if (!tracks.isArray() || tracks.empty() || tracks.size() > 100) {
+        return error(400, "Expected 1 to 100 tracks");
+      }
+      for (const auto &object : tracks) {
+        size_t track;
+        if (!trackOfUri(object["uri"].asString(), track)) {
+          return error(400, "Invalid track uri");
+        }
+        auto &items = playlist.items;
+        items.erase(std::remove_if(items.begin(), items.end(),
+                                   [track](const MockItem &item) {
+                                     return item.track == track;
+                                   }),
+                    items.end());
+      }
+      ++playlist.version;
+    } else if (method == "PUT") {
+      // Moves range_length items from range_start to before insert_before,
+      // both positions counted before the move
+      auto &items = playlist.items;
+      size_t start = body["range_start"].asUInt();
+      size_t length = body.get("range_length", 1).asUInt();
+      size_t before = body["insert_before"].asUInt();
+      if (!body["range_start"].isIntegral() ||
+          !body["insert_before"].isIntegral() || length == 0 ||
+          start + length > items.size() || before > items.size()) {
+        return error(400, "Invalid range");
+      }
+      if (before < start) {
+        std::rotate(items.begin() + before, items.begin() + start,
+                    items.begin() + start + length);
+      } else if (before > start + length) {
+        std::rotate(items.begin() + start, items.begin() + start + length,
+                    items.begin() + before);
+      }
+      ++playlist.version;
+    } else {
+      return error(405, "Method not allowed");
+    }
+    response.body = "{\"snapshot_id\":\"" + snapshotId(playlist) + "\"}";
+    return response;
+  }
+
+  // GET /tracks/{id}
+  if (method == "GET" && parts.size() == 2 && parts[0] == "tracks") {
+    auto it = track_ids.find(parts[1]);
+    if (it == track_ids.end()) {
+      return error(404, "Track not found");
+    }
+    appendTrack(response.body, catalogue[it->second]);
+    return response;
+  }
+
+  // GET /search, every query matches a track of its own, the same one each
+  // time it is searched
+  if (method == "GET" && parts.size() == 1 && parts[0] == "search") {
+    auto q = request.query.find("q");
+    if (q == request.query.end() || q->second.empty()) {
+      return error(400, "No search query");
+    }
+    auto it = searches.find(q->second);
+    if (it == searches.end()) {
+      size_t n = searches.size();
+      size_t track = addTrack(q->second, paddedName("Artist ", n / 20),
+                              paddedName("Album ", n / 10), 180000 + n % 60000);
+      it = searches.emplace(q->second, track).first;
+    }
+    response.body = "{\"tracks\":{\"items\":[";
+    appendTrack(response.body, catalogue[it->second]);
+    response.body += "],\"total\":1}}";
+    return response;
+  }
+
+  return error(404, "Service not found");
+}
+
+std::string newToken(const char *kind) {
+  return std::string("mock-") + kind + "-" + std::to_string(++issued);
+}
+
+// The authorization and token endpoints of the accounts service
+HttpResponse routeAccounts(const HttpRequest &request) {
+  HttpResponse response;
+  std::lock_guard<std::mutex> lock(auth_mutex);
+  const auto &query = request.query;
+  auto field = [&](const char *name) {
+    auto it = query.find(name);
+    return it == query.end() ? std::string() : it->second;
+  };
+
+  // GET /authorize, allowed at once
+  if (request.method == "GET" && request.path == "/authorize") {
+    std::string redirect_uri = field("redirect_uri");
+    if (field("response_type") != "code" || redirect_uri.empty() ||
+        field("code_challenge_method") != "S256" ||
+        field("code_challenge").empty()) {
+      return error(400, "Invalid authorization request");
+    }
+    std::string code = newToken("code");
+    auth_codes[code] = redirect_uri;
+    response.status = 302;
+    response.headers = "Location: " + redirect_uri + "?code=" + code +
+                       "&state=" + field("state") + "\r\n";
+    return response;
+  }
+
+  // POST /api/token
+  if (request.method != "POST" || request.path != "/api/token") {
+    return error(404, "Service not found");
+  }
+  std::string grant_type = field("grant_type");
+  bool granted = false;
+  if (grant_type == "authorization_code") {
+    auto it = auth_codes.find(field("code"));
+    granted = it != auth_codes.end() &&
+              it->second == field("redirect_uri") &&
+              !field("code_verifier").empty();
+    if (granted) {
+      auth_codes.erase(it); // Codes are used once
+    }
+  } else if (grant_type == "refresh_token") {
+    granted = refresh_tokens.count(field("refresh_token")) > 0;
+  }
+  if (!granted) {
+    response.status = 400;
+    response.body = "{\"error\":\"invalid_grant\","
+                    "\"error_description\":\"Invalid grant\"}";
+    return response;
+  }
+  // Every grant hands out a new refresh token, the old ones stay valid
+  int ttl = options.token_ttl > 0 ? options.token_ttl : 3600;
+  std::string access_token = newToken("access");
+  std::string refresh_token = newToken("refresh");
+  access_tokens[access_token] =
+      std::chrono::steady_clock::now() + std::chrono::seconds(ttl);
+  refresh_tokens[refresh_token] = true;
+  response.body = "{\"access_token\":\"" + access_token +
+                  "\",\"token_type\":\"Bearer\",\"expires_in\":" +
+                  std::to_string(ttl) + ",\"refresh_token\":\"" +
+                  refresh_token + "\"}";
+  return response;
+}
+
+// With --token-ttl, sets `response` to a 401 unless the request carries a
+// token that was issued and has not expired
+bool rejectToken(const HttpRequest &request, HttpResponse &response) {
+  if (options.token_ttl <= 0) {
+    return false;
+  }
+  const std::string prefix = "Bearer ";
+  std::lock_guard<std::mutex> lock(auth_mutex);
+  auto it = request.authorization.compare(0, prefix.size(), prefix) == 0
+                ? access_tokens.find(request.authorization.substr(
+                      prefix.size()))
+                : access_tokens.end();
+  if (it != access_tokens.end() &&
+      std::chrono::steady_clock::now() < it->second) {
+    return false;
+  }
+  ++unauthorized;
+  response = error(401, "The access token expired");
+  return true;
+}
+
+// Delays the request and decides whether it fails. Returns true if
+// `response` was set to an injected failure.
+bool inject(HttpResponse &response) {
+  thread_local std::mt19937 random(std::random_device{}());
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double delay_ms = options.latency_ms + options.jitter_ms * uniform(random);
+  if (delay_ms > 0) {
+    std::this_thread::sleep_for(
+        std::chrono::duration<double, std::milli>(delay_ms));
+  }
+  if (uniform(random) < options.rate_limit_rate) {
+    ++injected_rate_limits;
+    response = error(429, "API rate limit exceeded");
+    response.headers =
+        "Retry-After: " + std::to_string(options.retry_after) + "\r\n";
+    return true;
+  }
+  if (uniform(random) < options.error_rate) {
+    ++injected_errors;
+    response = error(500, "Server error");
+    return true;
+  }
+  return false;
+}
+
+std::string urlDecode(const std::string &value) {
+  std::string out;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '+') {
+      out += ' ';
+    } else if (value[i] == '%' && i + 2 < value.size() &&
+               isxdigit(value[i + 1]) && isxdigit(value[i + 2])) {
+      out += static_cast<char>(std::stoi(value.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else {
+      out += value[i];
+    }
+  }
+  return out;
+}
+
+// Adds the fields of an URL encoded query or form to `query`
+void parseQuery(const std::string &text,
+                std::unordered_map<std::string, std::string> &query) {
+  for (size_t start = 0; start < text.size();) {
+    size_t end = std::min(text.find('&', start), text.size());
+    std::string pair = text.substr(start, end - start);
+    size_t equals = pair.find('=');
+    query[urlDecode(pair.substr(0, equals))] =
+        equals == std::string::npos ? "" : urlDecode(pair.substr(equals + 1));
+    start = end + 1;
+  }
+}
+
+void parseTarget(const std::string &target, HttpRequest &request) {
+  size_t question = target.find('?');
+  request.path = urlDecode(target.substr(0, question));
+  if (request.path.compare(0, 4, "/v1/") == 0) {
+    request.path.erase(0, 3);
+  }
+  if (question != std::string::npos) {
+    parseQuery(target.substr(question + 1), request.query);
+  }
+}
+
+bool sendAll(int fd, const std::string &data) {
+  for (size_t sent = 0; sent < data.size();) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+const char *reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 201:
+    return "Created";
+  case 302:
+    return "Found";
+  case 400:
+    return "Bad Request";
+  case 401:
+    return "Unauthorized";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 429:
+    return "Too Many Requests";
+  default:
+    return "Internal Server Error";
+  }
+}
+
+// Serves the requests of one keep-alive connection
+void serve(int fd) {
+  std::string buffer;
+  char chunk[16384];
+  bool keep_alive = true;
+  while (keep_alive) {
+    // Read the request head
+    size_t head_end;
+    while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        close(fd);
+        return;
+      }
+      buffer.append(chunk, n);
+    }
+    std::string head = buffer.substr(0, head_end);
+    buffer.erase(0, head_end + 4);
+
+    HttpRequest request;
+    size_t line_end = head.find("\r\n");
+    std::string line = head.substr(0, line_end);
+    size_t space = line.find(' ');
+    size_t target_end = line.find(' ', space + 1);
+    if (space == std::string::npos || target_end == std::string::npos) {
+      break;
+    }
+    request.method = line.substr(0, space);
+    parseTarget(line.substr(space + 1, target_end - space - 1), request);
+
+    size_t content_length = 0;
+    bool expect_continue = false;
+    while (line_end != std::string::npos) {
+      size_t start = line_end + 2;
+      line_end = head.find("\r\n", start);
+      std::string header = head.substr(start, line_end - start);
+      size_t colon = header.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = header.substr(0, colon);
+      for (char &c : name) {
+        c = tolower(c);
+      }
+      std::string value = header.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(' '));
+      if (name == "content-length") {
+        content_length = std::strtoul(value.c_str(), nullptr, 10);
+      } else if (name == "connection") {
+        keep_alive = strcasecmp(value.c_str(), "close") != 0;
+      } else if (name == "expect") {
+        expect_continue = strcasecmp(value.c_str(), "100-continue") == 0;
+      } else if (name == "authorization") {
+        request.authorization = value;
+      }
+    }
+    // curl waits for this before sending larger bodies
+    if (expect_continue && buffer.size() < content_length &&
+        !sendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      break;
+    }
+    while (buffer.size() < content_length) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        close(fd);
+        return;
+      }
+      buffer.append(chunk, n);
+    }
+    request.body = buffer.substr(0, content_length);
+    buffer.erase(0, content_length);
+
+    HttpResponse response;
+    if (request.path == "/authorize" || request.path == "/api/token") {
+      // The form of a token request is read like a query
+      parseQuery(request.body, request.query);
+      response = routeAccounts(request);
+    } else if (!rejectToken(request, response) && !inject(response)) {
+      response = route(request);
+    }
+    ++served;
+    std::string out = "HTTP/1.1 " + std::to_string(response.status) + " " +
+                      reason(response.status) +
+                      "\r\nContent-Type: application/json; charset=utf-8"
+                      "\r\nContent-Length: " +
+                      std::to_string(response.body.size()) + "\r\n" +
+                      response.headers +
+                      (keep_alive ? "" : "Connection: close\r\n") + "\r\n" +
+                      response.body;
+    if (!sendAll(fd, out)) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+void onSignal(int) { stopping = 1; }
+
+bool parseOptions(int argc, char *argv[]) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string name = argv[i];
+    const char *value = argv[i + 1];
+    if (name == "--port") {
+      options.port = std::atoi(value);
+    } else if (name == "--playlists") {
+      options.playlists = std::strtoul(value, nullptr, 10);
+    } else if (name == "--tracks") {
+      options.tracks = std::strtoul(value, nullptr, 10);
+    } else if (name == "--saved") {
+      options.saved = std::strtoul(value, nullptr, 10);
+    } else if (name == "--latency") {
+      options.latency_ms = std::atof(value);
+    } else if (name == "--jitter") {
+      options.jitter_ms = std::atof(value);
+    } else if (name == "--error-rate") {
+      options.error_rate = std::atof(value);
+    } else if (name == "--rate-limit-rate") {
+      options.rate_limit_rate = std::atof(value);
+    } else if (name == "--retry-after") {
+      options.retry_after = std::atoi(value);
+    } else if (name == "--token-ttl") {
+      options.token_ttl = std::atoi(value);
+    } else {
+      return false;
+    }
+  }
+  return argc % 2 == 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (!parseOptions(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--port N] [--playlists N] [--tracks N] [--saved N]"
+                 " [--latency MS] [--jitter MS] [--error-rate P]"
+                 " [--rate-limit-rate P] [--retry-after SEC]"
+                 " [--token-ttl SEC]"
+              << std::endl;
+    return 1;
+  }
+  buildLibrary();
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(options.port);
+  if (bind(listener, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) == -1 ||
+      listen(listener, 128) == -1) {
+    perror("bind");
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  std::cout << "Serving " << options.playlists << " playlists of "
+            << options.tracks << " tracks and " << options.saved
+            << " saved tracks on http://127.0.0.1:"
+            << options.port << "/v1" << std::endl;
+
+  // Connections are kept alive by the clients, so a thread per connection
+  // is enough
+  while (!stopping) {
+    struct pollfd pfd = {listener, POLLIN, 0};
+    if (poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd == -1) {
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    ++connections;
+    std::thread(serve, fd).detach();
+  }
+  close(listener);
+  std::cout << "Served " << served << " requests on " << connections
+            << " connections, injected " << injected_errors << " errors and "
+            << injected_rate_limits << " rate limits, rejected "
+            << unauthorized << " expired tokens" << std::endl;
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Measures the time a FUSE thread spends reading track files, comparing the
+// synchronous system() launch on every read (the behaviour before the
+// playback launcher) with PlaybackLauncher, which queues one launch per open
+// and leaves reads as plain copies.
+//
+// Usage: read_throughput_bench [files] [reads_per_file]
+//
+// Both variants launch `true` instead of the desktop launcher so no client
+// starts. Files are opened in order and every file is read in 4 KiB chunks.
+
+#include "playback_launcher.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace {
+
+const std::string CONTENT = "Opening track in Spotify...\n";
+
+using Clock = std::chrono::steady_clock;
+
+std::string trackUri(size_t i) {
+  std::string id = std::to_string(i);
+  return "spotify:track:" + std::string(22 - id.size(), '0') + id;
+}
+
+size_t copyContent(char *buf, size_t size, size_t offset) {
+  if (offset >= CONTENT.size()) {
+    return 0;
+  }
+  size_t len = std::min(size, CONTENT.size() - offset);
+  memcpy(buf, CONTENT.data() + offset, len);
+  return len;
+}
+
+void report(const char *label, size_t reads, Clock::duration elapsed) {
+  double us = std::chrono::duration<double, std::micro>(elapsed).count();
+  std::cout << "  " << label << ": " << reads << " reads in " << us / 1000
+            << " ms, " << us / reads << " us/read, "
+            << static_cast<size_t>(reads / (us / 1e6)) << " reads/s"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t files = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+  size_t reads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+  char buf[4096];
+
+  // Forking a shell per read is slow, a sample of the files is enough
+  size_t sync_files = std::min<size_t>(files, 200);
+  auto start = Clock::now();
+  for (size_t file = 0; file < sync_files; ++file) {
+    std::string command = "true " + trackUri(file);
+    for (size_t i = 0; i < reads; ++i) {
+      system(command.c_str());
+      copyContent(buf, sizeof(buf), i * sizeof(buf));
+    }
+  }
+  std::cout << sync_files << " files, " << reads << " reads each"
+            << std::endl;
+  report("system() per read", sync_files * reads, Clock::now() - start);
+
+  PlaybackLauncher launcher("true", std::chrono::milliseconds(2000));
+  start = Clock::now();
+  Clock::duration longest{};
+  for (size_t file = 0; file < files; ++file) {
+    auto open_start = Clock::now();
+    launcher.launch(trackUri(file)); // What open() does
+    for (size_t i = 0; i < reads; ++i) {
+      copyContent(buf, sizeof(buf), i * sizeof(buf));
+    }
+    longest = std::max(longest, Clock::now() - open_start);
+  }
+  auto elapsed = Clock::now() - start;
+  std::cout << files << " files, " << reads << " reads each" << std::endl;
+  report("PlaybackLauncher per open", files * reads, elapsed);
+  std::cout << "  longest open and read of one file: "
+            << std::chrono::duration<double, std::micro>(longest).count()
+            << " us" << std::endl;
+
+  // Opening the same files again within the debounce interval launches
+  // nothing
+  for (size_t file = 0; file < files; ++file) {
+    launcher.launch(trackUri(file));
+  }
+  std::cout << "  opens: " << 2 * files << ", launches started: "
+            << launcher.launched() << ", skipped: " << launcher.skipped()
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,210 @@
+// Measures the search index behind /.search: the time to index a synthetic
+// library, its memory per track, and the latency of queries of several
+// kinds, as one JSON object per line.
+//
+// Usage: search_index_bench [tracks]
+//
+// Names are made of words from a vocabulary of 50000 pseudo-words, drawn
+// with a skew so that a few words are common and most are rare, as in real
+// titles. There are 10 tracks per album and 10 albums per artist. Tracks
+// are listed in playlists of 1000, a fifth of them in a second playlist.
+
+#include "search_index.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+size_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+class Words {
+public:
+  explicit Words(std::mt19937 &random) : random(random) {
+    static const char *syllables[] = {
+        "ka", "lo", "mi", "ra", "su", "te", "vo", "ne", "di", "ba",
+        "sha", "tri", "gle", "mor", "fen", "dal", "qui", "xan", "zo", "pe"};
+    std::uniform_int_distribution<size_t> syllable(0, 19), count(2, 4);
+    for (size_t i = 0; i < 50000; ++i) {
+      std::string word;
+      for (size_t n = count(random); n > 0; --n) {
+        word += syllables[syllable(random)];
+      }
+      word[0] = static_cast<char>(word[0] - 'a' + 'A');
+      vocabulary.push_back(word);
+    }
+  }
+
+  // Word i of the vocabulary is drawn with a probability falling with i
+  const std::string &draw() {
+    double u = std::uniform_real_distribution<double>(0, 1)(random);
+    return vocabulary[static_cast<size_t>(u * u * u * vocabulary.size())];
+  }
+
+  std::string phrase(size_t min, size_t max) {
+    std::string text = draw();
+    size_t count = std::uniform_int_distribution<size_t>(min, max)(random);
+    for (size_t i = 1; i < count; ++i) {
+      text += ' ';
+      text += draw();
+    }
+    return text;
+  }
+
+  const std::string &any() {
+    return vocabulary[std::uniform_int_distribution<size_t>(
+        0, vocabulary.size() - 1)(random)];
+  }
+
+private:
+  std::mt19937 &random;
+  std::vector<std::string> vocabulary;
+};
+
+std::string trackId(size_t i) {
+  std::string id = std::to_string(i);
+  return std::string(TrackTable::ID_LENGTH - id.size(), '0') + id;
+}
+
+// A random word of `text`
+std::string wordOf(const std::string &text, std::mt19937 &random) {
+  std::vector<std::string> words;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find(' ', start);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    if (end > start) {
+      words.push_back(text.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return words[std::uniform_int_distribution<size_t>(0, words.size() - 1)(
+      random)];
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  std::mt19937 random(42);
+  Words words(random);
+
+  // Playlists are only identified by address in the index
+  std::vector<char> playlists(count / 1000 + 1);
+  auto playlist = [&](size_t i) {
+    return reinterpret_cast<spotify_file *>(&playlists[i % playlists.size()]);
+  };
+
+  TrackTable table;
+  std::vector<std::string> artists(count / 100 + 1), albums(count / 10 + 1);
+  for (auto &artist : artists) {
+    artist = words.phrase(1, 2);
+  }
+  for (auto &album : albums) {
+    album = words.phrase(1, 3);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const std::string &artist = artists[i / 100];
+    std::string id = trackId(i);
+    table.add(id, artist + " -- " + words.phrase(1, 4), artist,
+              albums[i / 10], "spotify:track:" + id, 200000);
+  }
+
+  size_t rss_before = residentBytes();
+  SearchIndex index(table);
+  auto start = Clock::now();
+  std::vector<uint32_t> tracks;
+  for (size_t first = 0; first < count; first += 1000) {
+    tracks.clear();
+    for (size_t i = first; i < std::min(first + 1000, count); ++i) {
+      tracks.push_back(i);
+    }
+    index.add(playlist(first / 1000), tracks);
+  }
+  // A fifth of the tracks are in a second playlist
+  for (size_t first = 0; first < count; first += 5000) {
+    tracks.clear();
+    for (size_t i = first; i < std::min(first + 1000, count); ++i) {
+      tracks.push_back(i);
+    }
+    index.add(playlist(first / 1000 + 1), tracks);
+  }
+  double build_seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  printf("{\"bench\":\"build\",\"tracks\":%zu,\"words\":%zu,"
+         "\"seconds\":%.3f,\"index_bytes\":%zu,\"bytes_per_track\":%.1f,"
+         "\"rss_bytes_per_track\":%.1f}\n",
+         count, index.wordCount(), build_seconds, index.memoryBytes(),
+         double(index.memoryBytes()) / count,
+         double(residentBytes() - rss_before) / count);
+
+  // Queries are drawn from the library, so most of them match
+  std::uniform_int_distribution<size_t> track(0, count - 1);
+  auto title = [&](size_t i) {
+    std::string name(table.name(i));
+    return name.substr(name.find(" -- ") + 4);
+  };
+  struct Kind {
+    const char *name;
+    std::function<std::string()> query;
+  };
+  std::vector<Kind> kinds = {
+      {"title_word", [&]() { return wordOf(title(track(random)), random); }},
+      {"common_word", [&]() { return words.draw(); }},
+      {"artist_and_title",
+       [&]() {
+         size_t i = track(random);
+         return wordOf(std::string(table.str(table.get(i).artist)), random) +
+                " " + wordOf(title(i), random);
+       }},
+      {"album",
+       [&]() {
+         return std::string(table.str(table.get(track(random)).album));
+       }},
+      {"substring", [&]() { return words.any().substr(1, 4); }},
+      {"miss", [&]() { return std::string("zzqxv"); }},
+  };
+  for (auto &kind : kinds) {
+    std::vector<std::string> queries(1000);
+    for (auto &query : queries) {
+      query = kind.query();
+    }
+    std::vector<double> micros;
+    size_t hits = 0;
+    for (const auto &query : queries) {
+      auto begin = Clock::now();
+      hits += index.search(query, 1000).size();
+      micros.push_back(
+          std::chrono::duration<double, std::micro>(Clock::now() - begin)
+              .count());
+    }
+    std::sort(micros.begin(), micros.end());
+    double total = 0;
+    for (double m : micros) {
+      total += m;
+    }
+    printf("{\"bench\":\"query\",\"kind\":\"%s\",\"queries\":%zu,"
+           "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"max_us\":%.1f,\"mean_hits\":%.1f}\n",
+           kind.name, queries.size(), total / micros.size(),
+           micros[micros.size() / 2], micros[micros.size() * 99 / 100],
+           micros.back(), double(hits) / queries.size());
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+// Measures the memory used by playlist track entries, comparing one heap
+// node per entry (the layout before the track table) with the shared
+// TrackTable and index vectors.
+//
+// Usage: track_memory_bench legacy|compact [entries]
+//
+// Each layout runs in its own process so that RSS is not shared. The
+// library has 1000 entries per playlist drawn from a quarter as many
+// distinct tracks, with 10 tracks per album and 2 albums per artist.
+
+#include "track_table.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// A track entry as it was stored before the track table
+struct legacy_file {
+  std::string id;
+  std::string name;
+  std::string artist;
+  std::string album;
+  size_t duration_ms;
+  std::string uri;
+  bool is_playlist;
+  std::string original_name;
+  std::atomic<int> state;
+  int track_count;
+  std::string snapshot_id;
+  long cache_index = -1;
+  std::atomic<const void *> entries;
+  std::mutex write_mutex;
+};
+
+// Name index of a playlist, present in both layouts
+using name_index = std::unordered_map<std::string_view, size_t>;
+
+size_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+std::string trackId(size_t i) {
+  std::string id = std::to_string(i);
+  return std::string(TrackTable::ID_LENGTH - id.size(), '0') + id;
+}
+
+struct TrackInfo {
+  std::string id, name, artist, album, uri;
+  size_t duration_ms;
+};
+
+TrackInfo trackInfo(size_t i) {
+  TrackInfo info;
+  info.id = trackId(i);
+  info.artist = "Artist number " + std::to_string(i / 20);
+  info.album = "Album title number " + std::to_string(i / 10);
+  info.name = info.artist + " -- Song title " + std::to_string(i);
+  info.uri = "spotify:track:" + info.id;
+  info.duration_ms = 180000 + i % 60000;
+  return info;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " legacy|compact [entries]"
+              << std::endl;
+    return 1;
+  }
+  bool legacy = strcmp(argv[1], "legacy") == 0;
+  size_t entries = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000000;
+  const size_t per_playlist = 1000;
+  size_t distinct = entries / 4;
+
+  size_t before = residentBytes();
+  std::vector<std::vector<legacy_file *>> legacy_playlists;
+  std::vector<std::vector<uint32_t>> compact_playlists;
+  std::vector<name_index> indexes;
+  TrackTable table;
+
+  for (size_t start = 0; start < entries; start += per_playlist) {
+    indexes.emplace_back();
+    name_index &index = indexes.back();
+    if (legacy) {
+      legacy_playlists.emplace_back();
+    } else {
+      compact_playlists.emplace_back();
+    }
+    for (size_t i = start; i < std::min(entries, start + per_playlist); ++i) {
+      // Spread each playlist over the whole set of distinct tracks
+      TrackInfo info = trackInfo((i * 7919) % distinct);
+      if (legacy) {
+        auto file = new legacy_file();
+        file->id = info.id;
+        file->name = info.name;
+        file->artist = info.artist;
+        file->album = info.album;
+        file->duration_ms = info.duration_ms;
+        file->uri = info.uri;
+        file->is_playlist = false;
+        auto &tracks = legacy_playlists.back();
+        index.emplace(file->name, tracks.size());
+        tracks.push_back(file);
+      } else {
+        uint32_t track =
+            table.add(info.id, info.name, info.artist, info.album, info.uri,
+                      info.duration_ms);
+        auto &tracks = compact_playlists.back();
+        index.emplace(table.name(track), tracks.size());
+        tracks.push_back(track);
+      }
+    }
+  }
+  size_t after = residentBytes();
+
+  std::cout << (legacy ? "legacy" : "compact") << ": " << entries
+            << " entries, " << (after - before) / (1024 * 1024)
+            << " MiB RSS, " << (after - before) / entries
+            << " bytes per entry";
+  if (!legacy) {
+    std::cout << " (" << table.size() << " distinct tracks, "
+              << table.memoryBytes() / (1024 * 1024) << " MiB in the table)";
+  }
+  std::cout << std::endl;
+  return 0;
+}
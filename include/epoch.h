@@ -0,0 +1,43 @@
+#pragma once
+
+#include <functional>
+
+// Epoch-based reclamation for data that is read without locks. Readers pin
+// the current epoch with a ReadGuard while they hold pointers into shared
+// data. Writers unpublish an object and then retire it; it is freed once
+// every reader that was pinned when it was retired has finished.
+class Epoch {
+public:
+  // Pins the calling thread for its lifetime. Guards may be nested.
+  class ReadGuard {
+  public:
+    ReadGuard();
+    ~ReadGuard();
+    ReadGuard(const ReadGuard &) = delete;
+    ReadGuard &operator=(const ReadGuard &) = delete;
+  };
+
+  // Releases the pin of the calling thread for its lifetime and pins it
+  // again at the current epoch afterwards, for a blocking call made while
+  // guards are held. Guards taken meanwhile pin as usual. Pointers obtained
+  // before must not be used afterwards, they have to be looked up again.
+  class Unpin {
+  public:
+    Unpin();
+    ~Unpin();
+    Unpin(const Unpin &) = delete;
+    Unpin &operator=(const Unpin &) = delete;
+
+  private:
+    int depth; // Guards held when the pin was released
+  };
+
+  // Frees `ptr` once no reader can still see it
+  template <typename T> static void retire(const T *ptr) {
+    retire([ptr]() { delete ptr; });
+  }
+  static void retire(std::function<void()> deleter);
+
+  // Frees everything retired so far. Only safe when no readers are active.
+  static void drain();
+};
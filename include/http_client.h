@@ -0,0 +1,111 @@
+#pragma once
+
+#include "request_scheduler.h"
+#include <cstdint>
+#include <curl/curl.h>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Settings of the HTTP transport used by SpotifyAPI
+struct HttpConfig {
+  // Root of the Web API, may point at a local mock server
+  std::string base_url = "https://api.spotify.com/v1";
+  long connect_timeout_ms = 5000; // Timeout for establishing a connection
+  long timeout_ms = 30000;        // Timeout for a whole request
+};
+
+// Query parameters, URL encoded when the request is sent
+using HttpParameters = std::vector<std::pair<std::string, std::string>>;
+
+struct HttpRequest {
+  enum class Method { get, post, put, del };
+
+  Method method = Method::get;
+  std::string path;                 // Relative to the base URL, or absolute
+  HttpParameters parameters;        // Appended to the URL
+  std::vector<std::string> headers; // "Name: value" lines
+  std::string body;                 // Sent unless the method is get
+  bool idempotent = true;           // Whether failures may be retried
+  RequestPriority priority = RequestScheduler::currentPriority();
+  // Trace flow its attempts are linked to, started by submit() if 0
+  uint64_t flow = 0;
+  // If set, the body is handed to `on_data` chunk by chunk as it arrives
+  // instead of being collected in the response. Returning false aborts the
+  // transfer. `restart` is called before every attempt, so that a retried
+  // request is decoded from scratch.
+  std::function<void()> restart;
+  std::function<bool(std::string_view)> on_data;
+};
+
+struct HttpResponse {
+  long status_code = 0;  // 0 if the transfer failed
+  std::string text;      // Body, unless it was handed to on_data
+  std::string error;     // Reason of a failed transfer
+  long retry_after = -1; // Seconds of the Retry-After header, -1 without
+};
+
+// HTTP client that runs every request on a single event loop thread over a
+// curl multi handle, so any number of requests can be in flight without a
+// thread each, and connections are kept alive between requests. Requests
+// are sent against the budget of a RequestScheduler, interactive ones
+// first, and retried as it decides.
+class HttpClient {
+public:
+  using Callback = std::function<void(HttpResponse)>;
+
+  HttpClient(HttpConfig config, SchedulerConfig scheduler_config);
+  // Fails the requests that did not finish with status 0
+  ~HttpClient();
+  HttpClient(const HttpClient &) = delete;
+  HttpClient &operator=(const HttpClient &) = delete;
+
+  // Queues `request`. `done` is called on the event loop thread once the
+  // request finished, after any retries; it must not wait for other
+  // requests of this client, which would block the loop.
+  void submit(HttpRequest request, Callback done);
+  std::future<HttpResponse> submit(HttpRequest request);
+
+  const HttpConfig &config() const { return settings; }
+
+private:
+  using Clock = RequestScheduler::Clock;
+  struct Transfer;
+
+  void run();
+  // Moves retries that are due to the queues and starts queued requests
+  // while there is budget. Returns when to try again.
+  Clock::time_point dispatch(Clock::time_point now);
+  void start(std::unique_ptr<Transfer> transfer, Clock::time_point now);
+  void finish(Transfer *transfer, CURLcode result);
+  void enqueue(std::unique_ptr<Transfer> transfer);
+
+  static size_t onData(char *data, size_t size, size_t count, void *user);
+  static size_t onHeader(char *data, size_t size, size_t count, void *user);
+
+  HttpConfig settings;
+  RequestScheduler scheduler;
+  CURLM *multi;
+  std::thread loop; // Started with the first request
+  std::once_flag loop_started;
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Transfer>> submitted; // Not yet seen by loop
+  bool stopping = false;
+
+  // Owned by the loop thread
+  std::deque<std::unique_ptr<Transfer>> queued[2]; // Waiting for budget
+  std::multimap<Clock::time_point, std::unique_ptr<Transfer>> delayed;
+  // Transfers added to `multi`
+  std::unordered_map<Transfer *, std::unique_ptr<Transfer>> active;
+  std::vector<CURL *> idle_handles; // Reused for later requests
+};
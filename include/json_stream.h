@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Receives the events of a JsonStream. String and number views are only
+// valid during the call.
+class JsonHandler {
+public:
+  virtual ~JsonHandler() = default;
+
+  virtual void startObject() {}
+  virtual void endObject() {}
+  virtual void startArray() {}
+  virtual void endArray() {}
+  // Returns whether the value of the key is wanted. Unwanted values are
+  // skipped without being decoded or reported.
+  virtual bool key(std::string_view name) { return true; }
+  virtual void string(std::string_view value) {}
+  virtual void number(std::string_view text) {}
+  virtual void boolean(bool value) {}
+  virtual void null() {}
+};
+
+// Incremental SAX-style JSON parser. The document may be fed in chunks of
+// any size, such as they arrive from the network; no tree is built.
+class JsonStream {
+public:
+  explicit JsonStream(JsonHandler &handler);
+
+  // Parses the next chunk. Returns false once the document is malformed.
+  bool feed(std::string_view chunk);
+  // Ends the document. Returns true if exactly one complete value was read.
+  bool finish();
+  // Prepares for a new document
+  void reset();
+
+private:
+  enum class Expect {
+    value,        // Any value
+    value_or_end, // First array element or ']'
+    key,          // Object key
+    key_or_end,   // First object key or '}'
+    colon,        // ':' after a key
+    comma_or_end, // ',' or the end of the enclosing container
+    done          // The document is complete
+  };
+
+  enum class Lexeme {
+    none,    // Between tokens
+    string,  // Inside a string
+    escape,  // After a backslash in a string
+    unicode, // Inside a \uXXXX escape
+    scalar   // Inside a number or literal
+  };
+
+  bool structural(char c);
+  bool startValue(char c);
+  bool closeContainer(char c);
+  bool endString();
+  bool endScalar();
+  bool escape(char c);
+  void endValue();
+  void appendCodePoint(unsigned code_point);
+  bool skipped() const { return skipping || skip_depth > 0; }
+
+  JsonHandler &handler;
+  std::vector<char> containers; // '{' or '[' of every open container
+  Expect expect = Expect::value;
+  Lexeme lexeme = Lexeme::none;
+  std::string token;            // Decoded string or scalar text
+  bool in_key = false;          // The current string is an object key
+  bool wanted = true;           // The next value is wanted by the handler
+  bool skipping = false;        // The current value is skipped
+  size_t skip_depth = 0;        // Open containers inside a skipped value
+  unsigned code_unit = 0;       // Value of the current \u escape
+  int hex_digits = 0;           // Digits read of the current \u escape
+  unsigned high_surrogate = 0;  // Pending first half of a surrogate pair
+  bool failed = false;
+};
+
+// Handler that decodes selected fields of a document. Fields are addressed by
+// paths such as "items[].track.name", where "[]" stands for every element
+// of an array. Everything not leading to a field is skipped.
+class JsonProjection : public JsonHandler {
+public:
+  using Setter = std::function<void(std::string_view value)>;
+
+  // Calls `setter` with every string, number or boolean found at `path`
+  void field(const std::string &path, Setter setter);
+  // Calls `begin` before each element of the array at `path`
+  void element(const std::string &path, std::function<void()> begin);
+  // Prepares for a new document
+  void reset();
+
+  void startObject() override;
+  void endObject() override;
+  void startArray() override;
+  void endArray() override;
+  bool key(std::string_view name) override;
+  void string(std::string_view value) override;
+  void number(std::string_view text) override;
+  void boolean(bool value) override;
+  void null() override;
+
+private:
+  void addPrefixes(const std::string &path);
+  void beginValue();
+  void scalar(std::string_view value);
+  void endValue();
+
+  std::unordered_map<std::string, Setter> fields;
+  std::unordered_map<std::string, std::function<void()>> elements;
+  std::unordered_set<std::string> prefixes; // Paths that lead to a field
+
+  std::string path;             // Path of the current value
+  std::vector<size_t> marks;    // Length of `path` before each open level
+  std::vector<char> containers; // '{' or '[' of every open container
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// On-disk snapshot of the library metadata. The file is a fixed header
+// followed by fixed-size playlist and track records and a string pool, so it
+// can be memory-mapped and read in place without parsing.
+class LibraryCache {
+public:
+  static const uint32_t VERSION = 3;
+
+  // Reference to a string in the string pool
+  struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  struct Header {
+    char magic[8];           // "SPVFSNAP"
+    uint32_t version;        // Format version, see VERSION
+    uint32_t playlist_count; // Number of playlist records
+    uint64_t track_count;    // Number of track records
+    uint64_t strings_size;   // Size of the string pool in bytes
+  };
+
+  struct PlaylistRecord {
+    StringRef id;
+    StringRef name;
+    StringRef snapshot_id; // Empty if the tracks were not cached
+    uint64_t first_track;  // Index of the first track record
+    uint64_t track_count;  // Number of track records
+  };
+
+  struct TrackRecord {
+    StringRef id;
+    StringRef name; // Display name
+    StringRef artist;
+    StringRef album;
+    StringRef uri;
+    uint64_t duration_ms;
+    uint64_t added_at; // Seconds since the epoch, 0 if unknown
+  };
+
+  LibraryCache() = default;
+  ~LibraryCache();
+  LibraryCache(const LibraryCache &) = delete;
+  LibraryCache &operator=(const LibraryCache &) = delete;
+
+  // Maps the snapshot at `path`. Returns false if it is missing or was
+  // written by an incompatible version.
+  bool open(const std::string &path);
+  void close();
+
+  size_t playlistCount() const { return header ? header->playlist_count : 0; }
+  const PlaylistRecord &playlist(size_t i) const { return playlists[i]; }
+  const TrackRecord &track(uint64_t i) const { return tracks[i]; }
+  std::string_view str(StringRef ref) const {
+    return std::string_view(strings + ref.offset, ref.length);
+  }
+
+private:
+  void *data = nullptr; // Mapped file
+  size_t size = 0;      // Size of the mapping
+  const Header *header = nullptr;
+  const PlaylistRecord *playlists = nullptr;
+  const TrackRecord *tracks = nullptr;
+  const char *strings = nullptr;
+};
+
+// Builds a snapshot in memory and writes it out atomically
+class LibraryCacheWriter {
+public:
+  // Starts a new playlist; tracks added afterwards belong to it
+  void addPlaylist(std::string_view id, std::string_view name,
+                   std::string_view snapshot_id);
+  void addTrack(std::string_view id, std::string_view name,
+                std::string_view artist, std::string_view album,
+                std::string_view uri, uint64_t duration_ms,
+                uint64_t added_at);
+
+  // Writes the snapshot to `path` via a temporary file and rename
+  bool save(const std::string &path);
+
+private:
+  LibraryCache::StringRef intern(std::string_view value);
+
+  std::vector<LibraryCache::PlaylistRecord> playlists;
+  std::vector<LibraryCache::TrackRecord> tracks;
+  std::string strings;
+  // Deduplicates repeated strings such as artist and album names
+  std::unordered_map<std::string, LibraryCache::StringRef> interned;
+};
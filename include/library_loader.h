@@ -0,0 +1,26 @@
+#pragma once
+
+#include "spotify_api.h"
+#include <cstddef>
+#include <vector>
+
+// Tracks fetched for a single playlist
+struct LoadedPlaylist {
+  std::vector<Track> tracks; // Tracks in playlist order
+  bool complete = true;      // false if any page failed to load
+};
+
+// Loads the tracks of many playlists in parallel. Work is split into
+// individual pages so that large playlists are fetched concurrently too.
+class LibraryLoader {
+public:
+  // Creates a loader that keeps at most `concurrency` requests in flight
+  explicit LibraryLoader(size_t concurrency);
+
+  // Fetches every page of every playlist. The result holds the tracks of
+  // playlists[i] at index i.
+  std::vector<LoadedPlaylist> load(const std::vector<Playlist> &playlists);
+
+private:
+  size_t concurrency; // Maximum number of parallel requests
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "tracer.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// FUSE operations whose latency is recorded
+enum class FuseOp {
+  lookup,
+  forget,
+  getattr,
+  setattr,
+  readlink,
+  mkdir,
+  unlink,
+  rename,
+  open,
+  read,
+  write,
+  release,
+  fsync,
+  readdir,
+  create,
+  count
+};
+
+// Web API endpoints whose latency is recorded, including retries
+enum class ApiEndpoint {
+  playlists,       // GET /me/playlists
+  playlist_tracks, // GET /playlists/{id}/tracks
+  saved_tracks,    // GET /me/tracks
+  add_tracks,      // POST /playlists/{id}/tracks
+  remove_tracks,   // DELETE /playlists/{id}/tracks
+  reorder_tracks,  // PUT /playlists/{id}/tracks
+  update_playlist, // PUT /playlists/{id}
+  create_playlist, // POST /users/{id}/playlists
+  user,            // GET /me
+  search,          // GET /search
+  track,           // GET /tracks/{id}
+  count
+};
+
+// Parts of a request whose latency is recorded separately
+enum class Stage {
+  scheduler_wait, // Waiting for rate limit budget or a Retry-After pause
+  http_request,   // One HTTP attempt, including streamed decoding
+  json_decode,    // Decoding response bodies
+  load_wait,      // Waiting for another thread to load a playlist
+  search_query,   // Answering a query of /.search from the index
+  count
+};
+
+// Counters, and gauges that go up and down
+enum class Counter {
+  search_cache_hits,
+  search_cache_misses,
+  index_cache_hits,
+  index_cache_misses,
+  playlists_from_cache, // Playlists loaded from the library cache
+  playlists_from_api,   // Playlists loaded from the Web API
+  http_requests,        // HTTP attempts, retries included
+  http_errors,          // Attempts that failed or returned an error status
+  http_bytes_sent,      // Request bodies
+  http_bytes_received,  // Response bodies
+  api_retries,          // Attempts repeated after a 429, 5xx or failure
+  api_rate_limited,     // 429 responses
+  api_unauthorized,     // 401 responses, sent again after a token refresh
+  token_refreshes,      // Access tokens refreshed
+  token_refresh_errors, // Refreshes that failed
+  http_in_flight,       // Gauge: HTTP attempts currently running
+  search_index_tracks,  // Gauge: tracks in the search index
+  search_index_bytes,   // Gauge: memory used by the search index
+  count
+};
+
+// Runtime metrics. Every thread records into counters and latency
+// histograms of its own, so recording takes a few nanoseconds and never
+// contends; render() sums the threads up when /.stats is read.
+class Metrics {
+public:
+  static void add(Counter counter, int64_t value = 1);
+  static void record(FuseOp op, uint64_t ns);
+  static void record(ApiEndpoint endpoint, uint64_t ns);
+  static void record(Stage stage, uint64_t ns);
+
+  // All metrics in the Prometheus text exposition format
+  static std::string render();
+
+  // Label values in /.stats, also the names of trace spans
+  static constexpr const char *FUSE_OPS[] = {
+      "lookup", "forget",  "getattr", "setattr", "readlink",
+      "mkdir",  "unlink",  "rename",  "open",    "read",
+      "write",  "release", "fsync",   "readdir", "create"};
+  static constexpr const char *API_ENDPOINTS[] = {
+      "playlists",       "playlist_tracks", "saved_tracks",
+      "add_tracks",      "remove_tracks",   "reorder_tracks",
+      "update_playlist", "create_playlist", "user",
+      "search",          "track"};
+  static constexpr const char *STAGES[] = {"scheduler_wait", "http_request",
+                                           "json_decode", "load_wait",
+                                           "search_query"};
+
+  static const char *name(FuseOp op) {
+    return FUSE_OPS[static_cast<int>(op)];
+  }
+  static const char *name(ApiEndpoint endpoint) {
+    return API_ENDPOINTS[static_cast<int>(endpoint)];
+  }
+  static const char *name(Stage stage) {
+    return STAGES[static_cast<int>(stage)];
+  }
+  static const char *category(FuseOp) { return "fuse"; }
+  static const char *category(ApiEndpoint) { return "api"; }
+  static const char *category(Stage) { return "stage"; }
+
+  // Reading of the CPU's cycle counter, or of steady_clock where there is
+  // none. Cheaper than steady_clock, whose reads were most of the cost of a
+  // Timer.
+  static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+  // Nanoseconds since the ticks() reading `start`
+  static uint64_t elapsedNs(uint64_t start) {
+    uint64_t now = ticks();
+    // Counters of different cores may be slightly apart
+    return now > start ? static_cast<uint64_t>((now - start) * ns_per_tick)
+                       : 0;
+  }
+
+  // Records the time from construction to destruction, and the scope as a
+  // trace span when tracing is enabled
+  template <typename Kind> class Timer {
+  public:
+    explicit Timer(Kind kind)
+        : kind(kind), span(name(kind), category(kind)), start(ticks()) {}
+    ~Timer() { record(kind, elapsedNs(start)); }
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+  private:
+    Kind kind;
+    Tracer::Span span;
+    uint64_t start;
+  };
+
+private:
+  // Rate of ticks(), measured against steady_clock at startup
+  static const double ns_per_tick;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Queues track additions, removals and moves per playlist and sends them to
+// Spotify in batches. Changes are applied to the local tree right away; a
+// change whose batch fails is undone through the callback given with it.
+class MutationQueue {
+public:
+  static const size_t BATCH_SIZE = 100; // URIs per request accepted by Spotify
+
+  // Changes queued for longer than `delay` are flushed by a timer thread
+  explicit MutationQueue(std::chrono::milliseconds delay);
+  ~MutationQueue();
+
+  // Queues a change. A pending opposite change of the same URI cancels out
+  // with it instead.
+  void add(const std::string &playlist_id, const std::string &uri,
+           std::function<void()> undo);
+  void remove(const std::string &playlist_id, const std::string &uri,
+              std::function<void()> undo);
+  // Queues a move of the track at `range_start` to before the track at
+  // `insert_before`, both counted before the move. A move that continues
+  // the previous one, taking the track after its range to the end of it,
+  // joins it so that both go out as a single range.
+  void move(const std::string &playlist_id, int range_start,
+            int insert_before, std::function<void()> undo);
+
+  // Sends the pending changes of a playlist now. Returns false if any batch
+  // failed and was rolled back.
+  bool flush(const std::string &playlist_id);
+  // Asks the timer thread to flush a playlist without waiting for it
+  void flushSoon(const std::string &playlist_id);
+  // Whether changes of a playlist are queued or being sent
+  bool hasPending(const std::string &playlist_id);
+  // Whether additions or removals of a playlist are queued. Positions of a
+  // move only match Spotify's once they are sent.
+  bool hasPendingTracks(const std::string &playlist_id);
+  // Flushes everything and stops the timer thread
+  void stop();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Mutation {
+    enum class Kind { add, remove, move };
+
+    Kind kind;
+    std::string uri;            // Spotify track URI, empty for moves
+    int range_start = 0;        // First track moved
+    int range_length = 0;       // Number of tracks moved
+    int insert_before = 0;      // Track the moved ones are put before
+    std::function<void()> undo; // Reverts the local change
+  };
+
+  struct Pending {
+    std::vector<Mutation> mutations; // In the order they were made
+    Clock::time_point due;           // When the timer flushes them
+  };
+
+  void enqueue(const std::string &playlist_id, Mutation mutation);
+  // Extends the range of `queued` by `next` if it continues it
+  static bool extend(Mutation &queued, Mutation &next);
+  void run();
+
+  std::chrono::milliseconds delay;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::unordered_map<std::string, Pending> pending;
+  std::unordered_map<std::string, int> flushing; // Flushes in progress
+  bool stopping = false;
+
+  // Keeps the batches of a playlist in order when flushes overlap
+  std::mutex flush_mutex;
+  std::thread timer;
+};
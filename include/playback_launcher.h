@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+// Opens tracks in the Spotify client without blocking the caller. Launches
+// are queued for a dispatcher thread, which spawns the launcher command
+// directly instead of through a shell. A track launched again within the
+// debounce interval is launched only once, and a burst of opens such as
+// `grep -r` over the mount starts only the most recent few.
+class PlaybackLauncher {
+public:
+  // `command` is looked up in PATH and run with the track URI as its only
+  // argument
+  PlaybackLauncher(std::string command, std::chrono::milliseconds debounce);
+  ~PlaybackLauncher();
+
+  // Queues a launch of `uri` and returns immediately
+  void launch(const std::string &uri);
+  // Drops queued launches and stops the dispatcher thread
+  void stop();
+
+  size_t launched(); // Commands started so far
+  size_t skipped();  // Launches dropped as repeated or superseded
+
+private:
+  static const size_t MAX_QUEUED = 4; // Older launches are dropped
+
+  void run();
+
+  std::string command;
+  std::chrono::milliseconds debounce;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::string> queue; // URIs waiting to be launched
+  // Time of the last launch of each recently launched URI
+  std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+      recent;
+  // Entries of `recent` in launch order, for expiring them
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>>
+      expiry;
+  size_t launched_count = 0;
+  size_t skipped_count = 0;
+  bool stopping = false;
+  std::thread dispatcher;
+};
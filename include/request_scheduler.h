@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+
+// Priority class of an API request. Interactive requests are made on
+// behalf of a waiting FUSE operation and are served before background ones.
+enum class RequestPriority { interactive, background };
+
+// Settings of the request scheduler
+struct SchedulerConfig {
+  double rate = 10.0;          // Sustained requests per second
+  double burst = 20.0;         // Requests that may be sent back to back
+  int max_retries = 5;         // Retries after 429, 5xx or transport errors
+  long max_backoff_ms = 30000; // Upper bound of a single retry delay
+  // Upper bound of a Retry-After pause. Only guards against absurd values,
+  // Spotify asks for waits of minutes when an app is over its quota.
+  long max_retry_after_s = 3600;
+};
+
+// Schedules API requests against a token-bucket budget. A 429 response
+// pauses all requests for the duration given by its Retry-After header and
+// the request is sent again, so callers never see a throttled response
+// unless the retries are exhausted. The scheduler never blocks; it is used
+// by the event loop of HttpClient only and is not synchronized.
+class RequestScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RequestScheduler(SchedulerConfig config);
+
+  // Takes budget for a request sent at `now`. Returns false if there is
+  // none, `next` then receives the time to try again.
+  bool tryAcquire(Clock::time_point now, Clock::time_point &next);
+
+  // Decides whether attempt `attempt` of a request, which ended with
+  // `status_code` (0 for a transport error), is repeated. Requests that are
+  // not idempotent are only retried after a 429, which guarantees that the
+  // server did not act on them. Returns false if the request is done,
+  // otherwise `retry_at` receives the time of the next attempt.
+  // `retry_after` holds the seconds of a Retry-After header, or -1.
+  bool shouldRetry(long status_code, long retry_after, int attempt,
+                   bool idempotent, Clock::time_point now,
+                   Clock::time_point &retry_at);
+
+  // Priority of requests made by the calling thread
+  static RequestPriority currentPriority();
+
+  // Sets the priority of the calling thread for the lifetime of the scope
+  class PriorityScope {
+  public:
+    explicit PriorityScope(RequestPriority priority);
+    ~PriorityScope();
+    PriorityScope(const PriorityScope &) = delete;
+    PriorityScope &operator=(const PriorityScope &) = delete;
+
+  private:
+    RequestPriority previous;
+  };
+
+private:
+  // Delay before the given retry attempt, doubling from 500 ms
+  std::chrono::milliseconds backoff(int attempt);
+
+  SchedulerConfig config;
+  double tokens;                  // Available budget
+  Clock::time_point last_refill;  // Time the budget was last topped up
+  Clock::time_point paused_until; // Set by Retry-After
+  std::minstd_rand random;        // Jitter of retry delays
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "json_stream.h"
+#include "spotify_api.h"
+#include <string_view>
+#include <vector>
+
+// Decodes tracks from Web API responses straight into Track structs. Only
+// the fields of Track are decoded; markets, images and the like are skipped.
+class TrackDecoder {
+public:
+  // Layout of the response
+  enum class Source {
+    playlist_page, // Page of playlist items, each holding a track
+    search,        // Search result with a list of tracks
+    track          // A single track object
+  };
+
+  explicit TrackDecoder(Source source);
+  TrackDecoder(const TrackDecoder &) = delete;
+  TrackDecoder &operator=(const TrackDecoder &) = delete;
+
+  // Parses the next chunk of the response body
+  bool feed(std::string_view chunk) { return stream.feed(chunk); }
+  // Returns true if the whole body was well-formed
+  bool finish() { return stream.finish(); }
+  // Drops everything decoded so far
+  void reset();
+
+  std::vector<Track> tracks; // Tracks in response order
+  int total = 0;             // Total number of items (pages only)
+
+private:
+  Source source;
+  JsonProjection projection;
+  JsonStream stream;
+};
+
+// Decodes a page of the playlist listing into Playlist structs
+class PlaylistDecoder {
+public:
+  PlaylistDecoder();
+  PlaylistDecoder(const PlaylistDecoder &) = delete;
+  PlaylistDecoder &operator=(const PlaylistDecoder &) = delete;
+
+  bool feed(std::string_view chunk) { return stream.feed(chunk); }
+  bool finish() { return stream.finish(); }
+  void reset();
+
+  std::vector<Playlist> playlists; // Playlists in response order
+  int total = 0;                   // Total number of playlists
+
+private:
+  JsonProjection projection;
+  JsonStream stream;
+};
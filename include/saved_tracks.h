@@ -0,0 +1,49 @@
+#pragma once
+
+#include "spotify_api.h"
+#include <deque>
+#include <future>
+#include <optional>
+#include <vector>
+
+// Pages through the user's saved tracks, the Liked Songs collection, only
+// as far as they are needed instead of fetching all of them up front. Pages
+// are handed out in order. prefetch() requests pages ahead, so that they
+// are on their way while the previous ones are consumed. Not synchronized;
+// callers serialize access.
+class SavedTracksPager {
+public:
+  // Pages of `page_size` tracks, at most 50 are served per request
+  explicit SavedTracksPager(int page_size = 50);
+  SavedTracksPager(const SavedTracksPager &) = delete;
+  SavedTracksPager &operator=(const SavedTracksPager &) = delete;
+
+  // Takes the next page, requesting it unless it is in flight, and appends
+  // its tracks to `tracks`. Returns false if every page was taken or the
+  // request failed; a failed page is requested again by the next call.
+  bool next(std::vector<Track> &tracks);
+  // Requests the pages after the last requested one until `pages` are in
+  // flight or every page was requested
+  void prefetch(size_t pages);
+  // Whether every page was taken
+  bool complete() const { return total >= 0 && taken >= total; }
+  // Saved tracks reported with the last page taken, -1 before the first
+  int savedTracks() const { return total; }
+  // Starts over at the first page, dropping the pages in flight
+  void reset();
+  int pageSize() const { return page_size; }
+
+private:
+  struct Page {
+    int offset; // Of the first track of the page
+    std::future<std::optional<TracksPage>> done;
+  };
+
+  void request();
+
+  int page_size;
+  int requested = 0; // Offset of the next page to request
+  int taken = 0;     // Offset of the next page to hand out
+  int total = -1;    // Saved tracks, -1 until the first page arrived
+  std::deque<Page> pending; // In flight, in order
+};
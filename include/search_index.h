@@ -0,0 +1,101 @@
+#pragma once
+
+#include "track_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct spotify_file;
+
+// A track matching a search and a playlist it is listed in
+struct search_hit {
+  uint32_t track;         // Index into the track table
+  spotify_file *playlist; // Directory holding the track
+};
+
+// In-memory full-text index over the names, artists and albums of the
+// tracks in a TrackTable, answering queries without network access or
+// scans of the library. The distinct words of the indexed text form a
+// dictionary, every word with the sorted list of tracks that have it in
+// their title, artist or album. A word of a query is looked up in the
+// dictionary through trigrams, so that it also matches inside words, and
+// the lists of the words of a query are intersected by skipping ahead in
+// them. The index also knows which playlists list each track, as reported
+// through add() and remove(). Thread-safe.
+class SearchIndex {
+public:
+  // Indexes tracks of `table`, which must outlive the index
+  explicit SearchIndex(const TrackTable &table);
+  // Takes its memory and tracks off the metrics
+  ~SearchIndex();
+  SearchIndex(const SearchIndex &) = delete;
+  SearchIndex &operator=(const SearchIndex &) = delete;
+
+  // Record that `tracks` were added to or removed from `playlist`. Tracks
+  // added to the table since the last call are indexed first.
+  void add(spotify_file *playlist, const std::vector<uint32_t> &tracks);
+  void remove(spotify_file *playlist, const std::vector<uint32_t> &tracks);
+
+  // Up to `limit` listed tracks whose name, artist or album contains every
+  // word of `query`, ignoring ASCII case, in the order the tracks were
+  // added to the table. Each track is reported once for every playlist
+  // listing it. Words shorter than three characters only narrow down the
+  // matches of the others, a query without longer words matches nothing.
+  std::vector<search_hit> search(std::string_view query, size_t limit) const;
+  // Whether `track` matches `query` as above, listed or not
+  bool matches(uint32_t track, std::string_view query) const;
+
+  size_t trackCount() const;
+  size_t wordCount() const;
+  // Bytes of the dictionary, posting lists and playlist lists
+  size_t memoryBytes() const;
+
+private:
+  using Postings = std::vector<uint32_t>; // Sorted
+  using PostingMap = std::unordered_map<uint32_t, Postings>;
+
+  // A distinct word of the indexed text, in lower case
+  struct Word {
+    std::string text;
+    Postings tracks; // Tracks with the word in their title, artist or album
+  };
+  class Merge;
+
+  // Indexes the tracks added to the table since the last call. The caller
+  // must hold the mutex.
+  void indexNewTracks();
+  // IDs of the words of `text`, added to the dictionary if they are new
+  Postings addWords(std::string_view text);
+  // Words of the dictionary containing `word`, which is lower case and at
+  // least three characters long
+  Postings matchWords(std::string_view word) const;
+  // Title of a track, its name without the "Artist -- " prefix
+  std::string_view title(uint32_t track) const;
+  // Whether the name or album of `track` contains every one of `words`
+  bool containsAll(uint32_t track,
+                   const std::vector<std::string> &words) const;
+  // Memory of the index. The caller must hold the mutex.
+  size_t usedBytes() const;
+  // Publishes the change of the memory and track counts to the metrics
+  void reportMetrics();
+
+  const TrackTable &table;
+  mutable std::mutex mutex;
+  size_t indexed = 0;      // Tracks of the table indexed so far
+  std::deque<Word> words;  // The dictionary, by word ID
+  // Word IDs by text; the keys point into `words`, which never moves them
+  std::unordered_map<std::string_view, uint32_t> word_ids;
+  PostingMap word_trigrams; // Trigram to the words with it
+  PostingMap string_words;  // Artist or album string to its words
+  // First playlist listing each track, null if none does, and the others
+  std::vector<spotify_file *> listed_in;
+  std::unordered_multimap<uint32_t, spotify_file *> also_listed_in;
+  size_t bytes = 0;            // Allocations not covered by usedBytes()
+  int64_t reported_bytes = 0;  // Memory last added to the metrics
+  int64_t reported_tracks = 0; // Tracks last added to the metrics
+};
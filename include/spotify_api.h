@@ -1,25 +1,45 @@
 #pragma once
 
+#include "http_client.h"
+#include "metrics.h"
+#include "request_scheduler.h"
+#include "token_manager.h"
+#include <chrono>
+#include <ctime>
 #include <curl/curl.h>
+#include <functional>
+#include <future>
 #include <json/json.h>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // Represents a Spotify playlist
 struct Playlist {
-  std::string id;    // Unique identifier for the playlist
-  std::string name;  // Name of the playlist
-  std::string owner; // Owner of the playlist
+  std::string id;          // Unique identifier for the playlist
+  std::string name;        // Name of the playlist
+  std::string owner;       // Owner of the playlist
+  std::string snapshot_id; // Version of the playlist, changes on every edit
+  int track_count = 0;     // Number of tracks reported by the playlist listing
 };
 
 // Represents a track in Spotify
 struct Track {
-  std::string id;     // Unique identifier for the track
-  std::string name;   // Name of the track
-  std::string artist; // Artist of the track
-  std::string album;  // Album of the track
-  std::string uri;    // URI for the track
-  size_t duration_ms; // Duration of the track in milliseconds
+  std::string id;      // Unique identifier for the track
+  std::string name;    // Name of the track
+  std::string artist;  // Artist of the track
+  std::string album;   // Album of the track
+  std::string uri;     // URI for the track
+  size_t duration_ms;  // Duration of the track in milliseconds
+  time_t added_at = 0; // When it was added to the playlist, 0 if unknown
+};
+
+// Page of the tracks of a playlist or of the saved tracks
+struct TracksPage {
+  std::vector<Track> tracks;
+  int total = 0; // Tracks in the whole playlist or collection
 };
 
 // Class to interact with the Spotify API
@@ -28,24 +48,57 @@ public:
   // Returns the singleton instance of SpotifyAPI
   static SpotifyAPI *getInstance();
 
-  // Initializes the SpotifyAPI with the given client ID
-  static bool init(std::string client_id);
+  // Initializes the SpotifyAPI with the given login, transport and
+  // scheduling settings, and obtains the first access token. Returns false
+  // if there is none.
+  static bool init(const AuthConfig &auth_config,
+                   const HttpConfig &config = HttpConfig(),
+                   const SchedulerConfig &scheduler_config = SchedulerConfig());
 
-  // Retrieves all playlists for the authenticated user
-  std::vector<Playlist> getAllPlaylists();
+  // Retrieves all playlists for the authenticated user. Returns false if
+  // any page failed, `playlists` then holds the ones fetched before.
+  bool getAllPlaylists(std::vector<Playlist> &playlists);
 
   // Retrieves all tracks in a specified playlist
   std::vector<Track> getPlaylistTracks(std::string playlist_id);
 
+  // Retrieves a single page of tracks from a playlist. `total` receives the
+  // number of tracks in the playlist. Returns false if the request failed.
+  bool getPlaylistTracksPage(const std::string &playlist_id, int offset,
+                             int limit, std::vector<Track> &tracks,
+                             int &total);
+
+  // Retrieves a single page of the user's saved tracks (Liked Songs), most
+  // recently saved first. `total` receives the number of saved tracks.
+  // Returns false if the request failed.
+  bool getSavedTracksPage(int offset, int limit, std::vector<Track> &tracks,
+                          int &total);
+
   // Adds a track to a specified playlist
   bool addTrackToPlaylist(std::string playlist_id, std::string track_uri);
 
   // Removes a track from a specified playlist
   bool removeTrackFromPlaylist(std::string playlist_id, std::string track_uri);
 
+  // Appends up to 100 tracks, given by URI, to a playlist in one request
+  bool addTracksToPlaylist(const std::string &playlist_id,
+                           const std::vector<std::string> &uris);
+
+  // Removes up to 100 tracks, given by URI, from a playlist in one request
+  bool removeTracksFromPlaylist(const std::string &playlist_id,
+                                const std::vector<std::string> &uris);
+
+  // Moves the `range_length` tracks at `range_start` of a playlist to before
+  // the track at `insert_before`, both positions counted before the move
+  bool reorderPlaylistTracks(const std::string &playlist_id, int range_start,
+                             int insert_before, int range_length);
+
+  // Changes the name of a playlist
+  bool renamePlaylist(const std::string &playlist_id, const std::string &name);
+
   // Creates a new playlist with the specified name and description
-  bool createPlaylist(std::string name, std::string description,
-                      bool is_public);
+  Playlist createPlaylist(std::string name, std::string description,
+                          bool is_public);
 
   // Retrieves the user ID of the authenticated user
   std::string getUserId();
@@ -53,18 +106,102 @@ public:
   // Retrieves information about a track
   Track getTrackInfo(std::string track_id);
 
-  // Searches for a track by name and artist
-  std::string searchTrack(std::string query);
+  // Searches for a track by name and artist. `track` receives the best match,
+  // or a track with an empty ID if nothing matched. Returns false if the
+  // search request failed.
+  bool searchTrack(const std::string &query, Track &track);
+
+  // Asynchronous counterparts of the methods above, which wait for them.
+  // They return at once; the requests run on the event loop of the HTTP
+  // client, so many can be in flight without a thread each. Results are
+  // returned through the future, an empty optional if a request failed.
+  std::future<std::optional<std::vector<Playlist>>> getAllPlaylistsAsync();
+  std::future<std::optional<std::vector<Track>>>
+  getPlaylistTracksAsync(const std::string &playlist_id);
+  std::future<std::optional<TracksPage>>
+  getPlaylistTracksPageAsync(const std::string &playlist_id, int offset,
+                             int limit);
+  std::future<std::optional<TracksPage>> getSavedTracksPageAsync(int offset,
+                                                                 int limit);
+  std::future<bool> addTrackToPlaylistAsync(const std::string &playlist_id,
+                                            const std::string &track_uri);
+  std::future<bool>
+  removeTrackFromPlaylistAsync(const std::string &playlist_id,
+                               const std::string &track_uri);
+  std::future<bool>
+  addTracksToPlaylistAsync(const std::string &playlist_id,
+                           const std::vector<std::string> &uris);
+  std::future<bool>
+  removeTracksFromPlaylistAsync(const std::string &playlist_id,
+                                const std::vector<std::string> &uris);
+  std::future<bool> reorderPlaylistTracksAsync(const std::string &playlist_id,
+                                               int range_start,
+                                               int insert_before,
+                                               int range_length);
+  std::future<bool> renamePlaylistAsync(const std::string &playlist_id,
+                                        const std::string &name);
+  std::future<Playlist> createPlaylistAsync(const std::string &name,
+                                            const std::string &description,
+                                            bool is_public);
+  std::future<std::string> getUserIdAsync();
+  std::future<Track> getTrackInfoAsync(const std::string &track_id);
+  // The track is empty if nothing matched
+  std::future<std::optional<Track>> searchTrackAsync(const std::string &query);
 
 private:
   static SpotifyAPI *instance; // Singleton instance
 
-  std::string client_id;    // Client ID for Spotify API
-  std::string access_token; // Access token for authentication
+  std::unique_ptr<TokenManager> tokens; // Access token of every request
+  std::unique_ptr<HttpClient> http;     // Event loop running all requests
 
   SpotifyAPI() = default;             // Constructor is private and defaulted
   SpotifyAPI(SpotifyAPI const &);     // Prevent copies
   void operator=(SpotifyAPI const &); // Prevent assignments
 
-  void oauth(); // Handles the OAuth authentication process
+  bool oauth(); // Obtains the first access token
+
+  // A request of `method` for `path` with the headers every API request
+  // carries
+  HttpRequest request(HttpRequest::Method method,
+                      const std::string &path) const;
+
+  // Sends `request` and calls `done` with the response on the event loop
+  // thread, recording the latency of `endpoint`
+  void send(ApiEndpoint endpoint, HttpRequest request,
+            std::function<void(HttpResponse &)> done);
+  // Sends `request` with the current access token. If `renew` is set and
+  // the token is rejected, it is sent once more after a refresh.
+  void sendAuthorized(ApiEndpoint endpoint,
+                      std::shared_ptr<const HttpRequest> request,
+                      std::chrono::steady_clock::time_point start, bool renew,
+                      std::function<void(HttpResponse &)> done);
+
+  // Sends `request` and makes the future of `decode`'s result
+  template <typename T>
+  std::future<T> call(ApiEndpoint endpoint, HttpRequest request,
+                      std::function<T(HttpResponse &)> decode);
+
+  // Requests a page of the playlist listing or of the tracks at `path`
+  // and calls `done` with whether it succeeded, its items and the total
+  void playlistsPage(
+      int offset, int limit,
+      std::function<void(bool, std::vector<Playlist> &, int)> done);
+  void tracksPage(ApiEndpoint endpoint, const std::string &path, int offset,
+                  int limit,
+                  std::function<void(bool, std::vector<Track> &, int)> done);
+  // Requests every page of the playlist listing or of a playlist's tracks
+  // and calls `done` with whether all succeeded and the items of the pages
+  // before the first that failed
+  void allPlaylists(std::function<void(bool, std::vector<Playlist> &)> done);
+  void allTracks(const std::string &playlist_id,
+                 std::function<void(bool, std::vector<Track> &)> done);
+  // Requests a page of tracks at `path` and makes the future of it
+  std::future<std::optional<TracksPage>>
+  tracksPageAsync(ApiEndpoint endpoint, const std::string &path, int offset,
+                  int limit);
+
+  // Waits for the future of a blocking method, traced as a call of
+  // `endpoint`
+  template <typename T>
+  static T wait(ApiEndpoint endpoint, std::future<T> future);
 };
@@ -1,26 +1,193 @@
 #ifndef SPOTIFY_FS_H
 #define SPOTIFY_FS_H
 
+#include "library_cache.h"
+#include "mutation_queue.h"
+#include "playback_launcher.h"
+#include "saved_tracks.h"
+#include "search_index.h"
+#include "track_importer.h"
+#include "track_resolver.h"
+#include "track_table.h"
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
 #include <fuse.h>
 #include <fuse/fuse_lowlevel.h>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
-// Spotify-specific file structure
+// Load state of a playlist's tracks
+enum class load_state {
+  unloaded, // Tracks have not been requested yet
+  loading,  // A thread is fetching the tracks
+  loaded,   // Tracks are present in the file table
+  failed    // The last load failed; retried on next access
+};
+
+// Control files present in every playlist directory without being listed
+enum class control_file {
+  none,          // Not a control file
+  import,        // .import, takes newline-separated search queries
+  import_status, // .import.status, progress of the imports
+  playlist_json, // .playlist.json, the playlist and its tracks as JSON
+  tracks_tsv,    // .tracks.tsv, one line of metadata per track
+  playlist_m3u,  // .playlist.m3u, the tracks as an M3U playlist
+  library_tsv,   // /.library.tsv, the tracks of every playlist (root only)
+  stats          // /.stats, runtime metrics (root only)
+};
+
+// Generated content of an index file and the version of the entries it was
+// generated from
+struct index_content {
+  uint64_t version;
+  std::shared_ptr<const std::string> data;
+};
+
+// State of an open file, kept in fuse_file_info::fh from open to release.
+// Its kind decides how it is used and freed, whatever happens to the path
+// in between.
+struct open_file {
+  control_file kind;       // none for tracks
+  std::string playlist_id; // Playlist the file is in
+  std::string buffer;      // .import: the incomplete last line
+  // Index files: the content as it was when the file was opened
+  std::shared_ptr<const std::string> content;
+};
+
+struct spotify_file;
+
+// Track of a Spotify playlist that is not listed because an earlier one has
+// the same name
+struct hidden_track {
+  size_t position;   // Position in the Spotify playlist
+  uint32_t track;    // Track table index
+  uint32_t added_at; // When it was added, in seconds since the epoch
+};
+
+// Track entry as removeTrack took it out of a playlist, so that it can be
+// put back where it was
+struct removed_track {
+  size_t pos = 0;        // Position in `tracks`
+  size_t position = 0;   // Position in the Spotify playlist
+  uint32_t added_at = 0; // When it was added, in seconds since the epoch
+  std::vector<hidden_track> hidden; // Its hidden entries, sorted by position
+  std::vector<std::shared_ptr<const std::string>> aliases;
+};
+
+// Immutable snapshot of a directory's entries. Readers use whichever
+// snapshot is current without locking; writers publish a modified copy and
+// retire the old one through Epoch.
+struct dir_entries {
+  std::vector<spotify_file *> children; // Playlists (root only)
+  // Tracks in playlist order as track table indices (playlists only)
+  std::vector<uint32_t> tracks;
+  // When each of `tracks` was added to the playlist, in seconds since the
+  // epoch
+  std::vector<uint32_t> added_at;
+  // Position of each entry in `children` or `tracks`, keyed by entry name.
+  // The keys point into playlist names, the track table or `aliases`.
+  std::unordered_map<std::string_view, size_t> index;
+  // Additional names that resolve to an existing entry
+  std::vector<std::shared_ptr<const std::string>> aliases;
+  // Unlisted tracks, sorted by position. Positions sent to Spotify count
+  // them, see spotifyPosition.
+  std::vector<hidden_track> hidden;
+};
+
+// Directory node: the root or a playlist. Tracks are not nodes of their own,
+// they live in the shared track table.
 struct spotify_file {
-  std::string id;            // Spotify ID (track ID or playlist ID)
-  std::string name;          // Display name
-  std::string artist;        // Artist name (for tracks)
-  std::string album;         // Album name (for tracks)
-  size_t duration_ms;        // Track duration in milliseconds
-  std::string uri;           // Spotify URI
-  bool is_playlist;          // true if playlist, false if track
-  std::string original_name; // Original name of the file
+  std::string id;                // Spotify playlist ID
+  bool is_playlist;              // true for playlists, false for the root
+  std::atomic<load_state> state; // Load state of the tracks
+  // Threads fetching for the node without an Epoch pin, which keep it alive
+  // (see fetchUnpinned), plus RETIRED once the node was retired and only
+  // they can still reach it
+  std::atomic<int> loaders{0};
+  static const int RETIRED = 1 << 30;
+  int track_count;               // Listed track count
+  std::string snapshot_id;       // Spotify snapshot ID
+  long cache_index = -1;         // Record in the library cache, -1 if none
+
+  // Current directory entries
+  std::atomic<const dir_entries *> entries;
+  // Serializes writers of `entries`
+  std::mutex write_mutex;
+  // Incremented after every change of `entries`
+  std::atomic<uint64_t> version{0};
+
+  // Index files generated from the entries, kept until they change
+  std::mutex index_mutex;
+  std::map<control_file, index_content> indexes;
+
+  ~spotify_file() { delete display_name.load(); }
+
+  // Display name. Readers must hold an Epoch::ReadGuard while they use it.
+  const std::string &name() const { return *display_name.load(); }
+  // Names a node that is not published yet
+  void setName(std::string name) {
+    delete display_name.exchange(new std::string(std::move(name)));
+  }
+  // Renames a published node and returns the old name, which the caller
+  // retires through Epoch once the index of the root no longer refers to it
+  const std::string *replaceName(std::string name) {
+    return display_name.exchange(new std::string(std::move(name)));
+  }
+
+private:
+  std::atomic<const std::string *> display_name{new std::string()};
+};
+
+// Inode handed to the kernel by the low-level backend. Inode numbers are
+// derived from `key`, so an entry gets the same number on every lookup.
+struct ll_node {
+  fuse_ino_t parent;       // Inode of the directory the entry was found in
+  std::string name;        // Name of the last lookup
+  std::string key;         // Identity of the playlist, track or control file
+  std::string playlist_id; // Playlist the entry is or belongs to
+  bool is_playlist;        // true if the entry is the playlist itself
+  uint64_t lookups;        // Lookups the kernel has not forgotten yet
+};
+
+// Mount options understood by SpotifyFS (passed as -o key=value)
+struct spotify_options {
+  int load_concurrency;    // Maximum number of parallel requests during load
+  const char *cache_dir;   // Directory of the library cache, NULL for default
+  const char *api_url;     // Base URL of the Web API, NULL for Spotify's
+  const char *client_id;   // Client ID of the Spotify application
+  const char *auth_url;    // Root of the accounts service, NULL for Spotify's
+  int redirect_port;       // Port the login redirect is received on
+  const char *token_file;  // File keeping the login, NULL for the default
+  int connect_timeout;     // Connection timeout in milliseconds
+  int http_timeout;        // Request timeout in milliseconds
+  double rate_limit;       // Sustained API requests per second
+  int max_retries;         // Retries of throttled or failed requests
+  int flush_delay;         // Milliseconds changes are held for batching
+  int import_concurrency;  // Maximum number of parallel searches of imports
+  int search_cache_size;   // Search results kept in memory
+  int search_ttl;          // Seconds a search result is reused
+  int sync_interval;       // Seconds between library syncs, 0 disables them
+  double entry_timeout;    // Seconds the kernel caches names
+  double attr_timeout;     // Seconds the kernel caches attributes
+  double negative_timeout; // Seconds the kernel caches missing names
+  int playback;            // Open tracks in Spotify when they are opened
+  const char *trace;       // File spans are traced into, NULL disables tracing
+  int liked_songs;         // List the saved tracks as /Liked Songs
 };
 
 class SpotifyFileSystem {
 public:
-  static void init();
+  static void init(const spotify_options &options);
+  static void destroy(void *private_data);
   static int getFileAttributes(const char *path, struct stat *stbuf);
   static int listFiles(const char *path, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi);
@@ -31,17 +198,296 @@ public:
   static int createFile(const char *path, mode_t mode,
                         struct fuse_file_info *fi);
   static int removeFile(const char *path);
+  // Renames a playlist, or moves a track to the position N named by a
+  // "<N> <name>" target
+  static int renameFile(const char *from, const char *to);
+  // Acts on and frees the handle of `fi`; `path` may be empty, as the
+  // handle identifies the file
+  static int releaseFile(const char *path, struct fuse_file_info *fi);
+  static int syncFile(const char *path, int datasync,
+                      struct fuse_file_info *fi);
   static int cleanup();
   static int writeFile(const char *path, const char *buf, size_t size,
                        off_t offset, struct fuse_file_info *fi);
   static int truncateFile(const char *path, off_t size);
+  static int readLink(const char *path, char *buf, size_t size);
+
+  // Called after the entries of `dir` changed, with the name of an entry
+  // that was added, removed or replaced, or with an empty name when the
+  // listing of `dir` changed. Lets the FUSE backend drop kernel caches.
+  static std::function<void(spotify_file *dir, const std::string &name)>
+      invalidate;
 
+  // Low-level FUSE operations, implemented on top of the path-based ones
+  // above with inodes kept in a table
+  static void spotify_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                                const char *name);
+  static void spotify_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                                unsigned long nlookup);
+  static void spotify_ll_forget_multi(fuse_req_t req, size_t count,
+                                      struct fuse_forget_data *forgets);
+  static void spotify_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                                 struct fuse_file_info *fi);
+  static void spotify_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+                                 struct stat *attr, int to_set,
+                                 struct fuse_file_info *fi);
+  static void spotify_ll_readlink(fuse_req_t req, fuse_ino_t ino);
+  static void spotify_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+                               const char *name, mode_t mode);
+  static void spotify_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                                const char *name);
+  static void spotify_ll_rename(fuse_req_t req, fuse_ino_t parent,
+                                const char *name, fuse_ino_t newparent,
+                                const char *newname);
+  static void spotify_ll_open(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi);
+  static void spotify_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t off, struct fuse_file_info *fi);
+  static void spotify_ll_write(fuse_req_t req, fuse_ino_t ino,
+                               const char *buf, size_t size, off_t off,
+                               struct fuse_file_info *fi);
+  static void spotify_ll_release(fuse_req_t req, fuse_ino_t ino,
+                                 struct fuse_file_info *fi);
+  static void spotify_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                               struct fuse_file_info *fi);
+  static void spotify_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                 off_t off, struct fuse_file_info *fi);
   static void spotify_ll_create(fuse_req_t req, fuse_ino_t parent,
                                 const char *name, mode_t mode,
                                 struct fuse_file_info *fi);
+  // Sets the channel of the mount and sends `invalidate` calls to the
+  // kernel through it. Null once the session loop ended, invalidations are
+  // dropped from then on.
+  static void setChannel(struct fuse_chan *ch);
 
 private:
-  static std::unordered_map<std::string, struct spotify_file *> files;
+  static spotify_file root; // Root directory, its entries are the playlists
+  // Read-only directory of the saved tracks, listed in the root next to the
+  // playlists. Its tracks are fetched page by page as listings and lookups
+  // reach them, and kept for later lookups.
+  static spotify_file liked;
+  static std::unique_ptr<SavedTracksPager> liked_pager;
+  static std::mutex liked_mutex; // Serializes fetches of liked_pager
+  // Every track of every loaded playlist
+  static TrackTable track_table;
+  static spotify_options options;
+  // Time of the mount, the modification time of everything but tracks
+  static time_t mount_time;
+  static LibraryCache cache; // Snapshot from the previous mount
+  // Batches track additions and removals
+  static std::unique_ptr<MutationQueue> mutations;
+  // Cached search of the tracks named by created files and imports
+  static std::unique_ptr<TrackResolver> resolver;
+  // Resolves queries written to .import files
+  static std::unique_ptr<TrackImporter> importer;
+  // Starts playback of opened tracks, null if playback is disabled
+  static std::unique_ptr<PlaybackLauncher> launcher;
+  // Names, artists and albums of the listed tracks, queried through
+  // /.search
+  static std::unique_ptr<SearchIndex> search_index;
+
+  // Incremented after every change of any directory, the version of
+  // /.library.tsv
+  static std::atomic<uint64_t> library_version;
+
+  // Guards load state transitions of playlists
+  static std::mutex load_mutex;
+  static std::condition_variable load_cv;
+
+  // Resolves `path` to a directory. `parent` receives the directory that
+  // holds the last path component, even if that component does not exist or
+  // is a track. The tracks of a playlist are fetched on first access below
+  // it, see ensureLoaded.
+  static spotify_file *resolve(const char *path,
+                               spotify_file **parent = nullptr);
+  // Resolves `path` to the index of a track, -1 if it names none. `playlist`
+  // receives the playlist holding the last path component.
+  static long resolveTrack(const char *path, spotify_file **playlist,
+                           time_t *added_at = nullptr);
+  // Finds a playlist by its Spotify ID
+  static spotify_file *findPlaylist(const std::string &id);
+  // Finds a directory of the root by name, Liked Songs included
+  static spotify_file *lookupPlaylist(std::string_view name);
+  // Publishes the next page of Liked Songs, unless its entries changed since
+  // they were at `version`, and keeps `ahead` pages after it in flight.
+  // Returns 1 if there may be new entries, 0 once every saved track is
+  // listed and -EIO if the page failed. Like ensureLoaded, it releases the
+  // Epoch pin of the caller while it waits for the page.
+  static int fetchLiked(uint64_t version, size_t ahead);
+  // Identifies control files. `playlist` receives the playlist they belong to.
+  static control_file controlFile(const char *path, spotify_file **playlist);
+  // True for the read-only files generated from the track metadata or the
+  // metrics
+  static bool isIndexFile(control_file kind);
+  // Returns the content of an index file of `dir`, generating it if the
+  // entries changed since it was last generated. /.stats is generated every
+  // time. The caller must hold an Epoch::ReadGuard.
+  static std::shared_ptr<const std::string> indexFile(spotify_file *dir,
+                                                      control_file kind);
+  static std::string generateIndex(spotify_file *dir, control_file kind);
+  // Paths below /.search: returns 1 for /.search itself, 2 for the
+  // directory of a query and 3 for a result in it, 0 for other paths.
+  // `query` and `entry` receive the names of the query and the result.
+  static int searchPath(const char *path, std::string &query,
+                        std::string &entry);
+  // Resolves a result of `query`, named "Artist -- Track [Playlist]", to the
+  // relative path of the track. The caller must hold an Epoch::ReadGuard.
+  static bool searchTarget(const std::string &query, const std::string &entry,
+                           std::string &target);
+  // Lists the results of `query`, nothing but the dots for an empty one
+  static int listSearch(const std::string &query, void *buf,
+                        fuse_fill_dir_t filler, off_t offset);
+  // Stores a new open_file handle in `fi`
+  static open_file *attachHandle(struct fuse_file_info *fi, control_file kind,
+                                 const std::string &playlist_id);
+  static open_file *handleOf(struct fuse_file_info *fi) {
+    return reinterpret_cast<open_file *>(fi->fh);
+  }
+  // Frees the handle of an open the kernel never learned of
+  static void discardHandle(struct fuse_file_info *fi);
+  // Queues the complete lines of `buffer` for import and removes them from it
+  static void submitImport(const std::string &playlist_id,
+                           std::string &buffer, bool final);
+
+  // Directory entry helpers. Readers must hold an Epoch::ReadGuard for as
+  // long as they use the returned pointers.
+  static const dir_entries *entriesOf(spotify_file *dir);
+  static spotify_file *lookup(spotify_file *dir, std::string_view name);
+  // `added_at` receives when the track was added to the playlist
+  static long lookupTrack(spotify_file *playlist, std::string_view name,
+                          time_t *added_at = nullptr);
+  // Publishes a copy of the entries of `dir` modified by `change`
+  static void updateEntries(spotify_file *dir,
+                            const std::function<void(dir_entries &)> &change);
+  // Adds playlists whose names are not taken yet; the others are deleted
+  static void addEntries(spotify_file *dir,
+                         const std::vector<spotify_file *> &added);
+  static bool addEntry(spotify_file *dir, spotify_file *entry);
+  // Adds tracks whose names are not taken in the playlist yet, `added_at`
+  // holds when each was added. Tracks loaded from Spotify whose name is
+  // taken are kept as hidden entries. Returns the tracks that were listed.
+  static std::vector<uint32_t>
+  addTracks(spotify_file *playlist, const std::vector<uint32_t> &added,
+            const std::vector<uint32_t> &added_at, bool from_spotify = true);
+  // Adds a track under its name and `alias` unless the name is taken
+  static bool addTrackEntry(spotify_file *playlist, uint32_t track,
+                            time_t added_at, const std::string &alias = "");
+  static void addAlias(spotify_file *dir, const std::string &alias,
+                       std::string_view name);
+  // Removes a track and its hidden entries from a playlist. Fills `removed`,
+  // if given, with what restoreTrack needs to put them back.
+  static bool removeTrack(spotify_file *playlist, uint32_t track,
+                          removed_track *removed = nullptr);
+  // Puts back a track removed by removeTrack at its listed and Spotify
+  // positions, unless its name was taken since
+  static bool restoreTrack(spotify_file *playlist, uint32_t track,
+                           const removed_track &removed);
+  // Moves a track to `position` of its playlist, or to the end if that is
+  // past it. `moved` is called with the move in Spotify positions, the
+  // track's and the one it is put before, while the entries are locked; an
+  // error it returns leaves them unchanged. Returns 0 or a negative errno.
+  static int moveTrackEntry(spotify_file *playlist, uint32_t track,
+                            size_t position,
+                            const std::function<int(size_t, size_t)> &moved);
+  // Reverts a move from `range_start` to before `insert_before`, in Spotify
+  // positions, if the track is still where it put it
+  static void unmoveTrackEntry(spotify_file *playlist, uint32_t track,
+                               size_t range_start, size_t insert_before);
+  // Position in the Spotify playlist of the entry at `pos` of `tracks`
+  static size_t spotifyPosition(const dir_entries &entries, size_t pos);
+  // Renames a playlist in Spotify and then in the root
+  static int renamePlaylist(spotify_file *playlist, const std::string &name);
+  // Adds a track to a playlist and queues the addition for Spotify. `alias`
+  // is an additional name of the entry, may be empty.
+  static void addTrack(spotify_file *playlist, const Track &track,
+                       const std::string &alias);
+
+  // Adds the tracks of an import with one copy of the entries and queues
+  // the additions for Spotify
+  static void importTracks(spotify_file *playlist,
+                           const std::vector<Track> &tracks);
+  // Queues the addition of a listed track, removing it again if it fails
+  static void queueAddition(spotify_file *playlist, uint32_t index,
+                            const std::string &alias);
+  // Fetches the tracks of a playlist if they are not loaded yet. The Epoch
+  // pin of the caller is released while it waits, so pointers obtained
+  // before, `playlist` included, must be looked up again afterwards.
+  static void ensureLoaded(spotify_file *playlist);
+  // Loads a playlist unless another thread does, then waits for that one
+  static void loadOnce(spotify_file *playlist);
+  // Runs `fetch` with the caller's Epoch pin released. `playlist` stays
+  // valid until the caller's guard ends, though it may have been removed
+  // from the root meanwhile; other pointers must be looked up again.
+  static void fetchUnpinned(spotify_file *playlist,
+                            const std::function<void()> &fetch);
+  static bool loadPlaylist(spotify_file *playlist);
+  static void loadFromCache(spotify_file *playlist, size_t record);
+  // Creates the node of a playlist from the listing, tracks not loaded
+  static spotify_file *newPlaylist(const Playlist &playlist);
+  // Gives playlists whose name is taken, by an earlier playlist of the
+  // listing or by Liked Songs or .search, the first free "<name> (N)" with
+  // N from 2. The same listing always gets the same names.
+  static void uniqueNames(std::vector<Playlist> &playlists);
+  // Frees a playlist removed from the root once no reader can see it and
+  // no load is filling it in
+  static void retirePlaylist(spotify_file *playlist);
+  static void freePlaylist(spotify_file *playlist);
+
+  // Background sync with Spotify. Every sync_interval seconds the playlist
+  // listing is compared with the tree by snapshot ID and changed playlists
+  // are updated in place.
+  static std::thread sync_thread;
+  static std::mutex sync_mutex;
+  static std::condition_variable sync_cv;
+  static bool sync_stopping;
+  static void syncLoop();
+  static void syncLibrary();
+  // Re-fetches a loaded playlist and applies the difference to its entries,
+  // unless they changed during the fetch. Releases the Epoch pin like
+  // ensureLoaded.
+  static void syncTracks(spotify_file *playlist, const Playlist &listed);
+  // Drops the fetched pages of Liked Songs if the saved tracks changed, so
+  // that the next listing fetches them again
+  static void syncLiked();
+
+  // Inodes the kernel holds, see ll_node
+  static std::mutex inode_mutex;
+  static std::unordered_map<fuse_ino_t, ll_node> nodes;
+  static std::unordered_map<std::string, fuse_ino_t> inodes; // By key
+  static struct fuse_chan *channel;
+  // Invalidations go out from a thread of their own. The kernel may hold
+  // the directory locked for the very request that caused them.
+  static std::thread notify_thread;
+  static std::mutex notify_mutex;
+  static std::condition_variable notify_cv;
+  // Directory inode and entry name, empty for the whole listing
+  static std::deque<std::pair<fuse_ino_t, std::string>> notifications;
+  static bool notify_stopping;
+  static void notifyLoop();
+  static void queueNotification(fuse_ino_t parent, const std::string &name);
+  // Returns the inode of `key`, the FNV-1a hash of it unless that is taken.
+  // The caller must hold inode_mutex.
+  static fuse_ino_t inodeOf(const std::string &key);
+  // Identity of the entry at `path`. Tracks are identified by playlist and
+  // track ID, so every name of an entry maps to the same inode.
+  static bool entryKey(const char *path, std::string &key,
+                       std::string &playlist_id, bool &is_playlist);
+  // Path of an inode the kernel holds, false if it is unknown or gone
+  static bool nodePath(fuse_ino_t ino, std::string &path);
+  static bool childPath(fuse_ino_t parent, const char *name,
+                        std::string &path);
+  static void forgetNode(fuse_ino_t ino, uint64_t nlookup);
+  // Looks up the entry at `path` in `parent` and counts the lookup. Returns
+  // an errno value on failure.
+  static int lookupEntry(fuse_ino_t parent, const char *name,
+                         const std::string &path, fuse_entry_param &e);
+  // Control files change while imports run, their attributes are not cached
+  static double attrTimeout(const char *path);
+
+  // Location of the library cache file
+  static std::string cachePath();
+  // Writes the current library to the cache
+  static void saveCache();
 };
 
 #endif // SPOTIFY_FS_H
\ No newline at end of file
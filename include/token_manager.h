@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Settings of the login to the Spotify accounts service
+struct AuthConfig {
+  std::string client_id; // Client ID of the registered application
+  // Root of the accounts service, may point at a local mock server
+  std::string accounts_url = "https://accounts.spotify.com";
+  std::string scope =
+      "user-read-private user-read-email playlist-modify-private "
+      "playlist-modify-public user-library-modify user-library-read";
+  int redirect_port = 3000; // Port of the login redirect on 127.0.0.1
+  // File the refresh token is kept in across mounts, empty for the default
+  std::string token_file;
+  long refresh_margin_s = 300; // Tokens are refreshed this long before expiry
+  long timeout_ms = 30000;     // Timeout of a token request
+};
+
+// Obtains and refreshes the access token of the Web API. The first token
+// comes from a refresh token kept from an earlier mount, or from a login
+// with the Authorization Code flow with PKCE, whose redirect is received by
+// a local listener. Afterwards a background thread refreshes the token
+// before it expires. The current token is published by swapping a pointer,
+// so reading it never blocks on a refresh in progress.
+class TokenManager {
+public:
+  explicit TokenManager(AuthConfig config);
+  // Stops the refresh thread
+  ~TokenManager();
+  TokenManager(const TokenManager &) = delete;
+  TokenManager &operator=(const TokenManager &) = delete;
+
+  // Obtains the first token, logging in interactively if no refresh token
+  // is kept or it was revoked. Blocks, and only uses the calling thread so
+  // that it can run before the process daemonizes. Returns false if no
+  // token could be obtained.
+  bool login();
+  // Uses `token` as it is, it is never refreshed
+  void useToken(const std::string &token);
+
+  // "Authorization" header of the current token. `generation` receives its
+  // number, which grows with every refresh. Never blocks; the refresh
+  // thread is started by the first call.
+  std::string header(uint64_t &generation);
+  // Called when the token of `generation` was rejected. `done` is called
+  // once a refresh after it finished, successful or not, or at once if
+  // there was one already. Rejections of the same token share a single
+  // refresh. `done` runs on the refresh thread or the calling one.
+  void refresh(uint64_t generation, std::function<void()> done);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  // A token as published to the readers
+  struct Token {
+    std::string header;
+    uint64_t generation;
+  };
+  // The answer of the token endpoint
+  struct Grant {
+    long status = 0; // 0 if the request failed
+    std::string access_token;
+    std::string refresh_token; // Empty unless it was replaced
+    long expires_in = 3600;
+  };
+
+  void run();
+  // Sends the form `fields` to the token endpoint
+  Grant requestToken(const std::vector<std::pair<std::string, std::string>>
+                         &fields) const;
+  // Exchanges the refresh token for a new access token and publishes it.
+  // Returns the status of the token request, 0 if it failed.
+  long refreshNow();
+  // Publishes the token of `grant` and keeps its refresh token
+  void publish(const Grant &grant);
+  // Runs the browser login and publishes its token
+  bool authorize();
+  // Waits for the redirect of the login on `listener` and returns its code
+  std::string awaitCode(int listener, const std::string &state) const;
+  void saveRefreshToken(const std::string &token) const;
+
+  AuthConfig config;
+  std::atomic<const Token *> current{nullptr}; // Read under an Epoch guard
+  std::string redirect_uri;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::string refresh_token; // Empty if the token cannot be refreshed
+  Clock::time_point refresh_at = Clock::time_point::max();
+  uint64_t generation = 0;    // Of the last token published
+  bool refresh_wanted = false; // A request was rejected
+  std::vector<std::function<void()>> waiting; // For the next refresh
+  unsigned failures = 0; // Refreshes failed in a row
+  bool stopping = false;
+  std::thread refresher; // Started with the first request
+  std::once_flag refresher_started;
+};
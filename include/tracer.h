@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Optional request tracing in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Spans are recorded into a ring buffer
+// of the recording thread without locks and written to the trace file by a
+// background thread. Spans of one thread nest by time, so the work a FUSE
+// operation does on its own thread shows up inside it. Requests it runs on
+// another thread, such as the event loop of the HTTP client, are linked to
+// it by flow events.
+class Tracer {
+public:
+  // Starts recording into `path`. Returns false if it cannot be written.
+  static bool start(const std::string &path);
+  // Writes the remaining spans and closes the trace file
+  static void stop();
+
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+  // Attaches `detail`, such as a path, to the innermost open span of the
+  // calling thread
+  static void annotate(std::string_view detail);
+
+  // Records a span that is not a scope of the calling thread, such as a
+  // request run by an event loop. It shows up on the calling thread. If
+  // `flow` is not 0, the span is linked to that flow, see flow().
+  static void record(const char *name, const char *category,
+                     std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end,
+                     std::string_view detail = {}, uint64_t flow = 0);
+
+  // Starts a flow at the innermost open span of the calling thread and
+  // returns its ID, so that spans recorded with it on other threads are
+  // linked to that span. Inside a FlowScope the flow of the scope is
+  // continued instead. Returns 0 if tracing is disabled or no span is open.
+  static uint64_t flow();
+
+  // Makes flow() continue `id` on the calling thread for the lifetime of
+  // the scope, such as while a request's callback makes further requests
+  class FlowScope {
+  public:
+    explicit FlowScope(uint64_t id);
+    ~FlowScope();
+    FlowScope(const FlowScope &) = delete;
+    FlowScope &operator=(const FlowScope &) = delete;
+
+  private:
+    uint64_t previous;
+  };
+
+  // Records the scope as a span if tracing is enabled. `name` and
+  // `category` must be string literals or otherwise outlive the trace.
+  class Span {
+  public:
+    Span(const char *name, const char *category) {
+      if (enabled()) {
+        begin(name, category);
+      }
+    }
+    ~Span() {
+      if (started) {
+        end();
+      }
+    }
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+  private:
+    friend class Tracer;
+
+    void begin(const char *name, const char *category);
+    void end();
+
+    bool started = false;
+    const char *name;
+    const char *category;
+    uint64_t start_ns;
+    Span *parent;         // Span that was innermost before this one
+    char detail[64];      // Set by annotate(), truncated
+    size_t detail_length;
+  };
+
+private:
+  static std::atomic<bool> active;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "spotify_api.h"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Resolves search queries written to a playlist's import file and adds the
+// matching tracks in the order the queries were written. Searches run in
+// parallel on a fixed pool of worker threads.
+class TrackImporter {
+public:
+  // Finds the track matching a query, empty ID if none
+  using Resolve = std::function<Track(const std::string &query)>;
+  // Receives the resolved tracks, in query order per playlist. Tracks that
+  // become ready together arrive in one call. Called without the importer
+  // locked, one call per playlist at a time.
+  using Commit = std::function<void(const std::string &playlist_id,
+                                    const std::vector<Track> &tracks)>;
+
+  // Creates an importer that keeps at most `concurrency` searches in flight
+  TrackImporter(size_t concurrency, Resolve resolve, Commit commit);
+  ~TrackImporter();
+
+  // Queues queries for a playlist behind the ones queued before
+  void submit(const std::string &playlist_id,
+              std::vector<std::string> queries);
+  // Progress of the imports into a playlist, followed by the queries that
+  // did not match any track
+  std::string status(const std::string &playlist_id);
+  // Drops queued queries and stops the worker threads
+  void stop();
+
+private:
+  struct Query {
+    std::string text;  // Query as written
+    bool done = false; // Search finished
+    Track track;       // Matching track, empty ID if none
+  };
+
+  // Queries that matched nothing listed by status(), the latest ones
+  static const size_t MAX_UNRESOLVED = 1000;
+
+  // Imports into one playlist
+  struct Job {
+    // Queries not handed to `commit` yet, in the order they were written
+    std::deque<Query> queries;
+    size_t committed = 0;               // Queries before those in `queries`
+    size_t resolved = 0;                // Queries that matched a track
+    size_t unresolved_count = 0;        // Queries that matched nothing
+    std::deque<std::string> unresolved; // The latest of them
+    std::vector<Track> ready;           // Tracks waiting for `commit`
+    bool committing = false;            // A worker is handing `ready` over
+  };
+
+  // A single search
+  struct Task {
+    std::string playlist_id; // Job the query belongs to
+    size_t query;            // Position of the query in the job
+  };
+
+  void run();
+
+  Resolve resolve;
+  Commit commit;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Task> tasks;
+  std::unordered_map<std::string, Job> jobs;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "spotify_api.h"
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Resolves search queries to tracks with one search request each and keeps
+// the results in a bounded LRU cache. Queries that matched nothing are
+// remembered for a shorter time, so probing the same name again (editor
+// swap files, retried creates) stays off the network.
+class TrackResolver {
+public:
+  // Keeps up to `capacity` results, matches for `ttl` and misses for
+  // `negative_ttl`
+  TrackResolver(size_t capacity, std::chrono::seconds ttl,
+                std::chrono::seconds negative_ttl);
+
+  // Returns the best match of `query`, or a track with an empty ID if
+  // nothing matched or the search failed
+  Track resolve(const std::string &query);
+
+  // Cache key of a query: lower case with runs of whitespace collapsed
+  static std::string normalize(const std::string &query);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry {
+    std::string key;          // Normalized query
+    Track track;              // Match, empty ID for a miss
+    Clock::time_point expiry; // When the entry stops being used
+  };
+
+  size_t capacity;
+  std::chrono::seconds ttl;
+  std::chrono::seconds negative_ttl;
+
+  std::mutex mutex;
+  std::list<Entry> entries; // Most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Deduplicating string store. Strings are copied into large arena blocks and
+// referred to by 32-bit handles, so repeated artist and album names are kept
+// once. Reading a handle is lock-free; interning is serialized.
+class StringInterner {
+public:
+  static const uint32_t EMPTY = 0; // Handle of the empty string
+
+  StringInterner();
+  ~StringInterner();
+  StringInterner(const StringInterner &) = delete;
+  StringInterner &operator=(const StringInterner &) = delete;
+
+  // Returns the handle of `str`, copying it in if it is new. The caller
+  // must hold the table's write lock.
+  uint32_t intern(std::string_view str);
+  std::string_view str(uint32_t handle) const;
+  // Frees every string. Only safe when nobody reads any more.
+  void clear();
+
+  // Bytes allocated for arena blocks
+  size_t arenaBytes() const {
+    return arena_bytes.load(std::memory_order_relaxed);
+  }
+
+private:
+  static const int BLOCK_BITS = 20; // 1 MiB blocks
+  static const size_t BLOCK_SIZE = size_t(1) << BLOCK_BITS;
+  static const size_t MAX_BLOCKS = 4096; // Handles are 32 bits
+
+  // Each string is stored as a 32-bit length followed by its bytes. A handle
+  // is the block number followed by the offset within the block.
+  std::array<std::atomic<char *>, MAX_BLOCKS> blocks{};
+  size_t block_count = 0; // Blocks in use
+  size_t used = 0;        // Bytes used in the last block
+  std::atomic<size_t> arena_bytes{0}; // Read without the write lock
+  std::unordered_map<std::string_view, uint32_t> handles;
+};
+
+// Canonical track records shared by every playlist. A track that appears in
+// several playlists is stored once and playlists refer to it by index.
+// Records never move or change once added, so readers use them without
+// locking; they are only freed by clear().
+class TrackTable {
+public:
+  static const size_t ID_LENGTH = 22; // Base62 Spotify track ID
+
+  struct Record {
+    char id[ID_LENGTH];   // Track ID, all zero for tracks without one
+    uint32_t name;        // Display name "Artist -- Track"
+    uint32_t artist;      // Artist name
+    uint32_t album;       // Album name
+    uint32_t uri;         // URI unless it is spotify:track:<id>
+    uint32_t duration_ms; // Duration in milliseconds
+  };
+
+  TrackTable() = default;
+  ~TrackTable();
+  TrackTable(const TrackTable &) = delete;
+  TrackTable &operator=(const TrackTable &) = delete;
+
+  // Returns the index of the track, adding it if its ID is new. Tracks
+  // without a valid ID always get a record of their own.
+  uint32_t add(std::string_view id, std::string_view name,
+               std::string_view artist, std::string_view album,
+               std::string_view uri, size_t duration_ms);
+
+  const Record &get(uint32_t index) const {
+    return blocks[index >> BLOCK_BITS].load(
+        std::memory_order_acquire)[index & (BLOCK_RECORDS - 1)];
+  }
+  std::string_view str(uint32_t handle) const { return strings.str(handle); }
+  std::string_view name(uint32_t index) const { return str(get(index).name); }
+  std::string id(uint32_t index) const;
+  std::string uri(uint32_t index) const;
+
+  // Frees every record. Only safe when nobody reads any more.
+  void clear();
+
+  // Records added so far. Every record below the count is complete.
+  size_t size() const { return count.load(std::memory_order_acquire); }
+  // Bytes allocated for records and strings
+  size_t memoryBytes() const;
+
+private:
+  static const int BLOCK_BITS = 14; // 16384 records per block
+  static const size_t BLOCK_RECORDS = size_t(1) << BLOCK_BITS;
+  static const size_t MAX_BLOCKS = size_t(1) << (32 - BLOCK_BITS);
+
+  std::mutex mutex; // Serializes writers
+  std::array<std::atomic<Record *>, MAX_BLOCKS> blocks{};
+  // Published after the record is filled in, readers do not lock
+  std::atomic<size_t> count{0};
+  StringInterner strings;
+  // Index of every track with an ID, keyed by the ID stored in its record
+  std::unordered_map<std::string_view, uint32_t> by_id;
+};
@@ -0,0 +1,120 @@
+#include "epoch.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Per-thread slot holding the epoch the thread is pinned at, 0 if idle.
+// Slots are never freed, a thread exiting hands its slot to the next one.
+struct ThreadSlot {
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<bool> in_use{false};
+  ThreadSlot *next = nullptr;
+};
+
+std::atomic<uint64_t> global_epoch{1};
+std::atomic<ThreadSlot *> slots{nullptr};
+
+std::mutex retired_mutex;
+std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+
+ThreadSlot *acquireSlot() {
+  for (ThreadSlot *slot = slots.load(); slot; slot = slot->next) {
+    bool expected = false;
+    if (!slot->in_use.load() &&
+        slot->in_use.compare_exchange_strong(expected, true)) {
+      return slot;
+    }
+  }
+  ThreadSlot *slot = new ThreadSlot();
+  slot->in_use.store(true);
+  slot->next = slots.load();
+  while (!slots.compare_exchange_weak(slot->next, slot)) {
+  }
+  return slot;
+}
+
+// Owns the slot of the current thread
+struct ThreadState {
+  ThreadSlot *slot = acquireSlot();
+  int depth = 0;
+  ~ThreadState() { slot->in_use.store(false); }
+};
+
+thread_local ThreadState thread_state;
+
+// Oldest epoch any reader is still pinned at
+uint64_t oldestPinned() {
+  uint64_t oldest = std::numeric_limits<uint64_t>::max();
+  for (ThreadSlot *slot = slots.load(); slot; slot = slot->next) {
+    uint64_t epoch = slot->epoch.load();
+    if (epoch != 0) {
+      oldest = std::min(oldest, epoch);
+    }
+  }
+  return oldest;
+}
+
+} // namespace
+
+Epoch::ReadGuard::ReadGuard() {
+  if (thread_state.depth++ == 0) {
+    thread_state.slot->epoch.store(global_epoch.load());
+  }
+}
+
+Epoch::ReadGuard::~ReadGuard() {
+  if (--thread_state.depth == 0) {
+    thread_state.slot->epoch.store(0);
+  }
+}
+
+Epoch::Unpin::Unpin() : depth(thread_state.depth) {
+  thread_state.depth = 0;
+  thread_state.slot->epoch.store(0);
+}
+
+Epoch::Unpin::~Unpin() {
+  thread_state.depth = depth;
+  if (depth > 0) {
+    thread_state.slot->epoch.store(global_epoch.load());
+  }
+}
+
+void Epoch::retire(std::function<void()> deleter) {
+  std::vector<std::function<void()>> ready;
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    // Readers pinned after this point can no longer reach the object
+    retired.emplace_back(global_epoch.fetch_add(1), std::move(deleter));
+
+    uint64_t oldest = oldestPinned();
+    auto it = std::partition(retired.begin(), retired.end(),
+                             [oldest](const auto &entry) {
+                               return entry.first >= oldest;
+                             });
+    for (auto ready_it = it; ready_it != retired.end(); ++ready_it) {
+      ready.push_back(std::move(ready_it->second));
+    }
+    retired.erase(it, retired.end());
+  }
+  for (auto &free_object : ready) {
+    free_object();
+  }
+}
+
+void Epoch::drain() {
+  std::vector<std::pair<uint64_t, std::function<void()>>> ready;
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    ready.swap(retired);
+  }
+  for (auto &entry : ready) {
+    entry.second();
+  }
+}
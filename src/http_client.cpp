@@ -0,0 +1,319 @@
+#include "http_client.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cstdlib>
+#include <strings.h>
+
+struct HttpClient::Transfer {
+  HttpRequest request;
+  Callback done;
+  HttpResponse response;
+  std::string url;                // With the encoded parameters
+  curl_slist *headers = nullptr;  // Request headers in curl's form
+  CURL *easy = nullptr;           // Handle of the running attempt
+  int attempt = 0;                // Attempts made before the current one
+  Clock::time_point queued_at;    // Time it started waiting for budget
+  Clock::time_point started_at;   // Time the current attempt was sent
+
+  ~Transfer() { curl_slist_free_all(headers); }
+};
+
+static uint64_t nanoseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+      .count();
+}
+
+HttpClient::HttpClient(HttpConfig config, SchedulerConfig scheduler_config)
+    : settings(std::move(config)), scheduler(scheduler_config),
+      multi(curl_multi_init()) {}
+
+HttpClient::~HttpClient() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  curl_multi_wakeup(multi);
+  if (loop.joinable()) {
+    loop.join();
+  }
+  for (CURL *easy : idle_handles) {
+    curl_easy_cleanup(easy);
+  }
+  curl_multi_cleanup(multi);
+}
+
+void HttpClient::submit(HttpRequest request, Callback done) {
+  auto transfer = std::make_unique<Transfer>();
+  // Absolute URLs (such as pagination links) are used as they are
+  bool absolute = request.path.compare(0, 7, "http://") == 0 ||
+                  request.path.compare(0, 8, "https://") == 0;
+  transfer->url = absolute ? request.path : settings.base_url + request.path;
+  char separator = transfer->url.find('?') == std::string::npos ? '?' : '&';
+  for (const auto &[key, value] : request.parameters) {
+    char *encoded_key = curl_easy_escape(nullptr, key.c_str(), key.size());
+    char *encoded_value =
+        curl_easy_escape(nullptr, value.c_str(), value.size());
+    transfer->url += separator;
+    transfer->url += encoded_key;
+    transfer->url += '=';
+    transfer->url += encoded_value;
+    curl_free(encoded_key);
+    curl_free(encoded_value);
+    separator = '&';
+  }
+  for (const auto &header : request.headers) {
+    transfer->headers = curl_slist_append(transfer->headers, header.c_str());
+  }
+  // Bodies are sent right away instead of waiting for 100 Continue
+  transfer->headers = curl_slist_append(transfer->headers, "Expect:");
+  if (!request.flow) {
+    request.flow = Tracer::flow();
+  }
+  transfer->request = std::move(request);
+  transfer->done = std::move(done);
+  transfer->queued_at = Clock::now();
+
+  // The loop starts with the first request, so that a client created
+  // before the process daemonizes keeps its thread
+  std::call_once(loop_started,
+                 [this]() { loop = std::thread(&HttpClient::run, this); });
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!stopping) {
+      submitted.push_back(std::move(transfer));
+    }
+  }
+  if (transfer) {
+    HttpResponse response;
+    response.error = "HTTP client stopped";
+    transfer->done(std::move(response));
+    return;
+  }
+  curl_multi_wakeup(multi);
+}
+
+std::future<HttpResponse> HttpClient::submit(HttpRequest request) {
+  auto promise = std::make_shared<std::promise<HttpResponse>>();
+  std::future<HttpResponse> future = promise->get_future();
+  submit(std::move(request), [promise](HttpResponse response) {
+    promise->set_value(std::move(response));
+  });
+  return future;
+}
+
+void HttpClient::run() {
+  std::vector<std::unique_ptr<Transfer>> incoming;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stopping) {
+        break;
+      }
+      incoming.swap(submitted);
+    }
+    Clock::time_point now = Clock::now();
+    for (auto &transfer : incoming) {
+      enqueue(std::move(transfer));
+    }
+    incoming.clear();
+    Clock::time_point wake = dispatch(now);
+
+    int still_running = 0;
+    curl_multi_perform(multi, &still_running);
+    int pending = 0;
+    while (CURLMsg *message = curl_multi_info_read(multi, &pending)) {
+      if (message->msg == CURLMSG_DONE) {
+        Transfer *transfer = nullptr;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &transfer);
+        finish(transfer, message->data.result);
+      }
+    }
+
+    // Sleeps until a transfer progresses, a request is submitted, or budget
+    // or a retry becomes due; curl shortens the wait for its own timers
+    if (!delayed.empty()) {
+      wake = std::min(wake, delayed.begin()->first);
+    }
+    long timeout_ms = 1000;
+    if (wake != Clock::time_point::max()) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          wake - Clock::now() + std::chrono::microseconds(999));
+      timeout_ms = std::clamp<long>(wait.count(), 0, timeout_ms);
+    }
+    curl_multi_poll(multi, nullptr, 0, timeout_ms, nullptr);
+  }
+
+  // Requests that did not finish fail
+  std::vector<std::unique_ptr<Transfer>> failed;
+  for (auto &[transfer, owned] : active) {
+    curl_multi_remove_handle(multi, transfer->easy);
+    curl_easy_cleanup(transfer->easy);
+    Metrics::add(Counter::http_in_flight, -1);
+    failed.push_back(std::move(owned));
+  }
+  active.clear();
+  for (auto &queue : queued) {
+    std::move(queue.begin(), queue.end(), std::back_inserter(failed));
+    queue.clear();
+  }
+  for (auto &entry : delayed) {
+    failed.push_back(std::move(entry.second));
+  }
+  delayed.clear();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::move(submitted.begin(), submitted.end(), std::back_inserter(failed));
+    submitted.clear();
+  }
+  for (auto &transfer : failed) {
+    HttpResponse response;
+    response.error = "HTTP client stopped";
+    transfer->done(std::move(response));
+  }
+}
+
+void HttpClient::enqueue(std::unique_ptr<Transfer> transfer) {
+  queued[static_cast<int>(transfer->request.priority)].push_back(
+      std::move(transfer));
+}
+
+HttpClient::Clock::time_point HttpClient::dispatch(Clock::time_point now) {
+  while (!delayed.empty() && delayed.begin()->first <= now) {
+    auto transfer = std::move(delayed.begin()->second);
+    delayed.erase(delayed.begin());
+    transfer->queued_at = now;
+    enqueue(std::move(transfer));
+  }
+
+  // Interactive requests are started first, background ones get the budget
+  // that is left
+  for (auto &queue : queued) {
+    while (!queue.empty()) {
+      Clock::time_point next;
+      if (!scheduler.tryAcquire(now, next)) {
+        return next;
+      }
+      start(std::move(queue.front()), now);
+      queue.pop_front();
+    }
+  }
+  return Clock::time_point::max();
+}
+
+void HttpClient::start(std::unique_ptr<Transfer> transfer,
+                       Clock::time_point now) {
+  Metrics::record(Stage::scheduler_wait,
+                  nanoseconds(now - transfer->queued_at));
+  CURL *easy;
+  if (!idle_handles.empty()) {
+    easy = idle_handles.back();
+    idle_handles.pop_back();
+  } else {
+    easy = curl_easy_init();
+  }
+  transfer->easy = easy;
+  transfer->started_at = now;
+  transfer->response = HttpResponse();
+  if (transfer->request.restart) {
+    transfer->request.restart();
+  }
+
+  const HttpRequest &request = transfer->request;
+  curl_easy_setopt(easy, CURLOPT_URL, transfer->url.c_str());
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer.get());
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, onData);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+  curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, onHeader);
+  curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer.get());
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS,
+                   settings.connect_timeout_ms);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, settings.timeout_ms);
+  curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+  curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+  if (request.method != HttpRequest::Method::get) {
+    if (request.method == HttpRequest::Method::put) {
+      curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, "PUT");
+    } else if (request.method == HttpRequest::Method::del) {
+      curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, "DELETE");
+    }
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request.body.data());
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, long(request.body.size()));
+    Metrics::add(Counter::http_bytes_sent, request.body.size());
+  }
+
+  Metrics::add(Counter::http_requests);
+  Metrics::add(Counter::http_in_flight);
+  curl_multi_add_handle(multi, easy);
+  Transfer *key = transfer.get();
+  active.emplace(key, std::move(transfer));
+}
+
+void HttpClient::finish(Transfer *transfer, CURLcode result) {
+  Clock::time_point now = Clock::now();
+  auto it = active.find(transfer);
+  std::unique_ptr<Transfer> owned = std::move(it->second);
+  active.erase(it);
+
+  HttpResponse &response = transfer->response;
+  if (result == CURLE_OK) {
+    curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE,
+                      &response.status_code);
+  } else {
+    response.status_code = 0;
+    response.error = curl_easy_strerror(result);
+  }
+  curl_multi_remove_handle(multi, transfer->easy);
+  curl_easy_reset(transfer->easy);
+  idle_handles.push_back(transfer->easy);
+  transfer->easy = nullptr;
+
+  Metrics::add(Counter::http_in_flight, -1);
+  if (response.status_code == 0 || response.status_code >= 400) {
+    Metrics::add(Counter::http_errors);
+  }
+  Metrics::record(Stage::http_request,
+                  nanoseconds(now - transfer->started_at));
+  Tracer::record(Metrics::name(Stage::http_request),
+                 Metrics::category(Stage::http_request), transfer->started_at,
+                 now, transfer->request.path, transfer->request.flow);
+
+  Clock::time_point retry_at;
+  if (scheduler.shouldRetry(response.status_code, response.retry_after,
+                            transfer->attempt, transfer->request.idempotent,
+                            now, retry_at)) {
+    ++transfer->attempt;
+    delayed.emplace(retry_at, std::move(owned));
+    return;
+  }
+  // Requests made by `done` inherit the priority and the flow of this one
+  RequestScheduler::PriorityScope scope(transfer->request.priority);
+  Tracer::FlowScope flow(transfer->request.flow);
+  transfer->done(std::move(response));
+}
+
+size_t HttpClient::onData(char *data, size_t size, size_t count, void *user) {
+  auto *transfer = static_cast<Transfer *>(user);
+  size_t length = size * count;
+  Metrics::add(Counter::http_bytes_received, length);
+  if (transfer->request.on_data) {
+    return transfer->request.on_data(std::string_view(data, length)) ? length
+                                                                      : 0;
+  }
+  transfer->response.text.append(data, length);
+  return length;
+}
+
+size_t HttpClient::onHeader(char *data, size_t size, size_t count,
+                            void *user) {
+  auto *transfer = static_cast<Transfer *>(user);
+  size_t length = size * count;
+  static const char name[] = "Retry-After:";
+  if (length > sizeof(name) - 1 &&
+      strncasecmp(data, name, sizeof(name) - 1) == 0) {
+    std::string value(data + sizeof(name) - 1, length - (sizeof(name) - 1));
+    transfer->response.retry_after = std::strtol(value.c_str(), nullptr, 10);
+  }
+  return length;
+}
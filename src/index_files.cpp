@@ -0,0 +1,162 @@
+#include "spotify_fs.h"
+#include "metrics.h"
+#include <ctime>
+
+// Replaces the characters that would break a TSV line
+static void appendTsv(std::string &out, std::string_view value) {
+  for (char c : value) {
+    out += c == '\t' || c == '\n' || c == '\r' ? ' ' : c;
+  }
+}
+
+static void appendJson(std::string &out, std::string_view value) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xF];
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+// ISO 8601 in UTC as used by the Web API, empty if unknown
+static std::string formatTime(time_t time) {
+  if (time <= 0) {
+    return "";
+  }
+  struct tm tm;
+  char buf[32];
+  gmtime_r(&time, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  return buf;
+}
+
+bool SpotifyFileSystem::isIndexFile(control_file kind) {
+  return kind == control_file::playlist_json ||
+         kind == control_file::tracks_tsv ||
+         kind == control_file::playlist_m3u ||
+         kind == control_file::library_tsv || kind == control_file::stats;
+}
+
+std::shared_ptr<const std::string>
+SpotifyFileSystem::indexFile(spotify_file *dir, control_file kind) {
+  if (kind == control_file::stats) {
+    return std::make_shared<const std::string>(Metrics::render());
+  }
+  if (kind == control_file::library_tsv) {
+    // The library index lists every playlist, so all of them are loaded.
+    // Loads release the Epoch pin, the listing is read again after each.
+    for (size_t i = 0;; ++i) {
+      const dir_entries *playlists = entriesOf(&root);
+      if (i >= playlists->children.size()) {
+        break;
+      }
+      ensureLoaded(playlists->children[i]);
+    }
+  }
+
+  // Generation serializes on the directory, so concurrent readers of a
+  // changed playlist generate its index once
+  Tracer::Span span("index_file", "cache");
+  std::lock_guard<std::mutex> lock(dir->index_mutex);
+  uint64_t version = kind == control_file::library_tsv ? library_version.load()
+                                                       : dir->version.load();
+  auto it = dir->indexes.find(kind);
+  if (it != dir->indexes.end() && it->second.version == version) {
+    Metrics::add(Counter::index_cache_hits);
+    Tracer::annotate("hit");
+    return it->second.data;
+  }
+  Metrics::add(Counter::index_cache_misses);
+  Tracer::annotate("miss");
+  auto data = std::make_shared<const std::string>(generateIndex(dir, kind));
+  dir->indexes[kind] = {version, data};
+  return data;
+}
+
+std::string SpotifyFileSystem::generateIndex(spotify_file *dir,
+                                             control_file kind) {
+  std::string out;
+  auto appendTracks = [&out](spotify_file *playlist, bool with_playlist) {
+    const dir_entries *entries = entriesOf(playlist);
+    for (size_t i = 0; i < entries->tracks.size(); ++i) {
+      uint32_t track = entries->tracks[i];
+      const TrackTable::Record &record = track_table.get(track);
+      if (with_playlist) {
+        appendTsv(out, playlist->name());
+        out += '\t';
+      }
+      appendTsv(out, track_table.str(record.name));
+      out += '\t';
+      appendTsv(out, track_table.str(record.artist));
+      out += '\t';
+      appendTsv(out, track_table.str(record.album));
+      out += '\t' + std::to_string(record.duration_ms) + '\t' +
+             track_table.uri(track) + '\t' +
+             formatTime(entries->added_at[i]) + '\n';
+    }
+  };
+
+  switch (kind) {
+  case control_file::tracks_tsv:
+    out = "name\tartist\talbum\tduration_ms\turi\tadded_at\n";
+    appendTracks(dir, false);
+    break;
+  case control_file::library_tsv:
+    out = "playlist\tname\tartist\talbum\tduration_ms\turi\tadded_at\n";
+    for (spotify_file *playlist : entriesOf(&root)->children) {
+      appendTracks(playlist, true);
+    }
+    break;
+  case control_file::playlist_m3u: {
+    out = "#EXTM3U\n";
+    const dir_entries *entries = entriesOf(dir);
+    for (uint32_t track : entries->tracks) {
+      const TrackTable::Record &record = track_table.get(track);
+      out += "#EXTINF:" + std::to_string(record.duration_ms / 1000) + ",";
+      appendTsv(out, track_table.str(record.name));
+      out += '\n' + track_table.uri(track) + '\n';
+    }
+    break;
+  }
+  case control_file::playlist_json: {
+    const dir_entries *entries = entriesOf(dir);
+    out = "{\"id\":";
+    appendJson(out, dir->id);
+    out += ",\"name\":";
+    appendJson(out, dir->name());
+    out += ",\"snapshot_id\":";
+    appendJson(out, dir->snapshot_id);
+    out += ",\"tracks\":[";
+    for (size_t i = 0; i < entries->tracks.size(); ++i) {
+      uint32_t track = entries->tracks[i];
+      const TrackTable::Record &record = track_table.get(track);
+      out += i ? ",\n{\"name\":" : "\n{\"name\":";
+      appendJson(out, track_table.str(record.name));
+      out += ",\"artist\":";
+      appendJson(out, track_table.str(record.artist));
+      out += ",\"album\":";
+      appendJson(out, track_table.str(record.album));
+      out += ",\"duration_ms\":" + std::to_string(record.duration_ms) +
+             ",\"uri\":";
+      appendJson(out, track_table.uri(track));
+      out += ",\"added_at\":";
+      appendJson(out, formatTime(entries->added_at[i]));
+      out += '}';
+    }
+    out += "\n]}\n";
+    break;
+  }
+  default:
+    break;
+  }
+  return out;
+}
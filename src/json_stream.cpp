@@ -0,0 +1,445 @@
+#include "json_stream.h"
+
+namespace {
+
+bool isScalarChar(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.';
+}
+
+int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+} // namespace
+
+JsonStream::JsonStream(JsonHandler &handler) : handler(handler) {}
+
+void JsonStream::reset() {
+  containers.clear();
+  expect = Expect::value;
+  lexeme = Lexeme::none;
+  token.clear();
+  in_key = false;
+  wanted = true;
+  skipping = false;
+  skip_depth = 0;
+  high_surrogate = 0;
+  failed = false;
+}
+
+bool JsonStream::feed(std::string_view chunk) {
+  const char *data = chunk.data();
+  size_t size = chunk.size();
+  size_t i = 0;
+  while (i < size && !failed) {
+    switch (lexeme) {
+    case Lexeme::string: {
+      // Copy plain characters in one go, up to the next quote or escape
+      size_t end = i;
+      while (end < size && data[end] != '"' && data[end] != '\\') {
+        ++end;
+      }
+      if (!skipped()) {
+        token.append(data + i, end - i);
+      }
+      i = end;
+      if (i == size) {
+        break;
+      }
+      if (data[i++] == '\\') {
+        lexeme = Lexeme::escape;
+      } else {
+        lexeme = Lexeme::none;
+        failed = !endString();
+      }
+      break;
+    }
+    case Lexeme::escape:
+      lexeme = Lexeme::string;
+      failed = !escape(data[i++]);
+      break;
+    case Lexeme::unicode: {
+      int digit = hexValue(data[i++]);
+      if (digit < 0) {
+        failed = true;
+        break;
+      }
+      code_unit = code_unit * 16 + digit;
+      if (++hex_digits == 4) {
+        lexeme = Lexeme::string;
+        appendCodePoint(code_unit);
+      }
+      break;
+    }
+    case Lexeme::scalar:
+      if (isScalarChar(data[i])) {
+        if (!skipping) {
+          token += data[i];
+        }
+        ++i;
+        break;
+      }
+      // The character after a scalar is handled as structure
+      lexeme = Lexeme::none;
+      failed = !endScalar();
+      break;
+    case Lexeme::none:
+      if (skip_depth > 0) {
+        // Only strings and brackets matter inside a skipped container
+        while (i < size && data[i] != '"' && data[i] != '{' &&
+               data[i] != '}' && data[i] != '[' && data[i] != ']') {
+          ++i;
+        }
+        if (i == size) {
+          break;
+        }
+      }
+      failed = !structural(data[i++]);
+      break;
+    }
+  }
+  return !failed;
+}
+
+bool JsonStream::finish() {
+  if (!failed && lexeme == Lexeme::scalar) {
+    lexeme = Lexeme::none;
+    failed = !endScalar();
+  }
+  return !failed && lexeme == Lexeme::none && expect == Expect::done;
+}
+
+bool JsonStream::structural(char c) {
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    return true;
+  }
+  if (skip_depth > 0) {
+    if (c == '"') {
+      lexeme = Lexeme::string;
+    } else if (c == '{' || c == '[') {
+      ++skip_depth;
+    } else if (c == '}' || c == ']') {
+      if (--skip_depth == 0) {
+        endValue();
+      }
+    }
+    return true;
+  }
+
+  switch (expect) {
+  case Expect::key_or_end:
+    if (c == '}') {
+      return closeContainer(c);
+    }
+    [[fallthrough]];
+  case Expect::key:
+    if (c != '"') {
+      return false;
+    }
+    lexeme = Lexeme::string;
+    in_key = true;
+    token.clear();
+    return true;
+  case Expect::colon:
+    if (c != ':') {
+      return false;
+    }
+    expect = Expect::value;
+    return true;
+  case Expect::value_or_end:
+    if (c == ']') {
+      return closeContainer(c);
+    }
+    [[fallthrough]];
+  case Expect::value:
+    return startValue(c);
+  case Expect::comma_or_end:
+    if (c == ',') {
+      // Array elements are always wanted, object values only if their key
+      // is
+      if (containers.back() == '{') {
+        expect = Expect::key;
+      } else {
+        expect = Expect::value;
+        wanted = true;
+      }
+      return true;
+    }
+    return closeContainer(c);
+  case Expect::done:
+    return false;
+  }
+  return false;
+}
+
+bool JsonStream::startValue(char c) {
+  skipping = !wanted;
+  switch (c) {
+  case '{':
+  case '[':
+    if (skipping) {
+      skip_depth = 1;
+      return true;
+    }
+    containers.push_back(c);
+    if (c == '{') {
+      expect = Expect::key_or_end;
+      handler.startObject();
+    } else {
+      expect = Expect::value_or_end;
+      wanted = true;
+      handler.startArray();
+    }
+    return true;
+  case '"':
+    lexeme = Lexeme::string;
+    in_key = false;
+    token.clear();
+    return true;
+  default:
+    if (c != '-' && !(c >= '0' && c <= '9') && c != 't' && c != 'f' &&
+        c != 'n') {
+      return false;
+    }
+    lexeme = Lexeme::scalar;
+    token.clear();
+    if (!skipping) {
+      token += c;
+    }
+    return true;
+  }
+}
+
+bool JsonStream::closeContainer(char c) {
+  if (containers.empty() || containers.back() != (c == '}' ? '{' : '[')) {
+    return false;
+  }
+  containers.pop_back();
+  if (c == '}') {
+    handler.endObject();
+  } else {
+    handler.endArray();
+  }
+  endValue();
+  return true;
+}
+
+bool JsonStream::endString() {
+  if (skip_depth > 0) {
+    return true; // A string inside a skipped container
+  }
+  if (in_key) {
+    in_key = false;
+    wanted = handler.key(token);
+    expect = Expect::colon;
+    return true;
+  }
+  if (!skipping) {
+    handler.string(token);
+  }
+  endValue();
+  return true;
+}
+
+bool JsonStream::endScalar() {
+  if (!skipping) {
+    if (token == "true" || token == "false") {
+      handler.boolean(token == "true");
+    } else if (token == "null") {
+      handler.null();
+    } else if (token[0] == '-' || (token[0] >= '0' && token[0] <= '9')) {
+      handler.number(token);
+    } else {
+      return false;
+    }
+  }
+  endValue();
+  return true;
+}
+
+bool JsonStream::escape(char c) {
+  if (skipped()) {
+    return true; // Escapes of skipped strings only need to be stepped over
+  }
+  switch (c) {
+  case '"':
+  case '\\':
+  case '/':
+    token += c;
+    return true;
+  case 'b':
+    token += '\b';
+    return true;
+  case 'f':
+    token += '\f';
+    return true;
+  case 'n':
+    token += '\n';
+    return true;
+  case 'r':
+    token += '\r';
+    return true;
+  case 't':
+    token += '\t';
+    return true;
+  case 'u':
+    lexeme = Lexeme::unicode;
+    code_unit = 0;
+    hex_digits = 0;
+    return true;
+  default:
+    return false;
+  }
+}
+
+void JsonStream::appendCodePoint(unsigned code_point) {
+  // Characters outside the BMP arrive as a pair of surrogate escapes
+  if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+    high_surrogate = code_point;
+    return;
+  }
+  if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+    if (!high_surrogate) {
+      return; // Unpaired, dropped
+    }
+    code_point = 0x10000 + ((high_surrogate - 0xD800) << 10) +
+                 (code_point - 0xDC00);
+  }
+  high_surrogate = 0;
+
+  if (code_point < 0x80) {
+    token += static_cast<char>(code_point);
+  } else if (code_point < 0x800) {
+    token += static_cast<char>(0xC0 | (code_point >> 6));
+    token += static_cast<char>(0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x10000) {
+    token += static_cast<char>(0xE0 | (code_point >> 12));
+    token += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    token += static_cast<char>(0x80 | (code_point & 0x3F));
+  } else {
+    token += static_cast<char>(0xF0 | (code_point >> 18));
+    token += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+    token += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    token += static_cast<char>(0x80 | (code_point & 0x3F));
+  }
+}
+
+void JsonStream::endValue() {
+  skipping = false;
+  wanted = true;
+  expect = containers.empty() ? Expect::done : Expect::comma_or_end;
+}
+
+void JsonProjection::field(const std::string &path, Setter setter) {
+  fields[path] = std::move(setter);
+  addPrefixes(path);
+}
+
+void JsonProjection::element(const std::string &path,
+                             std::function<void()> begin) {
+  elements[path] = std::move(begin);
+  addPrefixes(path);
+}
+
+void JsonProjection::addPrefixes(const std::string &path) {
+  // Every key on the way to the field must be descended into
+  for (size_t i = 0; i < path.size(); ++i) {
+    if (path[i] == '.' || path[i] == '[') {
+      prefixes.insert(path.substr(0, i));
+    }
+  }
+  prefixes.insert(path);
+}
+
+void JsonProjection::reset() {
+  path.clear();
+  marks.clear();
+  containers.clear();
+}
+
+bool JsonProjection::key(std::string_view name) {
+  size_t mark = path.size();
+  if (!path.empty()) {
+    path += '.';
+  }
+  path.append(name);
+  if (!prefixes.count(path)) {
+    path.resize(mark);
+    return false;
+  }
+  marks.push_back(mark);
+  return true;
+}
+
+void JsonProjection::beginValue() {
+  if (!containers.empty() && containers.back() == '[') {
+    auto it = elements.find(path);
+    if (it != elements.end()) {
+      it->second();
+    }
+  }
+}
+
+void JsonProjection::endValue() {
+  // A value inside an object ends the key it belongs to
+  if (!containers.empty() && containers.back() == '{') {
+    path.resize(marks.back());
+    marks.pop_back();
+  }
+}
+
+void JsonProjection::scalar(std::string_view value) {
+  beginValue();
+  auto it = fields.find(path);
+  if (it != fields.end()) {
+    it->second(value);
+  }
+  endValue();
+}
+
+void JsonProjection::startObject() {
+  beginValue();
+  containers.push_back('{');
+}
+
+void JsonProjection::endObject() {
+  containers.pop_back();
+  endValue();
+}
+
+void JsonProjection::startArray() {
+  beginValue();
+  containers.push_back('[');
+  marks.push_back(path.size());
+  path += "[]";
+}
+
+void JsonProjection::endArray() {
+  path.resize(marks.back());
+  marks.pop_back();
+  containers.pop_back();
+  endValue();
+}
+
+void JsonProjection::string(std::string_view value) { scalar(value); }
+
+void JsonProjection::number(std::string_view text) { scalar(text); }
+
+void JsonProjection::boolean(bool value) {
+  scalar(value ? "true" : "false");
+}
+
+void JsonProjection::null() {
+  beginValue();
+  endValue();
+}
@@ -0,0 +1,169 @@
+#include "library_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = {'S', 'P', 'V', 'F', 'S', 'N', 'A', 'P'};
+
+LibraryCache::~LibraryCache() { close(); }
+
+bool LibraryCache::open(const std::string &path) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    ::close(fd);
+    return false;
+  }
+  void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  data = mapped;
+  size = st.st_size;
+
+  // Validate the header and that every section lies within the file
+  const char *base = static_cast<const char *>(data);
+  const Header *h = reinterpret_cast<const Header *>(base);
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION ||
+      h->track_count > size / sizeof(TrackRecord)) {
+    std::cerr << "Ignoring incompatible library cache: " << path << std::endl;
+    close();
+    return false;
+  }
+  size_t playlists_end =
+      sizeof(Header) + (size_t)h->playlist_count * sizeof(PlaylistRecord);
+  size_t tracks_end = playlists_end + h->track_count * sizeof(TrackRecord);
+  if (h->strings_size > size || tracks_end + h->strings_size != size) {
+    std::cerr << "Ignoring truncated library cache: " << path << std::endl;
+    close();
+    return false;
+  }
+
+  // Records are read in place later, so every reference in them has to be
+  // checked against the sections now
+  auto playlist_records =
+      reinterpret_cast<const PlaylistRecord *>(base + sizeof(Header));
+  auto track_records =
+      reinterpret_cast<const TrackRecord *>(base + playlists_end);
+  uint64_t strings_size = h->strings_size;
+  auto valid = [strings_size](StringRef ref) {
+    return (uint64_t)ref.offset + ref.length <= strings_size;
+  };
+  bool intact = true;
+  for (size_t i = 0; intact && i < h->playlist_count; ++i) {
+    const PlaylistRecord &record = playlist_records[i];
+    intact = valid(record.id) && valid(record.name) &&
+             valid(record.snapshot_id) &&
+             record.first_track <= h->track_count &&
+             record.track_count <= h->track_count - record.first_track;
+  }
+  for (size_t i = 0; intact && i < h->track_count; ++i) {
+    const TrackRecord &record = track_records[i];
+    intact = valid(record.id) && valid(record.name) && valid(record.artist) &&
+             valid(record.album) && valid(record.uri);
+  }
+  if (!intact) {
+    std::cerr << "Ignoring corrupt library cache: " << path << std::endl;
+    close();
+    return false;
+  }
+
+  header = h;
+  playlists = playlist_records;
+  tracks = track_records;
+  strings = base + tracks_end;
+  return true;
+}
+
+void LibraryCache::close() {
+  if (data) {
+    munmap(data, size);
+  }
+  data = nullptr;
+  size = 0;
+  header = nullptr;
+  playlists = nullptr;
+  tracks = nullptr;
+  strings = nullptr;
+}
+
+LibraryCache::StringRef LibraryCacheWriter::intern(std::string_view value) {
+  auto it = interned.find(std::string(value));
+  if (it != interned.end()) {
+    return it->second;
+  }
+  LibraryCache::StringRef ref = {(uint32_t)strings.size(),
+                                 (uint32_t)value.size()};
+  strings.append(value);
+  interned.emplace(std::string(value), ref);
+  return ref;
+}
+
+void LibraryCacheWriter::addPlaylist(std::string_view id,
+                                     std::string_view name,
+                                     std::string_view snapshot_id) {
+  LibraryCache::PlaylistRecord record;
+  record.id = intern(id);
+  record.name = intern(name);
+  record.snapshot_id = intern(snapshot_id);
+  record.first_track = tracks.size();
+  record.track_count = 0;
+  playlists.push_back(record);
+}
+
+void LibraryCacheWriter::addTrack(std::string_view id, std::string_view name,
+                                  std::string_view artist,
+                                  std::string_view album, std::string_view uri,
+                                  uint64_t duration_ms, uint64_t added_at) {
+  LibraryCache::TrackRecord record;
+  record.id = intern(id);
+  record.name = intern(name);
+  record.artist = intern(artist);
+  record.album = intern(album);
+  record.uri = intern(uri);
+  record.duration_ms = duration_ms;
+  record.added_at = added_at;
+  tracks.push_back(record);
+  ++playlists.back().track_count;
+}
+
+bool LibraryCacheWriter::save(const std::string &path) {
+  LibraryCache::Header header = {};
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = LibraryCache::VERSION;
+  header.playlist_count = playlists.size();
+  header.track_count = tracks.size();
+  header.strings_size = strings.size();
+
+  std::string tmp_path = path + ".tmp";
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    std::cerr << "Failed to write library cache: " << tmp_path << std::endl;
+    return false;
+  }
+  bool ok =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(playlists.data(), sizeof(LibraryCache::PlaylistRecord),
+             playlists.size(), file) == playlists.size() &&
+      fwrite(tracks.data(), sizeof(LibraryCache::TrackRecord), tracks.size(),
+             file) == tracks.size() &&
+      fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to write library cache: " << path << std::endl;
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,113 @@
+#include "library_loader.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+const int PAGE_SIZE = 100;
+
+// A single page request
+struct PageTask {
+  size_t playlist; // Index into the playlist list
+  int offset;      // Offset of the first track on the page
+};
+
+// Pages fetched so far for one playlist
+struct PlaylistPages {
+  int scheduled = 0;                       // End offset of scheduled pages
+  bool failed = false;                     // true if any page failed
+  std::map<int, std::vector<Track>> pages; // Fetched pages keyed by offset
+};
+
+} // namespace
+
+LibraryLoader::LibraryLoader(size_t concurrency)
+    : concurrency(std::max<size_t>(concurrency, 1)) {}
+
+std::vector<LoadedPlaylist>
+LibraryLoader::load(const std::vector<Playlist> &playlists) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<PageTask> queue;
+  std::vector<PlaylistPages> state(playlists.size());
+  size_t in_flight = 0;
+
+  // The playlist listing already reports the track count, so every page can be
+  // scheduled up front. The first page corrects the count if it was stale.
+  for (size_t i = 0; i < playlists.size(); ++i) {
+    int expected = std::max(playlists[i].track_count, 1);
+    for (int offset = 0; offset < expected; offset += PAGE_SIZE) {
+      queue.push_back({i, offset});
+    }
+    state[i].scheduled = queue.back().offset + PAGE_SIZE;
+  }
+
+  // Pages are requested with the priority of the thread asking for them
+  RequestPriority priority = RequestScheduler::currentPriority();
+
+  auto worker = [&]() {
+    RequestScheduler::PriorityScope scope(priority);
+    SpotifyAPI *api = SpotifyAPI::getInstance();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&]() { return !queue.empty() || in_flight == 0; });
+      if (queue.empty()) {
+        return;
+      }
+      PageTask task = queue.front();
+      queue.pop_front();
+      ++in_flight;
+      lock.unlock();
+
+      std::vector<Track> tracks;
+      int total = 0;
+      bool ok = api->getPlaylistTracksPage(playlists[task.playlist].id,
+                                           task.offset, PAGE_SIZE, tracks,
+                                           total);
+
+      lock.lock();
+      --in_flight;
+      PlaylistPages &pages = state[task.playlist];
+      if (ok) {
+        pages.pages[task.offset] = std::move(tracks);
+        // Schedule pages the playlist listing did not know about
+        for (; pages.scheduled < total; pages.scheduled += PAGE_SIZE) {
+          queue.push_back({task.playlist, pages.scheduled});
+        }
+      } else {
+        pages.failed = true;
+        std::cerr << "Failed to load tracks of playlist "
+                  << playlists[task.playlist].name << " at offset "
+                  << task.offset << std::endl;
+      }
+      cv.notify_all();
+    }
+  };
+
+  size_t thread_count = std::min(concurrency, queue.size());
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count);
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back(worker);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // Merge the pages of each playlist in offset order
+  std::vector<LoadedPlaylist> result(playlists.size());
+  for (size_t i = 0; i < playlists.size(); ++i) {
+    std::vector<Track> &tracks = result[i].tracks;
+    for (auto &page : state[i].pages) {
+      tracks.insert(tracks.end(), std::make_move_iterator(page.second.begin()),
+                    std::make_move_iterator(page.second.end()));
+    }
+    result[i].complete = !state[i].failed;
+  }
+  return result;
+}
@@ -1,36 +1,164 @@
 #include "spotify_api.h"
 #include "spotify_fs.h"
-#include <fuse.h>
+#include <cstddef>
+#include <cstdlib>
+#include <fuse/fuse_lowlevel.h>
 #include <iostream>
+#include <string>
+#include <unistd.h>
 
-// Define the operations for our file system.
-static struct fuse_operations spotify_oper = {
-    .getattr = SpotifyFileSystem::getFileAttributes,
-    .readdir = SpotifyFileSystem::listFiles,
-    .open = SpotifyFileSystem::openFile,
-    .read = SpotifyFileSystem::readFile,
-    .mkdir = SpotifyFileSystem::createFolder,
-    .unlink = SpotifyFileSystem::removeFile,
-    .write = SpotifyFileSystem::writeFile,
-    .truncate = SpotifyFileSystem::truncateFile,
-    .create = SpotifyFileSystem::createFile,
+// Define the operations for our file system. The low-level API lets the
+// kernel cache entries by inode instead of resolving full paths every time.
+static const struct fuse_lowlevel_ops spotify_ll_oper = {
+    .destroy = SpotifyFileSystem::destroy,
+    .lookup = SpotifyFileSystem::spotify_ll_lookup,
+    .forget = SpotifyFileSystem::spotify_ll_forget,
+    .getattr = SpotifyFileSystem::spotify_ll_getattr,
+    .setattr = SpotifyFileSystem::spotify_ll_setattr,
+    .readlink = SpotifyFileSystem::spotify_ll_readlink,
+    .mkdir = SpotifyFileSystem::spotify_ll_mkdir,
+    .unlink = SpotifyFileSystem::spotify_ll_unlink,
+    .rename = SpotifyFileSystem::spotify_ll_rename,
+    .open = SpotifyFileSystem::spotify_ll_open,
+    .read = SpotifyFileSystem::spotify_ll_read,
+    .write = SpotifyFileSystem::spotify_ll_write,
+    .release = SpotifyFileSystem::spotify_ll_release,
+    .fsync = SpotifyFileSystem::spotify_ll_fsync,
+    .readdir = SpotifyFileSystem::spotify_ll_readdir,
+    .create = SpotifyFileSystem::spotify_ll_create,
+    .forget_multi = SpotifyFileSystem::spotify_ll_forget_multi,
+};
+
+#define SPOTIFY_OPT(t, p) {t, offsetof(struct spotify_options, p), 0}
+
+// Mount options consumed by SpotifyFS itself
+static const struct fuse_opt spotify_opts[] = {
+    SPOTIFY_OPT("load_concurrency=%d", load_concurrency),
+    SPOTIFY_OPT("cache_dir=%s", cache_dir),
+    SPOTIFY_OPT("api_url=%s", api_url),
+    SPOTIFY_OPT("client_id=%s", client_id),
+    SPOTIFY_OPT("auth_url=%s", auth_url),
+    SPOTIFY_OPT("redirect_port=%d", redirect_port),
+    SPOTIFY_OPT("token_file=%s", token_file),
+    SPOTIFY_OPT("connect_timeout=%d", connect_timeout),
+    SPOTIFY_OPT("http_timeout=%d", http_timeout),
+    SPOTIFY_OPT("rate_limit=%lf", rate_limit),
+    SPOTIFY_OPT("max_retries=%d", max_retries),
+    SPOTIFY_OPT("flush_delay=%d", flush_delay),
+    SPOTIFY_OPT("import_concurrency=%d", import_concurrency),
+    SPOTIFY_OPT("search_cache=%d", search_cache_size),
+    SPOTIFY_OPT("search_ttl=%d", search_ttl),
+    SPOTIFY_OPT("sync_interval=%d", sync_interval),
+    SPOTIFY_OPT("entry_timeout=%lf", entry_timeout),
+    SPOTIFY_OPT("attr_timeout=%lf", attr_timeout),
+    SPOTIFY_OPT("negative_timeout=%lf", negative_timeout),
+    SPOTIFY_OPT("playback=%d", playback),
+    SPOTIFY_OPT("trace=%s", trace),
+    SPOTIFY_OPT("liked_songs=%d", liked_songs),
+    FUSE_OPT_END,
 };
 
 // Main function.
 int main(int argc, char *argv[]) {
-  int ret;
+  int ret = -1;
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+  // Parse SpotifyFS options, leaving the rest for FUSE
+  struct spotify_options options = {};
+  options.load_concurrency = 8;
+  options.redirect_port = 3000;
+  options.connect_timeout = 5000;
+  options.http_timeout = 30000;
+  options.rate_limit = 10.0;
+  options.max_retries = 5;
+  options.flush_delay = 200;
+  options.import_concurrency = 8;
+  options.search_cache_size = 4096;
+  options.search_ttl = 3600;
+  options.sync_interval = 30;
+  // Changes made by sync are pushed to the kernel, so entries can be cached
+  // for long
+  options.entry_timeout = 300.0;
+  options.attr_timeout = 300.0;
+  options.negative_timeout = 30.0;
+  options.playback = 1;
+  options.liked_songs = 1;
+  if (fuse_opt_parse(&args, &options, spotify_opts, nullptr) == -1) {
+    return -1;
+  }
+  char *mountpoint = nullptr;
+  int multithreaded = 0, foreground = 0;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) ==
+          -1 ||
+      !mountpoint) {
+    std::cerr << "Usage: " << argv[0] << " mountpoint [options]" << std::endl;
+    fuse_opt_free_args(&args);
+    return -1;
+  }
+
+  // Daemonizing changes to /, so a relative trace path is resolved first
+  std::string trace_path;
+  if (options.trace && options.trace[0] != '/') {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd))) {
+      trace_path = std::string(cwd) + "/" + options.trace;
+      options.trace = trace_path.c_str();
+    }
+  }
+
   // Initialize Spotify filesystem with access token
-  auto client_id = "";
-  if (!SpotifyAPI::init(client_id)) {
+  HttpConfig http_config;
+  if (options.api_url) {
+    http_config.base_url = options.api_url;
+  }
+  http_config.connect_timeout_ms = options.connect_timeout;
+  http_config.timeout_ms = options.http_timeout;
+
+  SchedulerConfig scheduler_config;
+  scheduler_config.rate = options.rate_limit;
+  scheduler_config.burst = 2 * options.rate_limit;
+  scheduler_config.max_retries = options.max_retries;
+
+  AuthConfig auth_config;
+  auth_config.client_id = options.client_id ? options.client_id : "";
+  if (options.auth_url) {
+    auth_config.accounts_url = options.auth_url;
+  }
+  auth_config.redirect_port = options.redirect_port;
+  if (options.token_file) {
+    auth_config.token_file = options.token_file;
+  }
+  auth_config.timeout_ms = options.http_timeout;
+
+  if (!SpotifyAPI::init(auth_config, http_config, scheduler_config)) {
     std::cerr << "Failed to initialize SpotifyAPI" << std::endl;
+    free(mountpoint);
+    fuse_opt_free_args(&args);
     return -1;
   }
 
-  SpotifyFileSystem::init();
-  ret = fuse_main(args.argc, args.argv, &spotify_oper, nullptr);
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch) {
+    struct fuse_session *se = fuse_lowlevel_new(
+        &args, &spotify_ll_oper, sizeof(spotify_ll_oper), nullptr);
+    if (se && fuse_set_signal_handlers(se) != -1) {
+      fuse_session_add_chan(se, ch);
+      SpotifyFileSystem::setChannel(ch);
+      // Daemonize before starting the threads of the file system
+      fuse_daemonize(foreground);
+      SpotifyFileSystem::init(options);
+      ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+      SpotifyFileSystem::setChannel(nullptr);
+      fuse_remove_signal_handlers(se);
+      fuse_session_remove_chan(ch);
+    }
+    if (se) {
+      fuse_session_destroy(se); // Calls destroy
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
   fuse_opt_free_args(&args);
 
   return ret;
-}
\ No newline at end of file
+}
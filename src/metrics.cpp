@@ -0,0 +1,307 @@
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Log-linear latency histogram in nanoseconds: 8 buckets per power of two,
+// so a bucket is at most 12.5% wide. Only the owning thread writes, the
+// atomics let render() read while it does.
+struct Histogram {
+  static constexpr int SUB_BUCKETS = 8;
+  static constexpr int MAX_EXPONENT = 37; // 2^37 ns is about 137 s
+  static constexpr size_t BUCKETS = (MAX_EXPONENT - 2) * SUB_BUCKETS;
+
+  std::atomic<uint64_t> buckets[BUCKETS] = {};
+  std::atomic<uint64_t> sum_ns{0};
+
+  static size_t bucketOf(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+      return ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= MAX_EXPONENT) {
+      return BUCKETS - 1;
+    }
+    return (exponent - 2) * SUB_BUCKETS +
+           ((ns >> (exponent - 3)) & (SUB_BUCKETS - 1));
+  }
+
+  // Smallest value of bucket `i`
+  static uint64_t lowerBound(size_t i) {
+    if (i < SUB_BUCKETS) {
+      return i;
+    }
+    int exponent = i / SUB_BUCKETS + 2;
+    return (SUB_BUCKETS + i % SUB_BUCKETS) << (exponent - 3);
+  }
+
+  void record(uint64_t ns) {
+    auto &bucket = buckets[bucketOf(ns)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+    sum_ns.store(sum_ns.load(std::memory_order_relaxed) + ns,
+                 std::memory_order_relaxed);
+  }
+};
+
+// Histogram summed over all threads
+struct Snapshot {
+  uint64_t buckets[Histogram::BUCKETS] = {};
+  uint64_t sum_ns = 0;
+  uint64_t count = 0;
+
+  void add(const Histogram &histogram) {
+    for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+      uint64_t n = histogram.buckets[i].load(std::memory_order_relaxed);
+      buckets[i] += n;
+      count += n;
+    }
+    sum_ns += histogram.sum_ns.load(std::memory_order_relaxed);
+  }
+
+  // Observations below `ns`, counting only buckets entirely below it
+  uint64_t below(uint64_t ns) const {
+    uint64_t n = 0;
+    for (size_t i = 0; i + 1 < Histogram::BUCKETS &&
+                       Histogram::lowerBound(i + 1) <= ns;
+         ++i) {
+      n += buckets[i];
+    }
+    return n;
+  }
+
+  // Upper bound of the bucket holding the `q` quantile
+  uint64_t quantile(double q) const {
+    uint64_t rank = static_cast<uint64_t>(q * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i + 1 < Histogram::BUCKETS; ++i) {
+      seen += buckets[i];
+      if (seen > rank) {
+        return Histogram::lowerBound(i + 1);
+      }
+    }
+    return Histogram::lowerBound(Histogram::BUCKETS - 1);
+  }
+};
+
+struct ThreadMetrics {
+  std::atomic<int64_t> counters[static_cast<int>(Counter::count)] = {};
+  Histogram fuse[static_cast<int>(FuseOp::count)];
+  Histogram api[static_cast<int>(ApiEndpoint::count)];
+  Histogram stages[static_cast<int>(Stage::count)];
+};
+
+// Blocks of all threads that ever recorded. The block of a thread that
+// exits is handed to the next new thread, so its counts are kept and FUSE
+// worker threads coming and going do not grow the list.
+std::mutex registry_mutex;
+std::vector<ThreadMetrics *> blocks;
+std::vector<ThreadMetrics *> unused_blocks;
+
+struct ThreadSlot {
+  ThreadMetrics *block = nullptr;
+
+  ~ThreadSlot() {
+    if (block) {
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      unused_blocks.push_back(block);
+    }
+  }
+};
+
+thread_local ThreadSlot slot;
+
+ThreadMetrics &local() {
+  if (!slot.block) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (!unused_blocks.empty()) {
+      slot.block = unused_blocks.back();
+      unused_blocks.pop_back();
+    } else {
+      slot.block = new ThreadMetrics();
+      blocks.push_back(slot.block);
+    }
+  }
+  return *slot.block;
+}
+
+struct CounterInfo {
+  const char *name;
+  const char *type;
+  const char *help;
+};
+
+const CounterInfo COUNTERS[] = {
+    {"spotifyfs_search_cache_hits_total", "counter",
+     "Track searches answered from the cache"},
+    {"spotifyfs_search_cache_misses_total", "counter",
+     "Track searches sent to the Web API"},
+    {"spotifyfs_index_cache_hits_total", "counter",
+     "Index files served without generating them"},
+    {"spotifyfs_index_cache_misses_total", "counter",
+     "Index files generated"},
+    {"spotifyfs_playlists_from_cache_total", "counter",
+     "Playlists loaded from the library cache"},
+    {"spotifyfs_playlists_from_api_total", "counter",
+     "Playlists loaded from the Web API"},
+    {"spotifyfs_http_requests_total", "counter",
+     "HTTP requests sent, retries included"},
+    {"spotifyfs_http_errors_total", "counter",
+     "HTTP requests that failed or returned an error status"},
+    {"spotifyfs_http_sent_bytes_total", "counter",
+     "Bytes of request bodies sent"},
+    {"spotifyfs_http_received_bytes_total", "counter",
+     "Bytes of response bodies received"},
+    {"spotifyfs_api_retries_total", "counter",
+     "Requests repeated after a 429, 5xx or transport error"},
+    {"spotifyfs_api_rate_limited_total", "counter",
+     "Requests answered with 429 Too Many Requests"},
+    {"spotifyfs_api_unauthorized_total", "counter",
+     "Requests answered with 401 Unauthorized"},
+    {"spotifyfs_token_refreshes_total", "counter",
+     "Access tokens refreshed"},
+    {"spotifyfs_token_refresh_errors_total", "counter",
+     "Access token refreshes that failed"},
+    {"spotifyfs_http_requests_in_flight", "gauge",
+     "HTTP requests currently running"},
+    {"spotifyfs_search_index_tracks", "gauge",
+     "Tracks in the search index of /.search"},
+    {"spotifyfs_search_index_bytes", "gauge",
+     "Memory used by the search index of /.search"},
+};
+static_assert(sizeof(COUNTERS) / sizeof(COUNTERS[0]) ==
+                  static_cast<size_t>(Counter::count),
+              "Every counter needs a name");
+
+// Bucket bounds exported to Prometheus, in seconds
+const double BOUNDS[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5,
+                         1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+                         1e-2, 2.5e-2, 5e-2, 0.1,  0.25,   0.5,
+                         1,    2.5,    5,    10,   30,     60};
+
+void appendf(std::string &out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void appendf(std::string &out, const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+// One histogram family with a series for each label value that was
+// recorded, followed by a gauge family of its quantiles
+template <size_t N>
+void renderHistograms(std::string &out, const char *name, const char *help,
+                      const char *label, const char *const (&values)[N],
+                      Histogram (ThreadMetrics::*histograms)[N]) {
+  std::vector<Snapshot> snapshots(N);
+  for (ThreadMetrics *block : blocks) {
+    for (size_t i = 0; i < N; ++i) {
+      snapshots[i].add((block->*histograms)[i]);
+    }
+  }
+
+  appendf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (size_t i = 0; i < N; ++i) {
+    const Snapshot &snapshot = snapshots[i];
+    if (snapshot.count == 0) {
+      continue;
+    }
+    for (double bound : BOUNDS) {
+      appendf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", name, label,
+              values[i], bound,
+              static_cast<unsigned long long>(
+                  snapshot.below(static_cast<uint64_t>(bound * 1e9))));
+    }
+    appendf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label,
+            values[i], static_cast<unsigned long long>(snapshot.count));
+    appendf(out, "%s_sum{%s=\"%s\"} %.9f\n", name, label, values[i],
+            snapshot.sum_ns / 1e9);
+    appendf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, values[i],
+            static_cast<unsigned long long>(snapshot.count));
+  }
+
+  appendf(out, "# HELP %s_quantile %s, quantiles\n# TYPE %s_quantile gauge\n",
+          name, help, name);
+  for (size_t i = 0; i < N; ++i) {
+    const Snapshot &snapshot = snapshots[i];
+    if (snapshot.count == 0) {
+      continue;
+    }
+    for (double q : {0.5, 0.99, 0.999}) {
+      appendf(out, "%s_quantile{%s=\"%s\",quantile=\"%g\"} %.9f\n", name,
+              label, values[i], q, snapshot.quantile(q) / 1e9);
+    }
+  }
+}
+
+// Ticks of Metrics::ticks() per nanosecond of steady_clock, counted over a
+// millisecond
+double measureTickRate() {
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start = Clock::now();
+  uint64_t first = Metrics::ticks();
+  Clock::time_point now;
+  do {
+    now = Clock::now();
+  } while (now - start < std::chrono::milliseconds(1));
+  uint64_t ticks = Metrics::ticks() - first;
+  double ns = std::chrono::duration<double, std::nano>(now - start).count();
+  return ticks > 0 ? ns / ticks : 1.0;
+}
+
+} // namespace
+
+const double Metrics::ns_per_tick = measureTickRate();
+
+void Metrics::add(Counter counter, int64_t value) {
+  auto &cell = local().counters[static_cast<int>(counter)];
+  cell.store(cell.load(std::memory_order_relaxed) + value,
+             std::memory_order_relaxed);
+}
+
+void Metrics::record(FuseOp op, uint64_t ns) {
+  local().fuse[static_cast<int>(op)].record(ns);
+}
+
+void Metrics::record(ApiEndpoint endpoint, uint64_t ns) {
+  local().api[static_cast<int>(endpoint)].record(ns);
+}
+
+void Metrics::record(Stage stage, uint64_t ns) {
+  local().stages[static_cast<int>(stage)].record(ns);
+}
+
+std::string Metrics::render() {
+  std::string out;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  for (int i = 0; i < static_cast<int>(Counter::count); ++i) {
+    int64_t total = 0;
+    for (ThreadMetrics *block : blocks) {
+      total += block->counters[i].load(std::memory_order_relaxed);
+    }
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", COUNTERS[i].name,
+            COUNTERS[i].help, COUNTERS[i].name, COUNTERS[i].type,
+            COUNTERS[i].name, static_cast<long long>(total));
+  }
+  renderHistograms(out, "spotifyfs_fuse_op_duration_seconds",
+                   "Time spent serving FUSE operations", "op",
+                   Metrics::FUSE_OPS, &ThreadMetrics::fuse);
+  renderHistograms(out, "spotifyfs_api_request_duration_seconds",
+                   "Time of Web API calls including retries", "endpoint",
+                   Metrics::API_ENDPOINTS, &ThreadMetrics::api);
+  renderHistograms(out, "spotifyfs_stage_duration_seconds",
+                   "Time spent in parts of API requests", "stage",
+                   Metrics::STAGES, &ThreadMetrics::stages);
+  return out;
+}
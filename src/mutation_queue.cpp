@@ -0,0 +1,250 @@
+#include "mutation_queue.h"
+#include "request_scheduler.h"
+#include "spotify_api.h"
+#include <algorithm>
+#include <iostream>
+
+MutationQueue::MutationQueue(std::chrono::milliseconds delay)
+    : delay(delay), timer(&MutationQueue::run, this) {}
+
+MutationQueue::~MutationQueue() { stop(); }
+
+void MutationQueue::add(const std::string &playlist_id, const std::string &uri,
+                        std::function<void()> undo) {
+  Mutation mutation;
+  mutation.kind = Mutation::Kind::add;
+  mutation.uri = uri;
+  mutation.undo = std::move(undo);
+  enqueue(playlist_id, std::move(mutation));
+}
+
+void MutationQueue::remove(const std::string &playlist_id,
+                           const std::string &uri,
+                           std::function<void()> undo) {
+  Mutation mutation;
+  mutation.kind = Mutation::Kind::remove;
+  mutation.uri = uri;
+  mutation.undo = std::move(undo);
+  enqueue(playlist_id, std::move(mutation));
+}
+
+void MutationQueue::move(const std::string &playlist_id, int range_start,
+                         int insert_before, std::function<void()> undo) {
+  Mutation mutation;
+  mutation.kind = Mutation::Kind::move;
+  mutation.range_start = range_start;
+  mutation.range_length = 1;
+  mutation.insert_before = insert_before;
+  mutation.undo = std::move(undo);
+  enqueue(playlist_id, std::move(mutation));
+}
+
+bool MutationQueue::extend(Mutation &queued, Mutation &next) {
+  if (queued.kind != Mutation::Kind::move ||
+      next.kind != Mutation::Kind::move || next.range_length != 1) {
+    return false;
+  }
+  // After the queued move its range is at `block`, and the track that
+  // followed the range is at `follower`. Moving that track to the end of
+  // the block is the same as moving a range one longer in the first place.
+  int start = queued.range_start, length = queued.range_length;
+  int before = queued.insert_before;
+  int block = before < start ? before : before - length;
+  int follower = before < start ? start + length : start;
+  int end = before < start ? block + length : before;
+  if (next.range_start != follower || next.insert_before != end) {
+    return false;
+  }
+  ++queued.range_length;
+  // Undone in the opposite order
+  queued.undo = [first = std::move(queued.undo),
+                 second = std::move(next.undo)]() {
+    second();
+    first();
+  };
+  return true;
+}
+
+void MutationQueue::enqueue(const std::string &playlist_id,
+                            Mutation mutation) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Pending &queued = pending[playlist_id];
+
+  if (mutation.kind == Mutation::Kind::move) {
+    if (!queued.mutations.empty() &&
+        extend(queued.mutations.back(), mutation)) {
+      return;
+    }
+  } else {
+    // Adding and then removing a track (or the other way around) before
+    // either was sent leaves the playlist unchanged, unless a move in
+    // between counted the track in its positions
+    auto opposite = std::find_if(
+        queued.mutations.rbegin(), queued.mutations.rend(),
+        [&mutation](const Mutation &other) {
+          return other.kind == Mutation::Kind::move ||
+                 (other.uri == mutation.uri && other.kind != mutation.kind);
+        });
+    if (opposite != queued.mutations.rend() &&
+        opposite->kind != Mutation::Kind::move) {
+      queued.mutations.erase(std::next(opposite).base());
+      if (queued.mutations.empty()) {
+        pending.erase(playlist_id);
+      }
+      return;
+    }
+  }
+
+  if (queued.mutations.empty()) {
+    queued.due = Clock::now() + delay;
+    cv.notify_all();
+  }
+  queued.mutations.push_back(std::move(mutation));
+}
+
+bool MutationQueue::flush(const std::string &playlist_id) {
+  std::lock_guard<std::mutex> flush_lock(flush_mutex);
+
+  std::vector<Mutation> mutations;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pending.find(playlist_id);
+    if (it == pending.end()) {
+      return true;
+    }
+    mutations = std::move(it->second.mutations);
+    pending.erase(it);
+    ++flushing[playlist_id];
+  }
+
+  // Consecutive additions or removals go out together, up to BATCH_SIZE
+  // per request, so the order of the changes is kept. A move is a request
+  // of its own.
+  SpotifyAPI *api = SpotifyAPI::getInstance();
+  bool success = true;
+  size_t start = 0;
+  while (start < mutations.size()) {
+    const Mutation &first = mutations[start];
+    size_t end = start;
+    bool sent;
+    const char *verb;
+    size_t count;
+    if (first.kind == Mutation::Kind::move) {
+      sent = api->reorderPlaylistTracks(playlist_id, first.range_start,
+                                        first.insert_before,
+                                        first.range_length);
+      verb = "move ";
+      count = first.range_length;
+      ++end;
+    } else {
+      std::vector<std::string> uris;
+      while (end < mutations.size() && mutations[end].kind == first.kind &&
+             uris.size() < BATCH_SIZE) {
+        uris.push_back(mutations[end].uri);
+        ++end;
+      }
+      bool is_add = first.kind == Mutation::Kind::add;
+      sent = is_add ? api->addTracksToPlaylist(playlist_id, uris)
+                    : api->removeTracksFromPlaylist(playlist_id, uris);
+      verb = is_add ? "add " : "remove ";
+      count = uris.size();
+    }
+    if (!sent) {
+      std::cerr << "Failed to " << verb << count << " tracks, rolling back"
+                << std::endl;
+      for (size_t i = start; i < end; ++i) {
+        mutations[i].undo();
+      }
+      success = false;
+    }
+    start = end;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (--flushing[playlist_id] == 0) {
+    flushing.erase(playlist_id);
+  }
+  return success;
+}
+
+bool MutationQueue::hasPending(const std::string &playlist_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return pending.count(playlist_id) || flushing.count(playlist_id);
+}
+
+bool MutationQueue::hasPendingTracks(const std::string &playlist_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pending.find(playlist_id);
+  return it != pending.end() &&
+         std::any_of(it->second.mutations.begin(), it->second.mutations.end(),
+                     [](const Mutation &mutation) {
+                       return mutation.kind != Mutation::Kind::move;
+                     });
+}
+
+void MutationQueue::flushSoon(const std::string &playlist_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pending.find(playlist_id);
+  if (it != pending.end()) {
+    it->second.due = Clock::now();
+    cv.notify_all();
+  }
+}
+
+void MutationQueue::run() {
+  // Timer flushes are bulk work and must not delay interactive requests
+  RequestScheduler::PriorityScope scope(RequestPriority::background);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    auto now = Clock::now();
+    auto next = Clock::time_point::max();
+    std::vector<std::string> due;
+    for (const auto &queued : pending) {
+      if (queued.second.due <= now) {
+        due.push_back(queued.first);
+      } else {
+        next = std::min(next, queued.second.due);
+      }
+    }
+
+    if (due.empty()) {
+      if (next == Clock::time_point::max()) {
+        cv.wait(lock);
+      } else {
+        cv.wait_until(lock, next);
+      }
+      continue;
+    }
+
+    lock.unlock();
+    for (const auto &playlist_id : due) {
+      flush(playlist_id);
+    }
+    lock.lock();
+  }
+}
+
+void MutationQueue::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+      return;
+    }
+    stopping = true;
+    cv.notify_all();
+  }
+  timer.join();
+
+  // Send whatever is left before unmounting
+  std::vector<std::string> playlist_ids;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &queued : pending) {
+      playlist_ids.push_back(queued.first);
+    }
+  }
+  for (const auto &playlist_id : playlist_ids) {
+    flush(playlist_id);
+  }
+}
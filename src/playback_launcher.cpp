@@ -0,0 +1,96 @@
+#include "playback_launcher.h"
+#include <cstring>
+#include <iostream>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+PlaybackLauncher::PlaybackLauncher(std::string command,
+                                   std::chrono::milliseconds debounce)
+    : command(std::move(command)), debounce(debounce) {
+  dispatcher = std::thread(&PlaybackLauncher::run, this);
+}
+
+PlaybackLauncher::~PlaybackLauncher() { stop(); }
+
+void PlaybackLauncher::launch(const std::string &uri) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (stopping) {
+    return;
+  }
+  auto it = recent.find(uri);
+  if (it != recent.end() && now - it->second < debounce) {
+    ++skipped_count;
+    return;
+  }
+  // Forget launches that can no longer suppress anything
+  while (!expiry.empty() && now - expiry.front().first >= debounce) {
+    auto expired = recent.find(expiry.front().second);
+    if (expired != recent.end() && expired->second == expiry.front().first) {
+      recent.erase(expired);
+    }
+    expiry.pop_front();
+  }
+  recent[uri] = now;
+  expiry.emplace_back(now, uri);
+  if (queue.size() == MAX_QUEUED) {
+    queue.pop_front(); // The newest open is the one the user waits for
+    ++skipped_count;
+  }
+  queue.push_back(uri);
+  cv.notify_one();
+}
+
+void PlaybackLauncher::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    queue.clear();
+    cv.notify_all();
+  }
+  if (dispatcher.joinable()) {
+    dispatcher.join();
+  }
+}
+
+size_t PlaybackLauncher::launched() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return launched_count;
+}
+
+size_t PlaybackLauncher::skipped() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return skipped_count;
+}
+
+void PlaybackLauncher::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+    if (stopping) {
+      return;
+    }
+    std::string uri = std::move(queue.front());
+    queue.pop_front();
+    ++launched_count;
+    lock.unlock();
+
+    char *argv[] = {const_cast<char *>(command.c_str()),
+                    const_cast<char *>(uri.c_str()), nullptr};
+    pid_t pid;
+    int err = posix_spawnp(&pid, command.c_str(), nullptr, nullptr, argv,
+                           environ);
+    if (err != 0) {
+      std::cerr << "Failed to run " << command << ": " << strerror(err)
+                << std::endl;
+    } else {
+      // The launcher hands the URI to the client and exits quickly
+      int status;
+      waitpid(pid, &status, 0);
+    }
+
+    lock.lock();
+  }
+}
@@ -0,0 +1,84 @@
+#include "request_scheduler.h"
+#include "metrics.h"
+#include <algorithm>
+#include <iostream>
+
+static thread_local RequestPriority thread_priority =
+    RequestPriority::interactive;
+
+RequestScheduler::PriorityScope::PriorityScope(RequestPriority priority)
+    : previous(thread_priority) {
+  thread_priority = priority;
+}
+
+RequestScheduler::PriorityScope::~PriorityScope() {
+  thread_priority = previous;
+}
+
+RequestPriority RequestScheduler::currentPriority() { return thread_priority; }
+
+RequestScheduler::RequestScheduler(SchedulerConfig config)
+    : config(config), tokens(config.burst), last_refill(Clock::now()),
+      paused_until(Clock::now()), random(std::random_device{}()) {
+  this->config.rate = std::max(this->config.rate, 0.1);
+  this->config.burst = std::max(this->config.burst, 1.0);
+}
+
+bool RequestScheduler::tryAcquire(Clock::time_point now,
+                                  Clock::time_point &next) {
+  if (now < paused_until) {
+    next = paused_until;
+    return false;
+  }
+  std::chrono::duration<double> elapsed = now - last_refill;
+  tokens = std::min(config.burst, tokens + elapsed.count() * config.rate);
+  last_refill = now;
+  if (tokens >= 1.0) {
+    tokens -= 1.0;
+    return true;
+  }
+  next = now + std::chrono::duration_cast<Clock::duration>(
+                   std::chrono::duration<double>((1.0 - tokens) /
+                                                 config.rate));
+  return false;
+}
+
+std::chrono::milliseconds RequestScheduler::backoff(int attempt) {
+  long delay = std::min(config.max_backoff_ms, 500L << std::min(attempt, 16));
+  // Add up to 25% jitter so that retries of parallel requests spread out
+  long jitter = std::uniform_int_distribution<long>(0, delay / 4)(random);
+  return std::chrono::milliseconds(delay + jitter);
+}
+
+bool RequestScheduler::shouldRetry(long status_code, long retry_after,
+                                   int attempt, bool idempotent,
+                                   Clock::time_point now,
+                                   Clock::time_point &retry_at) {
+  bool throttled = status_code == 429;
+  if (throttled) {
+    Metrics::add(Counter::api_rate_limited);
+  }
+  bool transient = idempotent && (status_code == 0 || status_code >= 500);
+  if ((!throttled && !transient) || attempt >= config.max_retries) {
+    return false;
+  }
+  Metrics::add(Counter::api_retries);
+
+  if (!throttled) {
+    retry_at = now + backoff(attempt);
+    return true;
+  }
+  // Retry-After is given in seconds and honoured as is, retrying earlier
+  // only earns more 429s; fall back to backoff without it. The pause holds
+  // back all requests, this one is sent once it is over.
+  std::chrono::milliseconds delay = backoff(attempt);
+  if (retry_after > 0) {
+    delay = std::chrono::seconds(
+        std::min(retry_after, config.max_retry_after_s));
+  }
+  std::cerr << "Rate limited, pausing requests for " << delay.count()
+            << " ms" << std::endl;
+  paused_until = std::max(paused_until, now + delay);
+  retry_at = now;
+  return true;
+}
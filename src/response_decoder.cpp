@@ -0,0 +1,113 @@
+#include "response_decoder.h"
+#include <charconv>
+#include <cstdio>
+#include <ctime>
+
+namespace {
+
+template <typename T> T toNumber(std::string_view text) {
+  T value = 0;
+  std::from_chars(text.data(), text.data() + text.size(), value);
+  return value;
+}
+
+// Parses a UTC timestamp like "2023-05-01T12:00:00Z", 0 if malformed
+time_t toTime(std::string_view text) {
+  std::string value(text);
+  struct tm tm = {};
+  if (sscanf(value.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+             &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+    return 0;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm);
+}
+
+} // namespace
+
+TrackDecoder::TrackDecoder(Source source) : source(source), stream(projection) {
+  std::string prefix;
+  switch (source) {
+  case Source::playlist_page:
+    projection.element("items[]", [this]() { tracks.emplace_back(); });
+    projection.field("total", [this](std::string_view value) {
+      total = toNumber<int>(value);
+    });
+    projection.field("items[].added_at", [this](std::string_view value) {
+      tracks.back().added_at = toTime(value);
+    });
+    prefix = "items[].track.";
+    break;
+  case Source::search:
+    projection.element("tracks.items[]", [this]() { tracks.emplace_back(); });
+    prefix = "tracks.items[].";
+    break;
+  case Source::track:
+    tracks.emplace_back();
+    break;
+  }
+
+  // The setters fill the track of the current element. A playlist item whose
+  // track is null (such as a removed local file) yields an empty track.
+  projection.field(prefix + "id", [this](std::string_view value) {
+    tracks.back().id = value;
+  });
+  projection.field(prefix + "name", [this](std::string_view value) {
+    tracks.back().name = value;
+  });
+  projection.field(prefix + "artists[].name", [this](std::string_view value) {
+    if (tracks.back().artist.empty()) {
+      tracks.back().artist = value; // The first artist names the track
+    }
+  });
+  projection.field(prefix + "album.name", [this](std::string_view value) {
+    tracks.back().album = value;
+  });
+  projection.field(prefix + "duration_ms", [this](std::string_view value) {
+    tracks.back().duration_ms = toNumber<size_t>(value);
+  });
+  projection.field(prefix + "uri", [this](std::string_view value) {
+    tracks.back().uri = value;
+  });
+}
+
+void TrackDecoder::reset() {
+  tracks.clear();
+  total = 0;
+  if (source == Source::track) {
+    tracks.emplace_back();
+  }
+  projection.reset();
+  stream.reset();
+}
+
+PlaylistDecoder::PlaylistDecoder() : stream(projection) {
+  projection.element("items[]", [this]() { playlists.emplace_back(); });
+  projection.field("total", [this](std::string_view value) {
+    total = toNumber<int>(value);
+  });
+  projection.field("items[].id", [this](std::string_view value) {
+    playlists.back().id = value;
+  });
+  projection.field("items[].name", [this](std::string_view value) {
+    playlists.back().name = value;
+  });
+  projection.field("items[].owner.display_name",
+                   [this](std::string_view value) {
+                     playlists.back().owner = value;
+                   });
+  projection.field("items[].snapshot_id", [this](std::string_view value) {
+    playlists.back().snapshot_id = value;
+  });
+  projection.field("items[].tracks.total", [this](std::string_view value) {
+    playlists.back().track_count = toNumber<int>(value);
+  });
+}
+
+void PlaylistDecoder::reset() {
+  playlists.clear();
+  total = 0;
+  projection.reset();
+  stream.reset();
+}
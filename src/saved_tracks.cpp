@@ -0,0 +1,53 @@
+#include "saved_tracks.h"
+#include <iterator>
+
+SavedTracksPager::SavedTracksPager(int page_size) : page_size(page_size) {}
+
+bool SavedTracksPager::next(std::vector<Track> &tracks) {
+  if (pending.empty()) {
+    if (complete()) {
+      return false;
+    }
+    request();
+  }
+  Page page = std::move(pending.front());
+  pending.pop_front();
+  std::optional<TracksPage> result = page.done.get();
+  if (!result) {
+    // The pages after it are dropped too, so that they are handed out in
+    // order once it succeeds
+    pending.clear();
+    requested = taken;
+    return false;
+  }
+  total = result->total;
+  taken = page.offset + page_size;
+  tracks.insert(tracks.end(), std::make_move_iterator(result->tracks.begin()),
+                std::make_move_iterator(result->tracks.end()));
+  return true;
+}
+
+void SavedTracksPager::prefetch(size_t pages) {
+  // Before the first page arrived the total is unknown, only that page is
+  // requested
+  while (pending.size() < pages &&
+         (total >= 0 ? requested < total : requested == 0)) {
+    request();
+  }
+}
+
+void SavedTracksPager::request() {
+  Page page;
+  page.offset = requested;
+  page.done =
+      SpotifyAPI::getInstance()->getSavedTracksPageAsync(requested, page_size);
+  requested += page_size;
+  pending.push_back(std::move(page));
+}
+
+void SavedTracksPager::reset() {
+  pending.clear();
+  requested = 0;
+  taken = 0;
+  total = -1;
+}
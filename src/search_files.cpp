@@ -0,0 +1,108 @@
+#include "spotify_fs.h"
+#include "epoch.h"
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+
+// Results listed per query; a query is meant to narrow the library down
+static const size_t SEARCH_LIMIT = 1000;
+
+int SpotifyFileSystem::searchPath(const char *path, std::string &query,
+                                  std::string &entry) {
+  static const char dir[] = "/.search";
+  const size_t len = sizeof(dir) - 1;
+  if (strncmp(path, dir, len) != 0) {
+    return 0;
+  }
+  if (path[len] == '\0') {
+    return 1;
+  }
+  if (path[len] != '/' || path[len + 1] == '\0') {
+    return 0;
+  }
+  const char *name = path + len + 1;
+  const char *slash = strchr(name, '/');
+  if (!slash) {
+    query = name;
+    return 2;
+  }
+  if (strchr(slash + 1, '/')) {
+    return 0;
+  }
+  query.assign(name, slash - name);
+  entry = slash + 1;
+  return 3;
+}
+
+bool SpotifyFileSystem::searchTarget(const std::string &query,
+                                     const std::string &entry,
+                                     std::string &target) {
+  if (entry.empty() || entry.back() != ']') {
+    return false;
+  }
+  // Track and playlist names may contain " [" themselves, every split is
+  // tried from the right
+  for (size_t open = entry.rfind(" ["); open != std::string::npos && open > 0;
+       open = entry.rfind(" [", open - 1)) {
+    std::string_view name(entry.data(), open);
+    spotify_file *playlist = lookupPlaylist(
+        std::string_view(entry).substr(open + 2, entry.size() - open - 3));
+    if (!playlist) {
+      continue;
+    }
+    // Only the name of the track itself is listed, not the ones it was
+    // created by
+    long track = lookupTrack(playlist, name);
+    if (track < 0 || track_table.name(track) != name ||
+        !search_index->matches(track, query)) {
+      continue;
+    }
+    target = "../../" + playlist->name() + "/" + std::string(name);
+    return true;
+  }
+  return false;
+}
+
+int SpotifyFileSystem::listSearch(const std::string &query, void *buf,
+                                  fuse_fill_dir_t filler, off_t offset) {
+  static const char *dots[] = {".", ".."};
+  for (off_t i = offset; i < 2; ++i) {
+    if (filler(buf, dots[i], NULL, i + 1)) {
+      return 0;
+    }
+  }
+  if (query.empty()) {
+    return 0; // Queries are not listed in /.search
+  }
+
+  // The results are looked up again by every call of a listing, they are
+  // listed in the same order as long as the library does not change
+  std::vector<search_hit> hits = search_index->search(query, SEARCH_LIMIT);
+  std::string name;
+  for (size_t i = offset > 2 ? offset - 2 : 0; i < hits.size(); ++i) {
+    name = track_table.name(hits[i].track);
+    name += " [";
+    name += hits[i].playlist->name();
+    name += ']';
+    if (filler(buf, name.c_str(), NULL, i + 3)) {
+      break;
+    }
+  }
+  return 0;
+}
+
+int SpotifyFileSystem::readLink(const char *path, char *buf, size_t size) {
+  Epoch::ReadGuard guard;
+  std::string query, entry, target;
+  if (searchPath(path, query, entry) != 3) {
+    return -EINVAL; // Results are the only symlinks
+  }
+  if (!searchTarget(query, entry, target)) {
+    return -ENOENT;
+  }
+  // Truncated to fit `buf` like readlink(2), but NUL-terminated
+  size_t len = std::min(target.size(), size - 1);
+  memcpy(buf, target.data(), len);
+  buf[len] = '\0';
+  return 0;
+}
@@ -0,0 +1,461 @@
+#include "search_index.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cctype>
+#include <string>
+
+namespace {
+
+// Bytes of a hash table node holding `Value`, with its link and hash
+template <typename Value>
+constexpr size_t NODE_BYTES = sizeof(Value) + 2 * sizeof(void *);
+
+// ASCII lower case of `c`
+char fold(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+uint32_t trigram(const char *text) {
+  return uint32_t(static_cast<unsigned char>(fold(text[0]))) << 16 |
+         uint32_t(static_cast<unsigned char>(fold(text[1]))) << 8 |
+         static_cast<unsigned char>(fold(text[2]));
+}
+
+// Whether `text` contains `word`, which is lower case, ignoring ASCII case
+bool contains(std::string_view text, std::string_view word) {
+  if (word.size() > text.size()) {
+    return false;
+  }
+  for (size_t i = 0; i + word.size() <= text.size(); ++i) {
+    size_t j = 0;
+    while (j < word.size() && fold(text[i + j]) == word[j]) {
+      ++j;
+    }
+    if (j == word.size()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Lower case words of `text`, split at whitespace
+std::vector<std::string> splitWords(std::string_view text) {
+  std::vector<std::string> result;
+  std::string word;
+  for (char c : text) {
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      if (!word.empty()) {
+        result.push_back(std::move(word));
+        word.clear();
+      }
+    } else {
+      word += fold(c);
+    }
+  }
+  if (!word.empty()) {
+    result.push_back(std::move(word));
+  }
+  return result;
+}
+
+// Heap memory of a string beyond the short string buffer
+size_t heapBytes(const std::string &text) {
+  return text.capacity() > 15 ? text.capacity() + 1 : 0;
+}
+
+// Appends `id` to sorted `postings` unless present, counting the growth
+void post(std::vector<uint32_t> &postings, uint32_t id, size_t &bytes) {
+  // IDs arrive in ascending order, mostly
+  auto pos = postings.end();
+  if (!postings.empty() && postings.back() >= id) {
+    pos = std::lower_bound(postings.begin(), postings.end(), id);
+    if (pos != postings.end() && *pos == id) {
+      return;
+    }
+  }
+  size_t capacity = postings.capacity();
+  postings.insert(pos, id);
+  bytes += (postings.capacity() - capacity) * sizeof(uint32_t);
+}
+
+// Sorted IDs in the postings of every trigram of `word`. The shortest list
+// is filtered by binary searches in the others.
+std::vector<uint32_t>
+intersect(const std::unordered_map<uint32_t, std::vector<uint32_t>> &map,
+          std::string_view word) {
+  std::vector<const std::vector<uint32_t> *> lists;
+  for (size_t i = 0; i + 3 <= word.size(); ++i) {
+    auto it = map.find(trigram(word.data() + i));
+    if (it == map.end()) {
+      return {};
+    }
+    lists.push_back(&it->second);
+  }
+  std::sort(lists.begin(), lists.end(), [](auto *a, auto *b) {
+    return a->size() < b->size();
+  });
+  lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+  std::vector<uint32_t> result;
+  for (uint32_t id : *lists.front()) {
+    bool everywhere = true;
+    for (size_t i = 1; i < lists.size() && everywhere; ++i) {
+      everywhere = std::binary_search(lists[i]->begin(), lists[i]->end(), id);
+    }
+    if (everywhere) {
+      result.push_back(id);
+    }
+  }
+  return result;
+}
+
+} // namespace
+
+SearchIndex::SearchIndex(const TrackTable &table) : table(table) {}
+
+SearchIndex::~SearchIndex() {
+  Metrics::add(Counter::search_index_bytes, -reported_bytes);
+  Metrics::add(Counter::search_index_tracks, -reported_tracks);
+}
+
+void SearchIndex::add(spotify_file *playlist,
+                      const std::vector<uint32_t> &tracks) {
+  std::lock_guard<std::mutex> lock(mutex);
+  indexNewTracks();
+  for (uint32_t track : tracks) {
+    if (track >= listed_in.size()) {
+      continue; // Not in the table
+    }
+    if (!listed_in[track]) {
+      listed_in[track] = playlist;
+    } else {
+      also_listed_in.emplace(track, playlist);
+      bytes += NODE_BYTES<std::pair<const uint32_t, spotify_file *>>;
+    }
+  }
+  reportMetrics();
+}
+
+void SearchIndex::remove(spotify_file *playlist,
+                         const std::vector<uint32_t> &tracks) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (uint32_t track : tracks) {
+    if (track >= listed_in.size()) {
+      continue;
+    }
+    // The first playlist is taken over by one of the others
+    auto range = also_listed_in.equal_range(track);
+    auto it = range.first;
+    if (listed_in[track] == playlist) {
+      listed_in[track] = it != range.second ? it->second : nullptr;
+    } else {
+      while (it != range.second && it->second != playlist) {
+        ++it;
+      }
+    }
+    if (it != range.second) {
+      also_listed_in.erase(it);
+      bytes -= NODE_BYTES<std::pair<const uint32_t, spotify_file *>>;
+    }
+  }
+  reportMetrics();
+}
+
+void SearchIndex::indexNewTracks() {
+  size_t count = table.size();
+  if (indexed == count) {
+    return;
+  }
+  listed_in.resize(count, nullptr);
+  for (uint32_t track = indexed; track < count; ++track) {
+    Postings track_words = addWords(title(track));
+    const TrackTable::Record &record = table.get(track);
+    for (uint32_t handle : {record.artist, record.album}) {
+      if (handle == StringInterner::EMPTY) {
+        continue;
+      }
+      // Strings are split into words once, with their first track
+      auto inserted = string_words.try_emplace(handle);
+      Postings &string = inserted.first->second;
+      if (inserted.second) {
+        string = addWords(table.str(handle));
+        string.shrink_to_fit();
+        bytes += NODE_BYTES<PostingMap::value_type> +
+                 string.capacity() * sizeof(uint32_t);
+      }
+      track_words.insert(track_words.end(), string.begin(), string.end());
+    }
+    for (uint32_t word : track_words) {
+      post(words[word].tracks, track, bytes);
+    }
+  }
+  indexed = count;
+}
+
+SearchIndex::Postings SearchIndex::addWords(std::string_view text) {
+  Postings ids;
+  for (std::string &text_word : splitWords(text)) {
+    auto it = word_ids.find(text_word);
+    if (it != word_ids.end()) {
+      ids.push_back(it->second);
+      continue;
+    }
+    uint32_t id = words.size();
+    words.push_back({std::move(text_word), {}});
+    const std::string &added = words.back().text;
+    word_ids.emplace(added, id);
+    bytes += NODE_BYTES<decltype(word_ids)::value_type> + heapBytes(added);
+    for (size_t i = 0; i + 3 <= added.size(); ++i) {
+      auto inserted = word_trigrams.try_emplace(trigram(added.data() + i));
+      if (inserted.second) {
+        bytes += NODE_BYTES<PostingMap::value_type>;
+      }
+      post(inserted.first->second, id, bytes);
+    }
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+std::string_view SearchIndex::title(uint32_t track) const {
+  const TrackTable::Record &record = table.get(track);
+  std::string_view name = table.str(record.name);
+  std::string_view artist = table.str(record.artist);
+  if (name.size() >= artist.size() + 4 &&
+      name.compare(0, artist.size(), artist) == 0 &&
+      name.compare(artist.size(), 4, " -- ") == 0) {
+    name.remove_prefix(artist.size() + 4);
+  }
+  return name;
+}
+
+SearchIndex::Postings SearchIndex::matchWords(std::string_view word) const {
+  // Trigrams only narrow the words down, each is checked for `word`
+  Postings result;
+  for (uint32_t id : intersect(word_trigrams, word)) {
+    if (contains(words[id].text, word)) {
+      result.push_back(id);
+    }
+  }
+  return result;
+}
+
+bool SearchIndex::containsAll(uint32_t track,
+                              const std::vector<std::string> &query) const {
+  const TrackTable::Record &record = table.get(track);
+  for (const auto &word : query) {
+    if (!contains(table.str(record.name), word) &&
+        !contains(table.str(record.album), word)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Tracks of several posting lists in ascending order, each once
+class SearchIndex::Merge {
+public:
+  void add(const Postings &postings) {
+    if (!postings.empty()) {
+      heap.emplace_back(postings.data(), postings.data() + postings.size());
+      total += postings.size();
+    }
+  }
+  // Call after adding the lists
+  void start() { std::make_heap(heap.begin(), heap.end(), later); }
+  bool done() const { return heap.empty(); }
+  uint32_t head() const { return *heap.front().first; }
+  // Moves to the first track not before `track`
+  void seek(uint32_t track) {
+    while (!heap.empty() && head() < track) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      Cursor &cursor = heap.back();
+      cursor.first = skip(cursor.first, cursor.second, track);
+      if (cursor.first == cursor.second) {
+        heap.pop_back();
+      } else {
+        std::push_heap(heap.begin(), heap.end(), later);
+      }
+    }
+  }
+  size_t lists() const { return heap.size(); }
+  size_t size() const { return total; } // Tracks, counting repeats
+  // Bitmap of the tracks of the lists, below `tracks`
+  std::vector<uint64_t> mark(size_t tracks) const {
+    std::vector<uint64_t> bits((tracks + 63) / 64);
+    for (const Cursor &cursor : heap) {
+      for (const uint32_t *track = cursor.first; track != cursor.second;
+           ++track) {
+        bits[*track / 64] |= uint64_t(1) << *track % 64;
+      }
+    }
+    return bits;
+  }
+
+private:
+  using Cursor = std::pair<const uint32_t *, const uint32_t *>;
+
+  static bool later(const Cursor &a, const Cursor &b) {
+    return *a.first > *b.first;
+  }
+  // First of [first, last) not before `track`, which is after *first.
+  // Gallops ahead, the target is usually close.
+  static const uint32_t *skip(const uint32_t *first, const uint32_t *last,
+                              uint32_t track) {
+    size_t size = last - first, bound = 1;
+    while (bound < size && first[bound] < track) {
+      bound *= 2;
+    }
+    return std::lower_bound(first + bound / 2, first + std::min(bound, size),
+                            track);
+  }
+
+  std::vector<Cursor> heap; // By next track
+  size_t total = 0;
+};
+
+std::vector<search_hit> SearchIndex::search(std::string_view query,
+                                            size_t limit) const {
+  // Skipping through a word that matches more words of the dictionary than
+  // this costs more than marking its tracks in a bitmap
+  static const size_t MAX_SKIPPED_LISTS = 64;
+
+  std::vector<search_hit> hits;
+  Metrics::Timer timer(Stage::search_query);
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<Merge> merges;
+  std::vector<std::string> checked; // Words checked on the text instead
+  for (std::string &word : splitWords(query)) {
+    if (word.size() < 3) {
+      checked.push_back(std::move(word));
+      continue;
+    }
+    Merge merge;
+    for (uint32_t id : matchWords(word)) {
+      merge.add(words[id].tracks);
+    }
+    if (merge.done()) {
+      return hits; // No track has the word
+    }
+    merges.push_back(std::move(merge));
+  }
+  if (merges.empty()) {
+    return hits; // No word is long enough to be looked up
+  }
+
+  // The word with the fewest tracks leads, the others are skipped to its
+  // tracks or marked
+  std::sort(merges.begin(), merges.end(), [](const Merge &a, const Merge &b) {
+    return a.size() < b.size();
+  });
+  std::vector<std::vector<uint64_t>> marked;
+  for (size_t i = merges.size(); i-- > 0;) {
+    if (merges[i].lists() > MAX_SKIPPED_LISTS) {
+      marked.push_back(merges[i].mark(indexed));
+      merges.erase(merges.begin() + i);
+    }
+  }
+  // Once there is a bitmap, a leading word with many tracks is cheaper to
+  // mark as well than to step through
+  if (!marked.empty() && !merges.empty() &&
+      merges[0].size() > indexed / 64) {
+    for (const Merge &merge : merges) {
+      marked.push_back(merge.mark(indexed));
+    }
+    merges.clear();
+  }
+  for (Merge &merge : merges) {
+    merge.start();
+  }
+  auto found = [&](uint32_t track) {
+    if (!listed_in[track] || !containsAll(track, checked)) {
+      return;
+    }
+    hits.push_back({track, listed_in[track]});
+    auto range = also_listed_in.equal_range(track);
+    for (auto it = range.first; it != range.second && hits.size() < limit;
+         ++it) {
+      hits.push_back({track, it->second});
+    }
+  };
+
+  if (merges.empty()) {
+    // Only marked words, their bitmaps are intersected
+    for (size_t i = 0; i < marked[0].size() && hits.size() < limit; ++i) {
+      uint64_t bits = marked[0][i];
+      for (size_t j = 1; j < marked.size(); ++j) {
+        bits &= marked[j][i];
+      }
+      for (; bits && hits.size() < limit; bits &= bits - 1) {
+        found(i * 64 + __builtin_ctzll(bits));
+      }
+    }
+    return hits;
+  }
+
+  // Every skipped word moves to the track of the leading one; a word
+  // without it moves the leading word to its next track instead
+  Merge &lead = merges[0];
+  while (!lead.done() && hits.size() < limit) {
+    uint32_t track = lead.head();
+    uint32_t next = track;
+    for (size_t i = 1; i < merges.size() && next == track; ++i) {
+      merges[i].seek(track);
+      if (merges[i].done()) {
+        return hits;
+      }
+      next = merges[i].head();
+    }
+    if (next != track) {
+      lead.seek(next);
+      continue;
+    }
+    bool everywhere = true;
+    for (size_t i = 0; i < marked.size() && everywhere; ++i) {
+      everywhere = marked[i][track / 64] >> track % 64 & 1;
+    }
+    if (everywhere) {
+      found(track);
+    }
+    lead.seek(track + 1);
+  }
+  return hits;
+}
+
+bool SearchIndex::matches(uint32_t track, std::string_view query) const {
+  std::vector<std::string> query_words = splitWords(query);
+  bool any_long = std::any_of(query_words.begin(), query_words.end(),
+                              [](const std::string &word) {
+                                return word.size() >= 3;
+                              });
+  return any_long && containsAll(track, query_words);
+}
+
+size_t SearchIndex::trackCount() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return indexed;
+}
+
+size_t SearchIndex::wordCount() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return words.size();
+}
+
+size_t SearchIndex::memoryBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return usedBytes();
+}
+
+size_t SearchIndex::usedBytes() const {
+  size_t buckets = word_ids.bucket_count() + word_trigrams.bucket_count() +
+                   string_words.bucket_count() +
+                   also_listed_in.bucket_count();
+  return bytes + words.size() * sizeof(Word) + buckets * sizeof(void *) +
+         listed_in.capacity() * sizeof(spotify_file *);
+}
+
+void SearchIndex::reportMetrics() {
+  int64_t total = usedBytes();
+  Metrics::add(Counter::search_index_bytes, total - reported_bytes);
+  Metrics::add(Counter::search_index_tracks,
+               int64_t(indexed) - reported_tracks);
+  reported_bytes = total;
+  reported_tracks = indexed;
+}
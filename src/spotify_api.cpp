@@ -1,31 +1,12 @@
 #include "spotify_api.h"
-#include <cpr/cpr.h>
+#include "metrics.h"
+#include "response_decoder.h"
+#include <cstdlib>
 #include <iostream>
 #include <json/json.h>
 
-#define DEBUG
-
 SpotifyAPI *SpotifyAPI::instance = nullptr;
 
-size_t WriteCallback(char *contents, size_t size, size_t nmemb, void *userp) {
-  ((std::string *)userp)->append((char *)contents, size * nmemb);
-  return size * nmemb;
-}
-
-std::string handleCallback(std::string callback_url) {
-  // Find start of access token
-  size_t token_start = callback_url.find("access_token=") + 13;
-  // Find end of access token (before next &)
-  size_t token_end = callback_url.find("&", token_start);
-  // Extract access token
-  std::string access_token =
-      callback_url.substr(token_start, token_end - token_start);
-#ifdef DEBUG
-  std::cout << "Access token: " << access_token << std::endl;
-#endif
-  return access_token;
-}
-
 SpotifyAPI *SpotifyAPI::getInstance() {
   if (instance == nullptr) {
     throw std::runtime_error("SpotifyAPI instance is null. Call init() first.");
@@ -33,186 +14,372 @@ SpotifyAPI *SpotifyAPI::getInstance() {
   return instance;
 }
 
-bool SpotifyAPI::init(std::string client_id) {
+bool SpotifyAPI::init(const AuthConfig &auth_config, const HttpConfig &config,
+                      const SchedulerConfig &scheduler_config) {
   if (instance == nullptr) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
     instance = new SpotifyAPI();
   }
-  instance->client_id = client_id;
-  instance->oauth();
-  return true;
+  instance->tokens = std::make_unique<TokenManager>(auth_config);
+  instance->http = std::make_unique<HttpClient>(config, scheduler_config);
+  return instance->oauth();
 }
 
-// OAuth flow
-void SpotifyAPI::oauth() {
-  std::string redirect_uri = "http://localhost:3000";
+HttpRequest SpotifyAPI::request(HttpRequest::Method method,
+                                const std::string &path) const {
+  HttpRequest request;
+  request.method = method;
+  request.path = path;
+  request.headers = {"Content-Type: application/json"};
+  return request;
+}
 
-  // Generate random state string
-  const int state_length = 16;
-  std::string state;
-  state.reserve(state_length);
-  static const char alphanum[] = "0123456789"
-                                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                                 "abcdefghijklmnopqrstuvwxyz";
-  for (int i = 0; i < state_length; ++i) {
-    state += alphanum[rand() % (sizeof(alphanum) - 1)];
+void SpotifyAPI::send(ApiEndpoint endpoint, HttpRequest request,
+                      std::function<void(HttpResponse &)> done) {
+  // Sent again after a token refresh, it stays on the caller's flow
+  if (!request.flow) {
+    request.flow = Tracer::flow();
   }
+  sendAuthorized(endpoint,
+                 std::make_shared<const HttpRequest>(std::move(request)),
+                 std::chrono::steady_clock::now(), true, std::move(done));
+}
 
-  // Build authorization URL
-  std::string scope =
-      "user-read-private user-read-email playlist-modify-private "
-      "playlist-modify-public user-library-modify";
-  std::string auth_url = "https://accounts.spotify.com/authorize";
-  auth_url += "?response_type=token";
-  auth_url += "&client_id=" + client_id;
-  auth_url +=
-      "&scope=" + std::string(curl_easy_escape(nullptr, scope.c_str(), 0));
-  auth_url += "&redirect_uri=" +
-              std::string(curl_easy_escape(nullptr, redirect_uri.c_str(), 0));
-  auth_url +=
-      "&state=" + std::string(curl_easy_escape(nullptr, state.c_str(), 0));
+void SpotifyAPI::sendAuthorized(ApiEndpoint endpoint,
+                                std::shared_ptr<const HttpRequest> request,
+                                std::chrono::steady_clock::time_point start,
+                                bool renew,
+                                std::function<void(HttpResponse &)> done) {
+  // The header is added to a copy, a retry gets the token of its own time
+  uint64_t generation;
+  HttpRequest authorized = *request;
+  authorized.headers.push_back(tokens->header(generation));
+  http->submit(std::move(authorized), [this, endpoint, request, start, renew,
+                                       generation, done = std::move(done)](
+                                          HttpResponse response) {
+    if (response.status_code == 401 && renew) {
+      // Requests rejected together wait for the same refresh and are then
+      // sent again whether it succeeded or not, so that `done` still runs
+      // on the event loop
+      Metrics::add(Counter::api_unauthorized);
+      tokens->refresh(generation, [this, endpoint, request, start, done]() {
+        sendAuthorized(endpoint, request, start, false, done);
+      });
+      return;
+    }
+    Metrics::record(endpoint,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+    done(response);
+  });
+}
+
+template <typename T>
+std::future<T> SpotifyAPI::call(ApiEndpoint endpoint, HttpRequest request,
+                                std::function<T(HttpResponse &)> decode) {
+  auto promise = std::make_shared<std::promise<T>>();
+  std::future<T> future = promise->get_future();
+  send(endpoint, std::move(request),
+       [promise, decode = std::move(decode)](HttpResponse &response) {
+         promise->set_value(decode(response));
+       });
+  return future;
+}
 
-  std::cout << "login url:\n" << auth_url << std::endl;
+template <typename T>
+T SpotifyAPI::wait(ApiEndpoint endpoint, std::future<T> future) {
+  Tracer::Span span(Metrics::name(endpoint), Metrics::category(endpoint));
+  return future.get();
+}
+
+// Logs a response that does not have the expected status
+static bool expectStatus(const HttpResponse &response, long status_code) {
+  if (response.status_code == status_code) {
+    return true;
+  }
+  std::cerr << "Request failed with status code: " << response.status_code
+            << std::endl;
+  std::cerr << "Body: " << (response.error.empty() ? response.text
+                                                    : response.error)
+            << std::endl;
+  return false;
+}
 
-  std::string redirect_url = "";
+// Fetches all pages of a listing with `page`. The first page gives the
+// total, the others are then requested at once. `done` receives the items
+// of the pages before the first one that failed, and whether none did.
+// Every callback runs on the event loop thread, so the state is not locked.
+template <typename Item>
+static void fetchPages(
+    int limit,
+    std::function<void(
+        int, std::function<void(bool, std::vector<Item> &, int)>)>
+        page,
+    std::function<void(bool, std::vector<Item> &)> done) {
+  page(0, [limit, page, done](bool ok, std::vector<Item> &first, int total) {
+    if (!ok || total <= limit) {
+      done(ok, first);
+      return;
+    }
+    struct Pages {
+      std::vector<std::vector<Item>> items;
+      std::vector<bool> ok;
+      size_t remaining;
+    };
+    size_t count = (total + limit - 1) / limit;
+    auto pages = std::make_shared<Pages>();
+    pages->items.resize(count);
+    pages->items[0] = std::move(first);
+    pages->ok.assign(count, true);
+    pages->remaining = count - 1;
+    for (size_t i = 1; i < count; ++i) {
+      int offset = static_cast<int>(i) * limit;
+      page(offset, [pages, i, done](bool ok, std::vector<Item> &items, int) {
+        pages->items[i] = std::move(items);
+        pages->ok[i] = ok;
+        if (--pages->remaining > 0) {
+          return;
+        }
+        std::vector<Item> all;
+        all.reserve(pages->items.size() * pages->items[0].size());
+        bool complete = true;
+        for (size_t j = 0; j < pages->items.size(); ++j) {
+          if (!pages->ok[j]) {
+            complete = false;
+            break;
+          }
+          all.insert(all.end(),
+                     std::make_move_iterator(pages->items[j].begin()),
+                     std::make_move_iterator(pages->items[j].end()));
+        }
+        done(complete, all);
+      });
+    }
+  });
+}
 
-  std::cout << "Enter redirect url: ";
+bool SpotifyAPI::oauth() {
+  // A token given in the environment skips the interactive login, e.g. for
+  // scripted runs against a mock server. It is used until it expires.
+  if (const char *token = getenv("SPOTIFY_ACCESS_TOKEN")) {
+    tokens->useToken(token);
+    return true;
+  }
+  return tokens->login();
+}
 
-  std::cin >> redirect_url;
-  access_token = handleCallback(redirect_url);
+void SpotifyAPI::playlistsPage(
+    int offset, int limit,
+    std::function<void(bool, std::vector<Playlist> &, int)> done) {
+  // The page is decoded while it arrives
+  auto decoder = std::make_shared<PlaylistDecoder>();
+  HttpRequest request =
+      this->request(HttpRequest::Method::get, "/me/playlists");
+  request.parameters = {{"offset", std::to_string(offset)},
+                        {"limit", std::to_string(limit)}};
+  request.restart = [decoder]() { decoder->reset(); };
+  request.on_data = [decoder](std::string_view chunk) {
+    Metrics::Timer timer(Stage::json_decode);
+    decoder->feed(chunk);
+    return true;
+  };
+  send(ApiEndpoint::playlists, std::move(request),
+       [decoder, done = std::move(done)](HttpResponse &response) {
+         bool ok = expectStatus(response, 200);
+         if (ok && !decoder->finish()) {
+           std::cerr << "Malformed playlist listing" << std::endl;
+           ok = false;
+         }
+         done(ok, decoder->playlists, decoder->total);
+       });
 }
 
-std::vector<Playlist> SpotifyAPI::getAllPlaylists() {
-  std::string url = "https://api.spotify.com/v1/me/playlists";
+void SpotifyAPI::tracksPage(
+    ApiEndpoint endpoint, const std::string &path, int offset, int limit,
+    std::function<void(bool, std::vector<Track> &, int)> done) {
+  // The page is decoded while it arrives
+  auto decoder =
+      std::make_shared<TrackDecoder>(TrackDecoder::Source::playlist_page);
+  HttpRequest request = this->request(HttpRequest::Method::get, path);
+  request.parameters = {{"offset", std::to_string(offset)},
+                        {"limit", std::to_string(limit)}};
+  request.restart = [decoder]() { decoder->reset(); };
+  request.on_data = [decoder](std::string_view chunk) {
+    Metrics::Timer timer(Stage::json_decode);
+    decoder->feed(chunk);
+    return true;
+  };
+  send(endpoint, std::move(request),
+       [decoder, path, done = std::move(done)](HttpResponse &response) {
+         bool ok = expectStatus(response, 200);
+         if (ok && !decoder->finish()) {
+           std::cerr << "Malformed tracks page of " << path << std::endl;
+           ok = false;
+         }
+         done(ok, decoder->tracks, decoder->total);
+       });
+}
 
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
+void SpotifyAPI::allPlaylists(
+    std::function<void(bool, std::vector<Playlist> &)> done) {
+  fetchPages<Playlist>(
+      50, [this](int offset, auto page) { playlistsPage(offset, 50, page); },
+      std::move(done));
+}
 
-  // Make GET request
-  auto response = cpr::Get(cpr::Url{url}, headers, cpr::VerifySsl{false});
-
-  std::vector<Playlist> playlists;
-
-  if (response.status_code == 200) {
-    // Parse JSON response
-    Json::Value root;
-    Json::Reader reader;
-
-    if (reader.parse(response.text, root)) {
-      const Json::Value items = root["items"];
-      std::cout << "Found " << items.size() << " playlists" << std::endl;
-      playlists.reserve(items.size());
-
-      for (const Json::Value &item : items) {
-        std::cout << "Found playlist: " << item["name"].asString() << std::endl;
-        Playlist playlist;
-        playlist.id = item["id"].asString();
-        playlist.name = item["name"].asString();
-        playlist.owner = item["owner"]["display_name"].asString();
-        playlists.push_back(playlist);
-      }
+std::future<std::optional<std::vector<Playlist>>>
+SpotifyAPI::getAllPlaylistsAsync() {
+  auto promise =
+      std::make_shared<std::promise<std::optional<std::vector<Playlist>>>>();
+  auto future = promise->get_future();
+  allPlaylists([promise](bool ok, std::vector<Playlist> &playlists) {
+    if (ok) {
+      promise->set_value(std::move(playlists));
+    } else {
+      promise->set_value(std::nullopt);
     }
-  } else {
-    std::cerr << "Request failed with status code: " << response.status_code
-              << std::endl;
-    std::cerr << "Body: " << response.text << std::endl;
-  }
+  });
+  return future;
+}
 
-  return playlists;
+bool SpotifyAPI::getAllPlaylists(std::vector<Playlist> &playlists) {
+  // The playlists fetched before a failed page are kept
+  auto promise = std::make_shared<std::promise<bool>>();
+  std::future<bool> future = promise->get_future();
+  allPlaylists([&playlists, promise](bool ok, std::vector<Playlist> &items) {
+    playlists = std::move(items);
+    promise->set_value(ok);
+  });
+  return wait(ApiEndpoint::playlists, std::move(future));
 }
 
-std::vector<Track> SpotifyAPI::getPlaylistTracks(std::string playlist_id) {
-  std::vector<Track> tracks;
-  int offset = 0;
-  const int limit = 100;
-  int total = 0;
-  bool first_page = true;
-
-  do {
-    std::string url = "https://api.spotify.com/v1/playlists/" + playlist_id +
-                      "/tracks?offset=" + std::to_string(offset) +
-                      "&limit=" + std::to_string(limit);
-
-    // Set up headers
-    cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
-
-    // Make GET request
-    auto response = cpr::Get(cpr::Url{url}, headers, cpr::VerifySsl{false});
-
-    if (response.status_code == 200) {
-      // Parse JSON response
-      Json::Value root;
-      Json::Reader reader;
-
-      if (reader.parse(response.text, root)) {
-        if (first_page) {
-          total = root["total"].asInt();
-          first_page = false;
-          std::cout << "Found total of " << total << " tracks" << std::endl;
-        }
+std::future<std::optional<TracksPage>>
+SpotifyAPI::tracksPageAsync(ApiEndpoint endpoint, const std::string &path,
+                            int offset, int limit) {
+  auto promise = std::make_shared<std::promise<std::optional<TracksPage>>>();
+  auto future = promise->get_future();
+  tracksPage(endpoint, path, offset, limit,
+             [promise](bool ok, std::vector<Track> &tracks, int total) {
+               if (!ok) {
+                 promise->set_value(std::nullopt);
+                 return;
+               }
+               TracksPage page;
+               page.tracks = std::move(tracks);
+               page.total = total;
+               promise->set_value(std::move(page));
+             });
+  return future;
+}
 
-        const Json::Value items = root["items"];
-        std::cout << "Fetched " << items.size() << " tracks at offset "
-                  << offset << std::endl;
-
-        for (const Json::Value &item : items) {
-          Track track;
-          track.id = item["track"]["id"].asString();
-          track.name = item["track"]["name"].asString();
-          track.artist = item["track"]["artists"][0]["name"].asString();
-          track.album = item["track"]["album"]["name"].asString();
-          track.duration_ms = item["track"]["duration_ms"].asInt();
-          track.uri = item["track"]["uri"].asString();
-          tracks.push_back(track);
-        }
-      }
+std::future<std::optional<TracksPage>>
+SpotifyAPI::getPlaylistTracksPageAsync(const std::string &playlist_id,
+                                       int offset, int limit) {
+  return tracksPageAsync(ApiEndpoint::playlist_tracks,
+                         "/playlists/" + playlist_id + "/tracks", offset,
+                         limit);
+}
+
+bool SpotifyAPI::getPlaylistTracksPage(const std::string &playlist_id,
+                                       int offset, int limit,
+                                       std::vector<Track> &tracks,
+                                       int &total) {
+  std::optional<TracksPage> page =
+      wait(ApiEndpoint::playlist_tracks,
+           getPlaylistTracksPageAsync(playlist_id, offset, limit));
+  if (!page) {
+    return false;
+  }
+  total = page->total;
+  tracks.insert(tracks.end(), std::make_move_iterator(page->tracks.begin()),
+                std::make_move_iterator(page->tracks.end()));
+  return true;
+}
+
+void SpotifyAPI::allTracks(
+    const std::string &playlist_id,
+    std::function<void(bool, std::vector<Track> &)> done) {
+  fetchPages<Track>(
+      100,
+      [this, path = "/playlists/" + playlist_id + "/tracks"](int offset,
+                                                             auto page) {
+        tracksPage(ApiEndpoint::playlist_tracks, path, offset, 100, page);
+      },
+      std::move(done));
+}
+
+std::future<std::optional<std::vector<Track>>>
+SpotifyAPI::getPlaylistTracksAsync(const std::string &playlist_id) {
+  auto promise =
+      std::make_shared<std::promise<std::optional<std::vector<Track>>>>();
+  auto future = promise->get_future();
+  allTracks(playlist_id, [promise](bool ok, std::vector<Track> &tracks) {
+    if (ok) {
+      promise->set_value(std::move(tracks));
     } else {
-      std::cerr << "Request failed with status code: " << response.status_code
-                << std::endl;
-      std::cerr << "Body: " << response.text << std::endl;
-      break;
+      promise->set_value(std::nullopt);
     }
+  });
+  return future;
+}
 
-    offset += limit;
-  } while (offset < total);
-
-  return tracks;
+std::vector<Track> SpotifyAPI::getPlaylistTracks(std::string playlist_id) {
+  // The tracks of the pages before a failed one are kept
+  auto promise = std::make_shared<std::promise<std::vector<Track>>>();
+  std::future<std::vector<Track>> future = promise->get_future();
+  allTracks(playlist_id, [promise](bool, std::vector<Track> &tracks) {
+    promise->set_value(std::move(tracks));
+  });
+  return wait(ApiEndpoint::playlist_tracks, std::move(future));
 }
 
-bool SpotifyAPI::addTrackToPlaylist(std::string playlist_id,
-                                    std::string track_uri) {
-  std::string url =
-      "https://api.spotify.com/v1/playlists/" + playlist_id + "/tracks";
+std::future<std::optional<TracksPage>>
+SpotifyAPI::getSavedTracksPageAsync(int offset, int limit) {
+  // Saved tracks are listed in the same shape as the tracks of a playlist
+  return tracksPageAsync(ApiEndpoint::saved_tracks, "/me/tracks", offset,
+                         limit);
+}
 
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
+bool SpotifyAPI::getSavedTracksPage(int offset, int limit,
+                                    std::vector<Track> &tracks, int &total) {
+  std::optional<TracksPage> page = wait(
+      ApiEndpoint::saved_tracks, getSavedTracksPageAsync(offset, limit));
+  if (!page) {
+    return false;
+  }
+  total = page->total;
+  tracks.insert(tracks.end(), std::make_move_iterator(page->tracks.begin()),
+                std::make_move_iterator(page->tracks.end()));
+  return true;
+}
 
+std::future<bool>
+SpotifyAPI::addTrackToPlaylistAsync(const std::string &playlist_id,
+                                    const std::string &track_uri) {
   // Make POST request
   Json::Value body;
   body["uris"].append("spotify:track:" + track_uri);
   body["position"] = 0;
-  auto response =
-      cpr::Post(cpr::Url{url}, headers, cpr::Body{body.toStyledString()},
-                cpr::VerifySsl{false});
-
-  if (response.status_code == 201) {
-    return true;
-  } else {
-    std::cerr << "Request failed with status code: " << response.status_code
-              << std::endl;
-    std::cerr << "Body: " << response.text << std::endl;
-    return false;
-  }
+  HttpRequest request = this->request(HttpRequest::Method::post,
+                                      "/playlists/" + playlist_id + "/tracks");
+  request.body = body.toStyledString();
+  request.idempotent = false;
+  return call<bool>(ApiEndpoint::add_tracks, std::move(request),
+                    [](HttpResponse &response) {
+                      return expectStatus(response, 201);
+                    });
 }
 
-bool SpotifyAPI::removeTrackFromPlaylist(std::string playlist_id,
-                                         std::string track_uri) {
-  std::string url =
-      "https://api.spotify.com/v1/playlists/" + playlist_id + "/tracks";
-
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token},
-                         {"Content-Type", "application/json"}};
+bool SpotifyAPI::addTrackToPlaylist(std::string playlist_id,
+                                    std::string track_uri) {
+  return wait(ApiEndpoint::add_tracks,
+              addTrackToPlaylistAsync(playlist_id, track_uri));
+}
 
+std::future<bool>
+SpotifyAPI::removeTrackFromPlaylistAsync(const std::string &playlist_id,
+                                         const std::string &track_uri) {
   // Create the request body with the track URI
   Json::Value trackObject;
   trackObject["uri"] = track_uri;
@@ -221,132 +388,247 @@ bool SpotifyAPI::removeTrackFromPlaylist(std::string playlist_id,
   body["tracks"].append(trackObject);
 
   // Make DELETE request
-  auto response =
-      cpr::Delete(cpr::Url{url}, headers, cpr::Body{body.toStyledString()},
-                  cpr::VerifySsl{false});
+  HttpRequest request = this->request(HttpRequest::Method::del,
+                                      "/playlists/" + playlist_id + "/tracks");
+  request.body = body.toStyledString();
+  return call<bool>(ApiEndpoint::remove_tracks, std::move(request),
+                    [](HttpResponse &response) {
+                      return expectStatus(response, 200);
+                    });
+}
 
-  if (response.status_code == 200) {
-    return true;
-  } else {
-    std::cerr << "Request failed with status code: " << response.status_code
-              << std::endl;
-    std::cerr << "Body: " << response.text << std::endl;
-    return false;
+bool SpotifyAPI::removeTrackFromPlaylist(std::string playlist_id,
+                                         std::string track_uri) {
+  return wait(ApiEndpoint::remove_tracks,
+              removeTrackFromPlaylistAsync(playlist_id, track_uri));
+}
+
+std::future<bool>
+SpotifyAPI::addTracksToPlaylistAsync(const std::string &playlist_id,
+                                     const std::vector<std::string> &uris) {
+  // Make POST request, tracks are appended in the given order
+  Json::Value body;
+  for (const auto &uri : uris) {
+    body["uris"].append(uri);
   }
+  HttpRequest request = this->request(HttpRequest::Method::post,
+                                      "/playlists/" + playlist_id + "/tracks");
+  request.body = body.toStyledString();
+  request.idempotent = false;
+  return call<bool>(ApiEndpoint::add_tracks, std::move(request),
+                    [](HttpResponse &response) {
+                      return expectStatus(response, 201);
+                    });
 }
 
-std::string SpotifyAPI::getUserId() {
-  std::string url = "https://api.spotify.com/v1/me";
+bool SpotifyAPI::addTracksToPlaylist(const std::string &playlist_id,
+                                     const std::vector<std::string> &uris) {
+  return wait(ApiEndpoint::add_tracks,
+              addTracksToPlaylistAsync(playlist_id, uris));
+}
 
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
+std::future<bool> SpotifyAPI::removeTracksFromPlaylistAsync(
+    const std::string &playlist_id, const std::vector<std::string> &uris) {
+  // Create the request body with the track URIs
+  Json::Value body;
+  for (const auto &uri : uris) {
+    Json::Value trackObject;
+    trackObject["uri"] = uri;
+    body["tracks"].append(trackObject);
+  }
 
-  // Make GET request
-  auto response = cpr::Get(cpr::Url{url}, headers, cpr::VerifySsl{false});
+  // Make DELETE request
+  HttpRequest request = this->request(HttpRequest::Method::del,
+                                      "/playlists/" + playlist_id + "/tracks");
+  request.body = body.toStyledString();
+  return call<bool>(ApiEndpoint::remove_tracks, std::move(request),
+                    [](HttpResponse &response) {
+                      return expectStatus(response, 200);
+                    });
+}
 
-  if (response.status_code == 200) {
-    Json::Value root;
-    Json::Reader reader;
-    if (reader.parse(response.text, root)) {
-      return root["id"].asString();
-    }
-  }
-  return "";
+bool SpotifyAPI::removeTracksFromPlaylist(
+    const std::string &playlist_id, const std::vector<std::string> &uris) {
+  return wait(ApiEndpoint::remove_tracks,
+              removeTracksFromPlaylistAsync(playlist_id, uris));
 }
 
-Playlist SpotifyAPI::createPlaylist(std::string name, std::string description,
-                                bool is_public) {
-  std::string url =
-      "https://api.spotify.com/v1/users/" + getUserId() + "/playlists";
+std::future<bool> SpotifyAPI::reorderPlaylistTracksAsync(
+    const std::string &playlist_id, int range_start, int insert_before,
+    int range_length) {
+  Json::Value body;
+  body["range_start"] = range_start;
+  body["insert_before"] = insert_before;
+  body["range_length"] = range_length;
+
+  // Make PUT request; moving twice is not the same as moving once
+  HttpRequest request = this->request(HttpRequest::Method::put,
+                                      "/playlists/" + playlist_id + "/tracks");
+  request.body = body.toStyledString();
+  request.idempotent = false;
+  return call<bool>(ApiEndpoint::reorder_tracks, std::move(request),
+                    [](HttpResponse &response) {
+                      return expectStatus(response, 200);
+                    });
+}
 
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
+bool SpotifyAPI::reorderPlaylistTracks(const std::string &playlist_id,
+                                       int range_start, int insert_before,
+                                       int range_length) {
+  return wait(ApiEndpoint::reorder_tracks,
+              reorderPlaylistTracksAsync(playlist_id, range_start,
+                                         insert_before, range_length));
+}
 
-  // Make POST request
+std::future<bool> SpotifyAPI::renamePlaylistAsync(
+    const std::string &playlist_id, const std::string &name) {
   Json::Value body;
   body["name"] = name;
-  body["description"] = "New playlist created by SpotifyFS";
-  body["public"] = is_public;
 
-  auto response =
-      cpr::Post(cpr::Url{url}, headers, cpr::Body{body.toStyledString()},
-                cpr::VerifySsl{false});
-
-  Playlist playlist;
-  if (response.status_code == 201) {
-    Json::Value root;
-    Json::Reader reader;
-    if (reader.parse(response.text, root)) {
-      playlist.id = root["id"].asString();
-      playlist.name = root["name"].asString();
-      playlist.owner = root["owner"]["id"].asString();
-    }
-  } else {
-    std::cerr << "Request failed with status code: " << response.status_code
-              << std::endl;
-    std::cerr << "Body: " << response.text << std::endl;
-  }
-  return playlist;
+  // Make PUT request, only the fields in the body are changed
+  HttpRequest request =
+      this->request(HttpRequest::Method::put, "/playlists/" + playlist_id);
+  request.body = body.toStyledString();
+  return call<bool>(ApiEndpoint::update_playlist, std::move(request),
+                    [](HttpResponse &response) {
+                      return expectStatus(response, 200);
+                    });
 }
 
-std::string SpotifyAPI::searchTrack(std::string query) {
-  // URL encode the query parameter properly
-  CURL *curl = curl_easy_init();
-  char *encoded_query = curl_easy_escape(curl, query.c_str(), query.length());
-  std::string url = "https://api.spotify.com/v1/search?q=" + 
-                    std::string(encoded_query) + 
-                    "&type=track";
-  curl_free(encoded_query);
-  curl_easy_cleanup(curl);
-
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
+bool SpotifyAPI::renamePlaylist(const std::string &playlist_id,
+                                const std::string &name) {
+  return wait(ApiEndpoint::update_playlist,
+              renamePlaylistAsync(playlist_id, name));
+}
 
+std::future<std::string> SpotifyAPI::getUserIdAsync() {
   // Make GET request
-  auto response = cpr::Get(cpr::Url{url}, headers, cpr::VerifySsl{false});
-
-  if (response.status_code == 200) {
-    Json::Value root;
-    Json::Reader reader;
-    if (reader.parse(response.text, root)) {
-      const Json::Value& items = root["tracks"]["items"];
-      if (!items.empty()) {
-        return items[0]["id"].asString();
-      }
-    }
-  } else {
-    std::cerr << "Search failed with status code: " << response.status_code << std::endl;
-    std::cerr << "Response: " << response.text << std::endl;
-  }
+  return call<std::string>(ApiEndpoint::user,
+                           request(HttpRequest::Method::get, "/me"),
+                           [](HttpResponse &response) -> std::string {
+                             if (response.status_code == 200) {
+                               Json::Value root;
+                               Json::Reader reader;
+                               if (reader.parse(response.text, root)) {
+                                 return root["id"].asString();
+                               }
+                             }
+                             return "";
+                           });
+}
+
+std::string SpotifyAPI::getUserId() {
+  return wait(ApiEndpoint::user, getUserIdAsync());
+}
+
+std::future<Playlist>
+SpotifyAPI::createPlaylistAsync(const std::string &name,
+                                const std::string &description,
+                                bool is_public) {
+  // Make POST request
+  Json::Value body;
+  body["name"] = name;
+  body["description"] = "New playlist created by SpotifyFS";
+  body["public"] = is_public;
 
-  return "";
+  // The playlist is created for the user ID, which takes a request first
+  auto promise = std::make_shared<std::promise<Playlist>>();
+  std::future<Playlist> future = promise->get_future();
+  send(ApiEndpoint::user, request(HttpRequest::Method::get, "/me"),
+       [this, promise, body = body.toStyledString()](HttpResponse &user) {
+         Json::Value root;
+         Json::Reader reader;
+         std::string user_id;
+         if (user.status_code == 200 && reader.parse(user.text, root)) {
+           user_id = root["id"].asString();
+         }
+         if (user_id.empty()) {
+           std::cerr << "Failed to get the user ID, status code: "
+                     << user.status_code << std::endl;
+           promise->set_value(Playlist());
+           return;
+         }
+         HttpRequest request = this->request(
+             HttpRequest::Method::post, "/users/" + user_id + "/playlists");
+         request.body = body;
+         request.idempotent = false;
+         send(ApiEndpoint::create_playlist, std::move(request),
+              [promise](HttpResponse &response) {
+                Playlist playlist;
+                if (expectStatus(response, 201)) {
+                  Json::Value root;
+                  Json::Reader reader;
+                  if (reader.parse(response.text, root)) {
+                    playlist.id = root["id"].asString();
+                    playlist.name = root["name"].asString();
+                    playlist.owner = root["owner"]["id"].asString();
+                    playlist.snapshot_id = root["snapshot_id"].asString();
+                  }
+                }
+                promise->set_value(playlist);
+              });
+       });
+  return future;
 }
 
+Playlist SpotifyAPI::createPlaylist(std::string name, std::string description,
+                                    bool is_public) {
+  return wait(ApiEndpoint::create_playlist,
+              createPlaylistAsync(name, description, is_public));
+}
 
+std::future<std::optional<Track>>
+SpotifyAPI::searchTrackAsync(const std::string &query) {
+  // Make GET request, the query parameter is URL encoded by the client
+  HttpRequest request = this->request(HttpRequest::Method::get, "/search");
+  request.parameters = {{"q", query}, {"type", "track"}, {"limit", "1"}};
+  return call<std::optional<Track>>(
+      ApiEndpoint::search, std::move(request),
+      [](HttpResponse &response) -> std::optional<Track> {
+        if (response.status_code != 200) {
+          std::cerr << "Search failed with status code: "
+                    << response.status_code << std::endl;
+          std::cerr << "Response: " << response.text << std::endl;
+          return std::nullopt;
+        }
 
-Track SpotifyAPI::getTrackInfo(std::string track_id) {
-  std::string url = "https://api.spotify.com/v1/tracks/" + track_id;
+        // The search result already holds the complete track object
+        Metrics::Timer decode_timer(Stage::json_decode);
+        TrackDecoder decoder(TrackDecoder::Source::search);
+        if (!decoder.feed(response.text) || !decoder.finish()) {
+          return std::nullopt;
+        }
+        if (decoder.tracks.empty()) {
+          return Track();
+        }
+        return std::move(decoder.tracks.front());
+      });
+}
 
-  // Set up headers
-  cpr::Header headers = {{"Authorization", "Bearer " + access_token}};
+bool SpotifyAPI::searchTrack(const std::string &query, Track &track) {
+  std::optional<Track> found =
+      wait(ApiEndpoint::search, searchTrackAsync(query));
+  track = found ? std::move(*found) : Track();
+  return found.has_value();
+}
 
+std::future<Track> SpotifyAPI::getTrackInfoAsync(const std::string &track_id) {
   // Make GET request
-  auto response = cpr::Get(cpr::Url{url}, headers, cpr::VerifySsl{false});
-
-  if (response.status_code == 200) {
-    Json::Value root;
-    Json::Reader reader;
-    if (reader.parse(response.text, root)) {
-      Track track;
-      track.id = root["id"].asString();
-      track.name = root["name"].asString();
-      track.artist = root["artists"][0]["name"].asString();
-      track.album = root["album"]["name"].asString();
-      track.duration_ms = root["duration_ms"].asInt();
-      track.uri = root["uri"].asString();
-      return track;
-    }
-  }
+  return call<Track>(ApiEndpoint::track,
+                     request(HttpRequest::Method::get, "/tracks/" + track_id),
+                     [](HttpResponse &response) {
+                       if (response.status_code == 200) {
+                         Metrics::Timer decode_timer(Stage::json_decode);
+                         TrackDecoder decoder(TrackDecoder::Source::track);
+                         if (decoder.feed(response.text) &&
+                             decoder.finish() && !decoder.tracks.empty()) {
+                           return std::move(decoder.tracks.front());
+                         }
+                       }
+                       return Track();
+                     });
+}
 
-  return Track();
+Track SpotifyAPI::getTrackInfo(std::string track_id) {
+  return wait(ApiEndpoint::track, getTrackInfoAsync(track_id));
 }
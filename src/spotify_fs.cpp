@@ -1,136 +1,1508 @@
 #include "spotify_fs.h"
+#include "epoch.h"
+#include "library_loader.h"
+#include "metrics.h"
+#include "request_scheduler.h"
 #include "spotify_api.h"
+#include "tracer.h"
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
-#include <fuse/fuse_lowlevel.h>
+#include <fcntl.h>
 #include <iostream>
-#include <thread>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <unordered_set>
 
-std::unordered_map<std::string, struct spotify_file *> SpotifyFileSystem::files;
+spotify_file SpotifyFileSystem::root;
+spotify_file SpotifyFileSystem::liked;
+std::unique_ptr<SavedTracksPager> SpotifyFileSystem::liked_pager;
+std::mutex SpotifyFileSystem::liked_mutex;
+TrackTable SpotifyFileSystem::track_table;
+spotify_options SpotifyFileSystem::options;
+time_t SpotifyFileSystem::mount_time;
+LibraryCache SpotifyFileSystem::cache;
+std::unique_ptr<MutationQueue> SpotifyFileSystem::mutations;
+std::unique_ptr<TrackResolver> SpotifyFileSystem::resolver;
+std::unique_ptr<TrackImporter> SpotifyFileSystem::importer;
+std::unique_ptr<PlaybackLauncher> SpotifyFileSystem::launcher;
+std::unique_ptr<SearchIndex> SpotifyFileSystem::search_index;
+std::atomic<uint64_t> SpotifyFileSystem::library_version{0};
+std::mutex SpotifyFileSystem::load_mutex;
+std::condition_variable SpotifyFileSystem::load_cv;
+std::thread SpotifyFileSystem::sync_thread;
+std::mutex SpotifyFileSystem::sync_mutex;
+std::condition_variable SpotifyFileSystem::sync_cv;
+bool SpotifyFileSystem::sync_stopping = false;
+std::function<void(spotify_file *, const std::string &)>
+    SpotifyFileSystem::invalidate;
 
-void SpotifyFileSystem::init() {
+void SpotifyFileSystem::init(const spotify_options &options) {
   SpotifyFileSystem::cleanup();
-  std::vector<Playlist> playlists =
-      SpotifyAPI::getInstance()->getAllPlaylists();
+  SpotifyFileSystem::options = options;
+  if (options.trace) {
+    Tracer::start(options.trace);
+  }
+  mount_time = time(NULL);
+  search_index = std::make_unique<SearchIndex>(track_table);
+  mutations = std::make_unique<MutationQueue>(
+      std::chrono::milliseconds(options.flush_delay));
+  // Misses are kept briefly so a name that is probed repeatedly, like an
+  // editor's swap file, is not searched every time
+  resolver = std::make_unique<TrackResolver>(
+      options.search_cache_size, std::chrono::seconds(options.search_ttl),
+      std::chrono::seconds(60));
+  importer = std::make_unique<TrackImporter>(
+      options.import_concurrency,
+      [](const std::string &query) { return resolver->resolve(query); },
+      [](const std::string &playlist_id, const std::vector<Track> &tracks) {
+        Epoch::ReadGuard guard;
+        spotify_file *playlist = findPlaylist(playlist_id);
+        if (playlist) {
+          importTracks(playlist, tracks);
+        }
+      });
+
+  if (options.playback) {
+#ifdef __APPLE__
+    const char *command = "open";
+#else
+    const char *command = "xdg-open";
+#endif
+    // Opening a file several times in a row, as file managers do, starts
+    // playback once
+    launcher = std::make_unique<PlaybackLauncher>(
+        command, std::chrono::milliseconds(2000));
+  }
+
+  if (options.liked_songs) {
+    liked.id = ":liked"; // Playlist IDs are base62, so this is never one
+    liked.setName("Liked Songs");
+    liked.is_playlist = true;
+    liked.state = load_state::loaded; // Fetched page by page instead
+    liked.track_count = 0;
+    liked_pager = std::make_unique<SavedTracksPager>();
+  }
+
+  // Tracks of playlists that did not change since the last mount are served
+  // from the cached snapshot, matched by playlist ID and snapshot ID
+  std::unordered_map<std::string_view, size_t> cached;
+  if (cache.open(cachePath())) {
+    for (size_t i = 0; i < cache.playlistCount(); ++i) {
+      cached[cache.str(cache.playlist(i).id)] = i;
+    }
+  }
+
+  std::vector<Playlist> playlists;
+  if (!SpotifyAPI::getInstance()->getAllPlaylists(playlists)) {
+    std::cerr << "Failed to list all playlists" << std::endl;
+  }
+  std::cout << "Found " << playlists.size() << " playlists" << std::endl;
+  uniqueNames(playlists);
+
+  // Only the playlists are loaded here, tracks are fetched on first access
+  std::vector<spotify_file *> loaded;
+  size_t reused = 0;
+  for (const auto &playlist : playlists) {
+    spotify_file *pl = newPlaylist(playlist);
+    auto it = cached.find(playlist.id);
+    if (it != cached.end() &&
+        cache.str(cache.playlist(it->second).snapshot_id) ==
+            playlist.snapshot_id) {
+      pl->cache_index = it->second;
+      ++reused;
+    }
+
+    loaded.push_back(pl);
+  }
+  addEntries(&root, loaded);
+  std::cout << "Reusing cached tracks of " << reused << " of "
+            << playlists.size() << " playlists" << std::endl;
+
+  sync_stopping = false;
+  if (options.sync_interval > 0) {
+    sync_thread = std::thread(syncLoop);
+  }
+}
+
+void SpotifyFileSystem::destroy(void *private_data) {
+  {
+    std::lock_guard<std::mutex> lock(sync_mutex);
+    sync_stopping = true;
+    sync_cv.notify_all();
+  }
+  if (sync_thread.joinable()) {
+    sync_thread.join();
+  }
+  launcher.reset();
+  importer.reset();  // Drops imports that were not resolved yet
+  mutations.reset(); // Sends all pending changes
+  saveCache();
+  cleanup();
+  Tracer::stop();
+}
+
+std::string SpotifyFileSystem::cachePath() {
+  std::string dir;
+  if (options.cache_dir) {
+    dir = options.cache_dir;
+  } else {
+    const char *xdg_cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg_cache && *xdg_cache) {
+      dir = xdg_cache;
+    } else if (home) {
+      dir = std::string(home) + "/.cache";
+    } else {
+      dir = "/tmp";
+    }
+    mkdir(dir.c_str(), 0700);
+    dir += "/spotifyvfs";
+  }
+  mkdir(dir.c_str(), 0700);
+  return dir + "/library.bin";
+}
+
+void SpotifyFileSystem::saveCache() {
+  Epoch::ReadGuard guard;
+  LibraryCacheWriter writer;
+  for (spotify_file *playlist : entriesOf(&root)->children) {
+    if (playlist->state == load_state::loaded) {
+      writer.addPlaylist(playlist->id, playlist->name(), playlist->snapshot_id);
+      const dir_entries *entries = entriesOf(playlist);
+      auto add = [&writer](uint32_t track, uint32_t added_at) {
+        const TrackTable::Record &record = track_table.get(track);
+        writer.addTrack(track_table.id(track), track_table.str(record.name),
+                        track_table.str(record.artist),
+                        track_table.str(record.album), track_table.uri(track),
+                        record.duration_ms, added_at);
+      };
+      // In Spotify's order, hidden duplicates included, so that they are
+      // hidden again when the cache is loaded
+      size_t hidden = 0;
+      for (size_t i = 0; i < entries->tracks.size(); ++i) {
+        for (; hidden < entries->hidden.size() &&
+               entries->hidden[hidden].position <= i + hidden;
+             ++hidden) {
+          add(entries->hidden[hidden].track, entries->hidden[hidden].added_at);
+        }
+        add(entries->tracks[i], entries->added_at[i]);
+      }
+      for (; hidden < entries->hidden.size(); ++hidden) {
+        add(entries->hidden[hidden].track, entries->hidden[hidden].added_at);
+      }
+    } else if (playlist->cache_index >= 0) {
+      // Never accessed during this mount, carry the cached tracks over
+      const auto &record = cache.playlist(playlist->cache_index);
+      writer.addPlaylist(playlist->id, playlist->name(), playlist->snapshot_id);
+      for (uint64_t i = 0; i < record.track_count; ++i) {
+        const auto &track = cache.track(record.first_track + i);
+        writer.addTrack(cache.str(track.id), cache.str(track.name),
+                        cache.str(track.artist), cache.str(track.album),
+                        cache.str(track.uri), track.duration_ms,
+                        track.added_at);
+      }
+    } else {
+      // Tracks unknown, the playlist is fetched again on next mount
+      writer.addPlaylist(playlist->id, playlist->name(), "");
+    }
+  }
+  writer.save(cachePath());
+}
+
+const dir_entries *SpotifyFileSystem::entriesOf(spotify_file *dir) {
+  static const dir_entries empty;
+  const dir_entries *entries = dir->entries.load();
+  return entries ? entries : &empty;
+}
+
+spotify_file *SpotifyFileSystem::lookup(spotify_file *dir,
+                                        std::string_view name) {
+  const dir_entries *entries = entriesOf(dir);
+  auto it = entries->index.find(name);
+  if (it == entries->index.end()) {
+    return nullptr;
+  }
+  return entries->children[it->second];
+}
+
+long SpotifyFileSystem::lookupTrack(spotify_file *playlist,
+                                    std::string_view name, time_t *added_at) {
+  const dir_entries *entries = entriesOf(playlist);
+  auto it = entries->index.find(name);
+  if (it == entries->index.end()) {
+    return -1;
+  }
+  if (added_at) {
+    *added_at = entries->added_at[it->second];
+  }
+  return entries->tracks[it->second];
+}
+
+void SpotifyFileSystem::updateEntries(
+    spotify_file *dir, const std::function<void(dir_entries &)> &change) {
+  std::lock_guard<std::mutex> lock(dir->write_mutex);
+  const dir_entries *old_entries = dir->entries.load();
+  auto new_entries = old_entries ? new dir_entries(*old_entries)
+                                 : new dir_entries();
+  change(*new_entries);
+  dir->entries.store(new_entries);
+  ++dir->version;
+  ++library_version;
+  if (old_entries) {
+    Epoch::retire(old_entries);
+  }
+}
+
+void SpotifyFileSystem::addEntries(spotify_file *dir,
+                                   const std::vector<spotify_file *> &added) {
+  updateEntries(dir, [&added](dir_entries &entries) {
+    entries.children.reserve(entries.children.size() + added.size());
+    entries.index.reserve(entries.index.size() + added.size());
+    for (spotify_file *entry : added) {
+      if (entries.index.count(entry->name())) {
+        delete entry; // Not published yet, nobody can see it
+        continue;
+      }
+      entries.index[entry->name()] = entries.children.size();
+      entries.children.push_back(entry);
+    }
+  });
+}
+
+bool SpotifyFileSystem::addEntry(spotify_file *dir, spotify_file *entry) {
+  bool added = false;
+  updateEntries(dir, [entry, &added](dir_entries &entries) {
+    if (entries.index.count(entry->name())) {
+      return;
+    }
+    entries.index[entry->name()] = entries.children.size();
+    entries.children.push_back(entry);
+    added = true;
+  });
+  return added;
+}
+
+std::vector<uint32_t>
+SpotifyFileSystem::addTracks(spotify_file *playlist,
+                             const std::vector<uint32_t> &added,
+                             const std::vector<uint32_t> &added_at,
+                             bool from_spotify) {
+  std::vector<uint32_t> listed; // Names that were not taken
+  updateEntries(playlist, [&](dir_entries &entries) {
+    entries.tracks.reserve(entries.tracks.size() + added.size());
+    entries.added_at.reserve(entries.added_at.size() + added.size());
+    entries.index.reserve(entries.index.size() + added.size());
+    for (size_t i = 0; i < added.size(); ++i) {
+      // The name lives in the track table, which never moves it
+      if (entries.index.emplace(track_table.name(added[i]),
+                                entries.tracks.size())
+              .second) {
+        entries.tracks.push_back(added[i]);
+        entries.added_at.push_back(added_at[i]);
+        listed.push_back(added[i]);
+      } else if (from_spotify) {
+        size_t position = entries.tracks.size() + entries.hidden.size();
+        entries.hidden.push_back({position, added[i], added_at[i]});
+      }
+    }
+  });
+  search_index->add(playlist, listed);
+  return listed;
+}
+
+bool SpotifyFileSystem::addTrackEntry(spotify_file *playlist, uint32_t track,
+                                      time_t added_at,
+                                      const std::string &alias) {
+  bool added = false;
+  updateEntries(playlist, [&](dir_entries &entries) {
+    size_t pos = entries.tracks.size();
+    if (!entries.index.emplace(track_table.name(track), pos).second) {
+      return;
+    }
+    entries.tracks.push_back(track);
+    entries.added_at.push_back(added_at);
+    if (!alias.empty() && !entries.index.count(alias)) {
+      entries.aliases.push_back(std::make_shared<const std::string>(alias));
+      entries.index[*entries.aliases.back()] = pos;
+    }
+    added = true;
+  });
+  if (added) {
+    search_index->add(playlist, {track});
+  }
+  return added;
+}
+
+void SpotifyFileSystem::addAlias(spotify_file *dir, const std::string &alias,
+                                 std::string_view name) {
+  updateEntries(dir, [&alias, name](dir_entries &entries) {
+    auto it = entries.index.find(name);
+    if (it == entries.index.end() || entries.index.count(alias)) {
+      return;
+    }
+    size_t pos = it->second;
+    entries.aliases.push_back(std::make_shared<const std::string>(alias));
+    entries.index[*entries.aliases.back()] = pos;
+  });
+}
+
+bool SpotifyFileSystem::removeTrack(spotify_file *playlist, uint32_t track,
+                                    removed_track *removed_entry) {
+  bool removed = false;
+  updateEntries(playlist, [&](dir_entries &entries) {
+    auto it = entries.index.find(track_table.name(track));
+    if (it == entries.index.end() || entries.tracks[it->second] != track) {
+      return;
+    }
+    removed = true;
+    size_t pos = it->second;
+
+    // Spotify removes every occurrence of the track, the hidden ones too.
+    // The remaining hidden entries move up past the removed ones.
+    size_t position = spotifyPosition(entries, pos), gone = 0;
+    std::vector<hidden_track> hidden;
+    hidden.reserve(entries.hidden.size());
+    if (removed_entry) {
+      removed_entry->pos = pos;
+      removed_entry->position = position;
+      removed_entry->added_at = entries.added_at[pos];
+      removed_entry->hidden.clear();
+      removed_entry->aliases.clear();
+      for (const auto &alias : entries.aliases) {
+        auto index = entries.index.find(*alias);
+        if (index != entries.index.end() && index->second == pos) {
+          removed_entry->aliases.push_back(alias);
+        }
+      }
+    }
+    for (hidden_track entry : entries.hidden) {
+      if (entry.track == track) {
+        if (removed_entry) {
+          removed_entry->hidden.push_back(entry);
+        }
+        ++gone;
+        continue;
+      }
+      entry.position -= gone + (entry.position > position ? 1 : 0);
+      hidden.push_back(entry);
+    }
+    entries.hidden = std::move(hidden);
+
+    entries.tracks.erase(entries.tracks.begin() + pos);
+    entries.added_at.erase(entries.added_at.begin() + pos);
+
+    // Drop every name of the entry, entries after it move up by one
+    for (auto index = entries.index.begin(); index != entries.index.end();) {
+      if (index->second == pos) {
+        index = entries.index.erase(index);
+        continue;
+      }
+      if (index->second > pos) {
+        --index->second;
+      }
+      ++index;
+    }
+    auto unused = [&entries](const std::shared_ptr<const std::string> &alias) {
+      return !entries.index.count(*alias);
+    };
+    entries.aliases.erase(std::remove_if(entries.aliases.begin(),
+                                         entries.aliases.end(), unused),
+                          entries.aliases.end());
+  });
+  if (removed) {
+    search_index->remove(playlist, {track});
+  }
+  return removed;
+}
+
+bool SpotifyFileSystem::restoreTrack(spotify_file *playlist, uint32_t track,
+                                     const removed_track &removed) {
+  bool restored = false;
+  updateEntries(playlist, [&](dir_entries &entries) {
+    if (entries.index.count(track_table.name(track))) {
+      return;
+    }
+    restored = true;
+    size_t pos = std::min(removed.pos, entries.tracks.size());
+
+    // The positions removeTrack took out come back, the remaining hidden
+    // entries move down past those before them
+    std::vector<size_t> returned = {removed.position};
+    for (const hidden_track &entry : removed.hidden) {
+      returned.push_back(entry.position);
+    }
+    std::sort(returned.begin(), returned.end());
+    std::vector<hidden_track> hidden;
+    hidden.reserve(entries.hidden.size() + removed.hidden.size());
+    for (hidden_track entry : entries.hidden) {
+      for (size_t position : returned) {
+        if (position <= entry.position) {
+          ++entry.position;
+        }
+      }
+      hidden.push_back(entry);
+    }
+    hidden.insert(hidden.end(), removed.hidden.begin(), removed.hidden.end());
+    std::sort(hidden.begin(), hidden.end(),
+              [](const hidden_track &a, const hidden_track &b) {
+                return a.position < b.position;
+              });
+    entries.hidden = std::move(hidden);
+
+    for (auto &index : entries.index) {
+      if (index.second >= pos) {
+        ++index.second;
+      }
+    }
+    entries.tracks.insert(entries.tracks.begin() + pos, track);
+    entries.added_at.insert(entries.added_at.begin() + pos, removed.added_at);
+    entries.index.emplace(track_table.name(track), pos);
+    for (const auto &alias : removed.aliases) {
+      if (entries.index.emplace(*alias, pos).second) {
+        entries.aliases.push_back(alias);
+      }
+    }
+  });
+  if (restored) {
+    search_index->add(playlist, {track});
+  }
+  return restored;
+}
+
+size_t SpotifyFileSystem::spotifyPosition(const dir_entries &entries,
+                                          size_t pos) {
+  // Every hidden entry up to the listed one comes before it in Spotify
+  for (const hidden_track &entry : entries.hidden) {
+    if (entry.position > pos) {
+      break;
+    }
+    ++pos;
+  }
+  return pos;
+}
+
+// Moves the listed entry at Spotify position `from` to before the one at
+// `before`, the way Spotify reorders the playlist
+static void reorderEntries(dir_entries &entries, size_t from, size_t before) {
+  auto listed = [&entries](size_t position) {
+    auto hidden = std::lower_bound(
+        entries.hidden.begin(), entries.hidden.end(), position,
+        [](const hidden_track &entry, size_t value) {
+          return entry.position < value;
+        });
+    return position - (hidden - entries.hidden.begin());
+  };
+  size_t old_pos = listed(from);
+  size_t to = listed(before) - (from < before ? 1 : 0);
+  auto move = [old_pos, to](std::vector<uint32_t> &items) {
+    auto first = items.begin() + old_pos, last = items.begin() + to;
+    if (old_pos < to) {
+      std::rotate(first, first + 1, last + 1);
+    } else {
+      std::rotate(last, first, first + 1);
+    }
+  };
+  move(entries.tracks);
+  move(entries.added_at);
+
+  // Every name of the entry moves along, the ones in between shift by one
+  for (auto &index : entries.index) {
+    size_t &pos = index.second;
+    if (pos == old_pos) {
+      pos = to;
+    } else if (old_pos < to && pos > old_pos && pos <= to) {
+      --pos;
+    } else if (to < old_pos && pos >= to && pos < old_pos) {
+      ++pos;
+    }
+  }
+  for (hidden_track &entry : entries.hidden) {
+    if (from < before && entry.position > from && entry.position < before) {
+      --entry.position;
+    } else if (before < from && entry.position >= before &&
+               entry.position < from) {
+      ++entry.position;
+    }
+  }
+}
+
+int SpotifyFileSystem::moveTrackEntry(
+    spotify_file *playlist, uint32_t track, size_t position,
+    const std::function<int(size_t, size_t)> &moved) {
+  int result = -ENOENT;
+  updateEntries(playlist, [&](dir_entries &entries) {
+    auto it = entries.index.find(track_table.name(track));
+    if (it == entries.index.end() || entries.tracks[it->second] != track) {
+      return;
+    }
+    size_t old_pos = it->second;
+    size_t to = std::min(position, entries.tracks.size() - 1);
+    result = 0;
+    if (to == old_pos) {
+      return;
+    }
+    // Hidden entries next to the target stay on the side they are on
+    size_t range_start = spotifyPosition(entries, old_pos);
+    size_t insert_before = spotifyPosition(entries, to) + (to > old_pos);
+    result = moved(range_start, insert_before);
+    if (result == 0) {
+      reorderEntries(entries, range_start, insert_before);
+    }
+  });
+  return result;
+}
+
+void SpotifyFileSystem::unmoveTrackEntry(spotify_file *playlist,
+                                         uint32_t track, size_t range_start,
+                                         size_t insert_before) {
+  // The move left the track right before `insert_before`
+  bool forward = range_start < insert_before;
+  size_t from = forward ? insert_before - 1 : insert_before;
+  size_t before = forward ? range_start : range_start + 1;
+  updateEntries(playlist, [&](dir_entries &entries) {
+    auto it = entries.index.find(track_table.name(track));
+    if (it == entries.index.end() || entries.tracks[it->second] != track ||
+        spotifyPosition(entries, it->second) != from) {
+      return;
+    }
+    reorderEntries(entries, from, before);
+  });
+}
+
+spotify_file *SpotifyFileSystem::findPlaylist(const std::string &id) {
+  if (liked_pager && id == liked.id) {
+    return &liked;
+  }
+  for (spotify_file *playlist : entriesOf(&root)->children) {
+    if (playlist->id == id) {
+      return playlist;
+    }
+  }
+  return nullptr;
+}
+
+spotify_file *SpotifyFileSystem::lookupPlaylist(std::string_view name) {
+  // Liked Songs shadows a playlist of the same name
+  if (liked_pager && name == liked.name()) {
+    return &liked;
+  }
+  return lookup(&root, name);
+}
+
+control_file SpotifyFileSystem::controlFile(const char *path,
+                                            spotify_file **playlist) {
+  static const std::pair<const char *, control_file> names[] = {
+      {".import", control_file::import},
+      {".import.status", control_file::import_status},
+      {".playlist.json", control_file::playlist_json},
+      {".tracks.tsv", control_file::tracks_tsv},
+      {".playlist.m3u", control_file::playlist_m3u},
+      {".library.tsv", control_file::library_tsv},
+      {".stats", control_file::stats},
+  };
+  const char *name = strrchr(path, '/') + 1;
+  control_file kind = control_file::none;
+  for (const auto &entry : names) {
+    if (strcmp(name, entry.first) == 0) {
+      kind = entry.second;
+      break;
+    }
+  }
+  if (kind == control_file::none) {
+    return control_file::none;
+  }
+
+  // The library index and the metrics are only in the root, the others only
+  // in playlists
+  bool in_root =
+      kind == control_file::library_tsv || kind == control_file::stats;
+  spotify_file *parent = nullptr;
+  resolve(path, &parent);
+  if (!parent || (parent == &root) != in_root || parent == &liked) {
+    return control_file::none;
+  }
+  *playlist = parent;
+  return kind;
+}
+
+void SpotifyFileSystem::submitImport(const std::string &playlist_id,
+                                     std::string &buffer, bool final) {
+  std::vector<std::string> queries;
+  size_t start = 0;
+  while (true) {
+    size_t end = buffer.find('\n', start);
+    if (end == std::string::npos) {
+      if (!final) {
+        break; // Wait for the rest of the line
+      }
+      end = buffer.size();
+    }
+    std::string line = buffer.substr(start, end - start);
+    line.erase(0, line.find_first_not_of(" \t\r"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty()) {
+      queries.push_back(std::move(line));
+    }
+    start = end + 1;
+    if (start >= buffer.size()) {
+      break;
+    }
+  }
+  buffer.erase(0, std::min(start, buffer.size()));
+  if (!queries.empty()) {
+    importer->submit(playlist_id, std::move(queries));
+  }
+}
+
+spotify_file *SpotifyFileSystem::resolve(const char *path,
+                                         spotify_file **parent) {
+  if (parent) {
+    *parent = nullptr;
+  }
+  if (path[0] != '/') {
+    return nullptr;
+  }
+
+  // Paths are "/", "/playlist" or "/playlist/track"
+  const char *name = path + 1;
+  const char *slash = strchr(name, '/');
+  if (!slash) {
+    if (*name == '\0') {
+      return &root;
+    }
+    if (parent) {
+      *parent = &root;
+    }
+    return lookupPlaylist(name);
+  }
+
+  std::string_view playlist_name(name, slash - name);
+  spotify_file *playlist = lookupPlaylist(playlist_name);
+  if (!playlist || strchr(slash + 1, '/')) {
+    return nullptr;
+  }
+  if (playlist->state != load_state::loaded) {
+    ensureLoaded(playlist);
+    playlist = lookupPlaylist(playlist_name); // Removed meanwhile?
+    if (!playlist) {
+      return nullptr;
+    }
+  }
+  if (parent) {
+    *parent = playlist;
+  }
+  return nullptr; // Entries of playlists are tracks
+}
+
+long SpotifyFileSystem::resolveTrack(const char *path,
+                                     spotify_file **playlist,
+                                     time_t *added_at) {
+  resolve(path, playlist);
+  if (!*playlist || *playlist == &root) {
+    return -1;
+  }
+  const char *name = strrchr(path, '/') + 1;
+  if (*playlist != &liked) {
+    return lookupTrack(*playlist, name, added_at);
+  }
+
+  // A saved track that was not fetched yet is searched for in the pages
+  // after the fetched ones. Only "Artist -- Track" names can match.
+  bool searchable = strstr(name, " -- ") != nullptr;
+  while (true) {
+    uint64_t version = liked.version;
+    long track = lookupTrack(&liked, name, added_at);
+    if (track >= 0 || !searchable || fetchLiked(version, 0) <= 0) {
+      return track;
+    }
+  }
+}
+
+spotify_file *SpotifyFileSystem::newPlaylist(const Playlist &playlist) {
+  auto pl = new spotify_file();
+  pl->id = playlist.id;
+  pl->setName(playlist.name);
+  pl->is_playlist = true;
+  pl->state = load_state::unloaded;
+  pl->track_count = playlist.track_count;
+  pl->snapshot_id = playlist.snapshot_id;
+  return pl;
+}
+
+void SpotifyFileSystem::uniqueNames(std::vector<Playlist> &playlists) {
+  std::unordered_set<std::string> taken = {".search"};
+  if (liked_pager) {
+    taken.insert(liked.name());
+  }
+  // Names as listed are kept by their first playlist, so a suffix never
+  // takes the name of a later one
+  std::unordered_set<std::string> listed;
   for (const auto &playlist : playlists) {
-    auto pl = new spotify_file();
-    pl->id = playlist.id;
-    pl->name = playlist.name;
-    pl->is_playlist = true;
-    files["/" + pl->name] = pl;
+    listed.insert(playlist.name);
+  }
+  std::vector<Playlist *> clashing;
+  for (auto &playlist : playlists) {
+    if (!taken.insert(playlist.name).second) {
+      clashing.push_back(&playlist);
+    }
+  }
+  for (Playlist *playlist : clashing) {
+    for (size_t n = 2;; ++n) {
+      std::string name = playlist->name + " (" + std::to_string(n) + ")";
+      if (!listed.count(name) && taken.insert(name).second) {
+        playlist->name = std::move(name);
+        break;
+      }
+    }
+  }
+}
+
+void SpotifyFileSystem::retirePlaylist(spotify_file *playlist) {
+  Epoch::retire([playlist]() {
+    // A load still in progress frees the node when it is done, see
+    // ensureLoaded. No new load can start, nobody can reach the node.
+    if (playlist->loaders.fetch_or(spotify_file::RETIRED) == 0) {
+      freePlaylist(playlist);
+    }
+  });
+}
+
+void SpotifyFileSystem::freePlaylist(spotify_file *playlist) {
+  // A load that finished after the playlist was removed listed its tracks
+  if (search_index) {
+    search_index->remove(playlist, entriesOf(playlist)->tracks);
+  }
+  delete playlist->entries.load();
+  delete playlist;
+}
+
+void SpotifyFileSystem::loadFromCache(spotify_file *playlist,
+                                      size_t record_index) {
+  const auto &record = cache.playlist(record_index);
+  std::vector<uint32_t> tracks, added_at;
+  tracks.reserve(record.track_count);
+  added_at.reserve(record.track_count);
+  for (uint64_t i = 0; i < record.track_count; ++i) {
+    const auto &track = cache.track(record.first_track + i);
+    tracks.push_back(track_table.add(
+        cache.str(track.id), cache.str(track.name), cache.str(track.artist),
+        cache.str(track.album), cache.str(track.uri), track.duration_ms));
+    added_at.push_back(track.added_at);
+  }
+  addTracks(playlist, tracks, added_at);
+}
+
+bool SpotifyFileSystem::loadPlaylist(spotify_file *playlist) {
+  if (playlist->cache_index >= 0) {
+    Metrics::add(Counter::playlists_from_cache);
+    loadFromCache(playlist, playlist->cache_index);
+    return true;
+  }
+  Metrics::add(Counter::playlists_from_api);
+
+  auto start = std::chrono::steady_clock::now();
+
+  Playlist request;
+  request.id = playlist->id;
+  request.name = playlist->name();
+  request.track_count = playlist->track_count;
+
+  LibraryLoader loader(options.load_concurrency);
+  LoadedPlaylist loaded = std::move(loader.load({request}).front());
+
+  std::vector<uint32_t> tracks, added_at;
+  tracks.reserve(loaded.tracks.size());
+  added_at.reserve(loaded.tracks.size());
+  for (const auto &track : loaded.tracks) {
+    tracks.push_back(track_table.add(track.id,
+                                     track.artist + " -- " + track.name,
+                                     track.artist, track.album, track.uri,
+                                     track.duration_ms));
+    added_at.push_back(track.added_at);
+  }
+  addTracks(playlist, tracks, added_at);
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "Loaded " << loaded.tracks.size() << " tracks of playlist "
+            << playlist->name() << " in " << elapsed.count() << " ms"
+            << std::endl;
+  return loaded.complete;
+}
+
+int SpotifyFileSystem::fetchLiked(uint64_t version, size_t ahead) {
+  std::lock_guard<std::mutex> lock(liked_mutex);
+  if (liked.version != version) {
+    return 1; // Another thread published a page meanwhile
+  }
+  std::vector<Track> page;
+  bool fetched;
+  {
+    Epoch::Unpin unpin; // Liked Songs is static, it cannot go away
+    fetched = liked_pager->next(page);
+  }
+  if (!fetched) {
+    return liked_pager->complete() ? 0 : -EIO;
+  }
+  liked_pager->prefetch(ahead);
+
+  std::vector<uint32_t> tracks, added_at;
+  tracks.reserve(page.size());
+  added_at.reserve(page.size());
+  for (const auto &track : page) {
+    tracks.push_back(track_table.add(track.id,
+                                     track.artist + " -- " + track.name,
+                                     track.artist, track.album, track.uri,
+                                     track.duration_ms));
+    added_at.push_back(track.added_at);
+  }
+  addTracks(&liked, tracks, added_at);
+  return 1;
+}
+
+void SpotifyFileSystem::ensureLoaded(spotify_file *playlist) {
+  if (playlist->state.load() == load_state::loaded) {
+    return;
+  }
+  fetchUnpinned(playlist, [playlist]() { loadOnce(playlist); });
+}
+
+void SpotifyFileSystem::fetchUnpinned(spotify_file *playlist,
+                                      const std::function<void()> &fetch) {
+  // The fetch can take seconds, longer when rate limited. Nothing retired
+  // anywhere could be freed while the caller's pin is held, so the node is
+  // kept alive by `loaders` instead; the last loader of a retired node
+  // frees it.
+  ++playlist->loaders;
+  {
+    Epoch::Unpin unpin;
+    fetch();
+  }
+  if (playlist->loaders.fetch_sub(1) == (spotify_file::RETIRED | 1)) {
+    // Retired while the caller is pinned again, so it goes after the
+    // caller's guard and the entries the fetch retired
+    Epoch::retire([playlist]() { freePlaylist(playlist); });
+  }
+}
+
+void SpotifyFileSystem::loadOnce(spotify_file *playlist) {
+  std::unique_lock<std::mutex> lock(load_mutex);
+  if (playlist->state == load_state::loading) {
+    Metrics::Timer timer(Stage::load_wait);
+    load_cv.wait(lock, [playlist]() {
+      return playlist->state != load_state::loading;
+    });
+  }
+  if (playlist->state == load_state::loaded) {
+    return;
+  }
+
+  // Fetch the tracks without holding the lock so other playlists stay usable
+  playlist->state = load_state::loading;
+  lock.unlock();
+  bool complete = loadPlaylist(playlist);
+  lock.lock();
+  playlist->state = complete ? load_state::loaded : load_state::failed;
+  load_cv.notify_all();
+}
+
+void SpotifyFileSystem::syncLoop() {
+  // Syncing must not delay requests made on behalf of FUSE operations
+  RequestScheduler::PriorityScope scope(RequestPriority::background);
+  auto interval = std::chrono::seconds(options.sync_interval);
+
+  std::unique_lock<std::mutex> lock(sync_mutex);
+  while (!sync_cv.wait_for(lock, interval, []() { return sync_stopping; })) {
+    lock.unlock();
+    syncLibrary();
+    lock.lock();
+  }
+}
+
+void SpotifyFileSystem::syncLibrary() {
+  if (liked_pager) {
+    syncLiked();
+  }
+
+  // An unchanged library costs only the listing
+  std::vector<Playlist> listed;
+  if (!SpotifyAPI::getInstance()->getAllPlaylists(listed)) {
+    return; // An incomplete listing would look like removed playlists
+  }
+  uniqueNames(listed);
+
+  Epoch::ReadGuard guard;
+  std::unordered_map<std::string_view, spotify_file *> local;
+  for (spotify_file *playlist : entriesOf(&root)->children) {
+    local[playlist->id] = playlist;
+  }
+
+  // Playlists renamed in Spotify keep their node and tracks under the new
+  // name
+  std::vector<spotify_file *> added;
+  std::unordered_map<spotify_file *, const std::string *> renamed;
+  std::vector<std::pair<std::string, const Playlist *>> changed;
+  std::unordered_set<std::string_view> listed_ids;
+  for (const auto &playlist : listed) {
+    listed_ids.insert(playlist.id);
+    auto it = local.find(playlist.id);
+    if (it == local.end()) {
+      added.push_back(newPlaylist(playlist));
+    } else {
+      if (it->second->name() != playlist.name) {
+        renamed[it->second] = &playlist.name;
+      }
+      if (it->second->snapshot_id != playlist.snapshot_id) {
+        changed.emplace_back(playlist.id, &playlist);
+      }
+    }
+  }
+  std::unordered_set<spotify_file *> removed;
+  for (const auto &playlist : local) {
+    if (!listed_ids.count(playlist.first)) {
+      removed.insert(playlist.second);
+    }
+  }
+
+  if (!added.empty() || !renamed.empty() || !removed.empty()) {
+    std::vector<std::string> names; // Root entries that changed
+    std::vector<spotify_file *> retired;
+    std::vector<const std::string *> old_names;
+    size_t postponed = 0; // Renames left for the next sync
+    size_t published = 0; // Added playlists that got an entry
+    updateEntries(&root, [&](dir_entries &entries) {
+      // Names the remaining playlists end up with. A rename to a name that
+      // another remaining playlist keeps or is renamed to would leave one of
+      // them without an entry; both keep their old name until a sync sees
+      // the names apart. Reverting can clash with another rename, so this
+      // repeats until the names are distinct.
+      std::unordered_map<spotify_file *, std::string_view> final_names;
+      for (spotify_file *playlist : entries.children) {
+        if (!removed.count(playlist)) {
+          auto rename = renamed.find(playlist);
+          final_names[playlist] = rename != renamed.end()
+                                      ? std::string_view(*rename->second)
+                                      : std::string_view(playlist->name());
+        }
+      }
+      bool clashed = true;
+      while (clashed) {
+        clashed = false;
+        std::unordered_map<std::string_view, size_t> uses;
+        for (const auto &final_name : final_names) {
+          ++uses[final_name.second];
+        }
+        for (auto &final_name : final_names) {
+          spotify_file *playlist = final_name.first;
+          if (uses[final_name.second] > 1 &&
+              final_name.second != playlist->name()) {
+            final_name.second = playlist->name();
+            ++postponed;
+            clashed = true;
+          }
+        }
+      }
+
+      dir_entries next;
+      next.children.reserve(entries.children.size() + added.size());
+      auto keep = [&next](spotify_file *playlist) {
+        if (!next.index.emplace(playlist->name(), next.children.size())
+                 .second) {
+          return false; // Name taken by another playlist
+        }
+        next.children.push_back(playlist);
+        return true;
+      };
+      for (spotify_file *playlist : entries.children) {
+        if (removed.count(playlist)) {
+          names.push_back(playlist->name());
+          retired.push_back(playlist);
+          continue;
+        }
+        std::string_view name = final_names.at(playlist);
+        if (name != playlist->name()) {
+          names.push_back(playlist->name());
+          old_names.push_back(playlist->replaceName(std::string(name)));
+          names.push_back(playlist->name());
+        }
+        if (!keep(playlist)) {
+          // Cannot happen with distinct names; dropping it without
+          // retiring it would leak the node and its search entries
+          std::cerr << "Sync: playlist " << playlist->name()
+                    << " lost its entry" << std::endl;
+          names.push_back(playlist->name());
+          retired.push_back(playlist);
+        }
+      }
+      for (spotify_file *playlist : added) {
+        if (keep(playlist)) {
+          names.push_back(playlist->name());
+          ++published;
+        } else {
+          delete playlist; // Not published, picked up again next sync
+        }
+      }
+      entries = std::move(next);
+    });
+    for (const std::string *name : old_names) {
+      Epoch::retire(name);
+    }
+    for (spotify_file *playlist : retired) {
+      search_index->remove(playlist, entriesOf(playlist)->tracks);
+      retirePlaylist(playlist);
+    }
+    // A playlist that found its name taken is offered again by every sync,
+    // which only counts once it gets an entry
+    if (!names.empty() || postponed > 0) {
+      if (invalidate) {
+        for (const auto &name : names) {
+          invalidate(&root, name);
+        }
+        invalidate(&root, "");
+      }
+      std::cout << "Sync: " << published << " playlists added, "
+                << renamed.size() - postponed << " renamed, "
+                << removed.size() << " removed";
+      if (postponed > 0) {
+        std::cout << ", " << postponed << " renames postponed";
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  // Each fetch releases the pin, so the playlists are looked up by ID
+  for (const auto &playlist : changed) {
+    spotify_file *node = findPlaylist(playlist.first);
+    if (node) {
+      syncTracks(node, *playlist.second);
+    }
+  }
+}
+
+void SpotifyFileSystem::syncTracks(spotify_file *playlist,
+                                   const Playlist &listed) {
+  {
+    std::lock_guard<std::mutex> lock(load_mutex);
+    if (playlist->state == load_state::loading) {
+      return; // Compared again on the next sync
+    }
+    if (playlist->state != load_state::loaded) {
+      // Not loaded yet, the next access fetches the current tracks
+      playlist->snapshot_id = listed.snapshot_id;
+      playlist->track_count = listed.track_count;
+      playlist->cache_index = -1;
+      return;
+    }
+  }
+  if (mutations->hasPending(playlist->id)) {
+    return; // Our own changes are not in Spotify yet
+  }
+
+  // Changes made during the fetch would be overwritten by its result, which
+  // is then dropped; the next sync compares again
+  uint64_t version = playlist->version;
+  std::string playlist_id = playlist->id;
+  LoadedPlaylist loaded;
+  fetchUnpinned(playlist, [&]() {
+    LibraryLoader loader(options.load_concurrency);
+    loaded = std::move(loader.load({listed}).front());
+  });
+  if (!loaded.complete || findPlaylist(playlist_id) != playlist) {
+    return;
+  }
+  std::vector<uint32_t> fresh;
+  fresh.reserve(loaded.tracks.size());
+  for (const auto &track : loaded.tracks) {
+    fresh.push_back(track_table.add(track.id,
+                                    track.artist + " -- " + track.name,
+                                    track.artist, track.album, track.uri,
+                                    track.duration_ms));
+  }
+
+  // Tracks are shared through the table, so entries that stayed keep their
+  // identity and only the names of added and removed ones change
+  std::vector<std::string> names;
+  std::vector<uint32_t> removed, added;
+  bool listing_changed = false, stale = false;
+  updateEntries(playlist, [&](dir_entries &entries) {
+    if (playlist->version != version ||
+        mutations->hasPending(playlist_id)) {
+      stale = true;
+      return;
+    }
+    dir_entries next;
+    next.tracks.reserve(fresh.size());
+    next.added_at.reserve(fresh.size());
+    for (size_t i = 0; i < fresh.size(); ++i) {
+      if (next.index.emplace(track_table.name(fresh[i]), next.tracks.size())
+              .second) {
+        next.tracks.push_back(fresh[i]);
+        next.added_at.push_back(loaded.tracks[i].added_at);
+      } else {
+        next.hidden.push_back(
+            {i, fresh[i], static_cast<uint32_t>(loaded.tracks[i].added_at)});
+      }
+    }
+    if (next.tracks == entries.tracks && next.added_at == entries.added_at) {
+      // Only unlisted duplicates may have changed
+      entries.hidden = std::move(next.hidden);
+      return;
+    }
+    listing_changed = true;
 
-    // Load tracks for this playlist
-    std::vector<Track> tracks =
-        SpotifyAPI::getInstance()->getPlaylistTracks(playlist.id);
-    for (const auto &track : tracks) {
-      auto track_file = new spotify_file();
-      track_file->id = track.id;
-      track_file->name = track.artist + " -- " + track.name;
-      track_file->is_playlist = false;
-      track_file->duration_ms = track.duration_ms;
-      track_file->uri = track.uri;
-      // Store track with path: /playlist_name/track_name
-      files["/" + pl->name + "/" + track_file->name] = track_file;
+    std::unordered_set<uint32_t> before(entries.tracks.begin(),
+                                        entries.tracks.end());
+    std::unordered_set<uint32_t> after(next.tracks.begin(),
+                                       next.tracks.end());
+    for (uint32_t track : entries.tracks) {
+      if (!after.count(track)) {
+        names.emplace_back(track_table.name(track));
+        removed.push_back(track);
+      }
+    }
+    for (uint32_t track : next.tracks) {
+      if (!before.count(track)) {
+        names.emplace_back(track_table.name(track));
+        added.push_back(track);
+      }
     }
+
+    // Names files were created with stay valid while their track does
+    for (const auto &alias : entries.aliases) {
+      uint32_t track = entries.tracks[entries.index.at(*alias)];
+      auto target = next.index.find(track_table.name(track));
+      if (target != next.index.end() && next.tracks[target->second] == track &&
+          !next.index.count(*alias)) {
+        next.aliases.push_back(alias);
+        next.index[*alias] = target->second;
+      } else if (target == next.index.end()) {
+        names.push_back(*alias);
+      }
+    }
+    entries = std::move(next);
+  });
+  if (stale) {
+    return; // The snapshot stays behind, so the next sync fetches again
+  }
+  playlist->snapshot_id = listed.snapshot_id;
+  playlist->track_count = listed.track_count;
+  search_index->remove(playlist, removed);
+  search_index->add(playlist, added);
+
+  if (listing_changed) {
+    if (invalidate) {
+      for (const auto &name : names) {
+        invalidate(playlist, name);
+      }
+      invalidate(playlist, "");
+    }
+    std::cout << "Sync: updated tracks of playlist " << playlist->name()
+              << std::endl;
   }
 }
 
+void SpotifyFileSystem::syncLiked() {
+  // The saved tracks are listed most recently saved first, so saving or
+  // removing one shifts every page. The newest track and the total tell
+  // whether the pages taken so far are still current.
+  std::vector<Track> newest;
+  int total = 0;
+  if (!SpotifyAPI::getInstance()->getSavedTracksPage(0, 1, newest, total)) {
+    return;
+  }
+
+  Epoch::ReadGuard guard;
+  std::vector<uint32_t> dropped;
+  {
+    std::lock_guard<std::mutex> lock(liked_mutex);
+    if (liked_pager->savedTracks() < 0) {
+      return; // Nothing fetched yet
+    }
+    const dir_entries *entries = entriesOf(&liked);
+    bool same_newest =
+        newest.empty()
+            ? entries->tracks.empty()
+            : !entries->tracks.empty() &&
+                  track_table.id(entries->tracks.front()) == newest[0].id;
+    if (liked_pager->savedTracks() == total && same_newest) {
+      return;
+    }
+    // Lookups and listings under way see the new version and fetch again
+    liked_pager->reset();
+    updateEntries(&liked, [&dropped](dir_entries &entries) {
+      dropped = std::move(entries.tracks);
+      entries = dir_entries();
+    });
+  }
+  search_index->remove(&liked, dropped);
+
+  if (invalidate) {
+    for (uint32_t track : dropped) {
+      invalidate(&liked, std::string(track_table.name(track)));
+    }
+    invalidate(&liked, "");
+  }
+  std::cout << "Sync: Liked Songs changed, " << total << " saved tracks"
+            << std::endl;
+}
+
 int SpotifyFileSystem::getFileAttributes(const char *path, struct stat *stbuf) {
+  Epoch::ReadGuard guard;
   memset(stbuf, 0, sizeof(struct stat));
 
-  if (strcmp(path, "/") == 0) {
-    stbuf->st_mode = S_IFDIR | 0777;
-    stbuf->st_nlink = 2;
+  // Queries are read-only directories of symlinks to their results
+  std::string query, entry;
+  if (int depth = searchPath(path, query, entry)) {
+    if (depth < 3) {
+      stbuf->st_mode = S_IFDIR | 0555;
+      stbuf->st_nlink = 2;
+    } else {
+      std::string target;
+      if (!searchTarget(query, entry, target)) {
+        return -ENOENT;
+      }
+      stbuf->st_mode = S_IFLNK | 0777;
+      stbuf->st_nlink = 1;
+      stbuf->st_size = target.size();
+    }
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
-    stbuf->st_mtime = time(NULL);
+    stbuf->st_mtime = mount_time;
     return 0;
   }
 
-  auto it = files.find(path);
-  if (it != files.end()) {
-    if (it->second->is_playlist) {
-      stbuf->st_mode = S_IFDIR | 0777;
-      stbuf->st_nlink = 2;
-    } else {
-      stbuf->st_mode = S_IFREG | 0666;
-      stbuf->st_nlink = 1;
-      stbuf->st_size =
-          it->second->duration_ms > 0 ? it->second->duration_ms : 1024;
+  spotify_file *playlist = nullptr;
+  control_file control = controlFile(path, &playlist);
+  if (control != control_file::none) {
+    stbuf->st_mode =
+        S_IFREG | (control == control_file::import ? 0222 : 0444);
+    stbuf->st_nlink = 1;
+    if (control == control_file::import_status) {
+      stbuf->st_size = importer->status(playlist->id).size();
+    } else if (isIndexFile(control)) {
+      stbuf->st_size = indexFile(playlist, control)->size();
     }
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
-    stbuf->st_mtime = time(NULL);
+    stbuf->st_mtime = mount_time;
     return 0;
   }
 
-  return -ENOENT;
+  // Attributes only change with the entries themselves, so the kernel can
+  // keep them for the whole attr_timeout
+  stbuf->st_mtime = mount_time;
+  if (spotify_file *dir = resolve(path, &playlist)) {
+    // Liked Songs is read-only
+    stbuf->st_mode = S_IFDIR | (dir == &liked ? 0555 : 0777);
+    stbuf->st_nlink = 2;
+  } else {
+    time_t added_at = 0;
+    long track = resolveTrack(path, &playlist, &added_at);
+    if (track < 0) {
+      return -ENOENT;
+    }
+    size_t duration_ms = track_table.get(track).duration_ms;
+    stbuf->st_mode = S_IFREG | (playlist == &liked ? 0444 : 0666);
+    stbuf->st_nlink = 1;
+    stbuf->st_size = duration_ms > 0 ? duration_ms : 1024;
+    if (added_at > 0) {
+      stbuf->st_mtime = added_at;
+    }
+  }
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  return 0;
 }
 
 int SpotifyFileSystem::listFiles(const char *path, void *buf,
                                  fuse_fill_dir_t filler, off_t offset,
                                  struct fuse_file_info *fi) {
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+  Epoch::ReadGuard guard;
+  std::string query, entry;
+  switch (searchPath(path, query, entry)) {
+  case 1:
+  case 2:
+    return listSearch(query, buf, filler, offset);
+  case 3:
+    return -ENOTDIR;
+  }
+  spotify_file *dir = resolve(path);
+  if (!dir) {
+    return -ENOENT;
+  }
+  if (dir != &root && dir->state != load_state::loaded) {
+    ensureLoaded(dir);
+    dir = resolve(path); // Removed meanwhile?
+    if (!dir) {
+      return -ENOENT;
+    }
+  }
 
-  if (strcmp(path, "/") == 0) {
-    // List all playlists in root
-    for (const auto &pair : files) {
-      if (pair.second->is_playlist) {
-        // Use original name for playlists
-        std::string name = pair.second->name;
-        filler(buf, name.c_str(), NULL, 0);
+  // Each entry is reported with the offset of the entry after it, so a large
+  // directory can be listed over several calls. Offsets 0 and 1 are "." and
+  // "..", entry i of the directory is at offset i + 2.
+  static const char *dots[] = {".", ".."};
+  for (off_t i = offset; i < 2; ++i) {
+    if (filler(buf, dots[i], NULL, i + 1)) {
+      return 0;
+    }
+  }
+  const dir_entries *entries = entriesOf(dir);
+  if (dir == &root) {
+    // Liked Songs comes first, the playlists follow it
+    off_t first = 2;
+    if (liked_pager) {
+      if (offset <= 2 && filler(buf, liked.name().c_str(), NULL, 3)) {
+        return 0;
       }
+      first = 3;
     }
-  } else {
-    // List tracks in a playlist
-    for (const auto &pair : files) {
-      std::string parent_path = std::string(path) + "/";
-      if (pair.first.find(parent_path) == 0 && !pair.second->is_playlist) {
-        // Use the original filename instead of the formatted name
-        std::string filename =
-            pair.first.substr(pair.first.find_last_of('/') + 1);
-        filler(buf, filename.c_str(), NULL, 0);
+    for (size_t i = offset > first ? offset - first : 0;
+         i < entries->children.size(); ++i) {
+      if (filler(buf, entries->children[i]->name().c_str(), NULL,
+                 i + first + 1)) {
+        break;
       }
     }
+    return 0;
+  }
+
+  // Liked Songs is fetched only as far as it is listed. Once a listing is
+  // continued past its first call, pages after the fetched ones are
+  // requested ahead, so that they arrive while these are delivered. Like
+  // readahead, the further the listing got the more pages are in flight.
+  size_t first = offset > 2 ? offset - 2 : 0;
+  size_t ahead = 0;
+  if (dir == &liked && offset > 2) {
+    size_t page_size = liked_pager->pageSize();
+    ahead = std::clamp<size_t>(first / page_size, 1,
+                               std::max(options.load_concurrency, 1));
+    if (first + page_size >= entries->tracks.size()) {
+      std::lock_guard<std::mutex> lock(liked_mutex);
+      liked_pager->prefetch(ahead);
+    }
+  }
+
+  // Names in the track table are not NUL-terminated
+  std::string name;
+  size_t i = first;
+  while (true) {
+    if (i >= entries->tracks.size()) {
+      if (dir != &liked) {
+        break;
+      }
+      // Entries published by another thread are listed before more are
+      // fetched
+      uint64_t version = liked.version;
+      entries = entriesOf(&liked);
+      if (i >= entries->tracks.size()) {
+        // The first call of a listing ends with the first page, so that a
+        // listing that is not continued costs a single request
+        if (offset <= 2 && i > first) {
+          break;
+        }
+        int ret = fetchLiked(version, ahead);
+        if (ret <= 0) {
+          // A failure is reported once nothing is left to deliver
+          return i == first ? ret : 0;
+        }
+        entries = entriesOf(&liked);
+      }
+      continue;
+    }
+    name = track_table.name(entries->tracks[i]);
+    if (filler(buf, name.c_str(), NULL, i + 3)) {
+      break;
+    }
+    ++i;
   }
   return 0;
 }
 
 int SpotifyFileSystem::openFile(const char *path, struct fuse_file_info *fi) {
-  auto it = files.find(path);
-  if (it == files.end() || it->second->is_playlist) {
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  control_file kind = controlFile(path, &playlist);
+  switch (kind) {
+  case control_file::import:
+    if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+      return -EACCES;
+    }
+    // Holds the incomplete last line between writes
+    attachHandle(fi, kind, playlist->id);
+    return 0;
+  case control_file::import_status:
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      return -EACCES;
+    }
+    attachHandle(fi, kind, playlist->id);
+    fi->direct_io = 1; // The size changes while the import runs
+    return 0;
+  case control_file::playlist_json:
+  case control_file::tracks_tsv:
+  case control_file::playlist_m3u:
+  case control_file::library_tsv:
+  case control_file::stats:
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      return -EACCES;
+    }
+    // Reads of one open see the content as it was when it was opened
+    attachHandle(fi, kind, playlist->id)->content = indexFile(playlist, kind);
+    fi->direct_io = 1;
+    return 0;
+  case control_file::none:
+    break;
+  }
+
+  long track = resolveTrack(path, &playlist);
+  if (track < 0) {
     return -ENOENT;
   }
+  attachHandle(fi, control_file::none, playlist->id);
+
+  // Playback starts once per open, in the background. Hidden files, like
+  // those probed by editors and file managers, never start it.
+  if (launcher && (fi->flags & O_ACCMODE) != O_WRONLY &&
+      strrchr(path, '/')[1] != '.') {
+    launcher->launch(track_table.uri(track));
+  }
   return 0;
 }
 
 int SpotifyFileSystem::readFile(const char *path, char *buf, size_t size,
                                 off_t offset, struct fuse_file_info *fi) {
-  auto it = files.find(path);
-  if (it == files.end() || it->second->is_playlist) {
-    return -ENOENT;
+  open_file *handle = handleOf(fi);
+  control_file kind = handle ? handle->kind : control_file::none;
+  if (kind == control_file::import_status) {
+    std::string status = importer->status(handle->playlist_id);
+    if (offset >= (off_t)status.size()) {
+      return 0;
+    }
+    size_t len = std::min(size, status.size() - offset);
+    memcpy(buf, status.data() + offset, len);
+    return len;
+  }
+  if (isIndexFile(kind)) {
+    const std::string &content = *handle->content;
+    if (offset >= (off_t)content.size()) {
+      return 0;
+    }
+    size_t len = std::min(size, content.size() - offset);
+    memcpy(buf, content.data() + offset, len);
+    return len;
   }
 
-  // Skip opening Spotify if we're in file creation or if it's a hidden file
-  std::string path_str(path);
-  std::string filename = path_str.substr(path_str.find_last_of('/') + 1);
-  if (filename[0] != '.') { // Only open Spotify for non-hidden files
-    std::string uri = it->second->uri;
-    std::string command;
-
-#ifdef __APPLE__
-    command = "open spotify:track:" + uri;
-#else
-    command = "xdg-open spotify:track:" + uri;
-#endif
-
-    system(command.c_str());
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  if (resolveTrack(path, &playlist) < 0) {
+    return -ENOENT;
   }
 
-  std::string content = "Opening track in Spotify...\n";
+  // Playback was started by open, reads only copy the content
+  static const std::string content = "Opening track in Spotify...\n";
   if (offset >= content.size()) {
     return 0;
   }
@@ -145,6 +1517,9 @@ int SpotifyFileSystem::readFile(const char *path, char *buf, size_t size,
 
 int SpotifyFileSystem::createFolder(const char *path, mode_t mode) {
   std::string name = std::string(path).substr(1); // Remove leading '/'
+  if ((liked_pager && name == liked.name()) || name == ".search") {
+    return -EEXIST;
+  }
   Playlist playlist = SpotifyAPI::getInstance()->createPlaylist(
       name, "Created via SpotifyFS", true);
   if (playlist.id.empty()) {
@@ -153,9 +1528,15 @@ int SpotifyFileSystem::createFolder(const char *path, mode_t mode) {
 
   auto pl = new spotify_file();
   pl->id = playlist.id;
-  pl->name = name;
+  pl->setName(name);
   pl->is_playlist = true;
-  files[path] = pl;
+  pl->state = load_state::loaded; // A new playlist has no tracks to fetch
+  pl->track_count = 0;
+  pl->snapshot_id = playlist.snapshot_id;
+  if (!addEntry(&root, pl)) {
+    delete pl;
+    return -EEXIST;
+  }
   return 0;
 }
 
@@ -169,215 +1550,374 @@ int SpotifyFileSystem::createFile(const char *path, mode_t mode,
   }
 
   std::string filename = path_str.substr(path_str.find_last_of('/') + 1);
-  std::string dir_path = path_str.substr(0, path_str.find_last_of('/'));
 
   // Find the playlist
-  auto playlist_it = files.find(dir_path);
-  if (playlist_it == files.end() || !playlist_it->second->is_playlist) {
-    return -ENOENT;
-  }
-
-  // URL encode the entire query string
-  std::string track_query;
-  for (unsigned char c : filename) {
-    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
-      track_query += c;
-    } else {
-      char hex[4];
-      snprintf(hex, sizeof(hex), "%%%02X", c);
-      track_query += hex;
-    }
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  if (controlFile(path, &playlist) != control_file::none) {
+    return openFile(path, fi);
   }
-
-  // Search for track and get info
-  SpotifyAPI *api = SpotifyAPI::getInstance();
-  std::string track_id = api->searchTrack(track_query);
-  if (track_id.empty()) {
+  resolve(path, &playlist);
+  if (!playlist || playlist == &root) {
     return -ENOENT;
   }
+  if (playlist == &liked) {
+    return -EACCES;
+  }
 
-  Track track = api->getTrackInfo(track_id);
+  // Search for the track
+  Track track = resolver->resolve(filename);
   if (track.id.empty()) {
     return -ENOENT;
   }
 
-  // Add track to playlist
-  bool success = api->addTrackToPlaylist(playlist_it->second->id, track.id);
-  if (!success) {
-    return -EACCES;
+  // The name the file was created with stays resolvable so that the
+  // creating process can finish
+  addTrack(playlist, track, filename);
+  attachHandle(fi, control_file::none, playlist->id);
+  return 0;
+}
+
+void SpotifyFileSystem::addTrack(spotify_file *playlist, const Track &track,
+                                 const std::string &alias) {
+  // The entry is listed under its "Artist -- Track" name
+  std::string name = track.artist + " -- " + track.name;
+  if (lookupTrack(playlist, name) >= 0) {
+    if (!alias.empty()) {
+      addAlias(playlist, alias, name);
+    }
+    return;
   }
 
-  std::cout << "Added track: " << track.artist << " -- " << track.name
-            << std::endl;
+  uint32_t index = track_table.add(track.id, name, track.artist, track.album,
+                                   track.uri, track.duration_ms);
+  if (addTrackEntry(playlist, index, time(NULL), alias)) {
+    queueAddition(playlist, index, alias);
+  }
+}
 
-  // Create file entry
-  auto file = new spotify_file();
-  file->id = track_id;
-  file->name = track.artist + " -- " + track.name;
-  file->is_playlist = false;
-  file->duration_ms = track.duration_ms;
-  file->uri = track.uri;
+void SpotifyFileSystem::importTracks(spotify_file *playlist,
+                                     const std::vector<Track> &tracks) {
+  // The entries are copied once for the whole batch
+  std::vector<uint32_t> indices, added_at;
+  indices.reserve(tracks.size());
+  added_at.reserve(tracks.size());
+  for (const auto &track : tracks) {
+    indices.push_back(track_table.add(track.id,
+                                      track.artist + " -- " + track.name,
+                                      track.artist, track.album, track.uri,
+                                      track.duration_ms));
+    added_at.push_back(time(NULL));
+  }
+  // Tracks already listed under their name are skipped
+  for (uint32_t index : addTracks(playlist, indices, added_at, false)) {
+    queueAddition(playlist, index, "");
+    if (invalidate) {
+      invalidate(playlist, std::string(track_table.name(index)));
+    }
+  }
+}
 
-  // First store with original path to let touch complete
-  files[path_str] = file;
+void SpotifyFileSystem::queueAddition(spotify_file *playlist, uint32_t index,
+                                      const std::string &alias) {
+  // The addition is sent to Spotify in a batch; undo it if that fails
+  std::string playlist_id = playlist->id;
+  mutations->add(playlist_id, track_table.uri(index), [playlist_id, index,
+                                                       alias]() {
+    Epoch::ReadGuard guard;
+    spotify_file *playlist = findPlaylist(playlist_id);
+    if (!playlist) {
+      return;
+    }
+    removeTrack(playlist, index);
+    if (invalidate) {
+      invalidate(playlist, std::string(track_table.name(index)));
+      if (!alias.empty()) {
+        invalidate(playlist, alias);
+      }
+    }
+  });
+}
 
-  // Create custom path and store the file there
-  std::string custom_path = dir_path + "/" + file->name;
-  files[custom_path] = file;
+int SpotifyFileSystem::removeFile(const char *path) {
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  if (resolve(path, &playlist)) {
+    // SpotifyAPI doesn't support deleting playlists
+    return -EACCES;
+  }
+  long track = resolveTrack(path, &playlist);
+  if (track < 0) {
+    return -ENOENT;
+  }
+  if (playlist == &liked) {
+    return -EACCES;
+  }
 
-  // Schedule removal of the original path entry
-  // We need to do this after a short delay to ensure touch completes
-  std::thread([path_str]() {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    files.erase(path_str);
-  }).detach();
+  // The removal is sent to Spotify in a batch; restore the entry where it
+  // was if that fails. The track record stays in the table, so it can be
+  // put back.
+  std::string playlist_id = playlist->id;
+  uint32_t index = track;
+  removed_track removed;
+  if (!removeTrack(playlist, index, &removed)) {
+    return -ENOENT;
+  }
 
+  mutations->remove(playlist_id, track_table.uri(index),
+                    [playlist_id, index, removed]() {
+                      Epoch::ReadGuard guard;
+                      spotify_file *playlist = findPlaylist(playlist_id);
+                      if (playlist && restoreTrack(playlist, index, removed) &&
+                          invalidate) {
+                        invalidate(playlist,
+                                   std::string(track_table.name(index)));
+                      }
+                    });
   return 0;
 }
 
-int SpotifyFileSystem::removeFile(const char *path) {
-  auto it = files.find(path);
-  if (it == files.end()) {
-    return -ENOENT;
+// Splits the name a track is renamed to, "<N> <name>", "<N>. <name>" or
+// "<N> - <name>", into the 1-based position N
+static bool parsePosition(std::string_view target, std::string_view name,
+                          size_t &position) {
+  if (target.size() <= name.size() ||
+      target.substr(target.size() - name.size()) != name) {
+    return false;
   }
+  std::string_view prefix = target.substr(0, target.size() - name.size());
+  size_t digits = 0;
+  position = 0;
+  while (digits < prefix.size() && digits < 9 &&
+         isdigit(static_cast<unsigned char>(prefix[digits]))) {
+    position = position * 10 + (prefix[digits] - '0');
+    ++digits;
+  }
+  std::string_view separator = prefix.substr(digits);
+  return digits > 0 && position > 0 &&
+         (separator == " " || separator == ". " || separator == " - ");
+}
 
-  if (it->second->is_playlist) {
-    // SpotifyAPI doesn't support deleting playlists
+int SpotifyFileSystem::renameFile(const char *from, const char *to) {
+  if (strcmp(from, to) == 0) {
+    return 0;
+  }
+  std::string query, entry;
+  if (searchPath(from, query, entry) || searchPath(to, query, entry)) {
     return -EACCES;
-  } else {
-    // Find parent playlist
-    std::string path_str(path);
-    size_t slash_pos = path_str.find_last_of('/');
-    std::string playlist_path = path_str.substr(0, slash_pos);
+  }
+  Epoch::ReadGuard guard;
+  spotify_file *parent = nullptr, *target_parent = nullptr;
+  if (controlFile(from, &parent) != control_file::none ||
+      controlFile(to, &target_parent) != control_file::none) {
+    return -EACCES;
+  }
+  const char *name = strrchr(to, '/') + 1;
 
-    auto playlist_it = files.find(playlist_path);
-    if (playlist_it == files.end() || !playlist_it->second->is_playlist) {
-      return -ENOENT;
+  spotify_file *dir = resolve(from, &parent);
+  if (dir) {
+    if (dir == &root) {
+      return -EBUSY;
     }
-
-    bool success = SpotifyAPI::getInstance()->removeTrackFromPlaylist(
-        playlist_it->second->id, it->second->uri);
-    if (!success) {
+    if (dir == &liked) {
+      return -EACCES;
+    }
+    // Playlists only exist in the root
+    resolve(to, &target_parent);
+    if (target_parent != &root) {
       return -EACCES;
     }
+    return renamePlaylist(dir, name);
   }
 
-  delete it->second;
-  files.erase(it);
-  return 0;
-}
+  long track = resolveTrack(from, &parent, nullptr);
+  if (track < 0) {
+    return -ENOENT;
+  }
+  if (parent == &liked) {
+    return -EACCES;
+  }
+  // The positions of a move count the tracks Spotify has, so it waits
+  // until queued additions and removals are sent. They are not flushed
+  // here: that would hold the rename for a round trip, and a rolled back
+  // change invalidates this directory, which the kernel keeps locked.
+  if (mutations->hasPendingTracks(parent->id)) {
+    mutations->flushSoon(parent->id);
+    return -EBUSY;
+  }
+  // Tracks cannot move between playlists, mv copies and unlinks them
+  resolve(to, &target_parent);
+  if (target_parent != parent) {
+    return -EXDEV;
+  }
 
-int SpotifyFileSystem::cleanup() {
-  for (auto &pair : files) {
-    delete pair.second;
+  // Only the position of a track can change, the name picks it
+  size_t position;
+  if (!parsePosition(name, track_table.name(track), position)) {
+    return -EINVAL;
   }
-  files.clear();
-  return 0;
+  // The move is queued while the entries are locked, so that concurrent
+  // moves reach Spotify in the order of their positions. Changes queued
+  // since the check above would shift those positions, the move waits for
+  // them too. It is sent to Spotify in a batch; move the track back if that
+  // fails.
+  std::string playlist_id = parent->id;
+  uint32_t index = track;
+  return moveTrackEntry(
+      parent, index, position - 1,
+      [&](size_t range_start, size_t insert_before) {
+        if (mutations->hasPendingTracks(playlist_id)) {
+          return -EBUSY;
+        }
+        mutations->move(
+            playlist_id, range_start, insert_before,
+            [playlist_id, index, range_start, insert_before]() {
+              Epoch::ReadGuard guard;
+              spotify_file *playlist = findPlaylist(playlist_id);
+              if (playlist) {
+                unmoveTrackEntry(playlist, index, range_start, insert_before);
+                if (invalidate) {
+                  invalidate(playlist, "");
+                }
+              }
+            });
+        return 0;
+      });
 }
 
-int SpotifyFileSystem::writeFile(const char *path, const char *buf, size_t size,
-                                 off_t offset, struct fuse_file_info *fi) {
-  auto it = files.find(path);
-  if (it == files.end() || it->second->is_playlist) {
-    return -ENOENT;
+int SpotifyFileSystem::renamePlaylist(spotify_file *playlist,
+                                      const std::string &name) {
+  if (name == playlist->name()) {
+    return 0;
+  }
+  if ((liked_pager && name == liked.name()) || name == ".search" ||
+      lookup(&root, name)) {
+    return -EEXIST;
+  }
+  // Renamed in Spotify first, a playlist renamed only here would get its
+  // old name back on the next sync
+  if (!SpotifyAPI::getInstance()->renamePlaylist(playlist->id, name)) {
+    return -EIO;
   }
 
-  // For now, just acknowledge the write
-  return size;
-}
-
-int SpotifyFileSystem::truncateFile(const char *path, off_t size) {
-  auto it = files.find(path);
-  if (it == files.end() || it->second->is_playlist) {
-    return -ENOENT;
+  // Only the name and its key in the root change, the tracks stay as they
+  // are
+  const std::string *old_name = nullptr;
+  updateEntries(&root, [&](dir_entries &entries) {
+    auto it = entries.index.find(playlist->name());
+    if (it == entries.index.end() || entries.index.count(name)) {
+      return;
+    }
+    size_t pos = it->second;
+    entries.index.erase(it);
+    old_name = playlist->replaceName(name);
+    entries.index[playlist->name()] = pos;
+  });
+  if (!old_name) {
+    return -EEXIST; // Taken while the request was sent
   }
+  Epoch::retire(old_name);
   return 0;
 }
 
-void SpotifyFileSystem::spotify_ll_create(fuse_req_t req, fuse_ino_t parent,
-                                          const char *name, mode_t mode,
-                                          struct fuse_file_info *fi) {
-  std::string path_str(name);
-
-  // Ignore macOS metadata files
-  if (path_str.find("/._") != std::string::npos) {
-    fuse_reply_err(req, EACCES);
-    return;
+int SpotifyFileSystem::releaseFile(const char *path,
+                                   struct fuse_file_info *fi) {
+  std::unique_ptr<open_file> handle(handleOf(fi));
+  fi->fh = 0;
+  if (!handle) {
+    return 0;
   }
-
-  // Check if file already exists
-  auto existing_file = files.find(path_str);
-  if (existing_file != files.end()) {
-    fuse_reply_err(req, EEXIST);
-    return;
+  if (handle->kind == control_file::import) {
+    // The last line may lack its newline
+    submitImport(handle->playlist_id, handle->buffer, true);
+  } else if (handle->kind == control_file::none) {
+    // Send pending changes of the playlist soon, without blocking close()
+    mutations->flushSoon(handle->playlist_id);
   }
+  return 0;
+}
 
-  std::string filename = path_str.substr(path_str.find_last_of('/') + 1);
+open_file *SpotifyFileSystem::attachHandle(struct fuse_file_info *fi,
+                                           control_file kind,
+                                           const std::string &playlist_id) {
+  auto handle = new open_file();
+  handle->kind = kind;
+  handle->playlist_id = playlist_id;
+  fi->fh = reinterpret_cast<uint64_t>(handle);
+  return handle;
+}
 
-  // URL encode spaces in the search query
-  std::string track_query = filename;
-  size_t pos = 0;
-  while ((pos = track_query.find(" ", pos)) != std::string::npos) {
-    track_query.replace(pos, 1, "%20");
-    pos += 3;
-  }
+void SpotifyFileSystem::discardHandle(struct fuse_file_info *fi) {
+  delete handleOf(fi);
+  fi->fh = 0;
+}
 
-  // Find the playlist
-  auto playlist_it = files.find(path_str.substr(0, path_str.find_last_of('/')));
-  if (playlist_it == files.end() || !playlist_it->second->is_playlist) {
-    fuse_reply_err(req, ENOENT);
-    return;
+int SpotifyFileSystem::syncFile(const char *path, int datasync,
+                                struct fuse_file_info *fi) {
+  // fsync() waits until the pending changes of the playlist are sent
+  std::string playlist_id;
+  {
+    Epoch::ReadGuard guard;
+    spotify_file *playlist = nullptr;
+    resolve(path, &playlist);
+    if (!playlist || playlist == &root) {
+      return -ENOENT;
+    }
+    playlist_id = playlist->id;
   }
+  return mutations->flush(playlist_id) ? 0 : -EIO;
+}
 
-  // Search for track and get info
-  SpotifyAPI *api = SpotifyAPI::getInstance();
-  std::string track_id = api->searchTrack(track_query);
-  if (track_id.empty()) {
-    fuse_reply_err(req, ENOENT);
-    return;
+int SpotifyFileSystem::cleanup() {
+  // Only called while no FUSE requests are being served
+  const dir_entries *playlists = root.entries.exchange(nullptr);
+  if (playlists) {
+    for (spotify_file *playlist : playlists->children) {
+      delete playlist->entries.load();
+      delete playlist;
+    }
+    delete playlists;
   }
+  liked_pager.reset();
+  delete liked.entries.exchange(nullptr);
+  Epoch::drain();
+  search_index.reset();
+  track_table.clear();
+  return 0;
+}
 
-  Track track = api->getTrackInfo(track_id);
-  if (track.id.empty()) {
-    fuse_reply_err(req, ENOENT);
-    return;
+int SpotifyFileSystem::writeFile(const char *path, const char *buf, size_t size,
+                                 off_t offset, struct fuse_file_info *fi) {
+  open_file *handle = handleOf(fi);
+  if (handle && handle->kind == control_file::import) {
+    // Queries are queued line by line as they arrive
+    handle->buffer.append(buf, size);
+    submitImport(handle->playlist_id, handle->buffer, false);
+    return size;
   }
 
-  // Add track to playlist
-  bool success = api->addTrackToPlaylist(playlist_it->second->id, track.id);
-  if (!success) {
-    fuse_reply_err(req, EACCES);
-    return;
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  if (resolveTrack(path, &playlist) < 0) {
+    return -ENOENT;
   }
 
-  std::cout << "Added track: " << track.artist << " -- " << track.name
-            << std::endl;
+  // For now, just acknowledge the write
+  return size;
+}
 
-  // Create file entry
-  auto file = new spotify_file();
-  file->id = track.id;
-  file->name = track.artist + " -- " + track.name;
-  file->original_name = filename;
-  file->is_playlist = false;
-  file->duration_ms = track.duration_ms;
-  file->uri = track.uri;
-
-  // Set up entry attributes
-  struct fuse_entry_param e;
-  memset(&e, 0, sizeof(e));
-  e.ino = random(); // You might want to implement proper inode allocation
-  e.attr.st_mode = S_IFREG | 0666;
-  e.attr.st_nlink = 1;
-  e.attr.st_uid = getuid();
-  e.attr.st_gid = getgid();
-  e.attr.st_size = track.duration_ms > 0 ? track.duration_ms : 1024;
-  e.attr.st_mtime = time(NULL);
-  e.generation = 1;
-  e.attr_timeout = 1.0;
-  e.entry_timeout = 1.0;
-
-  files[path_str] = file;
-
-  // Reply with the entry parameters
-  fuse_reply_create(req, &e, fi);
+int SpotifyFileSystem::truncateFile(const char *path, off_t size) {
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  control_file kind = controlFile(path, &playlist);
+  if (kind == control_file::import) {
+    return 0; // Writing with O_TRUNC starts a new import
+  }
+  if (kind != control_file::none) {
+    return -EACCES;
+  }
+  if (resolveTrack(path, &playlist) < 0) {
+    return -ENOENT;
+  }
+  return 0;
 }
@@ -0,0 +1,615 @@
+#include "epoch.h"
+#include "metrics.h"
+#include "spotify_fs.h"
+#include <cstring>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <vector>
+
+std::mutex SpotifyFileSystem::inode_mutex;
+std::unordered_map<fuse_ino_t, ll_node> SpotifyFileSystem::nodes;
+std::unordered_map<std::string, fuse_ino_t> SpotifyFileSystem::inodes;
+struct fuse_chan *SpotifyFileSystem::channel = nullptr;
+std::thread SpotifyFileSystem::notify_thread;
+std::mutex SpotifyFileSystem::notify_mutex;
+std::condition_variable SpotifyFileSystem::notify_cv;
+std::deque<std::pair<fuse_ino_t, std::string>>
+    SpotifyFileSystem::notifications;
+bool SpotifyFileSystem::notify_stopping = false;
+
+namespace {
+
+// Reply buffer of a readdir call, filled through a fuse_fill_dir_t
+struct dir_listing {
+  fuse_req_t req;
+  std::string path;  // Path of the directory
+  fuse_ino_t ino;    // Inode of the directory
+  fuse_ino_t parent; // Inode of its parent
+  std::vector<char> data;
+  size_t used = 0;
+};
+
+} // namespace
+
+void SpotifyFileSystem::setChannel(struct fuse_chan *ch) {
+  if (!ch) {
+    // The kernel is unmounting, its caches go anyway
+    {
+      std::lock_guard<std::mutex> lock(notify_mutex);
+      notify_stopping = true;
+      notifications.clear();
+      notify_cv.notify_all();
+    }
+    if (notify_thread.joinable()) {
+      notify_thread.join();
+    }
+    return;
+  }
+  channel = ch;
+  invalidate = [](spotify_file *dir, const std::string &name) {
+    fuse_ino_t parent = FUSE_ROOT_ID;
+    if (dir != &root) {
+      std::lock_guard<std::mutex> lock(inode_mutex);
+      auto it = inodes.find("p:" + dir->id);
+      if (it == inodes.end()) {
+        return; // The kernel caches nothing of this playlist
+      }
+      parent = it->second;
+    }
+    queueNotification(parent, name);
+  };
+  notify_thread = std::thread(notifyLoop);
+}
+
+void SpotifyFileSystem::queueNotification(fuse_ino_t parent,
+                                          const std::string &name) {
+  std::lock_guard<std::mutex> lock(notify_mutex);
+  if (notify_stopping) {
+    return;
+  }
+  notifications.emplace_back(parent, name);
+  notify_cv.notify_one();
+}
+
+void SpotifyFileSystem::notifyLoop() {
+  std::unique_lock<std::mutex> lock(notify_mutex);
+  while (true) {
+    notify_cv.wait(lock,
+                   [] { return notify_stopping || !notifications.empty(); });
+    if (notify_stopping) {
+      return;
+    }
+    auto notification = std::move(notifications.front());
+    notifications.pop_front();
+    lock.unlock();
+    // Blocks while a request holds the directory locked
+    if (notification.second.empty()) {
+      fuse_lowlevel_notify_inval_inode(channel, notification.first, 0, 0);
+    } else {
+      fuse_lowlevel_notify_inval_entry(channel, notification.first,
+                                       notification.second.c_str(),
+                                       notification.second.size());
+    }
+    lock.lock();
+  }
+}
+
+fuse_ino_t SpotifyFileSystem::inodeOf(const std::string &key) {
+  auto it = inodes.find(key);
+  if (it != inodes.end()) {
+    return it->second;
+  }
+
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : key) {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  }
+  // 0 and the root inode are reserved. On a collision the key gets the next
+  // free number and keeps it until the kernel forgets it.
+  fuse_ino_t ino = hash;
+  while (ino <= FUSE_ROOT_ID || nodes.count(ino)) {
+    ++ino;
+  }
+  return ino;
+}
+
+bool SpotifyFileSystem::entryKey(const char *path, std::string &key,
+                                 std::string &playlist_id,
+                                 bool &is_playlist) {
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  is_playlist = false;
+  // Results of a query are identified by their path, the same track in the
+  // same playlist is a different result of every query
+  std::string query, entry;
+  if (int depth = searchPath(path, query, entry)) {
+    playlist_id.clear();
+    is_playlist = depth < 3;
+    key = "s:" + std::string(path + strlen("/.search"));
+    return true;
+  }
+  if (controlFile(path, &playlist) != control_file::none) {
+    playlist_id = playlist->id;
+    key = "c:" + playlist_id + "/" + (strrchr(path, '/') + 1);
+    return true;
+  }
+  if (spotify_file *dir = resolve(path, &playlist)) {
+    if (dir == &root) {
+      return false;
+    }
+    playlist_id = dir->id;
+    is_playlist = true;
+    key = "p:" + playlist_id;
+    return true;
+  }
+
+  long track = resolveTrack(path, &playlist);
+  if (track < 0) {
+    return false;
+  }
+  playlist_id = playlist->id;
+  std::string id = track_table.id(track);
+  key = "t:" + playlist_id + "/" +
+        (id.empty() ? std::string(track_table.name(track)) : id);
+  return true;
+}
+
+bool SpotifyFileSystem::nodePath(fuse_ino_t ino, std::string &path) {
+  if (ino == FUSE_ROOT_ID) {
+    path = "/";
+    return true;
+  }
+
+  std::string name, playlist_id, playlist_name;
+  bool is_playlist;
+  {
+    std::lock_guard<std::mutex> lock(inode_mutex);
+    auto it = nodes.find(ino);
+    if (it == nodes.end()) {
+      return false;
+    }
+    name = it->second.name;
+    playlist_id = it->second.playlist_id;
+    is_playlist = it->second.is_playlist;
+    if (it->second.key.compare(0, 2, "s:") == 0) {
+      path = "/.search" + it->second.key.substr(2);
+      Tracer::annotate(path);
+      return true;
+    }
+    if (playlist_id.empty()) {
+      path = "/" + name; // A control file of the root
+      Tracer::annotate(path);
+      return true;
+    }
+    if (is_playlist) {
+      playlist_name = name;
+    } else {
+      auto parent = nodes.find(it->second.parent);
+      if (parent != nodes.end()) {
+        playlist_name = parent->second.name;
+      }
+    }
+  }
+
+  // Playlists are matched by ID, so an inode stays valid when a sync renames
+  // its playlist
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = lookup(&root, playlist_name);
+  if (!playlist || playlist->id != playlist_id) {
+    playlist = findPlaylist(playlist_id);
+  }
+  if (!playlist) {
+    return false;
+  }
+  path = "/" + playlist->name();
+  if (!is_playlist) {
+    path += "/" + name;
+  }
+  Tracer::annotate(path);
+  return true;
+}
+
+bool SpotifyFileSystem::childPath(fuse_ino_t parent, const char *name,
+                                  std::string &path) {
+  if (!nodePath(parent, path)) {
+    return false;
+  }
+  if (path.back() != '/') {
+    path += '/';
+  }
+  path += name;
+  Tracer::annotate(path);
+  return true;
+}
+
+void SpotifyFileSystem::forgetNode(fuse_ino_t ino, uint64_t nlookup) {
+  std::lock_guard<std::mutex> lock(inode_mutex);
+  auto it = nodes.find(ino);
+  if (it == nodes.end()) {
+    return;
+  }
+  if (it->second.lookups > nlookup) {
+    it->second.lookups -= nlookup;
+    return;
+  }
+  inodes.erase(it->second.key);
+  nodes.erase(it);
+}
+
+double SpotifyFileSystem::attrTimeout(const char *path) {
+  Epoch::ReadGuard guard;
+  spotify_file *playlist = nullptr;
+  return controlFile(path, &playlist) == control_file::none
+             ? options.attr_timeout
+             : 0;
+}
+
+int SpotifyFileSystem::lookupEntry(fuse_ino_t parent, const char *name,
+                                   const std::string &path,
+                                   fuse_entry_param &e) {
+  memset(&e, 0, sizeof(e));
+  int ret = getFileAttributes(path.c_str(), &e.attr);
+  if (ret < 0) {
+    return -ret;
+  }
+  std::string key, playlist_id;
+  bool is_playlist;
+  if (!entryKey(path.c_str(), key, playlist_id, is_playlist)) {
+    return ENOENT;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(inode_mutex);
+    e.ino = inodeOf(key);
+    ll_node &node = nodes[e.ino];
+    if (node.lookups == 0) {
+      node.key = key;
+      node.playlist_id = playlist_id;
+      node.is_playlist = is_playlist;
+      inodes[key] = e.ino;
+    }
+    // A later lookup under another name, or after a rename, moves the node
+    node.parent = parent;
+    node.name = name;
+    ++node.lookups;
+  }
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = attrTimeout(path.c_str());
+  e.entry_timeout = options.entry_timeout;
+  return 0;
+}
+
+void SpotifyFileSystem::spotify_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                                          const char *name) {
+  Metrics::Timer timer(FuseOp::lookup);
+  std::string path;
+  if (!childPath(parent, name, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  struct fuse_entry_param e;
+  int err = lookupEntry(parent, name, path, e);
+  if (err == ENOENT && options.negative_timeout > 0) {
+    // Inode 0 lets the kernel remember that the name does not exist
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = options.negative_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  // An interrupted request never reaches the kernel, nor does its lookup
+  if (fuse_reply_entry(req, &e) == -ENOENT) {
+    forgetNode(e.ino, 1);
+  }
+}
+
+void SpotifyFileSystem::spotify_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                                          unsigned long nlookup) {
+  Metrics::Timer timer(FuseOp::forget);
+  forgetNode(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+void SpotifyFileSystem::spotify_ll_forget_multi(
+    fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+  Metrics::Timer timer(FuseOp::forget);
+  for (size_t i = 0; i < count; ++i) {
+    forgetNode(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+void SpotifyFileSystem::spotify_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                                           struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::getattr);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  struct stat stbuf;
+  int ret = getFileAttributes(path.c_str(), &stbuf);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  stbuf.st_ino = ino;
+  fuse_reply_attr(req, &stbuf, attrTimeout(path.c_str()));
+}
+
+void SpotifyFileSystem::spotify_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+                                           struct stat *attr, int to_set,
+                                           struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::setattr);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    int ret = truncateFile(path.c_str(), attr->st_size);
+    if (ret < 0) {
+      fuse_reply_err(req, -ret);
+      return;
+    }
+  }
+  // Other attributes are fixed, the current ones are returned
+  spotify_ll_getattr(req, ino, fi);
+}
+
+void SpotifyFileSystem::spotify_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  Metrics::Timer timer(FuseOp::readlink);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  char target[PATH_MAX];
+  int ret = readLink(path.c_str(), target, sizeof(target));
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_readlink(req, target);
+}
+
+void SpotifyFileSystem::spotify_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+                                         const char *name, mode_t mode) {
+  Metrics::Timer timer(FuseOp::mkdir);
+  std::string path;
+  if (parent != FUSE_ROOT_ID || !childPath(parent, name, path)) {
+    fuse_reply_err(req, EACCES); // Playlists cannot be nested
+    return;
+  }
+  int ret = createFolder(path.c_str(), mode);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  struct fuse_entry_param e;
+  int err = lookupEntry(parent, name, path, e);
+  if (err) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  if (fuse_reply_entry(req, &e) == -ENOENT) {
+    forgetNode(e.ino, 1);
+  }
+}
+
+void SpotifyFileSystem::spotify_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                                          const char *name) {
+  Metrics::Timer timer(FuseOp::unlink);
+  std::string path;
+  if (!childPath(parent, name, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  fuse_reply_err(req, -removeFile(path.c_str()));
+}
+
+void SpotifyFileSystem::spotify_ll_rename(fuse_req_t req, fuse_ino_t parent,
+                                          const char *name,
+                                          fuse_ino_t newparent,
+                                          const char *newname) {
+  Metrics::Timer timer(FuseOp::rename);
+  std::string from, to;
+  if (!childPath(parent, name, from) || !childPath(newparent, newname, to)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  int ret = renameFile(from.c_str(), to.c_str());
+  // A renamed playlist keeps its inode under the new name. A moved track
+  // keeps its name, the target name only picked its position.
+  std::string key, playlist_id;
+  bool is_playlist;
+  if (ret == 0 && entryKey(to.c_str(), key, playlist_id, is_playlist) &&
+      is_playlist) {
+    std::lock_guard<std::mutex> lock(inode_mutex);
+    auto it = inodes.find(key);
+    if (it != inodes.end()) {
+      nodes[it->second].name = newname;
+    }
+  } else if (ret == 0) {
+    // The kernel moves the track's dentry to the target name, which does
+    // not exist. It is dropped once the rename has completed.
+    queueNotification(newparent, newname);
+  }
+  fuse_reply_err(req, -ret);
+}
+
+void SpotifyFileSystem::spotify_ll_open(fuse_req_t req, fuse_ino_t ino,
+                                        struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::open);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  int ret = openFile(path.c_str(), fi);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  if (fuse_reply_open(req, fi) == -ENOENT) {
+    discardHandle(fi); // Interrupted, there will be no release
+  }
+}
+
+void SpotifyFileSystem::spotify_ll_read(fuse_req_t req, fuse_ino_t ino,
+                                        size_t size, off_t off,
+                                        struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::read);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  std::vector<char> buf(size);
+  int ret = readFile(path.c_str(), buf.data(), size, off, fi);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_buf(req, buf.data(), ret);
+}
+
+void SpotifyFileSystem::spotify_ll_write(fuse_req_t req, fuse_ino_t ino,
+                                         const char *buf, size_t size,
+                                         off_t off, struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::write);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  int ret = writeFile(path.c_str(), buf, size, off, fi);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_write(req, ret);
+}
+
+void SpotifyFileSystem::spotify_ll_release(fuse_req_t req, fuse_ino_t ino,
+                                           struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::release);
+  // The handle identifies the file, even if its inode is gone by now
+  std::string path;
+  nodePath(ino, path);
+  releaseFile(path.c_str(), fi);
+  fuse_reply_err(req, 0);
+}
+
+void SpotifyFileSystem::spotify_ll_fsync(fuse_req_t req, fuse_ino_t ino,
+                                         int datasync,
+                                         struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::fsync);
+  std::string path;
+  if (!nodePath(ino, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  fuse_reply_err(req, -syncFile(path.c_str(), datasync, fi));
+}
+
+void SpotifyFileSystem::spotify_ll_readdir(fuse_req_t req, fuse_ino_t ino,
+                                           size_t size, off_t off,
+                                           struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::readdir);
+  dir_listing listing;
+  listing.req = req;
+  listing.ino = ino;
+  listing.parent = FUSE_ROOT_ID;
+  listing.data.resize(size);
+  if (!nodePath(ino, listing.path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(inode_mutex);
+    auto it = nodes.find(ino);
+    if (it != nodes.end()) {
+      listing.parent = it->second.parent;
+    }
+  }
+
+  // Entries carry the inode numbers their lookups will return
+  auto fill = [](void *buf, const char *name, const struct stat *,
+                 off_t next) -> int {
+    auto listing = static_cast<dir_listing *>(buf);
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      stbuf.st_ino = name[1] ? listing->parent : listing->ino;
+      stbuf.st_mode = S_IFDIR;
+    } else {
+      std::string path = listing->path;
+      if (path.back() != '/') {
+        path += '/';
+      }
+      path += name;
+      std::string key, playlist_id;
+      bool is_playlist = false;
+      if (entryKey(path.c_str(), key, playlist_id, is_playlist)) {
+        std::lock_guard<std::mutex> lock(inode_mutex);
+        stbuf.st_ino = inodeOf(key);
+      }
+      if (is_playlist) {
+        stbuf.st_mode = S_IFDIR;
+      } else {
+        stbuf.st_mode = key.compare(0, 2, "s:") == 0 ? S_IFLNK : S_IFREG;
+      }
+    }
+
+    size_t free = listing->data.size() - listing->used;
+    size_t needed =
+        fuse_add_direntry(listing->req, listing->data.data() + listing->used,
+                          free, name, &stbuf, next);
+    if (needed > free) {
+      return 1;
+    }
+    listing->used += needed;
+    return 0;
+  };
+  int ret = listFiles(listing.path.c_str(), &listing, fill, off, fi);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_buf(req, listing.data.data(), listing.used);
+}
+
+void SpotifyFileSystem::spotify_ll_create(fuse_req_t req, fuse_ino_t parent,
+                                          const char *name, mode_t mode,
+                                          struct fuse_file_info *fi) {
+  Metrics::Timer timer(FuseOp::create);
+  std::string path;
+  if (!childPath(parent, name, path)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  int ret = createFile(path.c_str(), mode, fi);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  // The entry gets the inode of its track, whichever name it was created by
+  struct fuse_entry_param e;
+  int err = lookupEntry(parent, name, path, e);
+  if (err) {
+    discardHandle(fi);
+    fuse_reply_err(req, err);
+    return;
+  }
+  if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+    discardHandle(fi);
+    forgetNode(e.ino, 1);
+  }
+}
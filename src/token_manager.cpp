@@ -0,0 +1,576 @@
+#include "token_manager.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "tracer.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <json/json.h>
+#include <map>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// How long the login waits for the browser to come back
+static const std::chrono::minutes LOGIN_TIMEOUT(5);
+// Longest wait before a failed refresh is tried again
+static const long MAX_REFRESH_BACKOFF_S = 60;
+
+namespace {
+
+// SHA-256 as specified in FIPS 180-4, only used for the PKCE challenge
+std::string sha256(const std::string &message) {
+  static const uint32_t K[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+  uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+  // Padded with a 1 bit, zeros and the length in bits to whole blocks
+  std::string data = message;
+  data += '\x80';
+  while (data.size() % 64 != 56) {
+    data += '\0';
+  }
+  uint64_t bits = uint64_t(message.size()) * 8;
+  for (int i = 7; i >= 0; --i) {
+    data += static_cast<char>(bits >> (i * 8));
+  }
+
+  for (size_t block = 0; block < data.size(); block += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      const unsigned char *p =
+          reinterpret_cast<const unsigned char *>(&data[block + i * 4]);
+      w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 |
+             uint32_t(p[2]) << 8 | p[3];
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5],
+             g = h[6], k = h[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 = k + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                    ((e & f) ^ (~e & g)) + K[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      k = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+  }
+
+  std::string digest;
+  for (uint32_t word : h) {
+    for (int i = 3; i >= 0; --i) {
+      digest += static_cast<char>(word >> (i * 8));
+    }
+  }
+  return digest;
+}
+
+// Base64 with the URL alphabet and without padding
+std::string base64url(const std::string &data) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  std::string text;
+  uint32_t buffer = 0;
+  int bits = 0;
+  for (unsigned char c : data) {
+    buffer = buffer << 8 | c;
+    bits += 8;
+    while (bits >= 6) {
+      bits -= 6;
+      text += alphabet[(buffer >> bits) & 63];
+    }
+  }
+  if (bits > 0) {
+    text += alphabet[(buffer << (6 - bits)) & 63];
+  }
+  return text;
+}
+
+// Random characters that need no escaping in a URL, as PKCE requires
+std::string randomString(size_t length) {
+  static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                              "abcdefghijklmnopqrstuvwxyz"
+                              "0123456789-._~";
+  std::random_device random;
+  std::uniform_int_distribution<size_t> pick(0, sizeof(chars) - 2);
+  std::string text;
+  for (size_t i = 0; i < length; ++i) {
+    text += chars[pick(random)];
+  }
+  return text;
+}
+
+std::string escape(const std::string &text) {
+  char *escaped = curl_easy_escape(nullptr, text.c_str(), text.size());
+  std::string result = escaped ? escaped : "";
+  curl_free(escaped);
+  return result;
+}
+
+std::string unescape(const std::string &text) {
+  int length = 0;
+  char *unescaped =
+      curl_easy_unescape(nullptr, text.c_str(), text.size(), &length);
+  std::string result = unescaped ? std::string(unescaped, length) : "";
+  curl_free(unescaped);
+  return result;
+}
+
+size_t appendBody(char *data, size_t size, size_t count, void *user) {
+  static_cast<std::string *>(user)->append(data, size * count);
+  return size * count;
+}
+
+// Answers the browser and closes the connection
+void respond(int conn, const char *status, const std::string &text) {
+  std::string response = std::string("HTTP/1.1 ") + status +
+                         "\r\nContent-Type: text/plain; charset=utf-8"
+                         "\r\nContent-Length: " +
+                         std::to_string(text.size()) +
+                         "\r\nConnection: close\r\n\r\n" + text;
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t n = send(conn, response.data() + sent, response.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n <= 0) {
+      break;
+    }
+    sent += n;
+  }
+  close(conn);
+}
+
+} // namespace
+
+TokenManager::TokenManager(AuthConfig config) : config(std::move(config)) {
+  std::string &file = this->config.token_file;
+  if (file.empty()) {
+    const char *xdg_config = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    if (xdg_config && *xdg_config) {
+      file = xdg_config;
+    } else if (home) {
+      file = std::string(home) + "/.config";
+    } else {
+      file = "/tmp";
+    }
+    mkdir(file.c_str(), 0700);
+    file += "/spotifyvfs";
+    mkdir(file.c_str(), 0700);
+    file += "/refresh_token";
+  } else if (file[0] != '/') {
+    // Daemonizing changes to /, the token is saved again after that
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd))) {
+      file = std::string(cwd) + "/" + file;
+    }
+  }
+  redirect_uri =
+      "http://127.0.0.1:" + std::to_string(this->config.redirect_port) +
+      "/callback";
+}
+
+TokenManager::~TokenManager() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  if (refresher.joinable()) {
+    refresher.join();
+  }
+  delete current.load();
+}
+
+bool TokenManager::login() {
+  std::ifstream file(config.token_file);
+  std::string kept;
+  if (file && std::getline(file, kept) && !kept.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      refresh_token = kept;
+    }
+    long status = refreshNow();
+    if (status == 200) {
+      return true;
+    }
+    if (status == 0 || status >= 500) {
+      return false; // Logging in again would not help
+    }
+    std::cerr << "The saved login was rejected, logging in again"
+              << std::endl;
+  }
+  return authorize();
+}
+
+void TokenManager::useToken(const std::string &token) {
+  Grant grant;
+  grant.status = 200;
+  grant.access_token = token;
+  publish(grant);
+}
+
+std::string TokenManager::header(uint64_t &generation) {
+  std::call_once(refresher_started, [this]() {
+    refresher = std::thread(&TokenManager::run, this);
+  });
+  Epoch::ReadGuard guard;
+  const Token *token = current.load();
+  if (!token) {
+    generation = 0;
+    return "Authorization: Bearer ";
+  }
+  generation = token->generation;
+  return token->header;
+}
+
+void TokenManager::refresh(uint64_t generation, std::function<void()> done) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (generation == this->generation && !refresh_token.empty()) {
+      waiting.push_back(std::move(done));
+      refresh_wanted = true;
+      wake.notify_all();
+      return;
+    }
+  }
+  // Already replaced, or it cannot be
+  done();
+}
+
+void TokenManager::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    if (!refresh_wanted && Clock::now() < refresh_at) {
+      if (refresh_at == Clock::time_point::max()) {
+        wake.wait(lock);
+      } else {
+        wake.wait_until(lock, refresh_at);
+      }
+      continue;
+    }
+    refresh_wanted = false;
+    if (failures == 0 || Clock::now() >= refresh_at) {
+      lock.unlock();
+      long status = refreshNow();
+      lock.lock();
+      if (status == 200) {
+        failures = 0;
+      } else if (!refresh_token.empty()) {
+        // Tried again with a growing delay while the old token may still
+        // be good; rejected requests meanwhile fail at once
+        ++failures;
+        refresh_at = Clock::now() +
+                     std::chrono::seconds(std::min(
+                         1L << std::min(failures, 6u), MAX_REFRESH_BACKOFF_S));
+      }
+    }
+    std::vector<std::function<void()>> done;
+    done.swap(waiting);
+    lock.unlock();
+    for (auto &callback : done) {
+      callback();
+    }
+    lock.lock();
+  }
+  std::vector<std::function<void()>> done;
+  done.swap(waiting);
+  lock.unlock();
+  for (auto &callback : done) {
+    callback();
+  }
+}
+
+TokenManager::Grant TokenManager::requestToken(
+    const std::vector<std::pair<std::string, std::string>> &fields) const {
+  std::string body;
+  for (const auto &field : fields) {
+    if (!body.empty()) {
+      body += '&';
+    }
+    body += escape(field.first) + "=" + escape(field.second);
+  }
+
+  Grant grant;
+  std::string text;
+  CURL *curl = curl_easy_init();
+  if (!curl) {
+    return grant;
+  }
+  std::string url = config.accounts_url + "/api/token";
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, appendBody);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &text);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, config.timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  CURLcode result = curl_easy_perform(curl);
+  if (result == CURLE_OK) {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &grant.status);
+  }
+  curl_easy_cleanup(curl);
+  if (result != CURLE_OK) {
+    std::cerr << "Token request failed: " << curl_easy_strerror(result)
+              << std::endl;
+    return grant;
+  }
+
+  Json::Value root;
+  Json::Reader reader;
+  if (!reader.parse(text, root) || !root.isObject()) {
+    std::cerr << "Token request returned status " << grant.status
+              << " without JSON" << std::endl;
+    grant.status = grant.status == 200 ? 0 : grant.status;
+    return grant;
+  }
+  if (grant.status != 200) {
+    std::cerr << "Token request failed with status " << grant.status << ": "
+              << root.get("error", "").asString() << " "
+              << root.get("error_description", "").asString() << std::endl;
+    return grant;
+  }
+  grant.access_token = root.get("access_token", "").asString();
+  grant.refresh_token = root.get("refresh_token", "").asString();
+  grant.expires_in = root.get("expires_in", 3600).asInt64();
+  if (grant.access_token.empty()) {
+    std::cerr << "Token request returned no access token" << std::endl;
+    grant.status = 0;
+  }
+  return grant;
+}
+
+long TokenManager::refreshNow() {
+  Tracer::Span span("token_refresh", "auth");
+  std::string token;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    token = refresh_token;
+  }
+  Grant grant = requestToken({{"grant_type", "refresh_token"},
+                              {"refresh_token", token},
+                              {"client_id", config.client_id}});
+  if (grant.status == 200) {
+    Metrics::add(Counter::token_refreshes);
+    publish(grant);
+    return grant.status;
+  }
+  Metrics::add(Counter::token_refresh_errors);
+  if (grant.status == 400 || grant.status == 401) {
+    // Revoked; the next mount logs in again
+    std::lock_guard<std::mutex> lock(mutex);
+    refresh_token.clear();
+    refresh_at = Clock::time_point::max();
+  }
+  return grant.status;
+}
+
+void TokenManager::publish(const Grant &grant) {
+  std::string save;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const Token *old = current.exchange(new Token{
+        "Authorization: Bearer " + grant.access_token, ++generation});
+    if (old) {
+      Epoch::retire(old);
+    }
+    // Spotify may hand out a new refresh token with a refresh
+    if (!grant.refresh_token.empty() && grant.refresh_token != refresh_token) {
+      refresh_token = grant.refresh_token;
+      save = refresh_token;
+    }
+    if (refresh_token.empty()) {
+      refresh_at = Clock::time_point::max();
+    } else {
+      long seconds = std::max(grant.expires_in - config.refresh_margin_s,
+                              grant.expires_in / 2);
+      refresh_at = Clock::now() + std::chrono::seconds(seconds);
+    }
+  }
+  wake.notify_all();
+  if (!save.empty()) {
+    saveRefreshToken(save);
+  }
+}
+
+bool TokenManager::authorize() {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    std::cerr << "Failed to create a socket: " << strerror(errno) << std::endl;
+    return false;
+  }
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(config.redirect_port);
+  if (bind(listener, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(listener, 4) != 0) {
+    std::cerr << "Failed to listen for the login on port "
+              << config.redirect_port << ": " << strerror(errno) << std::endl;
+    close(listener);
+    return false;
+  }
+
+  // The challenge is a hash of the verifier, which only the token request
+  // reveals, so an intercepted code is of no use without it
+  std::string verifier = randomString(64);
+  std::string state = randomString(16);
+  std::string url = config.accounts_url + "/authorize";
+  url += "?response_type=code";
+  url += "&client_id=" + escape(config.client_id);
+  url += "&scope=" + escape(config.scope);
+  url += "&redirect_uri=" + escape(redirect_uri);
+  url += "&state=" + state;
+  url += "&code_challenge_method=S256";
+  url += "&code_challenge=" + base64url(sha256(verifier));
+  std::cout << "Open this URL to log in to Spotify:\n" << url << std::endl;
+
+  std::string code = awaitCode(listener, state);
+  close(listener);
+  if (code.empty()) {
+    return false;
+  }
+  Grant grant = requestToken({{"grant_type", "authorization_code"},
+                              {"code", code},
+                              {"redirect_uri", redirect_uri},
+                              {"client_id", config.client_id},
+                              {"code_verifier", verifier}});
+  if (grant.status != 200) {
+    return false;
+  }
+  publish(grant);
+  return true;
+}
+
+std::string TokenManager::awaitCode(int listener,
+                                    const std::string &state) const {
+  auto deadline = Clock::now() + LOGIN_TIMEOUT;
+  while (true) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - Clock::now());
+    if (remaining.count() <= 0) {
+      std::cerr << "Timed out waiting for the login" << std::endl;
+      return "";
+    }
+    pollfd fd = {listener, POLLIN, 0};
+    if (poll(&fd, 1, static_cast<int>(remaining.count())) <= 0) {
+      continue;
+    }
+    int conn = accept(listener, nullptr, nullptr);
+    if (conn < 0) {
+      continue;
+    }
+    timeval timeout = {5, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string head;
+    char buf[4096];
+    while (head.find("\r\n\r\n") == std::string::npos && head.size() < 16384) {
+      ssize_t n = recv(conn, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      head.append(buf, n);
+    }
+
+    // "GET /callback?code=...&state=... HTTP/1.1"
+    size_t start = head.find(' ');
+    size_t end = start == std::string::npos ? start : head.find(' ', start + 1);
+    if (head.compare(0, 4, "GET ") != 0 || end == std::string::npos) {
+      respond(conn, "400 Bad Request", "Bad request\n");
+      continue;
+    }
+    std::string target = head.substr(start + 1, end - start - 1);
+    size_t question = target.find('?');
+    if (target.substr(0, question) != "/callback") {
+      respond(conn, "404 Not Found", "Not found\n");
+      continue;
+    }
+    std::map<std::string, std::string> parameters;
+    std::string query =
+        question == std::string::npos ? "" : target.substr(question + 1);
+    for (size_t pos = 0; pos <= query.size();) {
+      size_t amp = std::min(query.find('&', pos), query.size());
+      std::string pair = query.substr(pos, amp - pos);
+      size_t equals = pair.find('=');
+      if (equals != std::string::npos) {
+        parameters[unescape(pair.substr(0, equals))] =
+            unescape(pair.substr(equals + 1));
+      }
+      pos = amp + 1;
+    }
+    if (parameters["state"] != state) {
+      // Not the redirect of this login
+      respond(conn, "400 Bad Request", "Unexpected login state\n");
+      continue;
+    }
+    if (parameters.count("error")) {
+      respond(conn, "200 OK", "Login failed: " + parameters["error"] + "\n");
+      std::cerr << "Login failed: " << parameters["error"] << std::endl;
+      return "";
+    }
+    respond(conn, "200 OK", "Logged in to SpotifyFS, this window can be "
+                            "closed.\n");
+    return parameters["code"];
+  }
+}
+
+void TokenManager::saveRefreshToken(const std::string &token) const {
+  // Replaced atomically, and only readable by the user
+  std::string temp = config.token_file + ".tmp";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    std::cerr << "Failed to save the login to " << config.token_file << ": "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  std::string line = token + "\n";
+  bool ok = write(fd, line.data(), line.size()) ==
+            static_cast<ssize_t>(line.size());
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(temp.c_str(), config.token_file.c_str()) != 0) {
+    std::cerr << "Failed to save the login to " << config.token_file
+              << std::endl;
+    unlink(temp.c_str());
+  }
+}
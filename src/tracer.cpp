@@ -0,0 +1,336 @@
+#include "tracer.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+std::atomic<bool> Tracer::active{false};
+
+namespace {
+
+struct TraceEvent {
+  char phase;    // 'X' for a span, 's' or 't' for a flow start or step
+  uint64_t flow; // Flow ID of flow events
+  const char *name;
+  const char *category;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  char detail[64];
+  size_t detail_length;
+};
+
+static_assert(std::is_trivially_copyable<TraceEvent>::value,
+              "trace events are copied as words");
+
+// Slot of a ring. The owning thread may overwrite an event while the
+// writer thread copies it, so the event is kept in relaxed atomic words
+// behind a sequence number (a seqlock): odd while the slot is written, and
+// 2 * (index + 1) once the event of that index is complete.
+struct TraceSlot {
+  static constexpr size_t WORDS = (sizeof(TraceEvent) + 7) / 8;
+
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<uint64_t> words[WORDS] = {};
+
+  void store(uint64_t index, const TraceEvent &event) {
+    uint64_t copy[WORDS] = {};
+    memcpy(copy, &event, sizeof(event));
+    sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < WORDS; ++i) {
+      words[i].store(copy[i], std::memory_order_relaxed);
+    }
+    sequence.store(2 * index + 2, std::memory_order_release);
+  }
+
+  // Copies the event of `index`. Returns false if the slot no longer holds
+  // it complete, because it was overwritten before or while it was copied.
+  bool load(uint64_t index, TraceEvent &event) const {
+    uint64_t before = sequence.load(std::memory_order_acquire);
+    if (before != 2 * index + 2) {
+      return false;
+    }
+    uint64_t copy[WORDS];
+    for (size_t i = 0; i < WORDS; ++i) {
+      copy[i] = words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence.load(std::memory_order_relaxed) != before) {
+      return false;
+    }
+    memcpy(&event, copy, sizeof(event));
+    return true;
+  }
+};
+
+// Spans of one thread. Only the owning thread writes events; the writer
+// thread takes them from `tail` up to `head`.
+struct TraceRing {
+  static constexpr size_t CAPACITY = 16384;
+
+  uint32_t tid;
+  std::atomic<uint64_t> head{0}; // Events recorded so far
+  uint64_t tail = 0;             // Events taken by the writer thread
+  TraceSlot slots[CAPACITY];
+};
+
+// Rings of all threads that recorded spans. As with metrics, the ring of a
+// thread that exits is handed to the next new thread.
+std::mutex registry_mutex;
+std::vector<TraceRing *> rings;
+std::vector<TraceRing *> unused_rings;
+
+struct RingSlot {
+  TraceRing *ring = nullptr;
+
+  ~RingSlot() {
+    if (ring) {
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      unused_rings.push_back(ring);
+    }
+  }
+};
+
+thread_local RingSlot slot;
+thread_local Tracer::Span *current = nullptr; // Innermost open span
+thread_local uint64_t current_flow = 0;        // Set by FlowScope
+std::atomic<uint64_t> next_flow{1};
+
+// The trace file and its writer thread
+std::mutex writer_mutex;
+std::condition_variable writer_cv;
+std::thread writer;
+bool writer_stopping = false;
+FILE *file = nullptr;
+bool first_event = true;
+uint64_t start_ns = 0; // Time stamps in the file are relative to this
+uint64_t dropped = 0;  // Spans overwritten before they were written
+
+uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+TraceRing &localRing() {
+  if (!slot.ring) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (!unused_rings.empty()) {
+      slot.ring = unused_rings.back();
+      unused_rings.pop_back();
+    } else {
+      slot.ring = new TraceRing();
+      slot.ring->tid = rings.size() + 1;
+      rings.push_back(slot.ring);
+    }
+  }
+  return *slot.ring;
+}
+
+void writeEvent(const TraceEvent &event, uint32_t tid) {
+  if (event.phase != 'X') {
+    // Every flow event carries the same name and category, which together
+    // with the ID identify the flow
+    fprintf(file,
+            "%s{\"name\":\"request\",\"cat\":\"flow\",\"ph\":\"%c\","
+            "\"id\":%llu,\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+            first_event ? "" : ",\n", event.phase,
+            static_cast<unsigned long long>(event.flow), tid,
+            (event.start_ns - start_ns) / 1e3);
+    first_event = false;
+    return;
+  }
+  fprintf(file,
+          "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+          "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+          first_event ? "" : ",\n", event.name, event.category, tid,
+          (event.start_ns - start_ns) / 1e3, event.duration_ns / 1e3);
+  first_event = false;
+  if (event.detail_length > 0) {
+    fputs(",\"args\":{\"detail\":\"", file);
+    for (size_t i = 0; i < event.detail_length; ++i) {
+      unsigned char c = event.detail[i];
+      if (c == '"' || c == '\\') {
+        fputc('\\', file);
+        fputc(c, file);
+      } else if (c < 0x20) {
+        fprintf(file, "\\u%04x", c);
+      } else {
+        fputc(c, file);
+      }
+    }
+    fputs("\"}", file);
+  }
+  fputc('}', file);
+}
+
+// Writes the spans recorded since the last call. The caller must hold
+// writer_mutex.
+void drain() {
+  std::vector<TraceRing *> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    snapshot = rings;
+  }
+  for (TraceRing *ring : snapshot) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    if (head - ring->tail > TraceRing::CAPACITY) {
+      dropped += head - ring->tail - TraceRing::CAPACITY;
+      ring->tail = head - TraceRing::CAPACITY;
+    }
+    // Events the thread overwrites while they are copied are torn, their
+    // slot's sequence number tells
+    TraceEvent event;
+    for (uint64_t i = ring->tail; i < head; ++i) {
+      if (ring->slots[i % TraceRing::CAPACITY].load(i, event)) {
+        writeEvent(event, ring->tid);
+      } else {
+        ++dropped;
+      }
+    }
+    ring->tail = head;
+  }
+  fflush(file);
+}
+
+void writeLoop() {
+  std::unique_lock<std::mutex> lock(writer_mutex);
+  while (!writer_stopping) {
+    writer_cv.wait_for(lock, std::chrono::milliseconds(100));
+    drain();
+  }
+}
+
+void push(char phase, uint64_t flow, const char *name, const char *category,
+          uint64_t from_ns, uint64_t to_ns, std::string_view detail) {
+  TraceRing &ring = localRing();
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  TraceEvent event = {};
+  event.phase = phase;
+  event.flow = flow;
+  event.name = name;
+  event.category = category;
+  event.start_ns = from_ns;
+  event.duration_ns = to_ns - from_ns;
+  event.detail_length = std::min(detail.size(), sizeof(event.detail));
+  memcpy(event.detail, detail.data(), event.detail_length);
+  ring.slots[head % TraceRing::CAPACITY].store(head, event);
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+} // namespace
+
+bool Tracer::start(const std::string &path) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  if (file) {
+    return true;
+  }
+  file = fopen(path.c_str(), "w");
+  if (!file) {
+    std::cerr << "Failed to open trace file " << path << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+  first_event = true;
+  dropped = 0;
+  start_ns = now();
+  writer_stopping = false;
+  writer = std::thread(writeLoop);
+  active = true;
+  return true;
+}
+
+void Tracer::stop() {
+  active = false;
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    if (!file) {
+      return;
+    }
+    writer_stopping = true;
+    writer_cv.notify_all();
+  }
+  writer.join();
+
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  drain();
+  fputs("\n]}\n", file);
+  fclose(file);
+  file = nullptr;
+  if (dropped > 0) {
+    std::cerr << "Trace: dropped " << dropped
+              << " spans that were not written in time" << std::endl;
+  }
+}
+
+void Tracer::annotate(std::string_view detail) {
+  if (!enabled() || !current) {
+    return;
+  }
+  size_t length = std::min(detail.size(), sizeof(current->detail));
+  memcpy(current->detail, detail.data(), length);
+  current->detail_length = length;
+}
+
+void Tracer::Span::begin(const char *name, const char *category) {
+  started = true;
+  this->name = name;
+  this->category = category;
+  detail_length = 0;
+  parent = current;
+  current = this;
+  start_ns = now();
+}
+
+void Tracer::record(const char *name, const char *category,
+                    std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end,
+                    std::string_view detail, uint64_t flow) {
+  if (!enabled()) {
+    return;
+  }
+  auto ns = [](std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               time.time_since_epoch())
+        .count();
+  };
+  push('X', 0, name, category, ns(start), ns(end), detail);
+  if (flow) {
+    // A step at the start of the span binds to it
+    push('t', flow, nullptr, nullptr, ns(start), ns(start), {});
+  }
+}
+
+uint64_t Tracer::flow() {
+  if (current_flow) {
+    return current_flow;
+  }
+  if (!enabled() || !current) {
+    return 0;
+  }
+  uint64_t id = next_flow.fetch_add(1, std::memory_order_relaxed);
+  uint64_t at = now();
+  push('s', id, nullptr, nullptr, at, at, {});
+  return id;
+}
+
+Tracer::FlowScope::FlowScope(uint64_t id) : previous(current_flow) {
+  current_flow = id;
+}
+
+Tracer::FlowScope::~FlowScope() { current_flow = previous; }
+
+void Tracer::Span::end() {
+  uint64_t end_ns = now();
+  current = parent;
+  push('X', 0, name, category, start_ns, end_ns,
+       std::string_view(detail, detail_length));
+}
@@ -0,0 +1,137 @@
+#include "track_importer.h"
+#include "request_scheduler.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+TrackImporter::TrackImporter(size_t concurrency, Resolve resolve,
+                             Commit commit)
+    : resolve(std::move(resolve)), commit(std::move(commit)) {
+  concurrency = std::max<size_t>(concurrency, 1);
+  workers.reserve(concurrency);
+  for (size_t i = 0; i < concurrency; ++i) {
+    workers.emplace_back(&TrackImporter::run, this);
+  }
+}
+
+TrackImporter::~TrackImporter() { stop(); }
+
+void TrackImporter::submit(const std::string &playlist_id,
+                           std::vector<std::string> queries) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (stopping) {
+    return;
+  }
+  Job &job = jobs[playlist_id];
+  for (auto &text : queries) {
+    tasks.push_back({playlist_id, job.committed + job.queries.size()});
+    job.queries.emplace_back();
+    job.queries.back().text = std::move(text);
+  }
+  cv.notify_all();
+}
+
+std::string TrackImporter::status(const std::string &playlist_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = jobs.find(playlist_id);
+  if (it == jobs.end()) {
+    return "queries: 0\n";
+  }
+  const Job &job = it->second;
+  std::ostringstream out;
+  out << "queries: " << job.committed + job.queries.size() << "\n"
+      << "resolved: " << job.resolved << "\n"
+      << "unresolved: " << job.unresolved_count << "\n"
+      << "pending: " << job.queries.size() << "\n";
+  if (!job.unresolved.empty()) {
+    out << "\n";
+    if (job.unresolved_count > job.unresolved.size()) {
+      out << "(" << job.unresolved_count - job.unresolved.size()
+          << " earlier ones omitted)\n";
+    }
+    for (const auto &text : job.unresolved) {
+      out << text << "\n";
+    }
+  }
+  return out.str();
+}
+
+void TrackImporter::run() {
+  // Imports are bulk work and must not delay interactive requests
+  RequestScheduler::PriorityScope scope(RequestPriority::background);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+    if (stopping) {
+      return;
+    }
+    Task task = std::move(tasks.front());
+    tasks.pop_front();
+    Job *job = &jobs[task.playlist_id];
+    std::string text = job->queries[task.query - job->committed].text;
+    lock.unlock();
+
+    Track track = resolve(text);
+
+    lock.lock();
+    job = &jobs[task.playlist_id];
+    Query &done = job->queries[task.query - job->committed];
+    done.track = std::move(track);
+    done.done = true;
+
+    // Hand over every finished query that no earlier query is waiting on, so
+    // tracks are added in the order they were written
+    while (!job->queries.empty() && job->queries.front().done) {
+      Query &query = job->queries.front();
+      if (query.track.id.empty()) {
+        ++job->unresolved_count;
+        job->unresolved.push_back(std::move(query.text));
+        if (job->unresolved.size() > MAX_UNRESOLVED) {
+          job->unresolved.pop_front();
+        }
+      } else {
+        job->ready.push_back(std::move(query.track));
+        ++job->resolved;
+      }
+      job->queries.pop_front();
+      ++job->committed;
+    }
+
+    // Commits run unlocked, they may block on the kernel, which can be
+    // waiting for status() meanwhile. One worker per playlist hands the
+    // tracks over so that they stay in order.
+    if (job->committing) {
+      continue;
+    }
+    job->committing = true;
+    while (!job->ready.empty()) {
+      std::vector<Track> ready = std::move(job->ready);
+      job->ready.clear();
+      lock.unlock();
+      commit(task.playlist_id, ready);
+      lock.lock();
+      job = &jobs[task.playlist_id];
+    }
+    job->committing = false;
+  }
+}
+
+void TrackImporter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+      return;
+    }
+    stopping = true;
+    if (!tasks.empty()) {
+      std::cerr << "Dropping " << tasks.size() << " queued imports"
+                << std::endl;
+    }
+    tasks.clear();
+    cv.notify_all();
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
@@ -0,0 +1,70 @@
+#include "track_resolver.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cctype>
+
+TrackResolver::TrackResolver(size_t capacity, std::chrono::seconds ttl,
+                             std::chrono::seconds negative_ttl)
+    : capacity(std::max<size_t>(capacity, 1)), ttl(ttl),
+      negative_ttl(negative_ttl) {}
+
+std::string TrackResolver::normalize(const std::string &query) {
+  std::string key;
+  key.reserve(query.size());
+  bool space = false;
+  for (unsigned char c : query) {
+    if (std::isspace(c)) {
+      space = !key.empty();
+      continue;
+    }
+    if (space) {
+      key += ' ';
+      space = false;
+    }
+    key += std::tolower(c);
+  }
+  return key;
+}
+
+Track TrackResolver::resolve(const std::string &query) {
+  std::string key = normalize(query);
+  {
+    Tracer::Span span("search_cache", "cache");
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      if (it->second->expiry > Clock::now()) {
+        Metrics::add(Counter::search_cache_hits);
+        Tracer::annotate("hit");
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->track;
+      }
+      entries.erase(it->second);
+      index.erase(it);
+    }
+    Tracer::annotate("miss");
+  }
+
+  // Concurrent misses of the same query may both search; the later result
+  // simply replaces the earlier one
+  Metrics::add(Counter::search_cache_misses);
+  Track track;
+  if (!SpotifyAPI::getInstance()->searchTrack(query, track)) {
+    return Track(); // Failed requests are not cached
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(key);
+  if (it != index.end()) {
+    entries.erase(it->second);
+    index.erase(it);
+  }
+  auto expiry = Clock::now() + (track.id.empty() ? negative_ttl : ttl);
+  entries.push_front({key, track, expiry});
+  index[key] = entries.begin();
+  if (entries.size() > capacity) {
+    index.erase(entries.back().key);
+    entries.pop_back();
+  }
+  return track;
+}
@@ -0,0 +1,140 @@
+#include "track_table.h"
+#include <cstring>
+
+StringInterner::StringInterner() { intern(""); }
+
+StringInterner::~StringInterner() { clear(); }
+
+uint32_t StringInterner::intern(std::string_view str) {
+  auto it = handles.find(str);
+  if (it != handles.end()) {
+    return it->second;
+  }
+
+  uint32_t length = str.size();
+  size_t needed = sizeof(length) + length;
+  if (block_count == 0 || used + needed > BLOCK_SIZE) {
+    // A string larger than a block gets a block of its own
+    size_t size = needed > BLOCK_SIZE ? needed : BLOCK_SIZE;
+    blocks[block_count].store(new char[size], std::memory_order_release);
+    ++block_count;
+    used = 0;
+    arena_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  char *block = blocks[block_count - 1].load(std::memory_order_relaxed);
+  uint32_t handle = ((block_count - 1) << BLOCK_BITS) | used;
+  memcpy(block + used, &length, sizeof(length));
+  memcpy(block + used + sizeof(length), str.data(), length);
+  used += needed;
+  handles.emplace(std::string_view(block + used - length, length), handle);
+  return handle;
+}
+
+std::string_view StringInterner::str(uint32_t handle) const {
+  const char *block = blocks[handle >> BLOCK_BITS].load(
+      std::memory_order_acquire);
+  const char *data = block + (handle & (BLOCK_SIZE - 1));
+  uint32_t length;
+  memcpy(&length, data, sizeof(length));
+  return std::string_view(data + sizeof(length), length);
+}
+
+void StringInterner::clear() {
+  handles.clear();
+  for (size_t i = 0; i < block_count; ++i) {
+    delete[] blocks[i].exchange(nullptr);
+  }
+  block_count = 0;
+  used = 0;
+  arena_bytes.store(0, std::memory_order_relaxed);
+}
+
+TrackTable::~TrackTable() { clear(); }
+
+static bool validId(std::string_view id) {
+  if (id.size() != TrackTable::ID_LENGTH) {
+    return false;
+  }
+  for (char c : id) {
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t TrackTable::add(std::string_view id, std::string_view name,
+                         std::string_view artist, std::string_view album,
+                         std::string_view uri, size_t duration_ms) {
+  std::lock_guard<std::mutex> lock(mutex);
+  bool has_id = validId(id);
+  if (has_id) {
+    auto it = by_id.find(id);
+    if (it != by_id.end()) {
+      return it->second;
+    }
+  }
+
+  uint32_t index = count.load(std::memory_order_relaxed);
+  Record *block = blocks[index >> BLOCK_BITS].load(std::memory_order_relaxed);
+  if (!block) {
+    block = new Record[BLOCK_RECORDS];
+    blocks[index >> BLOCK_BITS].store(block, std::memory_order_release);
+  }
+
+  Record &record = block[index & (BLOCK_RECORDS - 1)];
+  memset(record.id, 0, ID_LENGTH);
+  if (has_id) {
+    memcpy(record.id, id.data(), ID_LENGTH);
+  }
+  record.name = strings.intern(name);
+  record.artist = strings.intern(artist);
+  record.album = strings.intern(album);
+  // The URI of a track is spotify:track:<id>; only other kinds of items
+  // (local files, episodes) need theirs stored
+  bool derived = has_id && uri.size() == 14 + ID_LENGTH &&
+                 uri.compare(0, 14, "spotify:track:") == 0 &&
+                 uri.substr(14) == id;
+  record.uri = derived ? StringInterner::EMPTY : strings.intern(uri);
+  record.duration_ms = duration_ms;
+  count.store(index + 1, std::memory_order_release);
+
+  if (has_id) {
+    by_id.emplace(std::string_view(record.id, ID_LENGTH), index);
+  }
+  return index;
+}
+
+std::string TrackTable::id(uint32_t index) const {
+  const Record &record = get(index);
+  if (record.id[0] == '\0') {
+    return "";
+  }
+  return std::string(record.id, ID_LENGTH);
+}
+
+std::string TrackTable::uri(uint32_t index) const {
+  const Record &record = get(index);
+  if (record.uri != StringInterner::EMPTY || record.id[0] == '\0') {
+    return std::string(str(record.uri));
+  }
+  return "spotify:track:" + std::string(record.id, ID_LENGTH);
+}
+
+void TrackTable::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  by_id.clear();
+  for (auto &block : blocks) {
+    delete[] block.exchange(nullptr);
+  }
+  count.store(0, std::memory_order_relaxed);
+  strings.clear();
+  strings.intern("");
+}
+
+size_t TrackTable::memoryBytes() const {
+  size_t block_count = (size() + BLOCK_RECORDS - 1) / BLOCK_RECORDS;
+  return block_count * BLOCK_RECORDS * sizeof(Record) + strings.arenaBytes();
+}
@@ -0,0 +1,208 @@
+// Moves tracks by renaming them in a playlist with duplicate entries and
+// after additions and removals, then checks that the changes sent to the
+// fake SpotifyAPI give the order listed by the filesystem.
+//
+// Usage: track_order_test
+
+#include "fake_spotify_api.h"
+#include "spotify_api.h"
+#include "spotify_fs.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <errno.h>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char *PLAYLIST = "/Playlist 0";
+const char *PLAYLIST_ID = "playlist0";
+
+int failures = 0;
+
+void check(bool condition, const std::string &what) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s\n", what.c_str());
+    ++failures;
+  }
+}
+
+int addEntry(void *buf, const char *name, const struct stat *, off_t) {
+  if (name[0] != '.') {
+    static_cast<std::vector<std::string> *>(buf)->push_back(name);
+  }
+  return 0;
+}
+
+std::vector<std::string> listPlaylist() {
+  std::vector<std::string> names;
+  SpotifyFileSystem::listFiles(PLAYLIST, &names, addEntry, 0, nullptr);
+  return names;
+}
+
+std::string trackPath(const std::string &name) {
+  return std::string(PLAYLIST) + "/" + name;
+}
+
+// Moves the track named `name` to the 1-based `position`
+int moveTrack(const std::string &name, size_t position) {
+  std::string target = trackPath(std::to_string(position) + " " + name);
+  return SpotifyFileSystem::renameFile(trackPath(name).c_str(),
+                                       target.c_str());
+}
+
+// The playlist as Spotify has it: URIs in order, duplicates included
+struct Model {
+  std::vector<std::string> uris;
+  std::map<std::string, std::string> names; // By URI
+  size_t applied = 0;                       // Changes applied so far
+
+  void apply(const std::vector<FakeChange> &changes) {
+    for (; applied < changes.size(); ++applied) {
+      const FakeChange &change = changes[applied];
+      if (change.playlist_id != PLAYLIST_ID) {
+        continue;
+      }
+      if (change.kind == FakeChange::Kind::add) {
+        uris.insert(uris.end(), change.uris.begin(), change.uris.end());
+      } else if (change.kind == FakeChange::Kind::remove) {
+        // Every occurrence of a removed track goes
+        std::set<std::string> removed(change.uris.begin(), change.uris.end());
+        uris.erase(std::remove_if(uris.begin(), uris.end(),
+                                  [&removed](const std::string &uri) {
+                                    return removed.count(uri) > 0;
+                                  }),
+                   uris.end());
+      } else {
+        auto first = uris.begin() + change.range_start;
+        auto last = first + change.range_length;
+        auto before = uris.begin() + change.insert_before;
+        if (before < first) {
+          std::rotate(before, first, last);
+        } else {
+          std::rotate(first, last, before);
+        }
+      }
+    }
+  }
+
+  // Names listed for the playlist, the first entry of each name
+  std::vector<std::string> listing() const {
+    std::vector<std::string> listed;
+    std::set<std::string> seen;
+    for (const auto &uri : uris) {
+      const std::string &name = names.at(uri);
+      if (seen.insert(name).second) {
+        listed.push_back(name);
+      }
+    }
+    return listed;
+  }
+};
+
+void checkOrder(Model &model, const std::vector<std::string> &listed,
+                const std::string &when) {
+  model.apply(fakeChanges());
+  check(model.listing() == listed, "Spotify order matches the listing " + when);
+}
+
+spotify_options testOptions(char *cache_dir) {
+  spotify_options options = {};
+  options.load_concurrency = 2;
+  options.cache_dir = cache_dir;
+  options.flush_delay = 60000; // Changes are only sent when forced
+  options.import_concurrency = 1;
+  options.search_cache_size = 16;
+  options.search_ttl = 3600;
+  options.sync_interval = 0;
+  options.playback = 0;
+  return options;
+}
+
+} // namespace
+
+int main() {
+  // Entries 3, 7 and 11 repeat the track before them and are not listed
+  FakeLibrary library;
+  library.playlists = 4;
+  library.tracks_per_playlist = 12;
+  library.repeat_every = 4;
+  setFakeLibrary(library);
+
+  char cache_dir[] = "/tmp/track_order_test.XXXXXX";
+  if (!mkdtemp(cache_dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  spotify_options options = testOptions(cache_dir);
+  std::streambuf *cout_buf = std::cout.rdbuf(nullptr);
+
+  Model model;
+  int total = 0;
+  std::vector<Track> tracks;
+  SpotifyAPI::getInstance()->getPlaylistTracksPage(PLAYLIST_ID, 0, 100, tracks,
+                                                   total);
+  for (const auto &track : tracks) {
+    model.uris.push_back(track.uri);
+    model.names[track.uri] = track.artist + " -- " + track.name;
+  }
+  Track added;
+  SpotifyAPI::getInstance()->searchTrack("new song", added);
+  model.names[added.uri] = added.artist + " -- " + added.name;
+
+  SpotifyFileSystem::init(options);
+  std::vector<std::string> names = listPlaylist();
+  check(names == model.listing(), "duplicates are listed once");
+
+  // A move waits for a queued addition to be sent
+  struct fuse_file_info fi = {};
+  check(SpotifyFileSystem::createFile(trackPath("new song").c_str(), 0644,
+                                      &fi) == 0,
+        "create a track");
+  check(moveTrack(names[8], 1) == -EBUSY, "move with an addition queued");
+  check(SpotifyFileSystem::syncFile(trackPath("new song").c_str(), 0, &fi) ==
+            0,
+        "send the addition");
+  check(moveTrack(names[8], 1) == 0, "move a track past duplicates");
+  SpotifyFileSystem::releaseFile("", &fi);
+
+  // Moves across the hidden entries in both directions
+  names = listPlaylist();
+  check(moveTrack(names[1], 8) == 0, "move a track forward");
+  names = listPlaylist();
+  check(moveTrack(names[9], 3) == 0, "move the added track back");
+
+  // A move after the removal of a repeated track
+  names = listPlaylist();
+  std::string repeated = model.names[tracks[2].uri];
+  check(SpotifyFileSystem::removeFile(trackPath(repeated).c_str()) == 0,
+        "remove a repeated track");
+  names = listPlaylist();
+  check(moveTrack(names.back(), 2) == -EBUSY, "move with a removal queued");
+  check(SpotifyFileSystem::syncFile(trackPath(names[0]).c_str(), 0, &fi) == 0,
+        "send the removal");
+  check(moveTrack(names.back(), 2) == 0, "move after a removal");
+  names = listPlaylist();
+  SpotifyFileSystem::destroy(nullptr);
+  checkOrder(model, names, "after unmounting");
+  check(model.uris.size() > names.size(), "duplicates are kept");
+
+  // The cache keeps the duplicates, so moves after the next mount count them
+  SpotifyFileSystem::init(options);
+  check(listPlaylist() == names, "the cache keeps the order");
+  check(moveTrack(names[6], 1) == 0, "move after loading the cache");
+  names = listPlaylist();
+  SpotifyFileSystem::destroy(nullptr);
+  checkOrder(model, names, "after loading the cache");
+
+  std::cout.rdbuf(cout_buf);
+  if (failures) {
+    return 1;
+  }
+  printf("track_order_test: all checks passed\n");
+  return 0;
+}